@@ -209,11 +209,20 @@ SceneViewerApplication::SceneViewerApplication(const std::string &path, const st
 		read_quirks(quirks_path);
 
 	scene_loader.load_scene(path);
+	scene_loader.get_scene().set_parallel_gather(&ThreadGroup::get_global());
+	forward_renderer.set_parallel_push(&ThreadGroup::get_global());
+	deferred_renderer.set_parallel_push(&ThreadGroup::get_global());
+	depth_renderer.set_parallel_push(&ThreadGroup::get_global());
+
+	// Whatever is animated moves back out of the static tree on its first update.
+	scene_loader.get_scene().update_cached_transforms();
+	scene_loader.get_scene().rebuild_static_spatial_tree();
 
 	// Why not. :D
 	//Ocean::add_to_scene(scene_loader.get_scene());
 
 	animation_system = scene_loader.consume_animation_system();
+	animation_system->set_parallel_sampling(&ThreadGroup::get_global());
 	context.set_lighting_parameters(&lighting);
 	cam.set_depth_range(0.1f, 1000.0f);
 
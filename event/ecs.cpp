@@ -21,20 +21,109 @@
  */
 
 #include "ecs.hpp"
+#include <stdlib.h>
+#include <cstddef>
 
 namespace Granite
 {
 uint32_t ComponentIDMapping::ids;
 uint32_t ComponentIDMapping::group_ids;
+uint32_t ComponentIDMapping::archetype_ids;
+
+void EntityArchetype::MallocDeleter::operator()(uint8_t *ptr)
+{
+	free(ptr);
+}
+
+EntityArchetype::EntityArchetype(std::vector<ComponentType> types_)
+	: types(std::move(types_))
+{
+	// Each component type gets a tightly packed array of ChunkSize elements within a chunk.
+	// malloc only guarantees fundamental alignment, which covers all components in practice.
+	offsets.reserve(types.size());
+	for (auto &type : types)
+	{
+		assert(type.alignment <= alignof(std::max_align_t));
+		chunk_bytes = (chunk_bytes + type.alignment - 1) & ~(type.alignment - 1);
+		offsets.push_back(chunk_bytes);
+		chunk_bytes += type.size * ChunkSize;
+	}
+}
+
+uint32_t EntityArchetype::allocate_slot()
+{
+	if (vacants.empty())
+	{
+		auto *chunk = static_cast<uint8_t *>(malloc(chunk_bytes));
+		if (!chunk)
+			throw std::bad_alloc();
+		chunks.emplace_back(chunk);
+
+		// Hand out slots in ascending order so entities created in sequence are laid out in sequence.
+		uint32_t base = uint32_t(chunks.size() - 1) * ChunkSize;
+		for (uint32_t i = ChunkSize; i; i--)
+			vacants.push_back(base + i - 1);
+	}
+
+	uint32_t slot = vacants.back();
+	vacants.pop_back();
+	return slot;
+}
+
+void EntityArchetype::free_slot(uint32_t slot)
+{
+	vacants.push_back(slot);
+}
 
 void EntityDeleter::operator()(Entity *entity)
 {
 	entity->get_pool()->delete_entity(entity);
 }
 
+void EntityPool::destroy_entities(EntityHandle *handles, size_t count)
+{
+	// Batches rarely touch more than a few groups, so look them up once rather than hashing per entity.
+	std::vector<std::pair<uint32_t, EntityGroupBase *>> group_cache;
+	auto get_group = [&](uint32_t id) -> EntityGroupBase * {
+		for (auto &group : group_cache)
+			if (group.first == id)
+				return group.second;
+		auto *group = groups[id].get();
+		group_cache.push_back({ id, group });
+		return group;
+	};
+
+	deferring_deletes = true;
+	for (size_t i = 0; i < count; i++)
+	{
+		handles[i].reset();
+
+		// Delete right away while the entity is still in cache.
+		// Component destructors may release the last reference to other entities, which are then appended here.
+		for (size_t j = 0; j < deferred_deletes.size(); j++)
+		{
+			auto *entity = deferred_deletes[j];
+			while (!entity->group_slots.empty())
+				get_group(entity->group_slots.back().group)->remove_entity(*entity);
+
+			for (auto &component : entity->components)
+				if (component.component)
+					free_component_storage(*entity, component.id, component.component);
+			if (entity->archetype)
+				entity->archetype->free_slot(entity->archetype_slot);
+			remove_from_pool(*entity);
+			entity_pool.free(entity);
+		}
+		deferred_deletes.clear();
+	}
+	deferring_deletes = false;
+}
+
 void EntityPool::reset_groups()
 {
 	component_to_groups.clear();
 	groups.clear();
+	for (auto *entity : entities)
+		entity->group_slots.clear();
 }
 }
\ No newline at end of file
@@ -23,13 +23,16 @@
 #pragma once
 
 #include <tuple>
+#include <utility>
 #include <vector>
 #include <memory>
 #include <unordered_set>
 #include <unordered_map>
 #include <algorithm>
+#include <new>
 #include "object_pool.hpp"
 #include "intrusive.hpp"
+#include "util.hpp"
 #include <assert.h>
 
 namespace Granite
@@ -38,30 +41,6 @@ struct ComponentBase
 {
 };
 
-namespace Internal
-{
-template <size_t Index>
-struct HasComponent
-{
-	template <typename T>
-	static bool has_component(const T &t, const ComponentBase *component)
-	{
-		return static_cast<ComponentBase *>(std::get<Index>(t)) == component ||
-		       HasComponent<Index - 1>::has_component(t, component);
-	}
-};
-
-template <>
-struct HasComponent<0>
-{
-	template <typename T>
-	static bool has_component(const T &t, const ComponentBase *component)
-	{
-		return static_cast<ComponentBase *>(std::get<0>(t)) == component;
-	}
-};
-}
-
 class Entity;
 
 struct ComponentIDMapping
@@ -81,9 +60,28 @@ public:
 		return id;
 	}
 
+	template <typename... Ts>
+	static uint32_t get_archetype_id()
+	{
+		static uint32_t id = archetype_ids++;
+		return id;
+	}
+
 private:
 	static uint32_t ids;
 	static uint32_t group_ids;
+	static uint32_t archetype_ids;
+};
+
+// Notified whenever an entity starts or stops having all the components of a group.
+// When an entity leaves a group, some of its components may already have been freed,
+// so component pointers should only be used as keys at that point.
+class EntityGroupListener
+{
+public:
+	virtual ~EntityGroupListener() = default;
+	virtual void on_entity_added(Entity &entity) = 0;
+	virtual void on_entity_removed(Entity &entity) = 0;
 };
 
 class EntityGroupBase
@@ -91,11 +89,130 @@ class EntityGroupBase
 public:
 	virtual ~EntityGroupBase() = default;
 	virtual void add_entity(Entity &entity) = 0;
-	virtual void remove_component(ComponentBase *component) = 0;
+	virtual void remove_entity(Entity &entity) = 0;
+	virtual void add_listener(EntityGroupListener *listener) = 0;
+
+	void remove_listener(EntityGroupListener *listener)
+	{
+		listeners.erase(std::remove(std::begin(listeners), std::end(listeners), listener), std::end(listeners));
+	}
+
+protected:
+	std::vector<EntityGroupListener *> listeners;
 };
 
 class EntityPool;
 
+template <typename... Ts>
+class EntityGroup;
+
+// Backing storage for entities created with EntityPool::create_archetype_entity<Ts...>().
+// Every component type gets its own array, so entities with the same set of components which are created
+// together sit next to each other in each array, and iterating a group over them streams linearly through memory.
+// Arrays are allocated in chunks which never move, so component pointers stay valid like with the per-type pools.
+class EntityArchetype
+{
+public:
+	struct ComponentType
+	{
+		uint32_t id;
+		size_t size;
+		size_t alignment;
+		void (*destroy)(ComponentBase *component);
+	};
+
+	explicit EntityArchetype(std::vector<ComponentType> types);
+
+	uint32_t allocate_slot();
+	void free_slot(uint32_t slot);
+
+	// Returns the index of the component type within the archetype, or -1 if it is not part of it.
+	int find_type(uint32_t id) const
+	{
+		for (size_t i = 0; i < types.size(); i++)
+			if (types[i].id == id)
+				return int(i);
+		return -1;
+	}
+
+	const ComponentType &get_type(unsigned index) const
+	{
+		return types[index];
+	}
+
+	void *get_storage(unsigned type_index, uint32_t slot) const
+	{
+		return chunks[slot / ChunkSize].get() + offsets[type_index] + (slot % ChunkSize) * types[type_index].size;
+	}
+
+	// Slots within one chunk are consecutive elements of each component array.
+	enum { ChunkSize = 1024 };
+
+private:
+
+	struct MallocDeleter
+	{
+		void operator()(uint8_t *ptr);
+	};
+
+	std::vector<ComponentType> types;
+	std::vector<size_t> offsets;
+	size_t chunk_bytes = 0;
+	std::vector<std::unique_ptr<uint8_t, MallocDeleter>> chunks;
+	std::vector<uint32_t> vacants;
+};
+
+// A set of slots in one archetype, used by groups to remember which of their entities live there.
+class EntityArchetypeSlots
+{
+public:
+	void set(uint32_t slot)
+	{
+		if (slot / 32 >= bits.size())
+			bits.resize(slot / 32 + 1);
+		bits[slot / 32] |= 1u << (slot & 31);
+	}
+
+	void clear(uint32_t slot)
+	{
+		bits[slot / 32] &= ~(1u << (slot & 31));
+	}
+
+	// Calls func(first_slot, count) for every run of consecutive slots in the set, in ascending order.
+	// Runs are split at chunk boundaries, so each one is a plain array per component type.
+	template <typename Func>
+	void for_each_run(const Func &func) const
+	{
+		uint32_t run_start = 0;
+		uint32_t run_count = 0;
+		for (size_t word = 0; word < bits.size(); word++)
+		{
+			uint32_t value = bits[word];
+			while (value)
+			{
+				uint32_t bit = trailing_zeroes(value);
+				uint32_t slot = uint32_t(word * 32 + bit);
+				if (run_count && (slot != run_start + run_count || slot % EntityArchetype::ChunkSize == 0))
+				{
+					func(run_start, run_count);
+					run_count = 0;
+				}
+
+				if (!run_count)
+					run_start = slot;
+				run_count++;
+				value &= value - 1;
+			}
+		}
+
+		if (run_count)
+			func(run_start, run_count);
+	}
+
+private:
+	std::vector<uint32_t> bits;
+};
+
 struct EntityDeleter
 {
 	void operator()(Entity *entity);
@@ -109,10 +226,15 @@ public:
 	{
 	}
 
+	struct ComponentEntry
+	{
+		uint32_t id;
+		ComponentBase *component;
+	};
+
 	bool has_component(uint32_t id) const
 	{
-		auto itr = components.find(id);
-		return itr != std::end(components) && itr->second;
+		return find_component(id) != nullptr;
 	}
 
 	template <typename T>
@@ -124,21 +246,13 @@ public:
 	template <typename T>
 	T *get_component()
 	{
-		auto itr = components.find(ComponentIDMapping::get_id<T>());
-		if (itr == std::end(components))
-			return nullptr;
-
-		return static_cast<T *>(itr->second);
+		return static_cast<T *>(find_component(ComponentIDMapping::get_id<T>()));
 	}
 
 	template <typename T>
 	const T *get_component() const
 	{
-		auto itr = components.find(ComponentIDMapping::get_id<T>());
-		if (itr == std::end(components))
-			return nullptr;
-
-		return static_cast<T *>(itr->second);
+		return static_cast<const T *>(find_component(ComponentIDMapping::get_id<T>()));
 	}
 
 	template <typename T, typename... Ts>
@@ -147,7 +261,7 @@ public:
 	template <typename T>
 	void free_component();
 
-	std::unordered_map<uint32_t, ComponentBase *> &get_components()
+	const std::vector<ComponentEntry> &get_components() const
 	{
 		return components;
 	}
@@ -157,9 +271,81 @@ public:
 		return pool;
 	}
 
+	EntityArchetype *get_archetype() const
+	{
+		return archetype;
+	}
+
 private:
+	friend class EntityPool;
+	template <typename... Ts>
+	friend class EntityGroup;
 	EntityPool *pool;
-	std::unordered_map<uint32_t, ComponentBase *> components;
+
+	// Entities rarely have more than a handful of components, so a linear search beats hashing.
+	std::vector<ComponentEntry> components;
+	EntityArchetype *archetype = nullptr;
+	uint32_t archetype_slot = 0;
+
+	// Where the entity lives in EntityPool::entities and in each group it belongs to, so removal never searches.
+	struct GroupSlot
+	{
+		uint32_t group;
+		uint32_t index;
+	};
+	std::vector<GroupSlot> group_slots;
+	size_t pool_index = 0;
+
+	uint32_t *find_group_slot(uint32_t group)
+	{
+		for (auto &slot : group_slots)
+			if (slot.group == group)
+				return &slot.index;
+		return nullptr;
+	}
+
+	void erase_group_slot(uint32_t group)
+	{
+		auto itr = std::find_if(std::begin(group_slots), std::end(group_slots), [group](const GroupSlot &slot) {
+			return slot.group == group;
+		});
+
+		if (itr != std::end(group_slots))
+		{
+			*itr = group_slots.back();
+			group_slots.pop_back();
+		}
+	}
+
+	ComponentBase *find_component(uint32_t id) const
+	{
+		for (auto &entry : components)
+			if (entry.id == id)
+				return entry.component;
+		return nullptr;
+	}
+
+	ComponentBase *&get_component_slot(uint32_t id)
+	{
+		for (auto &entry : components)
+			if (entry.id == id)
+				return entry.component;
+		components.push_back({ id, nullptr });
+		return components.back().component;
+	}
+
+	void erase_component(uint32_t id)
+	{
+		auto itr = std::find_if(std::begin(components), std::end(components), [id](const ComponentEntry &entry) {
+			return entry.id == id;
+		});
+
+		if (itr != std::end(components))
+		{
+			*itr = components.back();
+			components.pop_back();
+		}
+	}
 };
 
 template <typename... Ts>
@@ -170,28 +356,64 @@ public:
 	{
 		if (has_all_components<Ts...>(entity))
 		{
-			entities.push_back(&entity);
-			groups.push_back(std::make_tuple(entity.get_component<Ts>()...));
+			uint32_t group_id = ComponentIDMapping::get_group_id<Ts...>();
+			auto *slot = entity.find_group_slot(group_id);
+
+			// If the entity is already in the group, one of its components was replaced.
+			// Components stored in the archetype are replaced in place, so its chunk membership stays the same.
+			if (slot)
+				groups[*slot] = std::make_tuple(entity.get_component<Ts>()...);
+			else
+			{
+				entity.group_slots.push_back({ group_id, uint32_t(groups.size()) });
+				entities.push_back(&entity);
+				groups.push_back(std::make_tuple(entity.get_component<Ts>()...));
+
+				auto *members = find_archetype_members(entity);
+				if (members)
+					members->slots.set(entity.archetype_slot);
+				in_archetype.push_back(members != nullptr);
+			}
+			chunks_dirty = true;
+
+			for (auto *listener : listeners)
+				listener->on_entity_added(entity);
 		}
 	}
 
-	void remove_component(ComponentBase *component) override final
+	void add_listener(EntityGroupListener *listener) override final
 	{
-		auto itr = std::find_if(std::begin(groups), std::end(groups), [&](const std::tuple<Ts *...> &t) {
-			return has_component(t, component);
-		});
+		listeners.push_back(listener);
+		for (auto *entity : entities)
+			listener->on_entity_added(*entity);
+	}
 
-		if (itr == end(groups))
+	void remove_entity(Entity &entity) override final
+	{
+		uint32_t group_id = ComponentIDMapping::get_group_id<Ts...>();
+		auto *slot = entity.find_group_slot(group_id);
+		if (!slot)
 			return;
 
-		auto offset = size_t(itr - begin(groups));
+		uint32_t offset = *slot;
+		for (auto *listener : listeners)
+			listener->on_entity_removed(entity);
+		entity.erase_group_slot(group_id);
+
+		if (in_archetype[offset])
+			find_archetype_members(entity)->slots.clear(entity.archetype_slot);
+
 		if (offset != groups.size() - 1)
 		{
-			std::swap(groups[offset], groups.back());
-			std::swap(entities[offset], entities.back());
+			groups[offset] = groups.back();
+			entities[offset] = entities.back();
+			in_archetype[offset] = in_archetype.back();
+			*entities[offset]->find_group_slot(group_id) = offset;
 		}
 		groups.pop_back();
 		entities.pop_back();
+		in_archetype.pop_back();
+		chunks_dirty = true;
 	}
 
 	std::vector<std::tuple<Ts *...>> &get_groups()
@@ -199,9 +421,93 @@ public:
 		return groups;
 	}
 
+	// count entities whose components are consecutive elements of one array per component type,
+	// starting at the pointers in components.
+	struct Chunk
+	{
+		std::tuple<Ts *...> components;
+		size_t count;
+	};
+
+	// Every entity in the group, as runs of archetype slots in slot order, followed by entities
+	// which do not have all of Ts in their archetype as chunks of one.
+	// Rebuilt on first use after entities enter or leave the group.
+	const std::vector<Chunk> &get_chunks()
+	{
+		if (chunks_dirty)
+			build_chunks();
+		return chunks;
+	}
+
 private:
 	std::vector<std::tuple<Ts *...>> groups;
 	std::vector<Entity *> entities;
+	std::vector<bool> in_archetype;
+
+	struct ArchetypeMembers
+	{
+		EntityArchetype *archetype;
+		bool has_all_types;
+		unsigned type_indices[sizeof...(Ts)];
+		EntityArchetypeSlots slots;
+	};
+	std::vector<ArchetypeMembers> archetypes;
+	std::vector<Chunk> chunks;
+	bool chunks_dirty = true;
+
+	// Returns the slot set of the entity's archetype if it stores all of Ts, nullptr otherwise.
+	// There are only ever a handful of archetypes per group, so a linear search is fine.
+	ArchetypeMembers *find_archetype_members(const Entity &entity)
+	{
+		if (!entity.archetype)
+			return nullptr;
+
+		for (auto &members : archetypes)
+			if (members.archetype == entity.archetype)
+				return members.has_all_types ? &members : nullptr;
+
+		ArchetypeMembers members = {};
+		members.archetype = entity.archetype;
+		members.has_all_types = true;
+		const int type_indices[] = { entity.archetype->find_type(ComponentIDMapping::get_id<Ts>())... };
+		for (size_t i = 0; i < sizeof...(Ts); i++)
+		{
+			if (type_indices[i] < 0)
+				members.has_all_types = false;
+			else
+				members.type_indices[i] = unsigned(type_indices[i]);
+		}
+
+		archetypes.push_back(std::move(members));
+		return archetypes.back().has_all_types ? &archetypes.back() : nullptr;
+	}
+
+	template <size_t... Is>
+	static std::tuple<Ts *...> get_archetype_components(const ArchetypeMembers &members, uint32_t slot,
+	                                                     std::index_sequence<Is...>)
+	{
+		return std::make_tuple(static_cast<Ts *>(members.archetype->get_storage(members.type_indices[Is], slot))...);
+	}
+
+	void build_chunks()
+	{
+		chunks.clear();
+		for (auto &members : archetypes)
+		{
+			if (!members.has_all_types)
+				continue;
+
+			members.slots.for_each_run([&](uint32_t slot, uint32_t count) {
+				chunks.push_back({ get_archetype_components(members, slot, std::index_sequence_for<Ts...>()), count });
+			});
+		}
+
+		for (size_t i = 0; i < groups.size(); i++)
+			if (!in_archetype[i])
+				chunks.push_back({ groups[i], 1 });
+
+		chunks_dirty = false;
+	}
 
 	template <typename... Us>
 	struct HasAllComponents;
@@ -230,12 +536,6 @@ private:
 	{
 		return HasAllComponents<Us...>::has_component(entity);
 	}
-
-	template <typename... Us>
-	static bool has_component(const std::tuple<Us *...> &t, const ComponentBase *component)
-	{
-		return Internal::HasComponent<sizeof...(Us) - 1>::has_component(t, component);
-	}
 };
 
 class ComponentAllocatorBase
@@ -264,79 +564,125 @@ public:
 	EntityHandle create_entity()
 	{
 		auto itr = EntityHandle(entity_pool.allocate(this));
+		itr->pool_index = entities.size();
 		entities.push_back(itr.get());
 		return itr;
 	}
 
+	// Creates an entity with default constructed components Ts, stored in the arrays of the archetype for exactly
+	// this set of component types. Groups see the entity once, with all of its components in place.
+	// Components can still be freed and allocated afterwards. Types which are part of the archetype
+	// reuse their slot, any other type is allocated from the per-type pools as usual.
+	template <typename... Ts>
+	EntityHandle create_archetype_entity()
+	{
+		auto *archetype = get_archetype<Ts...>();
+		auto handle = create_entity();
+		auto &entity = *handle;
+		entity.archetype = archetype;
+		entity.archetype_slot = archetype->allocate_slot();
+		entity.components.reserve(sizeof...(Ts));
+
+		unsigned type_index = 0;
+		const uint32_t ids[] = { ComponentIDMapping::get_id<Ts>()... };
+		ComponentBase *components[] = {
+			construct_archetype_component<Ts>(*archetype, entity.archetype_slot, type_index++)...
+		};
+
+		for (size_t i = 0; i < sizeof...(Ts); i++)
+			entity.components.push_back({ ids[i], components[i] });
+
+		// Every group which cares about any of the components gets to look at the entity exactly once.
+		std::vector<uint32_t> touched_groups;
+		for (auto id : ids)
+			for (auto &group : component_to_groups[id])
+				if (std::find(std::begin(touched_groups), std::end(touched_groups), group) == std::end(touched_groups))
+					touched_groups.push_back(group);
+
+		for (auto &group : touched_groups)
+			groups[group]->add_entity(entity);
+
+		return handle;
+	}
+
 	void delete_entity(Entity *entity)
 	{
-		auto &components = entity->get_components();
-		for (auto &component : components)
-			if (component.second)
-				free_component(component.first, component.second);
-		entity_pool.free(entity);
+		if (deferring_deletes)
+		{
+			deferred_deletes.push_back(entity);
+			return;
+		}
 
-		auto itr = std::find(std::begin(entities), std::end(entities), entity);
-		auto offset = size_t(itr - std::begin(entities));
-		if (offset != entities.size() - 1)
-			std::swap(entities[offset], entities.back());
-		entities.pop_back();
+		for (auto &component : entity->components)
+			if (component.component)
+				free_component(*entity, component.id, component.component);
+		if (entity->archetype)
+			entity->archetype->free_slot(entity->archetype_slot);
+
+		remove_from_pool(*entity);
+		entity_pool.free(entity);
 	}
 
+	// Releases count handles. Entities which are not referenced anywhere else are deleted as a batch.
+	// Each one leaves exactly the groups it is in, found through its group slots, instead of every group
+	// registered for each of its components. Like single deletes, this is a swap-and-pop per group,
+	// so the cost only depends on the size of the batch.
+	void destroy_entities(EntityHandle *handles, size_t count);
+
 	template <typename... Ts>
 	std::vector<std::tuple<Ts *...>> &get_component_group()
 	{
-		uint32_t group_id = ComponentIDMapping::get_group_id<Ts...>();
-		auto itr = groups.find(group_id);
-		if (itr == std::end(groups))
-		{
-			register_group<Ts...>(group_id);
-			auto tmp = groups.insert(std::make_pair(group_id, std::unique_ptr<EntityGroupBase>(new EntityGroup<Ts...>())));
-			itr = tmp.first;
+		return get_entity_group<Ts...>()->get_groups();
+	}
 
-			auto *group = static_cast<EntityGroup<Ts...> *>(itr->second.get());
-			for (auto &entity : entities)
-				group->add_entity(*entity);
-		}
+	// Same entities as get_component_group(), as arrays of components which can be iterated without chasing pointers.
+	// Only valid until entities or components are added or removed.
+	template <typename... Ts>
+	const std::vector<typename EntityGroup<Ts...>::Chunk> &get_component_chunks()
+	{
+		return get_entity_group<Ts...>()->get_chunks();
+	}
+
+	// The listener is called for every entity already in the group, then for every entity entering or leaving it.
+	// Listeners are dropped along with the groups in reset_groups().
+	template <typename... Ts>
+	void add_component_group_listener(EntityGroupListener *listener)
+	{
+		get_entity_group<Ts...>()->add_listener(listener);
+	}
 
-		auto *group = static_cast<EntityGroup<Ts...> *>(itr->second.get());
-		return group->get_groups();
+	template <typename... Ts>
+	void remove_component_group_listener(EntityGroupListener *listener)
+	{
+		get_entity_group<Ts...>()->remove_listener(listener);
 	}
 
 	template <typename T, typename... Ts>
 	T *allocate_component(Entity &entity, Ts&&... ts)
 	{
 		uint32_t id = ComponentIDMapping::get_id<T>();
-		auto itr = components.find(id);
-		if (itr == std::end(components))
-		{
-			auto tmp = components.insert(std::make_pair(id, std::unique_ptr<ComponentAllocatorBase>(new ComponentAllocator<T>)));
-			itr = tmp.first;
-		}
-
-		auto *allocator = static_cast<ComponentAllocator<T> *>(itr->second.get());
-		auto &comp = entity.get_components()[id];
+		auto &comp = entity.get_component_slot(id);
 		if (comp)
-		{
-			allocator->free_component(comp);
-			comp = allocator->pool.allocate(std::forward<Ts>(ts)...);
-			for (auto &group : component_to_groups[id])
-				groups[group]->add_entity(entity);
-		}
+			free_component_storage(entity, id, comp);
+
+		T *component;
+		int type_index = entity.archetype ? entity.archetype->find_type(id) : -1;
+		if (type_index >= 0)
+			component = new (entity.archetype->get_storage(unsigned(type_index), entity.archetype_slot)) T(std::forward<Ts>(ts)...);
 		else
-		{
-			comp = allocator->pool.allocate(std::forward<Ts>(ts)...);
-			for (auto &group : component_to_groups[id])
-				groups[group]->add_entity(entity);
-		}
-		return static_cast<T *>(comp);
+			component = get_allocator<T>()->pool.allocate(std::forward<Ts>(ts)...);
+		comp = component;
+
+		for (auto &group : component_to_groups[id])
+			groups[group]->add_entity(entity);
+		return component;
 	}
 
-	void free_component(uint32_t id, ComponentBase *component)
+	void free_component(Entity &entity, uint32_t id, ComponentBase *component)
 	{
-		components[id]->free_component(component);
+		free_component_storage(entity, id, component);
 		for (auto &group : component_to_groups[id])
-			groups[group]->remove_component(component);
+			groups[group]->remove_entity(entity);
 	}
 
 	void reset_groups();
@@ -346,7 +692,92 @@ private:
 	std::unordered_map<uint32_t, std::unique_ptr<EntityGroupBase>> groups;
 	std::unordered_map<uint32_t, std::unique_ptr<ComponentAllocatorBase>> components;
 	std::unordered_map<uint32_t, std::unordered_set<uint32_t>> component_to_groups;
+	std::unordered_map<uint32_t, std::unique_ptr<EntityArchetype>> archetypes;
 	std::vector<Entity *> entities;
+	std::vector<Entity *> deferred_deletes;
+	bool deferring_deletes = false;
+
+	void remove_from_pool(Entity &entity)
+	{
+		auto offset = entity.pool_index;
+		if (offset != entities.size() - 1)
+		{
+			entities[offset] = entities.back();
+			entities[offset]->pool_index = offset;
+		}
+		entities.pop_back();
+	}
+
+	template <typename T>
+	ComponentAllocator<T> *get_allocator()
+	{
+		uint32_t id = ComponentIDMapping::get_id<T>();
+		auto itr = components.find(id);
+		if (itr == std::end(components))
+		{
+			auto tmp = components.insert(std::make_pair(id, std::unique_ptr<ComponentAllocatorBase>(new ComponentAllocator<T>)));
+			itr = tmp.first;
+		}
+
+		return static_cast<ComponentAllocator<T> *>(itr->second.get());
+	}
+
+	void free_component_storage(Entity &entity, uint32_t id, ComponentBase *component)
+	{
+		int type_index = entity.archetype ? entity.archetype->find_type(id) : -1;
+		if (type_index >= 0)
+			entity.archetype->get_type(unsigned(type_index)).destroy(component);
+		else
+			components[id]->free_component(component);
+	}
+
+	template <typename T>
+	static void destroy_component(ComponentBase *component)
+	{
+		static_cast<T *>(component)->~T();
+	}
+
+	template <typename T>
+	static ComponentBase *construct_archetype_component(EntityArchetype &archetype, uint32_t slot, unsigned type_index)
+	{
+		return new (archetype.get_storage(type_index, slot)) T();
+	}
+
+	template <typename... Ts>
+	EntityArchetype *get_archetype()
+	{
+		uint32_t archetype_id = ComponentIDMapping::get_archetype_id<Ts...>();
+		auto itr = archetypes.find(archetype_id);
+		if (itr == std::end(archetypes))
+		{
+			std::vector<EntityArchetype::ComponentType> types = {
+				{ ComponentIDMapping::get_id<Ts>(), sizeof(Ts), alignof(Ts), destroy_component<Ts> }...
+			};
+			auto tmp = archetypes.insert(std::make_pair(archetype_id, std::unique_ptr<EntityArchetype>(new EntityArchetype(std::move(types)))));
+			itr = tmp.first;
+		}
+
+		return itr->second.get();
+	}
+
+	template <typename... Ts>
+	EntityGroup<Ts...> *get_entity_group()
+	{
+		uint32_t group_id = ComponentIDMapping::get_group_id<Ts...>();
+		auto itr = groups.find(group_id);
+		if (itr == std::end(groups))
+		{
+			register_group<Ts...>(group_id);
+			auto tmp = groups.insert(std::make_pair(group_id, std::unique_ptr<EntityGroupBase>(new EntityGroup<Ts...>())));
+			itr = tmp.first;
+
+			auto *group = static_cast<EntityGroup<Ts...> *>(itr->second.get());
+			for (auto &entity : entities)
+				group->add_entity(*entity);
+		}
+
+		return static_cast<EntityGroup<Ts...> *>(itr->second.get());
+	}
 
 	template <typename... Us>
 	struct GroupRegisters;
@@ -389,12 +820,11 @@ template <typename T>
 void Entity::free_component()
 {
 	auto id = ComponentIDMapping::get_id<T>();
-	auto itr = components.find(id);
-	if (itr != std::end(components))
+	auto *component = find_component(id);
+	if (component)
 	{
-		assert(itr->second);
-		pool->free_component(id, itr->second);
-		components.erase(itr);
+		pool->free_component(*this, id, component);
+		erase_component(id);
 	}
 }
 
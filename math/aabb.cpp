@@ -53,4 +53,23 @@ void AABB::expand(const AABB &aabb)
 	maximum = max(maximum, aabb.maximum);
 }
 
+void AABBSoA::resize(size_t new_count)
+{
+	count = new_count;
+	size_t padded = (new_count + Alignment - 1) & ~size_t(Alignment - 1);
+	center_x.resize(padded);
+	center_y.resize(padded);
+	center_z.resize(padded);
+	radius.resize(padded);
+}
+
+void AABBSoA::set(size_t index, const AABB &aabb)
+{
+	vec3 center = aabb.get_center();
+	center_x[index] = center.x;
+	center_y[index] = center.y;
+	center_z[index] = center.z;
+	radius[index] = aabb.get_radius();
+}
+
 }
\ No newline at end of file
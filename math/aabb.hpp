@@ -24,6 +24,8 @@
 
 #include "math.hpp"
 #include "muglm/muglm_impl.hpp"
+#include <vector>
+#include <stddef.h>
 
 namespace Granite
 {
@@ -74,4 +76,48 @@ private:
 	vec3 minimum;
 	vec3 maximum;
 };
+
+// Many boxes in structure-of-arrays layout, for testing them against a frustum in batches.
+// Boxes are kept as the bounding spheres Frustum::intersects_fast() uses, so batched results match it exactly.
+// Storage is padded to a multiple of 8 boxes, so kernels never need a scalar tail.
+class AABBSoA
+{
+public:
+	enum { Alignment = 8 };
+
+	void resize(size_t count);
+	void set(size_t index, const AABB &aabb);
+
+	size_t size() const
+	{
+		return count;
+	}
+
+	const float *get_center_x() const
+	{
+		return center_x.data();
+	}
+
+	const float *get_center_y() const
+	{
+		return center_y.data();
+	}
+
+	const float *get_center_z() const
+	{
+		return center_z.data();
+	}
+
+	const float *get_radius() const
+	{
+		return radius.data();
+	}
+
+private:
+	std::vector<float> center_x;
+	std::vector<float> center_y;
+	std::vector<float> center_z;
+	std::vector<float> radius;
+	size_t count = 0;
+};
 }
\ No newline at end of file
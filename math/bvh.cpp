@@ -0,0 +1,411 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "bvh.hpp"
+#include <algorithm>
+
+namespace Granite
+{
+static float surface_area(const AABB &aabb)
+{
+	vec3 d = aabb.get_maximum() - aabb.get_minimum();
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+static AABB merge(const AABB &a, const AABB &b)
+{
+	return AABB(min(a.get_minimum(), b.get_minimum()), max(a.get_maximum(), b.get_maximum()));
+}
+
+static bool contains(const AABB &outer, const AABB &inner)
+{
+	const vec3 &omin = outer.get_minimum();
+	const vec3 &omax = outer.get_maximum();
+	const vec3 &imin = inner.get_minimum();
+	const vec3 &imax = inner.get_maximum();
+	return omin.x <= imin.x && omin.y <= imin.y && omin.z <= imin.z &&
+	       omax.x >= imax.x && omax.y >= imax.y && omax.z >= imax.z;
+}
+
+BVH::BVH()
+{
+}
+
+void BVH::set_margin(float margin)
+{
+	relative_margin = margin;
+}
+
+void BVH::clear()
+{
+	nodes.clear();
+	root = Invalid;
+	free_list = Invalid;
+	leaf_count = 0;
+}
+
+uint32_t BVH::allocate_node()
+{
+	uint32_t index;
+	if (free_list != Invalid)
+	{
+		index = free_list;
+		free_list = nodes[index].parent;
+	}
+	else
+	{
+		index = uint32_t(nodes.size());
+		nodes.emplace_back();
+	}
+
+	auto &node = nodes[index];
+	node.parent = Invalid;
+	node.children[0] = Invalid;
+	node.children[1] = Invalid;
+	node.user = 0;
+	node.mask = 0;
+	node.height = 0;
+	return index;
+}
+
+void BVH::free_node(uint32_t index)
+{
+	auto &node = nodes[index];
+	node.parent = free_list;
+	node.height = -1;
+	free_list = index;
+}
+
+void BVH::update_node(Node &node) const
+{
+	auto &a = nodes[node.children[0]];
+	auto &b = nodes[node.children[1]];
+	node.aabb = merge(a.aabb, b.aabb);
+	node.mask = a.mask | b.mask;
+	node.height = 1 + std::max(a.height, b.height);
+}
+
+uint32_t BVH::insert(const AABB &aabb, uint32_t user, uint32_t mask)
+{
+	uint32_t leaf = allocate_node();
+	auto &node = nodes[leaf];
+	vec3 margin = (aabb.get_maximum() - aabb.get_minimum()) * vec3(relative_margin);
+	node.aabb = AABB(aabb.get_minimum() - margin, aabb.get_maximum() + margin);
+	node.user = user;
+	node.mask = mask;
+	insert_leaf(leaf);
+	leaf_count++;
+	return leaf;
+}
+
+void BVH::remove(uint32_t leaf)
+{
+	assert(nodes[leaf].is_leaf());
+	remove_leaf(leaf);
+	free_node(leaf);
+	leaf_count--;
+}
+
+bool BVH::move(uint32_t leaf, const AABB &aabb)
+{
+	auto &node = nodes[leaf];
+	assert(node.is_leaf());
+
+	vec3 margin = (aabb.get_maximum() - aabb.get_minimum()) * vec3(relative_margin);
+	AABB fat(aabb.get_minimum() - margin, aabb.get_maximum() + margin);
+
+	// Objects which still fit are left alone, unless they shrank so much that the stored box is mostly empty.
+	if (contains(node.aabb, aabb))
+	{
+		vec3 stored_size = node.aabb.get_maximum() - node.aabb.get_minimum();
+		vec3 fat_size = fat.get_maximum() - fat.get_minimum();
+		if (stored_size.x <= 2.0f * fat_size.x && stored_size.y <= 2.0f * fat_size.y &&
+		    stored_size.z <= 2.0f * fat_size.z)
+			return false;
+	}
+
+	remove_leaf(leaf);
+	nodes[leaf].aabb = fat;
+	insert_leaf(leaf);
+	return true;
+}
+
+void BVH::set_mask(uint32_t leaf, uint32_t mask)
+{
+	assert(nodes[leaf].is_leaf());
+	nodes[leaf].mask = mask;
+
+	for (uint32_t index = nodes[leaf].parent; index != Invalid; index = nodes[index].parent)
+	{
+		auto &node = nodes[index];
+		uint32_t new_mask = nodes[node.children[0]].mask | nodes[node.children[1]].mask;
+		if (new_mask == node.mask)
+			break;
+		node.mask = new_mask;
+	}
+}
+
+void BVH::insert_leaf(uint32_t leaf)
+{
+	if (root == Invalid)
+	{
+		root = leaf;
+		nodes[leaf].parent = Invalid;
+		return;
+	}
+
+	// Walk down towards the sibling which grows the total surface area of the tree the least.
+	AABB leaf_aabb = nodes[leaf].aabb;
+	uint32_t index = root;
+	while (!nodes[index].is_leaf())
+	{
+		auto &node = nodes[index];
+		float area = surface_area(node.aabb);
+		float combined_area = surface_area(merge(node.aabb, leaf_aabb));
+
+		// Cost of pairing with this node, and the cost pushed down to any node below it.
+		float cost = 2.0f * combined_area;
+		float inheritance_cost = 2.0f * (combined_area - area);
+
+		float child_costs[2];
+		for (unsigned i = 0; i < 2; i++)
+		{
+			auto &child = nodes[node.children[i]];
+			float child_area = surface_area(merge(child.aabb, leaf_aabb));
+			if (!child.is_leaf())
+				child_area -= surface_area(child.aabb);
+			child_costs[i] = child_area + inheritance_cost;
+		}
+
+		if (cost < child_costs[0] && cost < child_costs[1])
+			break;
+
+		index = child_costs[0] < child_costs[1] ? node.children[0] : node.children[1];
+	}
+
+	uint32_t sibling = index;
+	uint32_t old_parent = nodes[sibling].parent;
+	uint32_t new_parent = allocate_node();
+
+	nodes[new_parent].parent = old_parent;
+	nodes[new_parent].children[0] = sibling;
+	nodes[new_parent].children[1] = leaf;
+	nodes[sibling].parent = new_parent;
+	nodes[leaf].parent = new_parent;
+
+	if (old_parent != Invalid)
+	{
+		auto &parent = nodes[old_parent];
+		parent.children[parent.children[0] == sibling ? 0 : 1] = new_parent;
+	}
+	else
+		root = new_parent;
+
+	refit_ancestors(new_parent);
+}
+
+void BVH::remove_leaf(uint32_t leaf)
+{
+	if (leaf == root)
+	{
+		root = Invalid;
+		return;
+	}
+
+	uint32_t parent = nodes[leaf].parent;
+	uint32_t grand_parent = nodes[parent].parent;
+	uint32_t sibling = nodes[parent].children[0] == leaf ? nodes[parent].children[1] : nodes[parent].children[0];
+
+	free_node(parent);
+	if (grand_parent != Invalid)
+	{
+		auto &node = nodes[grand_parent];
+		node.children[node.children[0] == parent ? 0 : 1] = sibling;
+		nodes[sibling].parent = grand_parent;
+		refit_ancestors(grand_parent);
+	}
+	else
+	{
+		root = sibling;
+		nodes[sibling].parent = Invalid;
+	}
+}
+
+void BVH::refit_ancestors(uint32_t index)
+{
+	while (index != Invalid)
+	{
+		index = balance(index);
+		update_node(nodes[index]);
+		index = nodes[index].parent;
+	}
+}
+
+// Rotates the taller grandchild up if the children of index differ in height by more than one.
+// Returns the node which took the place of index.
+uint32_t BVH::balance(uint32_t index_a)
+{
+	auto &a = nodes[index_a];
+	if (a.is_leaf() || a.height < 2)
+		return index_a;
+
+	for (unsigned side = 0; side < 2; side++)
+	{
+		uint32_t index_short = a.children[side];
+		uint32_t index_tall = a.children[side ^ 1];
+		auto &tall = nodes[index_tall];
+
+		if (tall.height - nodes[index_short].height <= 1)
+			continue;
+
+		// tall replaces a, and a adopts the shorter of tall's children in tall's old place.
+		uint32_t index_f = tall.children[0];
+		uint32_t index_g = tall.children[1];
+		if (nodes[index_f].height > nodes[index_g].height)
+			std::swap(index_f, index_g);
+
+		tall.parent = a.parent;
+		a.parent = index_tall;
+		if (tall.parent != Invalid)
+		{
+			auto &parent = nodes[tall.parent];
+			parent.children[parent.children[0] == index_a ? 0 : 1] = index_tall;
+		}
+		else
+			root = index_tall;
+
+		tall.children[0] = index_a;
+		tall.children[1] = index_g;
+		a.children[side ^ 1] = index_f;
+		nodes[index_f].parent = index_a;
+
+		update_node(a);
+		update_node(tall);
+		return index_tall;
+	}
+
+	return index_a;
+}
+
+void BVH::build(const AABB *aabbs, const uint32_t *users, const uint32_t *masks, size_t count, uint32_t *leaves)
+{
+	clear();
+	if (count == 0)
+		return;
+
+	std::vector<uint32_t> order(count);
+	nodes.reserve(2 * count - 1);
+	for (size_t i = 0; i < count; i++)
+	{
+		uint32_t leaf = allocate_node();
+		auto &node = nodes[leaf];
+		node.aabb = aabbs[i];
+		node.user = users[i];
+		node.mask = masks ? masks[i] : ~0u;
+		order[i] = leaf;
+		if (leaves)
+			leaves[i] = leaf;
+	}
+
+	leaf_count = count;
+	root = build_range(order.data(), count, Invalid);
+}
+
+uint32_t BVH::build_range(uint32_t *leaves, size_t count, uint32_t parent)
+{
+	if (count == 1)
+	{
+		nodes[leaves[0]].parent = parent;
+		return leaves[0];
+	}
+
+	// Median split along the axis where the box centers are spread the most.
+	vec3 lo = nodes[leaves[0]].aabb.get_center();
+	vec3 hi = lo;
+	for (size_t i = 1; i < count; i++)
+	{
+		vec3 c = nodes[leaves[i]].aabb.get_center();
+		lo = min(lo, c);
+		hi = max(hi, c);
+	}
+
+	vec3 extent = hi - lo;
+	unsigned axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+	size_t mid = count / 2;
+	std::nth_element(leaves, leaves + mid, leaves + count, [&](uint32_t a, uint32_t b) {
+		return nodes[a].aabb.get_center()[axis] < nodes[b].aabb.get_center()[axis];
+	});
+
+	uint32_t index = allocate_node();
+	uint32_t left = build_range(leaves, mid, index);
+	uint32_t right = build_range(leaves + mid, count - mid, index);
+
+	auto &node = nodes[index];
+	node.parent = parent;
+	node.children[0] = left;
+	node.children[1] = right;
+	update_node(node);
+	return index;
+}
+
+BVH::Overlap BVH::classify(const Frustum &frustum, const AABB &aabb)
+{
+	const vec4 *planes = frustum.get_planes();
+	const vec3 &lo = aabb.get_minimum();
+	const vec3 &hi = aabb.get_maximum();
+	bool inside = true;
+
+	for (unsigned i = 0; i < 6; i++)
+	{
+		const vec4 &p = planes[i];
+
+		// The corner furthest along the plane normal, and the one furthest against it.
+		vec3 pos(p.x >= 0.0f ? hi.x : lo.x, p.y >= 0.0f ? hi.y : lo.y, p.z >= 0.0f ? hi.z : lo.z);
+		vec3 neg(p.x >= 0.0f ? lo.x : hi.x, p.y >= 0.0f ? lo.y : hi.y, p.z >= 0.0f ? lo.z : hi.z);
+
+		if (dot(vec4(pos, 1.0f), p) < 0.0f)
+			return Overlap::Outside;
+		if (dot(vec4(neg, 1.0f), p) < 0.0f)
+			inside = false;
+	}
+
+	return inside ? Overlap::Inside : Overlap::Intersecting;
+}
+
+bool BVH::overlaps(const vec3 &center, float radius, const AABB &aabb)
+{
+	vec3 d = center - clamp(center, aabb.get_minimum(), aabb.get_maximum());
+	return dot(d, d) <= radius * radius;
+}
+
+bool BVH::overlaps(const AABB &a, const AABB &b)
+{
+	const vec3 &amin = a.get_minimum();
+	const vec3 &amax = a.get_maximum();
+	const vec3 &bmin = b.get_minimum();
+	const vec3 &bmax = b.get_maximum();
+	return amin.x <= bmax.x && amax.x >= bmin.x &&
+	       amin.y <= bmax.y && amax.y >= bmin.y &&
+	       amin.z <= bmax.z && amax.z >= bmin.z;
+}
+}
@@ -0,0 +1,256 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "aabb.hpp"
+#include "frustum.hpp"
+#include <vector>
+#include <stdint.h>
+#include <assert.h>
+
+namespace Granite
+{
+// Bounding volume hierarchy over AABBs, answering frustum, sphere and box queries in logarithmic time.
+// Every leaf carries a user value which is handed back by queries, and a mask which queries can filter on.
+// Inner nodes store the union of their children's masks, so subtrees without any matching leaf are skipped.
+//
+// insert(), remove() and move() maintain the tree incrementally, and keep it balanced with rotations.
+// Leaves are stored with a margin around the box, so objects which move a little do not touch the tree.
+// build() instead creates a tree top-down in one go, which is the better choice for objects which never move.
+class BVH
+{
+public:
+	enum : uint32_t { Invalid = 0xffffffffu };
+
+	BVH();
+
+	// Returns a leaf handle, which stays valid until the leaf is removed.
+	uint32_t insert(const AABB &aabb, uint32_t user, uint32_t mask = ~0u);
+	void remove(uint32_t leaf);
+
+	// Returns true if the leaf had to be reinserted, false if the new box was still within its margin.
+	bool move(uint32_t leaf, const AABB &aabb);
+	void set_mask(uint32_t leaf, uint32_t mask);
+
+	// Replaces the tree with one built top-down from the boxes. Leaves are stored without margin.
+	// Leaf handles are written to leaves if it is not nullptr.
+	void build(const AABB *aabbs, const uint32_t *users, const uint32_t *masks, size_t count, uint32_t *leaves);
+	void clear();
+
+	// Margin added on every side of inserted and moved leaves, relative to the size of the box.
+	void set_margin(float relative_margin);
+
+	uint32_t get_user(uint32_t leaf) const
+	{
+		return nodes[leaf].user;
+	}
+
+	const AABB &get_aabb(uint32_t leaf) const
+	{
+		return nodes[leaf].aabb;
+	}
+
+	size_t get_leaf_count() const
+	{
+		return leaf_count;
+	}
+
+	unsigned get_height() const
+	{
+		return root != Invalid ? unsigned(nodes[root].height) : 0;
+	}
+
+	// func(user) is called for every leaf whose mask matches and whose stored box intersects the volume.
+	// Stored boxes are conservative, so callers test the exact bounds of the object itself.
+	// Frustum::intersects_fast() tests the bounding sphere of a box, so leaves meant to be tested with it
+	// must store the box around that sphere.
+	template <typename Func>
+	void query(const Frustum &frustum, uint32_t mask, const Func &func) const;
+
+	template <typename Func>
+	void query(const vec3 &center, float radius, uint32_t mask, const Func &func) const;
+
+	template <typename Func>
+	void query(const AABB &aabb, uint32_t mask, const Func &func) const;
+
+private:
+	// An AVL balanced tree over N leaves is at most 1.44 * log2(N) deep, and so is a median split tree.
+	enum { MaxDepth = 96 };
+
+	enum class Overlap
+	{
+		Outside,
+		Intersecting,
+		Inside
+	};
+
+	struct Node
+	{
+		AABB aabb;
+		uint32_t parent;
+		uint32_t children[2];
+		uint32_t user;
+		uint32_t mask;
+		int height;
+
+		bool is_leaf() const
+		{
+			return children[0] == Invalid;
+		}
+	};
+
+	std::vector<Node> nodes;
+	uint32_t root = Invalid;
+	uint32_t free_list = Invalid;
+	size_t leaf_count = 0;
+	float relative_margin = 0.1f;
+
+	uint32_t allocate_node();
+	void free_node(uint32_t index);
+	void insert_leaf(uint32_t leaf);
+	void remove_leaf(uint32_t leaf);
+	void refit_ancestors(uint32_t index);
+	uint32_t balance(uint32_t index);
+	void update_node(Node &node) const;
+	uint32_t build_range(uint32_t *leaves, size_t count, uint32_t parent);
+
+	static Overlap classify(const Frustum &frustum, const AABB &aabb);
+	static bool overlaps(const vec3 &center, float radius, const AABB &aabb);
+	static bool overlaps(const AABB &a, const AABB &b);
+
+	template <typename Func>
+	void visit_subtree(uint32_t index, uint32_t mask, const Func &func) const;
+};
+
+template <typename Func>
+void BVH::visit_subtree(uint32_t index, uint32_t mask, const Func &func) const
+{
+	uint32_t stack[MaxDepth];
+	unsigned count = 0;
+	stack[count++] = index;
+
+	while (count)
+	{
+		auto &node = nodes[stack[--count]];
+		if ((node.mask & mask) == 0)
+			continue;
+
+		if (node.is_leaf())
+			func(node.user);
+		else
+		{
+			assert(count + 2 <= MaxDepth);
+			stack[count++] = node.children[1];
+			stack[count++] = node.children[0];
+		}
+	}
+}
+
+template <typename Func>
+void BVH::query(const Frustum &frustum, uint32_t mask, const Func &func) const
+{
+	if (root == Invalid)
+		return;
+
+	uint32_t stack[MaxDepth];
+	unsigned count = 0;
+	stack[count++] = root;
+
+	while (count)
+	{
+		uint32_t index = stack[--count];
+		auto &node = nodes[index];
+		if ((node.mask & mask) == 0)
+			continue;
+
+		auto overlap = classify(frustum, node.aabb);
+		if (overlap == Overlap::Outside)
+			continue;
+
+		if (node.is_leaf())
+			func(node.user);
+		else if (overlap == Overlap::Inside)
+			visit_subtree(index, mask, func);
+		else
+		{
+			assert(count + 2 <= MaxDepth);
+			stack[count++] = node.children[1];
+			stack[count++] = node.children[0];
+		}
+	}
+}
+
+template <typename Func>
+void BVH::query(const vec3 &center, float radius, uint32_t mask, const Func &func) const
+{
+	if (root == Invalid)
+		return;
+
+	uint32_t stack[MaxDepth];
+	unsigned count = 0;
+	stack[count++] = root;
+
+	while (count)
+	{
+		auto &node = nodes[stack[--count]];
+		if ((node.mask & mask) == 0 || !overlaps(center, radius, node.aabb))
+			continue;
+
+		if (node.is_leaf())
+			func(node.user);
+		else
+		{
+			assert(count + 2 <= MaxDepth);
+			stack[count++] = node.children[1];
+			stack[count++] = node.children[0];
+		}
+	}
+}
+
+template <typename Func>
+void BVH::query(const AABB &aabb, uint32_t mask, const Func &func) const
+{
+	if (root == Invalid)
+		return;
+
+	uint32_t stack[MaxDepth];
+	unsigned count = 0;
+	stack[count++] = root;
+
+	while (count)
+	{
+		auto &node = nodes[stack[--count]];
+		if ((node.mask & mask) == 0 || !overlaps(aabb, node.aabb))
+			continue;
+
+		if (node.is_leaf())
+			func(node.user);
+		else
+		{
+			assert(count + 2 <= MaxDepth);
+			stack[count++] = node.children[1];
+			stack[count++] = node.children[0];
+		}
+	}
+}
+}
@@ -21,6 +21,20 @@
  */
 
 #include "frustum.hpp"
+#include <assert.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FRUSTUM_SSE2
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FRUSTUM_AVX2
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define FRUSTUM_NEON
+#endif
 
 namespace Granite
 {
@@ -48,8 +62,13 @@ bool Frustum::intersects(const AABB &aabb) const
 
 bool Frustum::intersects_fast(const AABB &aabb) const
 {
-	vec4 center(aabb.get_center(), 1.0f);
-	float radius = aabb.get_radius();
+	return intersects_sphere(vec4(aabb.get_center(), aabb.get_radius()));
+}
+
+bool Frustum::intersects_sphere(const vec4 &sphere) const
+{
+	vec4 center(sphere.xyz(), 1.0f);
+	float radius = sphere.w;
 
 	for (auto &plane : planes)
 		if (dot(plane, center) < -radius)
@@ -58,6 +77,193 @@ bool Frustum::intersects_fast(const AABB &aabb) const
 	return true;
 }
 
+// All kernels evaluate dot(plane, vec4(center, 1.0)) < -radius with the same sequence of multiplies and adds
+// as intersects_fast(), and the math library is built without FP contraction, so results match bit for bit.
+// Each kernel handles a multiple of 8 boxes starting at a multiple of 32, and returns one mask word per 32 boxes.
+static void intersects_fast_scalar_kernel(const vec4 *planes, const AABBSoA &bounds, size_t begin, size_t count,
+                                          uint32_t *mask)
+{
+	const float *cx = bounds.get_center_x() + begin;
+	const float *cy = bounds.get_center_y() + begin;
+	const float *cz = bounds.get_center_z() + begin;
+	const float *r = bounds.get_radius() + begin;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		bool culled = false;
+		for (unsigned p = 0; p < 6; p++)
+		{
+			float d = planes[p].x * cx[i] + planes[p].y * cy[i] + planes[p].z * cz[i] + planes[p].w * 1.0f;
+			culled |= d < -r[i];
+		}
+
+		mask[i >> 5] |= uint32_t(!culled) << (i & 31);
+	}
+}
+
+#ifdef FRUSTUM_SSE2
+static void intersects_fast_sse2_kernel(const vec4 *planes, const AABBSoA &bounds, size_t begin, size_t count,
+                                        uint32_t *mask)
+{
+	const float *cx = bounds.get_center_x() + begin;
+	const float *cy = bounds.get_center_y() + begin;
+	const float *cz = bounds.get_center_z() + begin;
+	const float *r = bounds.get_radius() + begin;
+	const __m128 sign = _mm_set1_ps(-0.0f);
+
+	__m128 px[6], py[6], pz[6], pw[6];
+	for (unsigned p = 0; p < 6; p++)
+	{
+		px[p] = _mm_set1_ps(planes[p].x);
+		py[p] = _mm_set1_ps(planes[p].y);
+		pz[p] = _mm_set1_ps(planes[p].z);
+		pw[p] = _mm_set1_ps(planes[p].w);
+	}
+
+	for (size_t i = 0; i < count; i += 4)
+	{
+		__m128 x = _mm_loadu_ps(cx + i);
+		__m128 y = _mm_loadu_ps(cy + i);
+		__m128 z = _mm_loadu_ps(cz + i);
+		__m128 neg_r = _mm_xor_ps(_mm_loadu_ps(r + i), sign);
+
+		__m128 culled = _mm_setzero_ps();
+		for (unsigned p = 0; p < 6; p++)
+		{
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px[p], x), _mm_mul_ps(py[p], y)),
+			                                 _mm_mul_ps(pz[p], z)), pw[p]);
+			culled = _mm_or_ps(culled, _mm_cmplt_ps(d, neg_r));
+		}
+
+		uint32_t visible = uint32_t(~_mm_movemask_ps(culled)) & 0xfu;
+		mask[i >> 5] |= visible << (i & 31);
+	}
+}
+#endif
+
+#ifdef FRUSTUM_AVX2
+__attribute__((target("avx2")))
+static void intersects_fast_avx2_kernel(const vec4 *planes, const AABBSoA &bounds, size_t begin, size_t count,
+                                        uint32_t *mask)
+{
+	const float *cx = bounds.get_center_x() + begin;
+	const float *cy = bounds.get_center_y() + begin;
+	const float *cz = bounds.get_center_z() + begin;
+	const float *r = bounds.get_radius() + begin;
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+
+	__m256 px[6], py[6], pz[6], pw[6];
+	for (unsigned p = 0; p < 6; p++)
+	{
+		px[p] = _mm256_set1_ps(planes[p].x);
+		py[p] = _mm256_set1_ps(planes[p].y);
+		pz[p] = _mm256_set1_ps(planes[p].z);
+		pw[p] = _mm256_set1_ps(planes[p].w);
+	}
+
+	for (size_t i = 0; i < count; i += 8)
+	{
+		__m256 x = _mm256_loadu_ps(cx + i);
+		__m256 y = _mm256_loadu_ps(cy + i);
+		__m256 z = _mm256_loadu_ps(cz + i);
+		__m256 neg_r = _mm256_xor_ps(_mm256_loadu_ps(r + i), sign);
+
+		__m256 culled = _mm256_setzero_ps();
+		for (unsigned p = 0; p < 6; p++)
+		{
+			// Separate multiplies and adds, an FMA would round differently than the scalar path.
+			__m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px[p], x), _mm256_mul_ps(py[p], y)),
+			                                       _mm256_mul_ps(pz[p], z)), pw[p]);
+			culled = _mm256_or_ps(culled, _mm256_cmp_ps(d, neg_r, _CMP_LT_OQ));
+		}
+
+		uint32_t visible = uint32_t(~_mm256_movemask_ps(culled)) & 0xffu;
+		mask[i >> 5] |= visible << (i & 31);
+	}
+}
+
+static bool cpu_supports_avx2()
+{
+	static const bool supported = __builtin_cpu_supports("avx2");
+	return supported;
+}
+#endif
+
+#ifdef FRUSTUM_NEON
+static void intersects_fast_neon_kernel(const vec4 *planes, const AABBSoA &bounds, size_t begin, size_t count,
+                                        uint32_t *mask)
+{
+	const float *cx = bounds.get_center_x() + begin;
+	const float *cy = bounds.get_center_y() + begin;
+	const float *cz = bounds.get_center_z() + begin;
+	const float *r = bounds.get_radius() + begin;
+	static const uint32_t lane_bits[4] = { 1, 2, 4, 8 };
+	const uint32x4_t bits = vld1q_u32(lane_bits);
+
+	for (size_t i = 0; i < count; i += 4)
+	{
+		float32x4_t x = vld1q_f32(cx + i);
+		float32x4_t y = vld1q_f32(cy + i);
+		float32x4_t z = vld1q_f32(cz + i);
+		float32x4_t neg_r = vnegq_f32(vld1q_f32(r + i));
+
+		uint32x4_t culled = vdupq_n_u32(0);
+		for (unsigned p = 0; p < 6; p++)
+		{
+			// vmulq/vaddq rather than vmlaq, which is fused on AArch64.
+			float32x4_t d = vaddq_f32(vaddq_f32(vaddq_f32(vmulq_n_f32(x, planes[p].x), vmulq_n_f32(y, planes[p].y)),
+			                                    vmulq_n_f32(z, planes[p].z)), vdupq_n_f32(planes[p].w));
+			culled = vorrq_u32(culled, vcltq_f32(d, neg_r));
+		}
+
+		uint32x4_t visible_bits = vandq_u32(vmvnq_u32(culled), bits);
+		uint32x2_t sum = vadd_u32(vget_low_u32(visible_bits), vget_high_u32(visible_bits));
+		uint32_t visible = vget_lane_u32(vpadd_u32(sum, sum), 0);
+		mask[i >> 5] |= visible << (i & 31);
+	}
+}
+#endif
+
+using IntersectsKernel = void (*)(const vec4 *, const AABBSoA &, size_t, size_t, uint32_t *);
+
+static void run_intersects_kernel(IntersectsKernel kernel, const vec4 *planes, const AABBSoA &bounds,
+                                  size_t begin, size_t end, uint32_t *mask)
+{
+	assert((begin & 31) == 0);
+	assert(end <= bounds.size());
+	if (begin >= end)
+		return;
+
+	// Kernels work on whole groups of 8 boxes, which the padding of AABBSoA guarantees are readable.
+	size_t count = end - begin;
+	size_t padded_count = (count + AABBSoA::Alignment - 1) & ~size_t(AABBSoA::Alignment - 1);
+	mask += begin >> 5;
+	memset(mask, 0, ((count + 31) >> 5) * sizeof(uint32_t));
+	kernel(planes, bounds, begin, padded_count, mask);
+
+	// Clear the bits of the padding.
+	if (count & 31)
+		mask[count >> 5] &= (1u << (count & 31)) - 1u;
+}
+
+void Frustum::intersects_fast(const AABBSoA &bounds, size_t begin, size_t end, uint32_t *mask) const
+{
+	IntersectsKernel kernel = intersects_fast_scalar_kernel;
+#if defined(FRUSTUM_AVX2)
+	kernel = cpu_supports_avx2() ? intersects_fast_avx2_kernel : intersects_fast_sse2_kernel;
+#elif defined(FRUSTUM_SSE2)
+	kernel = intersects_fast_sse2_kernel;
+#elif defined(FRUSTUM_NEON)
+	kernel = intersects_fast_neon_kernel;
+#endif
+	run_intersects_kernel(kernel, planes, bounds, begin, end, mask);
+}
+
+void Frustum::intersects_fast_scalar(const AABBSoA &bounds, size_t begin, size_t end, uint32_t *mask) const
+{
+	run_intersects_kernel(intersects_fast_scalar_kernel, planes, bounds, begin, end, mask);
+}
+
 vec3 Frustum::get_coord(float dx, float dy, float dz) const
 {
 	vec4 clip = vec4(2.0f * dx - 1.0f, 2.0f * dy - 1.0f, dz, 1.0f);
@@ -34,6 +34,19 @@ public:
 	bool intersects(const AABB &aabb) const;
 	bool intersects_fast(const AABB &aabb) const;
 
+	// Tests a sphere with its center in xyz and radius in w.
+	// intersects_fast() is exactly this test on vec4(aabb.get_center(), aabb.get_radius()).
+	bool intersects_sphere(const vec4 &sphere) const;
+
+	// Tests boxes [begin, end) of bounds, and sets bit (i % 32) of mask[i / 32] for every box i which intersects.
+	// begin must be a multiple of 32, so ranges can be tested in parallel without sharing mask words.
+	// Uses the widest SIMD kernel the CPU supports, 4 or 8 boxes per iteration.
+	// Results are bit-identical to intersects_fast() on the individual boxes.
+	void intersects_fast(const AABBSoA &bounds, size_t begin, size_t end, uint32_t *mask) const;
+
+	// Same as above, but always uses the scalar kernel.
+	void intersects_fast_scalar(const AABBSoA &bounds, size_t begin, size_t end, uint32_t *mask) const;
+
 	vec3 get_coord(float dx, float dy, float dz) const;
 
 	static vec4 get_bounding_sphere(const mat4 &inv_projection, const mat4 &inv_view);
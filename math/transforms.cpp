@@ -23,6 +23,15 @@
 #include "transforms.hpp"
 #include "aabb.hpp"
 #include "muglm/matrix_helper.hpp"
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TRANSFORMS_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define TRANSFORMS_NEON
+#endif
 
 namespace Granite
 {
@@ -96,14 +105,241 @@ bool compute_plane_refraction(mat4 &projection, mat4 &view, vec3 camera_pos, vec
 	return true;
 }
 
+// out = a * b, with the terms of each column summed in the same order as muglm does.
+static inline void multiply_columns(mat4 &out, const mat4 &a, const vec4 *b)
+{
+#if defined(TRANSFORMS_SSE2)
+	const float *p = &a[0][0];
+	__m128 p0 = _mm_loadu_ps(p + 0);
+	__m128 p1 = _mm_loadu_ps(p + 4);
+	__m128 p2 = _mm_loadu_ps(p + 8);
+	__m128 p3 = _mm_loadu_ps(p + 12);
+
+	for (unsigned c = 0; c < 4; c++)
+	{
+		__m128 col = _mm_mul_ps(p0, _mm_set1_ps(b[c].x));
+		col = _mm_add_ps(col, _mm_mul_ps(p1, _mm_set1_ps(b[c].y)));
+		col = _mm_add_ps(col, _mm_mul_ps(p2, _mm_set1_ps(b[c].z)));
+		col = _mm_add_ps(col, _mm_mul_ps(p3, _mm_set1_ps(b[c].w)));
+		_mm_storeu_ps(&out[c][0], col);
+	}
+#elif defined(TRANSFORMS_NEON)
+	const float *p = &a[0][0];
+	float32x4_t p0 = vld1q_f32(p + 0);
+	float32x4_t p1 = vld1q_f32(p + 4);
+	float32x4_t p2 = vld1q_f32(p + 8);
+	float32x4_t p3 = vld1q_f32(p + 12);
+
+	for (unsigned c = 0; c < 4; c++)
+	{
+		float32x4_t col = vmulq_n_f32(p0, b[c].x);
+		col = vaddq_f32(col, vmulq_n_f32(p1, b[c].y));
+		col = vaddq_f32(col, vmulq_n_f32(p2, b[c].z));
+		col = vaddq_f32(col, vmulq_n_f32(p3, b[c].w));
+		vst1q_f32(&out[c][0], col);
+	}
+#else
+	out = a * mat4(b[0], b[1], b[2], b[3]);
+#endif
+}
+
 void compute_model_transform(mat4 &world, vec3 s, quat rot, vec3 trans, const mat4 &parent)
 {
-	mat4 S = scale(s);
-	mat4 R = mat4_cast(rot);
-	mat4 T = translate(trans);
+	// Equivalent to parent * translate(trans) * mat4_cast(rot) * scale(s).
+	// The scale and translation only scale columns and replace the last one, so only the product
+	// with the parent needs a full matrix multiply.
+	mat3 R = mat3_cast(rot);
+	const vec4 model[4] = {
+		vec4(R[0] * s.x, 0.0f),
+		vec4(R[1] * s.y, 0.0f),
+		vec4(R[2] * s.z, 0.0f),
+		vec4(trans, 1.0f),
+	};
+	multiply_columns(world, parent, model);
+}
+
+void compute_skin_palette(mat4 *palette, const mat4 *bone_transforms, const uint32_t *bone_indices,
+                          const mat4 *inverse_bind_poses, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		multiply_columns(palette[i], bone_transforms[bone_indices[i]], &inverse_bind_poses[i][0]);
+}
+
+namespace
+{
+// Just enough of a 4-wide float vector for the batched samplers.
+#if defined(TRANSFORMS_SSE2)
+using float4 = __m128;
+static inline float4 load4(const float *p) { return _mm_loadu_ps(p); }
+static inline void store4(float *p, float4 v) { _mm_storeu_ps(p, v); }
+static inline float4 splat4(float v) { return _mm_set1_ps(v); }
+static inline float4 add4(float4 a, float4 b) { return _mm_add_ps(a, b); }
+static inline float4 sub4(float4 a, float4 b) { return _mm_sub_ps(a, b); }
+static inline float4 mul4(float4 a, float4 b) { return _mm_mul_ps(a, b); }
+static inline float4 div4(float4 a, float4 b) { return _mm_div_ps(a, b); }
+static inline float4 less4(float4 a, float4 b) { return _mm_cmplt_ps(a, b); }
+static inline float4 equal4(float4 a, float4 b) { return _mm_cmpeq_ps(a, b); }
+static inline float4 select4(float4 mask, float4 a, float4 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+static inline float4 negate4(float4 mask, float4 v) { return _mm_xor_ps(v, _mm_and_ps(mask, _mm_set1_ps(-0.0f))); }
+#elif defined(TRANSFORMS_NEON)
+using float4 = float32x4_t;
+static inline float4 load4(const float *p) { return vld1q_f32(p); }
+static inline void store4(float *p, float4 v) { vst1q_f32(p, v); }
+static inline float4 splat4(float v) { return vdupq_n_f32(v); }
+static inline float4 add4(float4 a, float4 b) { return vaddq_f32(a, b); }
+static inline float4 sub4(float4 a, float4 b) { return vsubq_f32(a, b); }
+static inline float4 mul4(float4 a, float4 b) { return vmulq_f32(a, b); }
+static inline float4 div4(float4 a, float4 b)
+{
+	float va[4], vb[4];
+	vst1q_f32(va, a);
+	vst1q_f32(vb, b);
+	for (unsigned i = 0; i < 4; i++)
+		va[i] /= vb[i];
+	return vld1q_f32(va);
+}
+static inline float4 less4(float4 a, float4 b) { return vreinterpretq_f32_u32(vcltq_f32(a, b)); }
+static inline float4 equal4(float4 a, float4 b) { return vreinterpretq_f32_u32(vceqq_f32(a, b)); }
+static inline float4 select4(float4 mask, float4 a, float4 b) { return vbslq_f32(vreinterpretq_u32_f32(mask), a, b); }
+static inline float4 negate4(float4 mask, float4 v)
+{
+	return vreinterpretq_f32_u32(veorq_u32(vreinterpretq_u32_f32(v),
+	                                       vandq_u32(vreinterpretq_u32_f32(mask), vdupq_n_u32(0x80000000u))));
+}
+#else
+struct float4
+{
+	float v[4];
+};
+static inline float4 load4(const float *p) { return { { p[0], p[1], p[2], p[3] } }; }
+static inline void store4(float *p, float4 a) { for (unsigned i = 0; i < 4; i++) p[i] = a.v[i]; }
+static inline float4 splat4(float v) { return { { v, v, v, v } }; }
+#define TRANSFORMS_FLOAT4_OP(name, expr) \
+static inline float4 name(float4 a, float4 b) { float4 r; for (unsigned i = 0; i < 4; i++) r.v[i] = (expr); return r; }
+TRANSFORMS_FLOAT4_OP(add4, a.v[i] + b.v[i])
+TRANSFORMS_FLOAT4_OP(sub4, a.v[i] - b.v[i])
+TRANSFORMS_FLOAT4_OP(mul4, a.v[i] * b.v[i])
+TRANSFORMS_FLOAT4_OP(div4, a.v[i] / b.v[i])
+// Masks are kept as 0.0 or 1.0.
+TRANSFORMS_FLOAT4_OP(less4, a.v[i] < b.v[i] ? 1.0f : 0.0f)
+TRANSFORMS_FLOAT4_OP(equal4, a.v[i] == b.v[i] ? 1.0f : 0.0f)
+#undef TRANSFORMS_FLOAT4_OP
+static inline float4 select4(float4 mask, float4 a, float4 b)
+{
+	float4 r;
+	for (unsigned i = 0; i < 4; i++)
+		r.v[i] = mask.v[i] != 0.0f ? a.v[i] : b.v[i];
+	return r;
+}
+static inline float4 negate4(float4 mask, float4 v)
+{
+	for (unsigned i = 0; i < 4; i++)
+		if (mask.v[i] != 0.0f)
+			v.v[i] = -v.v[i];
+	return v;
+}
+#endif
+}
 
-	mat4 model = R * S;
-	world = parent * T * model;
+void sample_linear_soa(float *out, const float *a, const float *b, const float *l, size_t stride)
+{
+	for (size_t i = 0; i < stride; i += 4)
+	{
+		float4 t = load4(l + i);
+		float4 unchanged = equal4(t, splat4(0.0f));
+		for (unsigned c = 0; c < 3; c++)
+		{
+			float4 va = load4(a + c * stride + i);
+			float4 vb = load4(b + c * stride + i);
+			store4(out + c * stride + i, select4(unchanged, va, add4(va, mul4(sub4(vb, va), t))));
+		}
+	}
+}
+
+void sample_slerp_soa(float *out, const float *a, const float *b, const float *l, size_t stride)
+{
+	for (size_t i = 0; i < stride; i += 4)
+	{
+		float4 va[4], vb[4];
+		for (unsigned c = 0; c < 4; c++)
+		{
+			va[c] = load4(a + c * stride + i);
+			vb[c] = load4(b + c * stride + i);
+		}
+
+		float4 cos_theta = mul4(va[0], vb[0]);
+		for (unsigned c = 1; c < 4; c++)
+			cos_theta = add4(cos_theta, mul4(va[c], vb[c]));
+
+		// Take the shortest path.
+		float4 flip = less4(cos_theta, splat4(0.0f));
+		cos_theta = negate4(flip, cos_theta);
+		for (auto &v : vb)
+			v = negate4(flip, v);
+
+		// There is no vector acos or sin to lean on, so the weights are computed per lane,
+		// and only for lanes which end up using them.
+		float cos_lanes[4];
+		float weight_a[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+		float weight_b[4] = {};
+		float denom[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+		store4(cos_lanes, cos_theta);
+		for (unsigned j = 0; j < 4; j++)
+		{
+			float phase = l[i + j];
+			if (phase == 0.0f || cos_lanes[j] > 0.999f)
+				continue;
+
+			float angle = std::acos(cos_lanes[j]);
+			weight_a[j] = std::sin((1.0f - phase) * angle);
+			weight_b[j] = std::sin(phase * angle);
+			denom[j] = std::sin(angle);
+		}
+
+		float4 t = load4(l + i);
+		float4 near = less4(splat4(0.999f), cos_theta);
+		float4 unchanged = equal4(t, splat4(0.0f));
+		float4 wa = load4(weight_a);
+		float4 wb = load4(weight_b);
+		float4 d = load4(denom);
+
+		for (unsigned c = 0; c < 4; c++)
+		{
+			float4 lerped = add4(va[c], mul4(sub4(vb[c], va[c]), t));
+			float4 slerped = div4(add4(mul4(wa, va[c]), mul4(wb, vb[c])), d);
+			float4 res = select4(unchanged, va[c], select4(near, lerped, slerped));
+			store4(out + c * stride + i, res);
+		}
+	}
+}
+
+void sample_cubic_soa(float *out, const float *p0, const float *m0, const float *m1, const float *p1,
+                      const float *l, const float *dt, size_t stride)
+{
+	for (size_t i = 0; i < stride; i += 4)
+	{
+		float4 t = load4(l + i);
+		float4 t2 = mul4(t, t);
+		float4 t3 = mul4(t2, t);
+		float4 two = splat4(2.0f);
+		float4 three = splat4(3.0f);
+
+		float4 h00 = add4(sub4(mul4(two, t3), mul4(three, t2)), splat4(1.0f));
+		float4 h10 = add4(sub4(t3, mul4(two, t2)), t);
+		float4 h01 = add4(mul4(splat4(-2.0f), t3), mul4(three, t2));
+		float4 h11 = sub4(t3, t2);
+		float4 scale = load4(dt + i);
+
+		for (unsigned c = 0; c < 3; c++)
+		{
+			size_t offset = c * stride + i;
+			float4 res = mul4(h00, load4(p0 + offset));
+			res = add4(res, mul4(h10, mul4(scale, load4(m0 + offset))));
+			res = add4(res, mul4(h01, load4(p1 + offset)));
+			res = add4(res, mul4(h11, mul4(scale, load4(m1 + offset))));
+			store4(out + offset, res);
+		}
+	}
 }
 
 void compute_normal_transform(mat4 &normal, const mat4 &world)
@@ -24,6 +24,8 @@
 
 #include "math.hpp"
 #include <vector>
+#include <stddef.h>
+#include <stdint.h>
 
 namespace Granite
 {
@@ -39,6 +41,10 @@ void compute_model_transform(mat4 &world, vec3 scale, quat rotation, vec3 transl
 
 void compute_normal_transform(mat4 &normal, const mat4 &world);
 
+// palette[i] = bone_transforms[bone_indices[i]] * inverse_bind_poses[i].
+void compute_skin_palette(mat4 *palette, const mat4 *bone_transforms, const uint32_t *bone_indices,
+                          const mat4 *inverse_bind_poses, size_t count);
+
 quat rotate_vector(vec3 from, vec3 to);
 
 quat look_at(vec3 direction, vec3 up);
@@ -53,6 +59,16 @@ mat4 ortho(const AABB &aabb);
 
 void compute_cube_render_transform(vec3 center, unsigned face, mat4 &projection, mat4 &view, float znear, float zfar);
 
+// Batched samplers, evaluating many animation channels at once. Data is laid out in SoA form,
+// component c of channel i lives at [c * stride + i], and l holds the phase of each channel.
+// stride is the channel count rounded up to a multiple of 4, and every array must be filled up to it.
+// Results match the scalar samplers below.
+void sample_linear_soa(float *out, const float *a, const float *b, const float *l, size_t stride);
+void sample_slerp_soa(float *out, const float *a, const float *b, const float *l, size_t stride);
+// dt is the duration of each channel's key interval, which scales the tangents m0 and m1.
+void sample_cubic_soa(float *out, const float *p0, const float *m0, const float *m1, const float *p1,
+                      const float *l, const float *dt, size_t stride);
+
 struct LinearSampler
 {
 	std::vector<vec3> values;
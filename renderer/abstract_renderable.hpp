@@ -24,6 +24,7 @@
 
 #include "aabb.hpp"
 #include "intrusive.hpp"
+#include "array_view.hpp"
 
 namespace Granite
 {
@@ -66,6 +67,13 @@ public:
 		return &aabb;
 	}
 
+	// Bounds of the vertices each bone influences, in the space the bone transforms of the skin apply to.
+	// Lets skinned renderables compute tight bounds from a pose. Empty if unknown or not skinned.
+	virtual Util::ArrayView<const AABB> get_bone_aabbs() const
+	{
+		return {};
+	}
+
 	virtual DrawPipeline get_mesh_draw_pipeline() const
 	{
 		return DrawPipeline::Opaque;
@@ -21,63 +21,480 @@
  */
 
 #include "animation_system.hpp"
+#include "thread_group.hpp"
+#include <algorithm>
+#include <cmath>
 
 using namespace std;
 
 namespace Granite
 {
-void AnimationSystem::animate(double t)
+// Layout of SampleBatch::data for each sampler type, in units of the batch stride.
+enum LinearBatchLayout
 {
-	for (auto &animation : animations)
+	LINEAR_A = 0,
+	LINEAR_B = 3,
+	LINEAR_PHASE = 6,
+	LINEAR_OUT = 7,
+	LINEAR_SIZE = 10
+};
+
+enum SphericalBatchLayout
+{
+	SPHERICAL_A = 0,
+	SPHERICAL_B = 4,
+	SPHERICAL_PHASE = 8,
+	SPHERICAL_OUT = 9,
+	SPHERICAL_SIZE = 13
+};
+
+enum CubicBatchLayout
+{
+	CUBIC_P0 = 0,
+	CUBIC_M0 = 3,
+	CUBIC_M1 = 6,
+	CUBIC_P1 = 9,
+	CUBIC_PHASE = 12,
+	CUBIC_DT = 13,
+	CUBIC_OUT = 14,
+	CUBIC_SIZE = 17
+};
+
+static void init_batch(vector<float> &data, size_t &stride, size_t count, unsigned size)
+{
+	// Padding lanes stay zero, which every sampler copes with.
+	stride = (count + 3) & ~size_t(3);
+	data.resize(stride * size);
+}
+
+AnimationSystem::AnimationState::AnimationState(const SceneFormats::Animation &anim, double start_time, bool repeating)
+	: animation(anim), start_time(start_time), repeating(repeating)
+{
+	init_channels();
+}
+
+AnimationSystem::AnimationState::AnimationState(const SceneFormats::CompressedAnimation &anim, double start_time, bool repeating)
+	: compressed(&anim), animation(decoded), start_time(start_time), repeating(repeating)
+{
+	compressed->decode_chunk(chunk, decoded);
+	init_channels();
+}
+
+void AnimationSystem::AnimationState::init_channels()
+{
+	cursors.resize(animation.channels.size());
+	channel_types.reserve(animation.channels.size());
+	for (auto &channel : animation.channels)
+	{
+		channel_types.push_back(channel.type);
+		switch (channel.type)
+		{
+		case SceneFormats::AnimationChannel::Type::Translation:
+		case SceneFormats::AnimationChannel::Type::Scale:
+			linear.count++;
+			break;
+		case SceneFormats::AnimationChannel::Type::Rotation:
+			spherical.count++;
+			break;
+		case SceneFormats::AnimationChannel::Type::CubicTranslation:
+		case SceneFormats::AnimationChannel::Type::CubicScale:
+			cubic.count++;
+			break;
+		}
+	}
+
+	init_batch(linear.data, linear.stride, linear.count, LINEAR_SIZE);
+	init_batch(spherical.data, spherical.stride, spherical.count, SPHERICAL_SIZE);
+	init_batch(cubic.data, cubic.stride, cubic.count, CUBIC_SIZE);
+}
+
+void AnimationSystem::sample(AnimationState &state, double t)
+{
+	float wrapped_time = float(fmod(t - state.start_time, state.animation.length));
+
+	if (state.compressed)
 	{
-		double wrapped_time = fmod(t - animation->start_time, animation->animation.length);
+		unsigned chunk = state.compressed->get_chunk_index(wrapped_time);
+		if (chunk != state.chunk)
+		{
+			// Key indices change with the chunk, so the cursors are no longer meaningful.
+			state.compressed->decode_chunk(chunk, state.decoded);
+			state.chunk = chunk;
+			fill(begin(state.cursors), end(state.cursors), 0u);
+		}
+	}
+
+	// Gather the keys on either side of each sample into SoA form in one pass over the channels,
+	// then evaluate each batch in one go.
+	float *linear = state.linear.data.data();
+	float *spherical = state.spherical.data.data();
+	float *cubic = state.cubic.data.data();
+	size_t linear_stride = state.linear.stride;
+	size_t spherical_stride = state.spherical.stride;
+	size_t cubic_stride = state.cubic.stride;
+	size_t linear_lane = 0, spherical_lane = 0, cubic_lane = 0;
 
-		auto target = begin(animation->channel_targets);
-		for (auto &channel : animation->animation.channels)
+	unsigned *cursor = state.cursors.data();
+	for (auto &channel : state.animation.channels)
+	{
+		unsigned key;
+		float phase;
+		channel.get_index_phase(wrapped_time, key, phase, *cursor++);
+
+		switch (channel.type)
+		{
+		case SceneFormats::AnimationChannel::Type::Translation:
+		case SceneFormats::AnimationChannel::Type::Scale:
 		{
-			auto *transform = target->first;
-			auto *node = target->second;
+			const vec3 &a = channel.linear.values[key];
+			const vec3 &b = phase != 0.0f ? channel.linear.values[key + 1] : a;
+			size_t lane = linear_lane++;
+			for (unsigned c = 0; c < 3; c++)
+			{
+				linear[(LINEAR_A + c) * linear_stride + lane] = a[c];
+				linear[(LINEAR_B + c) * linear_stride + lane] = b[c];
+			}
+			linear[LINEAR_PHASE * linear_stride + lane] = phase;
+			break;
+		}
 
-			unsigned index;
-			float phase;
-			channel.get_index_phase(float(wrapped_time), index, phase);
+		case SceneFormats::AnimationChannel::Type::Rotation:
+		{
+			const vec4 &a = channel.spherical.values[key].as_vec4();
+			const vec4 &b = phase != 0.0f ? channel.spherical.values[key + 1].as_vec4() : a;
+			size_t lane = spherical_lane++;
+			for (unsigned c = 0; c < 4; c++)
+			{
+				spherical[(SPHERICAL_A + c) * spherical_stride + lane] = a[c];
+				spherical[(SPHERICAL_B + c) * spherical_stride + lane] = b[c];
+			}
+			spherical[SPHERICAL_PHASE * spherical_stride + lane] = phase;
+			break;
+		}
 
-			switch (channel.type)
+		case SceneFormats::AnimationChannel::Type::CubicTranslation:
+		case SceneFormats::AnimationChannel::Type::CubicScale:
+		{
+			// Keys are stored as in-tangent, value, out-tangent triplets.
+			const vec3 *values = &channel.cubic.values[3 * key];
+			bool single_key = channel.timestamps.size() == 1;
+			const vec3 &p0 = values[1];
+			const vec3 &p1 = single_key ? p0 : values[4];
+			size_t lane = cubic_lane++;
+			for (unsigned c = 0; c < 3; c++)
 			{
-			case SceneFormats::AnimationChannel::Type::Translation:
-				transform->translation = channel.linear.sample(index, phase);
-				break;
-			case SceneFormats::AnimationChannel::Type::Scale:
-				transform->scale = channel.linear.sample(index, phase);
-				break;
-			case SceneFormats::AnimationChannel::Type::Rotation:
-				transform->rotation = channel.spherical.sample(index, phase);
-				break;
-			case SceneFormats::AnimationChannel::Type::CubicTranslation:
-				transform->translation = channel.cubic.sample(index, phase,
-				                                              channel.timestamps[index + 1] - channel.timestamps[index]);
-				break;
-			case SceneFormats::AnimationChannel::Type::CubicScale:
-				transform->scale = channel.cubic.sample(index, phase,
-				                                        channel.timestamps[index + 1] - channel.timestamps[index]);
-				break;
+				cubic[(CUBIC_P0 + c) * cubic_stride + lane] = p0[c];
+				cubic[(CUBIC_M0 + c) * cubic_stride + lane] = values[2][c];
+				cubic[(CUBIC_M1 + c) * cubic_stride + lane] = single_key ? 0.0f : values[3][c];
+				cubic[(CUBIC_P1 + c) * cubic_stride + lane] = p1[c];
 			}
+			cubic[CUBIC_PHASE * cubic_stride + lane] = phase;
+			cubic[CUBIC_DT * cubic_stride + lane] = single_key ? 0.0f : channel.timestamps[key + 1] - channel.timestamps[key];
+			break;
+		}
+		}
+	}
 
-			node->invalidate_cached_transform();
-			++target;
+	if (linear_stride)
+	{
+		sample_linear_soa(linear + LINEAR_OUT * linear_stride, linear + LINEAR_A * linear_stride,
+		                  linear + LINEAR_B * linear_stride, linear + LINEAR_PHASE * linear_stride, linear_stride);
+	}
+
+	if (spherical_stride)
+	{
+		sample_slerp_soa(spherical + SPHERICAL_OUT * spherical_stride, spherical + SPHERICAL_A * spherical_stride,
+		                 spherical + SPHERICAL_B * spherical_stride, spherical + SPHERICAL_PHASE * spherical_stride,
+		                 spherical_stride);
+	}
+
+	if (cubic_stride)
+	{
+		sample_cubic_soa(cubic + CUBIC_OUT * cubic_stride, cubic + CUBIC_P0 * cubic_stride,
+		                 cubic + CUBIC_M0 * cubic_stride, cubic + CUBIC_M1 * cubic_stride,
+		                 cubic + CUBIC_P1 * cubic_stride, cubic + CUBIC_PHASE * cubic_stride,
+		                 cubic + CUBIC_DT * cubic_stride, cubic_stride);
+	}
+}
+
+static vec3 read_vec3(const vector<float> &data, size_t stride, unsigned offset, size_t lane)
+{
+	return vec3(data[offset * stride + lane], data[(offset + 1) * stride + lane], data[(offset + 2) * stride + lane]);
+}
+
+void AnimationSystem::apply(AnimationState &state)
+{
+	// Written back in channel order, so channels targeting the same transform resolve like they always did.
+	size_t linear_lane = 0, spherical_lane = 0, cubic_lane = 0;
+	auto target = begin(state.channel_targets);
+	for (auto type : state.channel_types)
+	{
+		auto *transform = target->first;
+		auto *node = target->second;
+
+		switch (type)
+		{
+		case SceneFormats::AnimationChannel::Type::Translation:
+			transform->translation = read_vec3(state.linear.data, state.linear.stride, LINEAR_OUT, linear_lane++);
+			break;
+		case SceneFormats::AnimationChannel::Type::Scale:
+			transform->scale = read_vec3(state.linear.data, state.linear.stride, LINEAR_OUT, linear_lane++);
+			break;
+		case SceneFormats::AnimationChannel::Type::Rotation:
+		{
+			auto &data = state.spherical.data;
+			size_t stride = state.spherical.stride;
+			size_t lane = spherical_lane++;
+			transform->rotation = quat(vec4(data[(SPHERICAL_OUT + 0) * stride + lane],
+			                                data[(SPHERICAL_OUT + 1) * stride + lane],
+			                                data[(SPHERICAL_OUT + 2) * stride + lane],
+			                                data[(SPHERICAL_OUT + 3) * stride + lane]));
+			break;
+		}
+		case SceneFormats::AnimationChannel::Type::CubicTranslation:
+			transform->translation = read_vec3(state.cubic.data, state.cubic.stride, CUBIC_OUT, cubic_lane++);
+			break;
+		case SceneFormats::AnimationChannel::Type::CubicScale:
+			transform->scale = read_vec3(state.cubic.data, state.cubic.stride, CUBIC_OUT, cubic_lane++);
+			break;
+		}
+
+		node->invalidate_cached_transform();
+		++target;
+	}
+}
+
+static quat read_quat(const vector<float> &data, size_t stride, unsigned offset, size_t lane)
+{
+	return quat(vec4(data[offset * stride + lane], data[(offset + 1) * stride + lane],
+	                 data[(offset + 2) * stride + lane], data[(offset + 3) * stride + lane]));
+}
+
+void AnimationSystem::accumulate_layer(const AnimationState &state)
+{
+	size_t linear_lane = 0, spherical_lane = 0, cubic_lane = 0;
+	auto slot_index = begin(state.channel_slots);
+	float w = state.weight;
+	bool additive = state.mode == BlendMode::Additive;
+
+	for (auto type : state.channel_types)
+	{
+		auto &slot = pose_slots[*slot_index++];
+
+		switch (type)
+		{
+		case SceneFormats::AnimationChannel::Type::Translation:
+		case SceneFormats::AnimationChannel::Type::CubicTranslation:
+		{
+			vec3 v = type == SceneFormats::AnimationChannel::Type::Translation ?
+			         read_vec3(state.linear.data, state.linear.stride, LINEAR_OUT, linear_lane++) :
+			         read_vec3(state.cubic.data, state.cubic.stride, CUBIC_OUT, cubic_lane++);
+
+			if (additive)
+				slot.additive_translation += w * v;
+			else
+			{
+				slot.translation += w * v;
+				slot.translation_weight += w;
+			}
+			break;
+		}
+
+		case SceneFormats::AnimationChannel::Type::Scale:
+		case SceneFormats::AnimationChannel::Type::CubicScale:
+		{
+			vec3 v = type == SceneFormats::AnimationChannel::Type::Scale ?
+			         read_vec3(state.linear.data, state.linear.stride, LINEAR_OUT, linear_lane++) :
+			         read_vec3(state.cubic.data, state.cubic.stride, CUBIC_OUT, cubic_lane++);
+
+			if (additive)
+				slot.additive_scale *= mix(vec3(1.0f), v, w);
+			else
+			{
+				slot.scale += w * v;
+				slot.scale_weight += w;
+			}
+			break;
+		}
+
+		case SceneFormats::AnimationChannel::Type::Rotation:
+		{
+			vec4 q = read_quat(state.spherical.data, state.spherical.stride, SPHERICAL_OUT, spherical_lane++).as_vec4();
+			if (additive)
+			{
+				if (q.w < 0.0f)
+					q = -q;
+				q = normalize(mix(vec4(0.0f, 0.0f, 0.0f, 1.0f), q, w));
+				slot.additive_rotation = quat(q) * slot.additive_rotation;
+			}
+			else
+			{
+				// Keep every layer in the same hemisphere as the sum so far.
+				if (dot(slot.rotation.as_vec4(), q) < 0.0f)
+					q = -q;
+				slot.rotation = quat(slot.rotation.as_vec4() + w * q);
+				slot.rotation_weight += w;
+			}
+			break;
+		}
 		}
 	}
 }
 
+void AnimationSystem::evaluate_blend(const Blend &blend)
+{
+	PoseSlot *slots = pose_slots.data() + blend.first_slot;
+	const RestPose *rest = rest_poses.data() + blend.first_slot;
+	Transform *const *targets = pose_targets.data() + blend.first_slot;
+
+	for (uint32_t i = 0; i < blend.slot_count; i++)
+	{
+		auto &slot = slots[i];
+		slot.translation = vec3(0.0f);
+		slot.translation_weight = 0.0f;
+		slot.rotation = quat(vec4(0.0f));
+		slot.rotation_weight = 0.0f;
+		slot.scale = vec3(0.0f);
+		slot.scale_weight = 0.0f;
+		slot.additive_rotation = quat(1.0f, 0.0f, 0.0f, 0.0f);
+		slot.additive_translation = vec3(0.0f);
+		slot.additive_scale = vec3(1.0f);
+	}
+
+	for (auto *layer : blend.layers)
+		if (layer->mode == BlendMode::Weighted && layer->weight != 0.0f)
+			accumulate_layer(*layer);
+	for (auto *layer : blend.layers)
+		if (layer->mode == BlendMode::Additive && layer->weight != 0.0f)
+			accumulate_layer(*layer);
+
+	for (uint32_t i = 0; i < blend.slot_count; i++)
+	{
+		auto &slot = slots[i];
+		auto &rest_pose = rest[i];
+		auto *transform = targets[i];
+
+		if (rest_pose.components & POSE_TRANSLATION_BIT)
+		{
+			vec3 v = slot.translation;
+			float w = slot.translation_weight;
+			if (w < 1.0f)
+			{
+				v += (1.0f - w) * rest_pose.translation;
+				w = 1.0f;
+			}
+			transform->translation = v / w + slot.additive_translation;
+		}
+
+		if (rest_pose.components & POSE_ROTATION_BIT)
+		{
+			vec4 q = slot.rotation.as_vec4();
+			float w = slot.rotation_weight;
+			if (w < 1.0f)
+			{
+				vec4 r = rest_pose.rotation.as_vec4();
+				q += (dot(q, r) < 0.0f ? -(1.0f - w) : (1.0f - w)) * r;
+			}
+			transform->rotation = slot.additive_rotation * quat(normalize(q));
+		}
+
+		if (rest_pose.components & POSE_SCALE_BIT)
+		{
+			vec3 v = slot.scale;
+			float w = slot.scale_weight;
+			if (w < 1.0f)
+			{
+				v += (1.0f - w) * rest_pose.scale;
+				w = 1.0f;
+			}
+			transform->scale = v / w * slot.additive_scale;
+		}
+	}
+}
+
+void AnimationSystem::animate(double t)
+{
+	size_t num_channels = 0;
+	for (auto &animation : animations)
+		num_channels += animation->channel_types.size();
+
+	bool parallel = sampling_group && num_channels >= 2 * sampling_min_channels_per_task;
+
+	// Layers which currently do not contribute to their blend are skipped.
+	if (parallel)
+	{
+		// Split on channels rather than animations, so each task gets roughly sampling_min_channels_per_task channels.
+		size_t animations_per_task = std::max<size_t>(1, sampling_min_channels_per_task * animations.size() / num_channels);
+		sampling_group->parallel_for(0, animations.size(), animations_per_task, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				if (animations[i]->weight != 0.0f)
+					sample(*animations[i], t);
+		});
+	}
+	else
+	{
+		for (auto &animation : animations)
+			if (animation->weight != 0.0f)
+				sample(*animation, t);
+	}
+
+	// Invalidating nodes touches shared parents, so this part stays serial.
+	for (auto &animation : animations)
+		if (animation->blend == NoBlend)
+			apply(*animation);
+
+	// create_blend_slots() makes sure no two blends share a target, so they can be evaluated in parallel as well.
+	if (parallel && blends.size() > 1)
+	{
+		size_t blends_per_task = std::max<size_t>(1, sampling_min_channels_per_task * blends.size() / std::max<size_t>(pose_slots.size(), 1));
+		sampling_group->parallel_for(0, blends.size(), blends_per_task, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				evaluate_blend(blends[i]);
+		});
+	}
+	else
+	{
+		for (auto &blend : blends)
+			evaluate_blend(blend);
+	}
+
+	for (auto &blend : blends)
+		for (auto *node : blend.nodes)
+			node->invalidate_cached_transform();
+}
+
+void AnimationSystem::set_parallel_sampling(ThreadGroup *group, size_t min_channels_per_task)
+{
+	sampling_group = group;
+	sampling_min_channels_per_task = std::max<size_t>(min_channels_per_task, 1);
+}
+
 void AnimationSystem::register_animation(const std::string &name, const SceneFormats::Animation &animation)
 {
+	compressed_animation_map.erase(name);
 	animation_map[name] = animation;
 }
 
+void AnimationSystem::register_animation(const std::string &name, SceneFormats::CompressedAnimation animation)
+{
+	animation_map.erase(name);
+	compressed_animation_map[name] = move(animation);
+}
+
+unique_ptr<AnimationSystem::AnimationState> AnimationSystem::create_state(const std::string &name, double start_time, bool repeat)
+{
+	auto itr = compressed_animation_map.find(name);
+	if (itr != end(compressed_animation_map))
+		return unique_ptr<AnimationState>(new AnimationState(itr->second, start_time, repeat));
+	else
+		return unique_ptr<AnimationState>(new AnimationState(animation_map[name], start_time, repeat));
+}
+
 void AnimationSystem::start_animation(Scene::Node &node, const std::string &name, double start_time, bool repeat)
 {
-	std::vector<std::pair<Transform *, Scene::Node *>> target_nodes;
-	auto &animation = animation_map[name];
+	auto state = create_state(name, start_time, repeat);
+	auto &animation = state->animation;
+	auto &target_nodes = state->channel_targets;
 	target_nodes.reserve(animation.channels.size());
 
 	for (auto &channel : animation.channels)
@@ -95,13 +512,14 @@ void AnimationSystem::start_animation(Scene::Node &node, const std::string &name
 			target_nodes.push_back({ &node.transform, &node });
 	}
 
-	animations.emplace_back(new AnimationState(move(target_nodes), animation, start_time, repeat));
+	animations.push_back(move(state));
 }
 
 void AnimationSystem::start_animation(Scene::NodeHandle *node_list, const std::string &name, double start_time, bool repeat)
 {
-	std::vector<std::pair<Transform *, Scene::Node *>> target_nodes;
-	auto &animation = animation_map[name];
+	auto state = create_state(name, start_time, repeat);
+	auto &animation = state->animation;
+	auto &target_nodes = state->channel_targets;
 	target_nodes.reserve(animation.channels.size());
 
 	if (animation.skinning)
@@ -120,7 +538,141 @@ void AnimationSystem::start_animation(Scene::NodeHandle *node_list, const std::s
 			target_nodes.push_back({ &node_list[channel.node_index]->transform, node_list[channel.node_index].get() });
 	}
 
-	animations.emplace_back(new AnimationState(move(target_nodes), animation, start_time, repeat));
+	animations.push_back(move(state));
+}
+
+unsigned AnimationSystem::create_blend_slots(const vector<pair<Transform *, Scene::Node *>> &targets, Scene::Node *base_node)
+{
+	// Blends are evaluated in parallel, so no transform may be written by two blends, or twice by one.
+	for (size_t i = 0; i < targets.size(); i++)
+	{
+		auto *transform = targets[i].first;
+		if (transform && !blend_targets.insert(transform).second)
+		{
+			// A rejected blend leaves everything as it was.
+			for (size_t j = 0; j < i; j++)
+				if (targets[j].first)
+					blend_targets.erase(targets[j].first);
+			throw logic_error("Transform is already the target of a blend.");
+		}
+	}
+
+	Blend blend;
+	blend.first_slot = uint32_t(pose_slots.size());
+	blend.slot_count = uint32_t(targets.size());
+	blend.base_node = base_node;
+
+	pose_slots.resize(pose_slots.size() + targets.size());
+	for (auto &target : targets)
+	{
+		RestPose rest = {};
+		if (target.first)
+		{
+			rest.translation = target.first->translation;
+			rest.rotation = target.first->rotation;
+			rest.scale = target.first->scale;
+		}
+		rest_poses.push_back(rest);
+		pose_targets.push_back(target.first);
+		blend.slot_nodes.push_back(target.second);
+	}
+
+	blends.push_back(move(blend));
+	return unsigned(blends.size() - 1);
+}
+
+unsigned AnimationSystem::create_blend(Scene::Node &node)
+{
+	vector<pair<Transform *, Scene::Node *>> targets;
+	targets.reserve(node.get_skin().skin.size() + 1);
+	targets.push_back({ &node.transform, &node });
+	for (auto *bone : node.get_skin().skin)
+		targets.push_back({ bone, &node });
+	return create_blend_slots(targets, &node);
+}
+
+unsigned AnimationSystem::create_blend(Scene::NodeHandle *node_list, size_t count)
+{
+	vector<pair<Transform *, Scene::Node *>> targets;
+	targets.reserve(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		if (node_list[i])
+			targets.push_back({ &node_list[i]->transform, node_list[i].get() });
+		else
+			targets.push_back({ nullptr, nullptr });
+	}
+	return create_blend_slots(targets, nullptr);
+}
+
+unsigned AnimationSystem::add_blend_layer(unsigned blend_index, const std::string &name, double start_time, bool repeat,
+                                          float weight, BlendMode mode)
+{
+	auto &blend = blends[blend_index];
+	auto state = create_state(name, start_time, repeat);
+	auto &animation = state->animation;
+	state->blend = blend_index;
+	state->weight = weight;
+	state->mode = mode;
+	state->channel_slots.reserve(animation.channels.size());
+
+	if (!blend.base_node && animation.skinning)
+		throw logic_error("Cannot start skinning animations without a target base node.");
+
+	for (auto &channel : animation.channels)
+	{
+		uint32_t slot;
+		if (channel.joint)
+		{
+			if (!blend.base_node)
+				throw logic_error("Cannot start skinning animations without a target base node.");
+			if (blend.base_node->get_skin().skin.empty())
+				throw logic_error("Node does not have a skin.");
+			if (blend.base_node->get_skin().skin_compat != animation.skin_compat)
+				throw logic_error("Nodes skin is not compatible with animation skin index.");
+			slot = channel.joint_index + 1;
+		}
+		else if (blend.base_node)
+			slot = 0;
+		else
+		{
+			if (channel.node_index >= blend.slot_count || !blend.slot_nodes[channel.node_index])
+				throw logic_error("Trying to animate a node which does not exist.");
+			slot = channel.node_index;
+		}
+
+		auto *node = blend.slot_nodes[slot];
+		slot += blend.first_slot;
+		state->channel_slots.push_back(slot);
+
+		auto &components = rest_poses[slot].components;
+		if (!components && find(begin(blend.nodes), end(blend.nodes), node) == end(blend.nodes))
+			blend.nodes.push_back(node);
+
+		switch (channel.type)
+		{
+		case SceneFormats::AnimationChannel::Type::Translation:
+		case SceneFormats::AnimationChannel::Type::CubicTranslation:
+			components |= POSE_TRANSLATION_BIT;
+			break;
+		case SceneFormats::AnimationChannel::Type::Rotation:
+			components |= POSE_ROTATION_BIT;
+			break;
+		case SceneFormats::AnimationChannel::Type::Scale:
+		case SceneFormats::AnimationChannel::Type::CubicScale:
+			components |= POSE_SCALE_BIT;
+			break;
+		}
+	}
+
+	blend.layers.push_back(state.get());
+	animations.push_back(move(state));
+	return unsigned(blend.layers.size() - 1);
+}
+
+void AnimationSystem::set_blend_layer_weight(unsigned blend, unsigned layer, float weight)
+{
+	blends[blend].layers[layer]->weight = weight;
 }
 
 }
\ No newline at end of file
@@ -24,10 +24,14 @@
 
 #include "scene.hpp"
 #include "scene_formats.hpp"
+#include "animation_compression.hpp"
+#include <unordered_set>
 #include <vector>
 
 namespace Granite
 {
+class ThreadGroup;
+
 class AnimationSystem
 {
 public:
@@ -37,21 +41,142 @@ public:
 	void start_animation(Scene::Node &node, const std::string &name, double start_time, bool repeat);
 	void register_animation(const std::string &name, const SceneFormats::Animation &animation);
 
+	// Compressed clips are decoded one chunk at a time while they play.
+	void register_animation(const std::string &name, SceneFormats::CompressedAnimation animation);
+
+	enum class BlendMode
+	{
+		// Layers are averaged by weight. Whatever is left of a total weight of 1 goes to the rest pose.
+		Weighted,
+		// Layers hold offsets from the identity transform, which are scaled by weight
+		// and applied on top of the weighted result in the order the layers were added.
+		Additive
+	};
+
+	// A blend evaluates any number of animation layers into one pose for a set of targets,
+	// and writes each target and invalidates each node once per frame, however many layers touch it.
+	// The rest pose is the transforms of the targets when the blend is created.
+	// Blends for a node target its own transform and the bones of its skin,
+	// blends for a node list target the transforms of the first count nodes.
+	// A transform can only be targeted by one blend, creating a second one throws std::logic_error.
+	unsigned create_blend(Scene::Node &node);
+	unsigned create_blend(Scene::NodeHandle *node_list, size_t count);
+	unsigned add_blend_layer(unsigned blend, const std::string &name, double start_time, bool repeat,
+	                         float weight = 1.0f, BlendMode mode = BlendMode::Weighted);
+	// Layers with a weight of 0 are not sampled at all.
+	void set_blend_layer_weight(unsigned blend, unsigned layer, float weight);
+
+	// Samples running animations over the workers of group. Transforms are still written back on the calling thread,
+	// in the same order as before. Fewer than 2 * min_channels_per_task channels in total are sampled serially.
+	// Pass nullptr to disable.
+	void set_parallel_sampling(ThreadGroup *group, size_t min_channels_per_task = 1024);
+
 private:
 	std::unordered_map<std::string, SceneFormats::Animation> animation_map;
+	std::unordered_map<std::string, SceneFormats::CompressedAnimation> compressed_animation_map;
+
+	// Channels of one sampler type, evaluated together in SoA form. See sample_linear_soa() and friends.
+	// Lanes are assigned in channel order.
+	struct SampleBatch
+	{
+		std::vector<float> data;
+		size_t count = 0;
+		size_t stride = 0;
+	};
+
+	enum { NoBlend = ~0u };
 
 	struct AnimationState
 	{
-		AnimationState(std::vector<std::pair<Transform *, Scene::Node *>> channel_targets, const SceneFormats::Animation &anim, double start_time, bool repeating)
-			: channel_targets(std::move(channel_targets)), animation(anim), start_time(start_time), repeating(repeating)
-		{
-		}
+		AnimationState(const SceneFormats::Animation &anim, double start_time, bool repeating);
+		AnimationState(const SceneFormats::CompressedAnimation &anim, double start_time, bool repeating);
 		std::vector<std::pair<Transform *, Scene::Node *>> channel_targets;
+
+		// For compressed clips, the chunk currently decoded into decoded, which animation then refers to.
+		const SceneFormats::CompressedAnimation *compressed = nullptr;
+		unsigned chunk = 0;
+		SceneFormats::Animation decoded;
+
 		const SceneFormats::Animation &animation;
 		double start_time = 0.0;
 		bool repeating = false;
+
+		// Where the last sample of each channel was found in its timestamps.
+		std::vector<unsigned> cursors;
+		// Kept apart from the channels, so writing results back does not have to touch them again.
+		std::vector<SceneFormats::AnimationChannel::Type> channel_types;
+		SampleBatch linear;
+		SampleBatch spherical;
+		SampleBatch cubic;
+
+		// Set for layers of a blend, which are accumulated into its pose rather than applied directly.
+		unsigned blend = NoBlend;
+		float weight = 1.0f;
+		BlendMode mode = BlendMode::Weighted;
+		// Pose slot of each channel.
+		std::vector<uint32_t> channel_slots;
+
+		void init_channels();
+	};
+
+	enum PoseComponentBits
+	{
+		POSE_TRANSLATION_BIT = 1 << 0,
+		POSE_ROTATION_BIT = 1 << 1,
+		POSE_SCALE_BIT = 1 << 2
 	};
 
+	// One per blend target, in a pool shared by every blend. Each blend owns a contiguous range of it.
+	struct PoseSlot
+	{
+		vec3 translation;
+		float translation_weight;
+		quat rotation;
+		float rotation_weight;
+		vec3 scale;
+		float scale_weight;
+		quat additive_rotation;
+		vec3 additive_translation;
+		vec3 additive_scale;
+	};
+
+	struct RestPose
+	{
+		vec3 translation;
+		quat rotation;
+		vec3 scale;
+		// Which components any layer animates. Others are never written.
+		uint32_t components;
+	};
+
+	struct Blend
+	{
+		uint32_t first_slot;
+		uint32_t slot_count;
+		std::vector<AnimationState *> layers;
+		// Node of each slot, and every distinct node with an animated slot.
+		std::vector<Scene::Node *> slot_nodes;
+		std::vector<Scene::Node *> nodes;
+		// Set for blends of a node and its skin.
+		Scene::Node *base_node = nullptr;
+	};
+
+	std::vector<PoseSlot> pose_slots;
+	std::vector<RestPose> rest_poses;
+	std::vector<Transform *> pose_targets;
+	std::vector<Blend> blends;
+	// Every transform targeted by a blend. Each transform can only belong to one blend.
+	std::unordered_set<const Transform *> blend_targets;
+
 	std::vector<std::unique_ptr<AnimationState>> animations;
+	ThreadGroup *sampling_group = nullptr;
+	size_t sampling_min_channels_per_task = 1024;
+
+	std::unique_ptr<AnimationState> create_state(const std::string &name, double start_time, bool repeat);
+	static void sample(AnimationState &state, double t);
+	static void apply(AnimationState &state);
+	unsigned create_blend_slots(const std::vector<std::pair<Transform *, Scene::Node *>> &targets, Scene::Node *base_node);
+	void evaluate_blend(const Blend &blend);
+	void accumulate_layer(const AnimationState &state);
 };
-}
\ No newline at end of file
+}
@@ -816,6 +816,7 @@ void LightClusterer::build_cluster_cpu(Vulkan::CommandBuffer &cmd, Vulkan::Image
 
 	auto &workers = ThreadGroup::get_global();
 	auto task = workers.create_task();
+	task->set_desc("clusterer-cpu-binning");
 
 	// Naive and simple multithreading :)
 	// Pre-compute useful data structures before we go wide ...
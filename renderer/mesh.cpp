@@ -302,7 +302,7 @@ void SkinnedMesh::get_render_info(const RenderContext &context, const CachedSpat
 	instance_data->world_transforms = queue.allocate_many<mat4>(num_bones);
 	instance_data->normal_transforms = queue.allocate_many<mat4>(num_bones);
 	memcpy(instance_data->world_transforms, transform->skin_transform->bone_world_transforms.data(), num_bones * sizeof(mat4));
-	memcpy(instance_data->normal_transforms, transform->skin_transform->bone_normal_transforms.data(), num_bones * sizeof(mat4));
+	memcpy(instance_data->normal_transforms, transform->skin_transform->get_bone_normal_transforms(), num_bones * sizeof(mat4));
 
 	auto *mesh_info = queue.push<StaticMeshInfo>(type, instance_key, sorting_key,
 	                                             RenderFunctions::skinned_mesh_render,
@@ -195,5 +195,12 @@ struct SkinnedMesh : public StaticMesh
 {
 	void get_render_info(const RenderContext &context, const CachedSpatialTransformComponent *transform,
 	                     RenderQueue &queue) const override;
+
+	Util::ArrayView<const AABB> get_bone_aabbs() const override
+	{
+		return bone_aabbs;
+	}
+
+	std::vector<AABB> bone_aabbs;
 };
 }
@@ -54,6 +54,7 @@ ImportedSkinnedMesh::ImportedSkinnedMesh(const Mesh &mesh, const MaterialInfo &i
 
 	material = Util::make_derived_handle<Material, MaterialFile>(info);
 	static_aabb = mesh.static_aabb;
+	bone_aabbs = mesh_compute_bone_aabbs(mesh);
 
 	EVENT_MANAGER_REGISTER_LATCH(ImportedSkinnedMesh, on_device_created, on_device_destroyed, DeviceCreatedEvent);
 }
@@ -30,6 +30,9 @@
 #include "abstract_renderable.hpp"
 #include "renderer_enums.hpp"
 #include "camera.hpp"
+#include "transforms.hpp"
+#include <atomic>
+#include <mutex>
 
 namespace Granite
 {
@@ -58,8 +61,36 @@ struct CachedTransform
 
 struct CachedSkinTransform
 {
+	// The bone palette, already multiplied with the inverse bind pose.
 	std::vector<mat4> bone_world_transforms;
-	std::vector<mat4> bone_normal_transforms;
+
+	// Normal transforms are only derived from the palette once a renderer asks for them after it changed.
+	// Safe to call from several threads at once.
+	const mat4 *get_bone_normal_transforms() const
+	{
+		if (normals_dirty.load(std::memory_order_acquire))
+		{
+			std::lock_guard<std::mutex> holder{normals_lock};
+			if (normals_dirty.load(std::memory_order_relaxed))
+			{
+				bone_normal_transforms.resize(bone_world_transforms.size());
+				for (size_t i = 0; i < bone_world_transforms.size(); i++)
+					compute_normal_transform(bone_normal_transforms[i], bone_world_transforms[i]);
+				normals_dirty.store(false, std::memory_order_release);
+			}
+		}
+		return bone_normal_transforms.data();
+	}
+
+	void invalidate_normal_transforms()
+	{
+		normals_dirty.store(true, std::memory_order_relaxed);
+	}
+
+private:
+	mutable std::vector<mat4> bone_normal_transforms;
+	mutable std::atomic<bool> normals_dirty{true};
+	mutable std::mutex normals_lock;
 };
 
 struct BoundedComponent : ComponentBase
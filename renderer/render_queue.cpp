@@ -22,8 +22,10 @@
 
 #include "render_queue.hpp"
 #include "render_context.hpp"
+#include "thread_group.hpp"
 #include <cstring>
 #include <iterator>
+#include <functional>
 #include <algorithm>
 #include <assert.h>
 
@@ -33,14 +35,288 @@ using namespace Util;
 
 namespace Granite
 {
-void RenderQueue::sort()
+// Below this many draws, a comparison sort is cheaper than the passes of the radix sort.
+static const size_t RadixSortMinItems = 2048;
+static const size_t RadixSortMaxChunks = 64;
+
+enum
+{
+	RADIX_BITS = 8,
+	RADIX_SIZE = 1 << RADIX_BITS,
+	RADIX_PASSES = 64 / RADIX_BITS
+};
+
+static inline unsigned get_radix_digit(uint64_t key, unsigned pass)
+{
+	return unsigned(key >> (pass * RADIX_BITS)) & (RADIX_SIZE - 1);
+}
+
+// LSD radix sort over sorting_key, which is stable like the comparison sort it replaces.
+// Each chunk of the queue is counted and scattered on its own. Chunks are laid out in order within each digit,
+// so splitting the queue does not change the result.
+void RenderQueue::radix_sort(vector<RenderQueueData> &queue, ThreadGroup *group)
+{
+	size_t count = queue.size();
+	size_t num_chunks = 1;
+	if (group && count >= 2 * sort_min_items_per_task)
+		num_chunks = std::min(count / sort_min_items_per_task, RadixSortMaxChunks);
+	size_t chunk_size = (count + num_chunks - 1) / num_chunks;
+
+	sort_scratch.resize(count);
+	sort_histograms.resize(num_chunks * RADIX_PASSES * RADIX_SIZE);
+
+	const auto for_each_chunk = [&](const std::function<void (size_t, size_t, uint32_t *)> &func) {
+		const auto run = [&](size_t chunk) {
+			size_t begin = chunk * chunk_size;
+			size_t end = std::min(begin + chunk_size, count);
+			func(begin, end, sort_histograms.data() + chunk * RADIX_PASSES * RADIX_SIZE);
+		};
+
+		if (num_chunks > 1)
+		{
+			group->parallel_for(0, num_chunks, 1, [&](size_t begin, size_t end) {
+				for (size_t chunk = begin; chunk < end; chunk++)
+					run(chunk);
+			});
+		}
+		else
+			run(0);
+	};
+
+	// Count every digit up front, so passes where all keys share the same digit can be skipped.
+	RenderQueueData *src = queue.data();
+	RenderQueueData *dst = sort_scratch.data();
+	for_each_chunk([&](size_t begin, size_t end, uint32_t *histograms) {
+		memset(histograms, 0, RADIX_PASSES * RADIX_SIZE * sizeof(uint32_t));
+		for (size_t i = begin; i < end; i++)
+		{
+			uint64_t key = src[i].sorting_key;
+			for (unsigned pass = 0; pass < RADIX_PASSES; pass++)
+				histograms[pass * RADIX_SIZE + get_radix_digit(key, pass)]++;
+		}
+	});
+
+	uint32_t totals[RADIX_PASSES * RADIX_SIZE] = {};
+	for (size_t chunk = 0; chunk < num_chunks; chunk++)
+		for (unsigned i = 0; i < RADIX_PASSES * RADIX_SIZE; i++)
+			totals[i] += sort_histograms[chunk * RADIX_PASSES * RADIX_SIZE + i];
+
+	bool reordered = false;
+	for (unsigned pass = 0; pass < RADIX_PASSES; pass++)
+	{
+		if (totals[pass * RADIX_SIZE + get_radix_digit(src[0].sorting_key, pass)] == count)
+			continue;
+
+		// Once the order has changed, each chunk holds different draws than when it was counted.
+		if (reordered && num_chunks > 1)
+		{
+			for_each_chunk([&](size_t begin, size_t end, uint32_t *histograms) {
+				uint32_t *histogram = histograms + pass * RADIX_SIZE;
+				memset(histogram, 0, RADIX_SIZE * sizeof(uint32_t));
+				for (size_t i = begin; i < end; i++)
+					histogram[get_radix_digit(src[i].sorting_key, pass)]++;
+			});
+		}
+
+		uint32_t offset = 0;
+		for (unsigned digit = 0; digit < RADIX_SIZE; digit++)
+		{
+			for (size_t chunk = 0; chunk < num_chunks; chunk++)
+			{
+				uint32_t &histogram = sort_histograms[(chunk * RADIX_PASSES + pass) * RADIX_SIZE + digit];
+				uint32_t digit_count = histogram;
+				histogram = offset;
+				offset += digit_count;
+			}
+		}
+
+		for_each_chunk([&](size_t begin, size_t end, uint32_t *histograms) {
+			uint32_t *offsets = histograms + pass * RADIX_SIZE;
+			for (size_t i = begin; i < end; i++)
+				dst[offsets[get_radix_digit(src[i].sorting_key, pass)]++] = src[i];
+		});
+
+		std::swap(src, dst);
+		reordered = true;
+	}
+
+	if (src != queue.data())
+		queue.swap(sort_scratch);
+}
+
+void RenderQueue::sort_queues(ThreadGroup *group)
 {
 	for (auto &queue : queues)
 	{
-		stable_sort(begin(queue), end(queue), [](const RenderQueueData &a, const RenderQueueData &b) {
-			return a.sorting_key < b.sorting_key;
+		if (queue.size() >= RadixSortMinItems)
+			radix_sort(queue, group);
+		else
+		{
+			stable_sort(begin(queue), end(queue), [](const RenderQueueData &a, const RenderQueueData &b) {
+				return a.sorting_key < b.sorting_key;
+			});
+		}
+	}
+}
+
+void RenderQueue::sort()
+{
+	sort_queues(sort_group);
+}
+
+// Merges sorted runs. Draws with equal keys are taken from earlier runs first, which keeps the merge stable.
+static void merge_sorted_runs(vector<RenderQueueData> &output, const vector<RenderQueueData> *const *runs, size_t count)
+{
+	struct Head
+	{
+		uint64_t key;
+		size_t run;
+	};
+
+	const auto later = [](const Head &a, const Head &b) {
+		return a.key > b.key || (a.key == b.key && a.run > b.run);
+	};
+
+	vector<Head> heads;
+	vector<size_t> positions(count);
+	size_t total = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		total += runs[i]->size();
+		if (!runs[i]->empty())
+			heads.push_back({ runs[i]->front().sorting_key, i });
+	}
+	make_heap(begin(heads), end(heads), later);
+
+	output.clear();
+	output.reserve(total);
+
+	while (!heads.empty())
+	{
+		pop_heap(begin(heads), end(heads), later);
+		auto &head = heads.back();
+		auto &run = *runs[head.run];
+		auto &position = positions[head.run];
+
+		// Take everything which still sorts before the next run in one go.
+		uint64_t limit = heads.size() > 1 ? heads.front().key : UINT64_MAX;
+		bool inclusive = heads.size() == 1 || head.run < heads.front().run;
+		do
+		{
+			output.push_back(run[position++]);
+		} while (position < run.size() &&
+		         (run[position].sorting_key < limit || (inclusive && run[position].sorting_key == limit)));
+
+		if (position < run.size())
+		{
+			head.key = run[position].sorting_key;
+			push_heap(begin(heads), end(heads), later);
+		}
+		else
+			heads.pop_back();
+	}
+}
+
+void RenderQueue::merge(RenderQueue *const *others, size_t count, bool sort)
+{
+	// Render infos allocated by more than one queue for the same key are replaced by the first one.
+	merge_remap.clear();
+	for (size_t i = 0; i < count; i++)
+	{
+		for (auto &info : others[i]->render_infos)
+		{
+			auto itr = render_infos.find(info.first);
+			if (itr == std::end(render_infos))
+				render_infos[info.first] = info.second;
+			else if (itr->second != info.second)
+				merge_remap[Hash(reinterpret_cast<uintptr_t>(info.second))] = itr->second;
+		}
+	}
+
+	const auto prepare = [&](size_t index) {
+		if (index == 0)
+		{
+			if (sort)
+				sort_queues(nullptr);
+			return;
+		}
+
+		auto &other = *others[index - 1];
+		if (!merge_remap.empty())
+		{
+			// Draws of the same render info tend to come in runs.
+			const void *last_from = nullptr;
+			const void *last_to = nullptr;
+			for (auto &queue : other.queues)
+			{
+				for (auto &data : queue)
+				{
+					if (data.render_info != last_from)
+					{
+						last_from = data.render_info;
+						auto itr = merge_remap.find(Hash(reinterpret_cast<uintptr_t>(last_from)));
+						last_to = itr != std::end(merge_remap) ? itr->second : last_from;
+					}
+					data.render_info = last_to;
+				}
+			}
+		}
+
+		if (sort)
+			other.sort_queues(nullptr);
+	};
+
+	// Each queue is prepared on its own, then each queue type is merged on its own.
+	if (sort_group && count > 0)
+	{
+		sort_group->parallel_for(0, count + 1, 1, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				prepare(i);
+		});
+	}
+	else
+	{
+		for (size_t i = 0; i <= count; i++)
+			prepare(i);
+	}
+
+	const auto merge_type = [&](unsigned type) {
+		vector<const vector<RenderQueueData> *> runs;
+		runs.reserve(count + 1);
+		runs.push_back(&queues[type]);
+		for (size_t i = 0; i < count; i++)
+			runs.push_back(&others[i]->queues[type]);
+
+		if (sort)
+		{
+			merge_sorted_runs(merge_scratch[type], runs.data(), runs.size());
+			queues[type].swap(merge_scratch[type]);
+		}
+		else
+		{
+			for (size_t i = 1; i < runs.size(); i++)
+				queues[type].insert(end(queues[type]), begin(*runs[i]), end(*runs[i]));
+		}
+	};
+
+	if (sort_group && count > 0)
+	{
+		sort_group->parallel_for(0, ecast(Queue::Count), 1, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				merge_type(unsigned(i));
 		});
 	}
+	else
+	{
+		for (unsigned i = 0; i < ecast(Queue::Count); i++)
+			merge_type(i);
+	}
+}
+
+void RenderQueue::set_parallel_sort(ThreadGroup *group, size_t min_items_per_task)
+{
+	sort_group = group;
+	sort_min_items_per_task = std::max<size_t>(min_items_per_task, 1);
 }
 
 void RenderQueue::combine_render_info(const RenderQueue &queue)
@@ -108,6 +384,15 @@ void *RenderQueue::allocate_from_block(Block &block, size_t size, size_t alignme
 		return nullptr;
 }
 
+void RenderQueue::move_queue_data(RenderQueue &other)
+{
+	for (unsigned i = 0; i < ecast(Queue::Count); i++)
+	{
+		assert(other.queues[i].empty());
+		std::swap(queues[i], other.queues[i]);
+	}
+}
+
 void RenderQueue::reset()
 {
 	current = begin(blocks);
@@ -35,6 +35,7 @@ namespace Granite
 {
 class ShaderSuite;
 class RenderContext;
+class ThreadGroup;
 
 enum class Queue : unsigned
 {
@@ -141,6 +142,18 @@ public:
 	}
 
 	void combine_render_info(const RenderQueue &queue);
+
+	// Moves the draws of count other queues into this one, after its own draws and in the order given.
+	// Render infos which several of the queues allocated for the same instance key are deduplicated to the first one,
+	// so instancing works like it would with a single queue. The other queues own that memory,
+	// so they must not be reset before this queue is.
+	// With sort set, the queues are sorted on their own and merged, which orders draws exactly like
+	// pushing all of them into this queue and calling sort() would. The sorting is split over the group
+	// set with set_parallel_sort().
+	void merge(RenderQueue *const *others, size_t count, bool sort);
+
+	// Moves the draws into other, which must not hold any. Render infos and the memory they point to stay here.
+	void move_queue_data(RenderQueue &other);
 	void reset();
 	void reset_and_reclaim();
 
@@ -149,7 +162,12 @@ public:
 		return queues[Util::ecast(queue)];
 	}
 
+	// Sorts every queue by sorting_key. Draws with equal keys keep the order they were pushed in.
 	void sort();
+
+	// Splits the sort of queues with at least 2 * min_items_per_task draws over the workers of group.
+	// Pass nullptr to disable.
+	void set_parallel_sort(ThreadGroup *group, size_t min_items_per_task = 16 * 1024);
 	void dispatch(Queue queue, Vulkan::CommandBuffer &cmd, const Vulkan::CommandBufferSavedState *state);
 	void dispatch(Queue queue, Vulkan::CommandBuffer &cmd, const Vulkan::CommandBufferSavedState *state, size_t begin, size_t end);
 
@@ -205,5 +223,14 @@ private:
 
 	ShaderSuite *shader_suites = nullptr;
 	Util::HashMap<void *> render_infos;
+
+	std::vector<RenderQueueData> sort_scratch;
+	std::vector<uint32_t> sort_histograms;
+	ThreadGroup *sort_group = nullptr;
+	size_t sort_min_items_per_task = 16 * 1024;
+	std::vector<RenderQueueData> merge_scratch[static_cast<unsigned>(Queue::Count)];
+	Util::HashMap<const void *> merge_remap;
+	void radix_sort(std::vector<RenderQueueData> &queue, ThreadGroup *group);
+	void sort_queues(ThreadGroup *group);
 };
 }
@@ -25,6 +25,7 @@
 #include "render_context.hpp"
 #include "sprite.hpp"
 #include "lights/clusterer.hpp"
+#include "thread_group.hpp"
 #include <string.h>
 
 using namespace Vulkan;
@@ -221,6 +222,11 @@ void Renderer::begin()
 {
 	queue.reset();
 	queue.set_shader_suites(suite);
+
+	for (size_t i = 0; i < num_worker_queues; i++)
+		worker_queues[i]->reset();
+	num_worker_queues = 0;
+	merged_worker_queues = 0;
 }
 
 static void set_cluster_parameters(Vulkan::CommandBuffer &cmd, const LightClusterer &cluster)
@@ -325,7 +331,9 @@ void Renderer::flush(Vulkan::CommandBuffer &cmd, RenderContext &context, Rendere
 	if (type == RendererType::GeneralForward)
 		set_lighting_parameters(cmd, context);
 
-	if ((options & SKIP_SORTING_BIT) == 0)
+	if (merged_worker_queues < num_worker_queues)
+		merge_worker_queues((options & SKIP_SORTING_BIT) == 0);
+	else if ((options & SKIP_SORTING_BIT) == 0)
 		queue.sort();
 
 	cmd.set_opaque_state();
@@ -477,16 +485,106 @@ void Renderer::render_debug_aabb(RenderContext &context, const AABB &aabb, const
 
 void Renderer::push_renderables(RenderContext &context, const VisibilityList &visible)
 {
+	if (push_group)
+	{
+		push_renderables_parallel(context, visible, false);
+		return;
+	}
+
 	for (auto &vis : visible)
 		vis.renderable->get_render_info(context, vis.transform, queue);
 }
 
 void Renderer::push_depth_renderables(RenderContext &context, const VisibilityList &visible)
 {
+	if (push_group)
+	{
+		push_renderables_parallel(context, visible, true);
+		return;
+	}
+
 	for (auto &vis : visible)
 		vis.renderable->get_depth_render_info(context, vis.transform, queue);
 }
 
+void Renderer::set_parallel_push(ThreadGroup *group, size_t min_renderables_per_task)
+{
+	push_group = group;
+	push_min_renderables_per_task = std::max<size_t>(min_renderables_per_task, 1);
+	queue.set_parallel_sort(group);
+}
+
+void Renderer::push_renderables_parallel(RenderContext &context, const VisibilityList &visible, bool depth)
+{
+	if (visible.empty())
+		return;
+
+	// Every slice gets a queue of its own, even when pushed serially, so merging keeps the order of the pushes.
+	// Each slice is merged back in, so there is no point in having many more of them than workers.
+	size_t num_slices = std::max<size_t>(1, visible.size() / push_min_renderables_per_task);
+	num_slices = std::min<size_t>(num_slices, 2 * (push_group->get_num_threads() + 1));
+	size_t slice_size = (visible.size() + num_slices - 1) / num_slices;
+
+	move_direct_draws_to_worker_queue();
+	while (worker_queues.size() < num_worker_queues + num_slices)
+		worker_queues.emplace_back(new RenderQueue);
+
+	const auto push_slice = [&](size_t slice) {
+		auto &slice_queue = *worker_queues[num_worker_queues + slice];
+		slice_queue.set_shader_suites(suite);
+
+		size_t begin = slice * slice_size;
+		size_t end = std::min(begin + slice_size, visible.size());
+		for (size_t i = begin; i < end; i++)
+		{
+			auto &vis = visible[i];
+			if (depth)
+				vis.renderable->get_depth_render_info(context, vis.transform, slice_queue);
+			else
+				vis.renderable->get_render_info(context, vis.transform, slice_queue);
+		}
+	};
+
+	if (num_slices > 1)
+	{
+		push_group->parallel_for(0, num_slices, 1, [&](size_t begin, size_t end) {
+			for (size_t slice = begin; slice < end; slice++)
+				push_slice(slice);
+		});
+	}
+	else
+		push_slice(0);
+
+	num_worker_queues += num_slices;
+}
+
+void Renderer::move_direct_draws_to_worker_queue()
+{
+	// Draws in the render queue, whether merged earlier or pushed straight into it, go in a run of their own,
+	// so they end up in between the slices pushed before and after them.
+	bool has_draws = false;
+	for (unsigned i = 0; i < ecast(Queue::Count); i++)
+		has_draws |= !queue.get_queue_data(static_cast<Queue>(i)).empty();
+	if (!has_draws)
+		return;
+
+	if (worker_queues.size() <= num_worker_queues)
+		worker_queues.emplace_back(new RenderQueue);
+	queue.move_queue_data(*worker_queues[num_worker_queues++]);
+}
+
+void Renderer::merge_worker_queues(bool sort)
+{
+	move_direct_draws_to_worker_queue();
+	vector<RenderQueue *> runs;
+	runs.reserve(num_worker_queues - merged_worker_queues);
+	for (size_t i = merged_worker_queues; i < num_worker_queues; i++)
+		runs.push_back(worker_queues[i].get());
+
+	queue.merge(runs.data(), runs.size(), sort);
+	merged_worker_queues = num_worker_queues;
+}
+
 void DeferredLightRenderer::render_light(Vulkan::CommandBuffer &cmd, RenderContext &context,
                                          Renderer::RendererOptionFlags flags)
 {
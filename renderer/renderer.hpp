@@ -77,6 +77,13 @@ public:
 	void push_renderables(RenderContext &context, const VisibilityList &visible);
 	void push_depth_renderables(RenderContext &context, const VisibilityList &visible);
 
+	// Splits the pushes above over the workers of group, each slice of the visibility list into a queue of its own.
+	// flush() merges them back into the render queue, in the same order as pushing everything serially,
+	// and sorts on group as well. Draws pushed straight into get_render_queue() in between keep their place too.
+	// Lists with fewer than 2 * min_renderables_per_task renderables are pushed on the calling thread.
+	// Pass nullptr to disable.
+	void set_parallel_push(ThreadGroup *group, size_t min_renderables_per_task = 1024);
+
 	void flush(Vulkan::CommandBuffer &cmd, RenderContext &context, RendererFlushFlags options = 0);
 
 	void render_debug_aabb(RenderContext &context, const AABB &aabb, const vec4 &color);
@@ -110,6 +117,16 @@ private:
 	uint8_t stencil_write_mask = 0;
 	uint8_t stencil_reference = 0;
 
+	ThreadGroup *push_group = nullptr;
+	size_t push_min_renderables_per_task = 1024;
+	// Queues filled by parallel pushes since begin(), in push order. The first merged_worker_queues are already merged.
+	std::vector<std::unique_ptr<RenderQueue>> worker_queues;
+	size_t num_worker_queues = 0;
+	size_t merged_worker_queues = 0;
+	void push_renderables_parallel(RenderContext &context, const VisibilityList &visible, bool depth);
+	void merge_worker_queues(bool sort);
+	void move_direct_draws_to_worker_queue();
+
 	void set_lighting_parameters(Vulkan::CommandBuffer &cmd, const RenderContext &context);
 	void set_mesh_renderer_options_internal(RendererOptionFlags flags);
 };
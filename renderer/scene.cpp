@@ -23,7 +23,11 @@
 #include "scene.hpp"
 #include "transforms.hpp"
 #include "lights/lights.hpp"
+#include "thread_group.hpp"
 #include <float.h>
+#include <algorithm>
+#include <cmath>
+#include <mutex>
 
 using namespace std;
 
@@ -31,8 +35,7 @@ namespace Granite
 {
 
 Scene::Scene()
-	: spatials(pool.get_component_group<BoundedComponent, CachedSpatialTransformComponent, CachedSpatialTransformTimestampComponent>()),
-	  opaque(pool.get_component_group<CachedSpatialTransformComponent, RenderableComponent, OpaqueComponent>()),
+	: opaque(pool.get_component_group<CachedSpatialTransformComponent, RenderableComponent, OpaqueComponent>()),
 	  transparent(pool.get_component_group<CachedSpatialTransformComponent, RenderableComponent, TransparentComponent>()),
 	  positional_lights(pool.get_component_group<CachedSpatialTransformComponent, RenderableComponent, PositionalLightComponent>()),
 	  static_shadowing(pool.get_component_group<CachedSpatialTransformComponent, RenderableComponent, CastsStaticShadowComponent>()),
@@ -46,9 +49,22 @@ Scene::Scene()
 	  per_frame_update_transforms(pool.get_component_group<PerFrameUpdateTransformComponent, CachedSpatialTransformComponent>()),
 	  environments(pool.get_component_group<EnvironmentComponent>()),
 	  render_pass_sinks(pool.get_component_group<RenderPassSinkComponent, RenderableComponent, CullPlaneComponent>()),
-	  render_pass_creators(pool.get_component_group<RenderPassComponent>())
+	  render_pass_creators(pool.get_component_group<RenderPassComponent>()),
+	  transform_storage(Util::make_handle<TransformStorage>())
 {
-
+	spatial_listeners[0].init(this, SPATIAL_BOUNDED_BIT);
+	spatial_listeners[1].init(this, SPATIAL_QUERY_OPAQUE_BIT);
+	spatial_listeners[2].init(this, SPATIAL_QUERY_TRANSPARENT_BIT);
+	spatial_listeners[3].init(this, SPATIAL_QUERY_STATIC_SHADOW_BIT);
+	spatial_listeners[4].init(this, SPATIAL_QUERY_DYNAMIC_SHADOW_BIT);
+	spatial_listeners[5].init(this, SPATIAL_QUERY_POSITIONAL_LIGHT_BIT);
+
+	pool.add_component_group_listener<BoundedComponent, CachedSpatialTransformComponent, CachedSpatialTransformTimestampComponent>(&spatial_listeners[0]);
+	pool.add_component_group_listener<CachedSpatialTransformComponent, RenderableComponent, OpaqueComponent>(&spatial_listeners[1]);
+	pool.add_component_group_listener<CachedSpatialTransformComponent, RenderableComponent, TransparentComponent>(&spatial_listeners[2]);
+	pool.add_component_group_listener<CachedSpatialTransformComponent, RenderableComponent, CastsStaticShadowComponent>(&spatial_listeners[3]);
+	pool.add_component_group_listener<CachedSpatialTransformComponent, RenderableComponent, CastsDynamicShadowComponent>(&spatial_listeners[4]);
+	pool.add_component_group_listener<CachedSpatialTransformComponent, RenderableComponent, PositionalLightComponent>(&spatial_listeners[5]);
 }
 
 Scene::~Scene()
@@ -58,21 +74,590 @@ Scene::~Scene()
 }
 
 template <typename T>
-static void gather_visible_renderables(const Frustum &frustum, VisibilityList &list, const T &objects)
+static RenderableInfo *gather_visible_renderables_range(const Frustum &frustum, RenderableInfo *output,
+                                                        const T *objects, size_t count)
 {
-	for (auto &o : objects)
+	for (size_t i = 0; i < count; i++)
 	{
-		auto *transform = get<0>(o);
-		auto *renderable = get<1>(o);
+		auto *transform = get<0>(objects[i]);
+		auto *renderable = get<1>(objects[i]);
 
 		if (transform->transform)
 		{
 			if (frustum.intersects_fast(transform->world_aabb))
-				list.push_back({ renderable->renderable.get(), transform });
+				*output++ = { renderable->renderable.get(), transform };
+		}
+		else
+			*output++ = { renderable->renderable.get(), nullptr };
+	}
+
+	return output;
+}
+
+template <typename T>
+void Scene::gather_visible_renderables(const Frustum &frustum, VisibilityList &list, const T &objects)
+{
+	// Every chunk culls into its own region of the list, after which the regions are compacted in order.
+	// This keeps the serial ordering without any per-thread lists to allocate and merge.
+	enum { MaxChunks = 64 };
+	size_t count = objects.size();
+	size_t num_chunks = 1;
+	if (gather_group && count >= 2 * gather_min_objects_per_task)
+	{
+		num_chunks = count / gather_min_objects_per_task;
+		num_chunks = std::min<size_t>(num_chunks, 4 * std::max(gather_group->get_num_threads(), 1u));
+		num_chunks = std::min<size_t>(num_chunks, MaxChunks);
+	}
+
+	size_t base = list.size();
+	list.resize(base + count);
+	auto *output = list.data() + base;
+
+	if (num_chunks == 1)
+	{
+		auto *end = gather_visible_renderables_range(frustum, output, objects.data(), count);
+		list.resize(base + size_t(end - output));
+		return;
+	}
+
+	size_t chunk_counts[MaxChunks];
+	gather_group->parallel_for(0, num_chunks, 1, [&](size_t begin, size_t end) {
+		for (size_t chunk = begin; chunk < end; chunk++)
+		{
+			size_t first = (count * chunk) / num_chunks;
+			size_t last = (count * (chunk + 1)) / num_chunks;
+			auto *chunk_end = gather_visible_renderables_range(frustum, output + first,
+			                                                   objects.data() + first, last - first);
+			chunk_counts[chunk] = size_t(chunk_end - (output + first));
+		}
+	});
+
+	size_t written = chunk_counts[0];
+	for (size_t chunk = 1; chunk < num_chunks; chunk++)
+	{
+		// Regions only ever move towards the front, so copying forward is safe.
+		auto *first = output + (count * chunk) / num_chunks;
+		copy(first, first + chunk_counts[chunk], output + written);
+		written += chunk_counts[chunk];
+	}
+	list.resize(base + written);
+}
+
+void Scene::set_parallel_gather(ThreadGroup *group, size_t min_objects_per_task)
+{
+	gather_group = group;
+	gather_min_objects_per_task = std::max<size_t>(min_objects_per_task, 1);
+}
+
+void Scene::set_spatial_tree_culling(bool enable)
+{
+	spatial_tree_culling = enable;
+}
+
+void Scene::SpatialGroupListener::init(Scene *scene_, uint32_t flag_)
+{
+	scene = scene_;
+	flag = flag_;
+}
+
+void Scene::SpatialGroupListener::on_entity_added(Entity &entity)
+{
+	scene->add_spatial_flag(entity, flag);
+}
+
+void Scene::SpatialGroupListener::on_entity_removed(Entity &entity)
+{
+	scene->remove_spatial_flag(entity, flag);
+}
+
+void Scene::add_spatial_flag(Entity &entity, uint32_t flag)
+{
+	auto *transform = entity.get_component<CachedSpatialTransformComponent>();
+	uint32_t index;
+
+	auto itr = spatial_lookup.find(transform);
+	if (itr == end(spatial_lookup))
+	{
+		if (spatial_free_list.empty())
+		{
+			index = uint32_t(spatial_entries.size());
+			spatial_entries.emplace_back();
+			spatial_cull_info.emplace_back();
+		}
+		else
+		{
+			index = spatial_free_list.back();
+			spatial_free_list.pop_back();
+			spatial_entries[index] = {};
+		}
+
+		spatial_entries[index].transform = transform;
+		spatial_lookup[transform] = index;
+	}
+	else
+		index = itr->second;
+
+	auto &entry = spatial_entries[index];
+	entry.flags |= flag;
+	if (flag == SPATIAL_BOUNDED_BIT)
+	{
+		entry.bounded = entity.get_component<BoundedComponent>();
+		entry.timestamp = entity.get_component<CachedSpatialTransformTimestampComponent>();
+	}
+	else
+		entry.renderable = entity.get_component<RenderableComponent>();
+
+	if (entry.leaf != BVH::Invalid)
+	{
+		spatial_cull_info[index].renderable = entry.renderable ? entry.renderable->renderable.get() : nullptr;
+		(entry.is_static ? static_tree : dynamic_tree).set_mask(entry.leaf, entry.flags);
+	}
+
+	queue_spatial(index);
+}
+
+void Scene::remove_spatial_flag(Entity &entity, uint32_t flag)
+{
+	auto itr = spatial_lookup.find(entity.get_component<CachedSpatialTransformComponent>());
+	if (itr == end(spatial_lookup))
+		return;
+
+	uint32_t index = itr->second;
+	auto &entry = spatial_entries[index];
+	entry.flags &= ~flag;
+
+	if (flag == SPATIAL_BOUNDED_BIT)
+	{
+		untrack_spatial_timestamp(index);
+		entry.bounded = nullptr;
+		entry.timestamp = nullptr;
+		if (entry.leaf != BVH::Invalid)
+			remove_spatial_leaf(entry);
+	}
+	else if (entry.leaf != BVH::Invalid)
+		(entry.is_static ? static_tree : dynamic_tree).set_mask(entry.leaf, entry.flags);
+
+	if (entry.flags)
+		queue_spatial(index);
+	else
+	{
+		// Stale indices in pending_spatials are harmless, entries which are no longer pending are skipped.
+		set_spatial_unindexed(index, false);
+		entry.pending = false;
+		spatial_lookup.erase(itr);
+		spatial_free_list.push_back(index);
+	}
+}
+
+void Scene::queue_spatial(uint32_t index)
+{
+	auto &entry = spatial_entries[index];
+	if (!entry.pending)
+	{
+		entry.pending = true;
+		pending_spatials.push_back(index);
+	}
+}
+
+void Scene::track_spatial_timestamp(uint32_t index)
+{
+	auto &entry = spatial_entries[index];
+	untrack_spatial_timestamp(index);
+	if (!entry.timestamp || !entry.timestamp->current_timestamp)
+		return;
+
+	entry.tracked_timestamp = entry.timestamp->current_timestamp;
+	auto itr = spatial_timestamp_heads.find(entry.tracked_timestamp);
+	if (itr == end(spatial_timestamp_heads))
+	{
+		entry.next_with_timestamp = ~0u;
+		spatial_timestamp_heads[entry.tracked_timestamp] = index;
+	}
+	else
+	{
+		entry.next_with_timestamp = itr->second;
+		itr->second = index;
+	}
+}
+
+void Scene::untrack_spatial_timestamp(uint32_t index)
+{
+	auto &entry = spatial_entries[index];
+	if (!entry.tracked_timestamp)
+		return;
+
+	// Chains are as long as the number of renderables on a single node, which is tiny.
+	auto itr = spatial_timestamp_heads.find(entry.tracked_timestamp);
+	assert(itr != end(spatial_timestamp_heads));
+	if (itr->second == index)
+	{
+		if (entry.next_with_timestamp == ~0u)
+			spatial_timestamp_heads.erase(itr);
+		else
+			itr->second = entry.next_with_timestamp;
+	}
+	else
+	{
+		uint32_t prev = itr->second;
+		while (spatial_entries[prev].next_with_timestamp != index)
+			prev = spatial_entries[prev].next_with_timestamp;
+		spatial_entries[prev].next_with_timestamp = entry.next_with_timestamp;
+	}
+
+	entry.tracked_timestamp = nullptr;
+	entry.next_with_timestamp = ~0u;
+}
+
+void Scene::set_spatial_unindexed(uint32_t index, bool unindexed)
+{
+	auto &entry = spatial_entries[index];
+	if (unindexed == (entry.unindexed_slot != ~0u))
+		return;
+
+	if (unindexed)
+	{
+		entry.unindexed_slot = uint32_t(unindexed_spatials.size());
+		unindexed_spatials.push_back(index);
+	}
+	else
+	{
+		uint32_t last = unindexed_spatials.back();
+		unindexed_spatials[entry.unindexed_slot] = last;
+		spatial_entries[last].unindexed_slot = entry.unindexed_slot;
+		unindexed_spatials.pop_back();
+		entry.unindexed_slot = ~0u;
+	}
+}
+
+void Scene::insert_spatial_leaf(uint32_t index, const AABB &bounds)
+{
+	auto &entry = spatial_entries[index];
+	auto &info = spatial_cull_info[index];
+	info.renderable = entry.renderable ? entry.renderable->renderable.get() : nullptr;
+	info.transform = entry.transform;
+	entry.leaf = dynamic_tree.insert(bounds, index, entry.flags);
+	entry.is_static = false;
+}
+
+void Scene::remove_spatial_leaf(SpatialEntry &entry)
+{
+	// The static tree is never modified after it is built, its leaves are only masked out.
+	if (entry.is_static)
+		static_tree.set_mask(entry.leaf, 0);
+	else
+		dynamic_tree.remove(entry.leaf);
+
+	entry.leaf = BVH::Invalid;
+	entry.is_static = false;
+}
+
+// Frustum culling tests the bounding sphere of the world AABB, so the trees store the box around that sphere.
+// It is grown a little, so rounding in the box tests of the trees never culls anything intersects_fast() keeps.
+static bool get_spatial_tree_bounds(const AABB &aabb, AABB &bounds)
+{
+	vec3 center = aabb.get_center();
+	float radius = aabb.get_radius();
+	float slack = 1e-5f * (radius + std::max(std::max(muglm::abs(center.x), muglm::abs(center.y)), muglm::abs(center.z)));
+	vec3 extent = vec3(radius + slack);
+	bounds = AABB(center - extent, center + extent);
+
+	// Skins without bones have an inverted world AABB, which must not end up in a tree.
+	return std::isfinite(radius) && std::isfinite(slack);
+}
+
+void Scene::update_spatial_entry(uint32_t index)
+{
+	auto &entry = spatial_entries[index];
+	if (entry.flags & SPATIAL_BOUNDED_BIT)
+	{
+		auto *cached_transform = entry.transform;
+		auto *timestamp = entry.timestamp;
+
+		// The timestamp is usually hooked up to a node after the entity has been created.
+		if (entry.tracked_timestamp != timestamp->current_timestamp)
+			track_spatial_timestamp(index);
+
+		bool moved = timestamp->current_timestamp && timestamp->last_timestamp != *timestamp->current_timestamp;
+
+		if (moved)
+		{
+			if (cached_transform->transform)
+			{
+				if (cached_transform->skin_transform)
+				{
+					Util::ArrayView<const AABB> bone_aabbs;
+					if (entry.renderable && entry.renderable->renderable)
+						bone_aabbs = entry.renderable->renderable->get_bone_aabbs();
+
+					auto &bones = cached_transform->skin_transform->bone_world_transforms;
+					cached_transform->world_aabb = AABB(vec3(FLT_MAX), vec3(-FLT_MAX));
+
+					// Each bone only needs to cover the vertices it influences.
+					// Bones which influence nothing have an inverted box, or no box at all, and are skipped.
+					if (!bone_aabbs.empty() && bone_aabbs.size() <= bones.size())
+					{
+						for (size_t i = 0; i < bone_aabbs.size(); i++)
+							if (all(lessThanEqual(bone_aabbs[i].get_minimum(), bone_aabbs[i].get_maximum())))
+								cached_transform->world_aabb.expand(bone_aabbs[i].transform(bones[i]));
+					}
+					else
+					{
+						for (auto &m : bones)
+							cached_transform->world_aabb.expand(entry.bounded->aabb->transform(m));
+					}
+				}
+				else
+				{
+					cached_transform->world_aabb = entry.bounded->aabb->transform(
+						cached_transform->transform->world_transform);
+				}
+			}
+			timestamp->last_timestamp = *timestamp->current_timestamp;
+		}
+
+		AABB bounds;
+		if (cached_transform->transform && get_spatial_tree_bounds(cached_transform->world_aabb, bounds))
+		{
+			if (entry.leaf == BVH::Invalid || moved)
+			{
+				auto &aabb = cached_transform->world_aabb;
+				spatial_cull_info[index].sphere = vec4(aabb.get_center(), aabb.get_radius());
+			}
+
+			if (entry.leaf == BVH::Invalid)
+				insert_spatial_leaf(index, bounds);
+			else if (moved && entry.is_static)
+			{
+				remove_spatial_leaf(entry);
+				insert_spatial_leaf(index, bounds);
+			}
+			else if (moved)
+				dynamic_tree.move(entry.leaf, bounds);
+
+			set_spatial_unindexed(index, false);
+			return;
+		}
+	}
+
+	if (entry.leaf != BVH::Invalid)
+		remove_spatial_leaf(entry);
+	set_spatial_unindexed(index, true);
+}
+
+void Scene::update_spatial_entries()
+{
+	// Only entries whose node moved, or whose components changed, are looked at,
+	// so a static scene costs nothing here.
+	auto &storage = *transform_storage;
+	for (auto slot : storage.moved_slots)
+	{
+		storage.get_flags(slot) &= ~TransformStorage::MOVED_BIT;
+		auto itr = spatial_timestamp_heads.find(&storage.get_timestamp(slot));
+		if (itr == end(spatial_timestamp_heads))
+			continue;
+
+		for (uint32_t index = itr->second; index != ~0u; index = spatial_entries[index].next_with_timestamp)
+			queue_spatial(index);
+	}
+	storage.moved_slots.clear();
+
+	// Go through entries in index order, so the trees come out the same regardless of how updates were scheduled.
+	sort(begin(pending_spatials), end(pending_spatials));
+	for (auto index : pending_spatials)
+	{
+		auto &entry = spatial_entries[index];
+		if (!entry.pending)
+			continue;
+
+		entry.pending = false;
+		update_spatial_entry(index);
+	}
+	pending_spatials.clear();
+}
+
+static uint32_t spread_morton_bits(uint32_t v)
+{
+	v = (v | (v << 16)) & 0x030000ffu;
+	v = (v | (v << 8)) & 0x0300f00fu;
+	v = (v | (v << 4)) & 0x030c30c3u;
+	v = (v | (v << 2)) & 0x09249249u;
+	return v;
+}
+
+void Scene::rebuild_static_spatial_tree()
+{
+	struct SortKey
+	{
+		uint32_t code;
+		uint32_t index;
+	};
+	vector<SortKey> keys;
+
+	AABB scene_bounds(vec3(FLT_MAX), vec3(-FLT_MAX));
+	uint32_t count = uint32_t(spatial_entries.size());
+	for (uint32_t index = 0; index < count; index++)
+	{
+		auto &entry = spatial_entries[index];
+		if (!entry.flags)
+			continue;
+
+		keys.push_back({ ~0u, index });
+		if (entry.leaf != BVH::Invalid)
+		{
+			vec3 center = spatial_cull_info[index].sphere.xyz();
+			scene_bounds.expand(AABB(center, center));
+		}
+	}
+
+	// Renumber entries along a Morton curve, so leaves which are close in the tree are also close in memory.
+	// Entries outside the trees go last. This also drops the free slots.
+	vec3 scale = vec3(1023.0f) / max(scene_bounds.get_maximum() - scene_bounds.get_minimum(), vec3(FLT_MIN));
+	for (auto &key : keys)
+	{
+		if (spatial_entries[key.index].leaf == BVH::Invalid)
+			continue;
+
+		vec3 p = (spatial_cull_info[key.index].sphere.xyz() - scene_bounds.get_minimum()) * scale;
+		key.code = spread_morton_bits(uint32_t(p.x)) |
+		           (spread_morton_bits(uint32_t(p.y)) << 1) |
+		           (spread_morton_bits(uint32_t(p.z)) << 2);
+	}
+
+	stable_sort(begin(keys), end(keys), [](const SortKey &a, const SortKey &b) {
+		return a.code < b.code;
+	});
+
+	vector<SpatialEntry> entries(keys.size());
+	vector<SpatialCullInfo> cull_info(keys.size());
+	vector<uint32_t> remap(count, ~0u);
+	for (uint32_t i = 0; i < uint32_t(keys.size()); i++)
+	{
+		entries[i] = spatial_entries[keys[i].index];
+		cull_info[i] = spatial_cull_info[keys[i].index];
+		remap[keys[i].index] = i;
+		spatial_lookup[entries[i].transform] = i;
+	}
+
+	swap(spatial_entries, entries);
+	swap(spatial_cull_info, cull_info);
+	spatial_free_list.clear();
+
+	// Every list of entry indices has to follow the renumbering.
+	const auto remap_list = [&](vector<uint32_t> &list) {
+		auto itr = remove_if(begin(list), end(list), [&](uint32_t index) {
+			return remap[index] == ~0u;
+		});
+		list.erase(itr, end(list));
+		for (auto &index : list)
+			index = remap[index];
+	};
+	remap_list(unindexed_spatials);
+	remap_list(pending_spatials);
+
+	for (uint32_t i = 0; i < uint32_t(unindexed_spatials.size()); i++)
+		spatial_entries[unindexed_spatials[i]].unindexed_slot = i;
+
+	spatial_timestamp_heads.clear();
+	for (uint32_t index = 0; index < uint32_t(spatial_entries.size()); index++)
+	{
+		auto &entry = spatial_entries[index];
+		if (entry.tracked_timestamp)
+		{
+			entry.tracked_timestamp = nullptr;
+			track_spatial_timestamp(index);
+		}
+	}
+
+	// Every leaf moves to the new static tree, so the dynamic tree starts over empty.
+	vector<AABB> bounds;
+	vector<uint32_t> indices;
+	vector<uint32_t> masks;
+	vector<uint32_t> leaves;
+
+	for (uint32_t index = 0; index < uint32_t(spatial_entries.size()); index++)
+	{
+		auto &entry = spatial_entries[index];
+		if (entry.leaf == BVH::Invalid)
+			break;
+
+		AABB aabb;
+		get_spatial_tree_bounds(entry.transform->world_aabb, aabb);
+		bounds.push_back(aabb);
+		indices.push_back(index);
+		masks.push_back(entry.flags);
+	}
+
+	dynamic_tree.clear();
+	leaves.resize(indices.size());
+	static_tree.build(bounds.data(), indices.data(), masks.data(), indices.size(), leaves.data());
+
+	for (size_t i = 0; i < indices.size(); i++)
+	{
+		auto &entry = spatial_entries[indices[i]];
+		entry.leaf = leaves[i];
+		entry.is_static = true;
+	}
+}
+
+template <typename Query, typename Test>
+void Scene::query_spatial_trees(const Query &query, const Test &test, SpatialQueryFlags flags, VisibilityList &list)
+{
+	for (auto index : unindexed_spatials)
+	{
+		auto &entry = spatial_entries[index];
+		if ((entry.flags & flags) == 0)
+			continue;
+
+		auto *transform = entry.transform;
+		if (transform->transform)
+		{
+			auto &aabb = transform->world_aabb;
+			if (test(*transform, vec4(aabb.get_center(), aabb.get_radius())))
+				list.push_back({ entry.renderable->renderable.get(), transform });
 		}
 		else
-			list.push_back({ renderable->renderable.get(), nullptr});
+			list.push_back({ entry.renderable->renderable.get(), nullptr });
 	}
+
+	const auto visit = [&](uint32_t index) {
+		auto &info = spatial_cull_info[index];
+		if (test(*info.transform, info.sphere))
+			list.push_back({ info.renderable, info.transform });
+	};
+
+	query(static_tree, visit);
+	query(dynamic_tree, visit);
+}
+
+void Scene::query_spatials(const Frustum &frustum, SpatialQueryFlags flags, VisibilityList &list)
+{
+	query_spatial_trees([&](const BVH &tree, const auto &visit) {
+		tree.query(frustum, flags, visit);
+	}, [&](const CachedSpatialTransformComponent &, const vec4 &sphere) {
+		return frustum.intersects_sphere(sphere);
+	}, flags, list);
+}
+
+void Scene::query_spatials(const vec3 &center, float radius, SpatialQueryFlags flags, VisibilityList &list)
+{
+	query_spatial_trees([&](const BVH &tree, const auto &visit) {
+		tree.query(center, radius, flags, visit);
+	}, [&](const CachedSpatialTransformComponent &transform, const vec4 &) {
+		auto &aabb = transform.world_aabb;
+		vec3 d = center - clamp(center, aabb.get_minimum(), aabb.get_maximum());
+		return dot(d, d) <= radius * radius;
+	}, flags, list);
+}
+
+void Scene::query_spatials(const AABB &aabb, SpatialQueryFlags flags, VisibilityList &list)
+{
+	query_spatial_trees([&](const BVH &tree, const auto &visit) {
+		tree.query(aabb, flags, visit);
+	}, [&](const CachedSpatialTransformComponent &transform, const vec4 &) {
+		auto &object = transform.world_aabb;
+		return all(lessThanEqual(aabb.get_minimum(), object.get_maximum())) &&
+		       all(lessThanEqual(object.get_minimum(), aabb.get_maximum()));
+	}, flags, list);
 }
 
 void Scene::add_render_passes(RenderGraph &graph)
@@ -162,59 +747,74 @@ void Scene::gather_visible_render_pass_sinks(const vec3 &camera_pos, VisibilityL
 
 void Scene::gather_visible_opaque_renderables(const Frustum &frustum, VisibilityList &list)
 {
-	gather_visible_renderables(frustum, list, opaque);
+	if (spatial_tree_culling)
+		query_spatials(frustum, SPATIAL_QUERY_OPAQUE_BIT, list);
+	else
+		gather_visible_renderables(frustum, list, opaque);
 }
 
 void Scene::gather_visible_transparent_renderables(const Frustum &frustum, VisibilityList &list)
 {
-	gather_visible_renderables(frustum, list, transparent);
+	if (spatial_tree_culling)
+		query_spatials(frustum, SPATIAL_QUERY_TRANSPARENT_BIT, list);
+	else
+		gather_visible_renderables(frustum, list, transparent);
 }
 
 void Scene::gather_visible_static_shadow_renderables(const Frustum &frustum, VisibilityList &list)
 {
-	gather_visible_renderables(frustum, list, static_shadowing);
+	if (spatial_tree_culling)
+		query_spatials(frustum, SPATIAL_QUERY_STATIC_SHADOW_BIT, list);
+	else
+		gather_visible_renderables(frustum, list, static_shadowing);
 }
 
 void Scene::gather_visible_positional_lights(const Frustum &frustum, VisibilityList &list,
                                              unsigned max_spot_lights, unsigned max_point_lights)
 {
+	size_t base = list.size();
+	if (spatial_tree_culling)
+		query_spatials(frustum, SPATIAL_QUERY_POSITIONAL_LIGHT_BIT, list);
+	else
+		gather_visible_renderables(frustum, list, positional_lights);
+
 	unsigned spot_count = 0;
 	unsigned point_count = 0;
+	size_t written = base;
 
-	for (auto &o : positional_lights)
+	for (size_t i = base; i < list.size(); i++)
 	{
-		auto *transform = get<0>(o);
-		auto *renderable = get<1>(o);
-
-		if (transform->transform)
+		auto &info = list[i];
+		if (info.transform)
 		{
-			if (frustum.intersects_fast(transform->world_aabb))
+			const auto *light = static_cast<const PositionalLight *>(info.renderable);
+			if (light->get_type() == PositionalLight::Type::Point)
 			{
-				const auto *light = static_cast<const PositionalLight *>(renderable->renderable.get());
-				if (light->get_type() == PositionalLight::Type::Point)
-				{
-					if (point_count >= max_point_lights)
-						continue;
-					point_count++;
-				}
-				else if (light->get_type() == PositionalLight::Type::Spot)
-				{
-					if (spot_count >= max_spot_lights)
-						continue;
-					spot_count++;
-				}
-
-				list.push_back({ renderable->renderable.get(), transform });
+				if (point_count >= max_point_lights)
+					continue;
+				point_count++;
+			}
+			else if (light->get_type() == PositionalLight::Type::Spot)
+			{
+				if (spot_count >= max_spot_lights)
+					continue;
+				spot_count++;
 			}
 		}
-		else
-			list.push_back({ renderable->renderable.get(), nullptr });
+
+		list[written++] = info;
 	}
+
+	list.resize(written);
 }
 
 void Scene::gather_visible_dynamic_shadow_renderables(const Frustum &frustum, VisibilityList &list)
 {
-	gather_visible_renderables(frustum, list, dynamic_shadowing);
+	if (spatial_tree_culling)
+		query_spatials(frustum, SPATIAL_QUERY_DYNAMIC_SHADOW_BIT, list);
+	else
+		gather_visible_renderables(frustum, list, dynamic_shadowing);
+
 	for (auto &object : render_pass_shadowing)
 		list.push_back({ get<1>(object)->renderable.get(), nullptr });
 }
@@ -240,86 +840,231 @@ static void log_node_transforms(const Scene::Node &node)
 }
 #endif
 
-void Scene::update_skinning(Node &node)
+void Scene::rebuild_transform_hierarchy()
 {
-	if (!node.cached_skin_transform.bone_world_transforms.empty())
+	transform_nodes.clear();
+	transform_rebuild_nodes.clear();
+	transform_level_offsets.clear();
+	transform_skins.clear();
+	transform_skin_bones.clear();
+	transform_skin_inverse_bind.clear();
+
+	auto add_node = [this](Node *node, uint32_t parent, uint32_t flags) {
+		// Nodes from another scene live in another storage, and cannot be updated with this one.
+		assert(node->get_transform_storage() == transform_storage.get());
+		transform_nodes.push_back({ node->get_transform_slot(), parent, flags });
+		transform_rebuild_nodes.push_back(node);
+	};
+
+	if (root_node)
+		add_node(root_node.get(), ~0u, 0);
+
+	size_t level_begin = 0;
+	while (level_begin < transform_nodes.size())
 	{
-		unsigned len = unsigned(node.get_skin().cached_skin.size());
-		assert(node.get_skin().cached_skin.size() == node.cached_skin_transform.bone_world_transforms.size());
-		assert(node.get_skin().cached_skin.size() == node.cached_skin_transform.bone_normal_transforms.size());
-		for (unsigned i = 0; i < len; i++)
+		size_t level_end = transform_nodes.size();
+		transform_level_offsets.push_back(uint32_t(level_begin));
+
+		for (size_t i = level_begin; i < level_end; i++)
 		{
-			node.cached_skin_transform.bone_world_transforms[i] = node.get_skin().cached_skin[i]->world_transform;
-			node.cached_skin_transform.bone_normal_transforms[i] = node.get_skin().cached_skin[i]->normal_transform;
+			auto &node = *transform_rebuild_nodes[i];
+			node.get_and_clear_hierarchy_dirty();
+			if (!node.get_skin().skin.empty())
+				transform_skins.push_back({ &node, uint32_t(i), 0, 0 });
+
+			for (auto &child : node.get_children())
+				add_node(child.get(), uint32_t(i), 0);
+			for (auto &child : node.get_skeletons())
+				add_node(child.get(), uint32_t(i), TRANSFORM_NODE_SKELETON_BIT);
 		}
 
-		//log_node_transforms(node);
+		level_begin = level_end;
 	}
-}
+	transform_level_offsets.push_back(uint32_t(transform_nodes.size()));
 
-void Scene::update_transform_tree(Node &node, const mat4 &transform, bool parent_is_dirty)
-{
-	bool transform_dirty = node.get_and_clear_transform_dirty() || parent_is_dirty;
+	uint32_t missing_bone = uint32_t(transform_nodes.size());
+	transform_parent_space.resize(transform_nodes.size() + 1);
+	transform_parent_space[missing_bone] = mat4(1.0f);
+	transform_states.resize(transform_nodes.size());
 
-	if (transform_dirty)
+	if (!transform_skins.empty())
 	{
-		compute_model_transform(node.cached_transform.world_transform,
-		                        node.transform.scale, node.transform.rotation, node.transform.translation, transform);
-	}
+		unordered_map<const Transform *, uint32_t> bone_indices;
+		for (size_t i = 0; i < transform_nodes.size(); i++)
+			if (transform_nodes[i].flags & TRANSFORM_NODE_SKELETON_BIT)
+				bone_indices[&transform_rebuild_nodes[i]->transform] = uint32_t(i);
 
-	if (node.get_and_clear_child_transform_dirty() || transform_dirty)
-	{
-		for (auto &child : node.get_children())
-			update_transform_tree(*child, node.cached_transform.world_transform, transform_dirty);
+		for (auto &skin : transform_skins)
+		{
+			auto &node = *skin.node;
+			auto &bones = node.get_skin().skin;
+			assert(bones.size() == node.cached_skin_transform.bone_world_transforms.size());
+
+			skin.first_bone = uint32_t(transform_skin_bones.size());
+			skin.num_bones = uint32_t(bones.size());
+			for (auto *bone : bones)
+			{
+				auto itr = bone_indices.find(bone);
+				if (itr != end(bone_indices))
+				{
+					transform_skin_bones.push_back(itr->second);
+					transform_skin_inverse_bind.push_back(transform_rebuild_nodes[itr->second]->initial_transform);
+				}
+				else
+				{
+					transform_skin_bones.push_back(missing_bone);
+					transform_skin_inverse_bind.push_back(mat4(1.0f));
+				}
+			}
+		}
 	}
 
-	if (transform_dirty)
+	transform_hierarchy_dirty = false;
+}
+
+void Scene::update_transform_range(size_t begin, size_t end, vector<uint32_t> &moved)
+{
+	static const mat4 identity(1.0f);
+	auto &storage = *transform_storage;
+
+	for (size_t i = begin; i < end; i++)
 	{
-		for (auto &child : node.get_skeletons())
-			update_transform_tree(*child, node.cached_transform.world_transform, true);
+		auto &entry = transform_nodes[i];
+
+		// Children are only visited if the parent asked for it, skeletons only if the parent moved.
+		bool visit = true;
+		bool parent_dirty = false;
+		const mat4 *parent_transform = &identity;
+		if (entry.parent != ~0u)
+		{
+			uint8_t parent_state = transform_states[entry.parent];
+			if (entry.flags & TRANSFORM_NODE_SKELETON_BIT)
+			{
+				visit = (parent_state & TRANSFORM_STATE_DIRTY_BIT) != 0;
+				parent_dirty = true;
+			}
+			else
+			{
+				visit = (parent_state & TRANSFORM_STATE_VISIT_CHILDREN_BIT) != 0;
+				parent_dirty = (parent_state & TRANSFORM_STATE_DIRTY_BIT) != 0;
+			}
+
+			if (parent_dirty)
+				parent_transform = &transform_parent_space[entry.parent];
+			else
+				parent_transform = &storage.get_cached_transform(transform_nodes[entry.parent].slot).world_transform;
+		}
+
+		if (!visit)
+		{
+			transform_states[i] = 0;
+			continue;
+		}
+
+		auto &flags = storage.get_flags(entry.slot);
+		bool transform_dirty = (flags & TransformStorage::TRANSFORM_DIRTY_BIT) != 0 || parent_dirty;
+		bool visit_children = (flags & TransformStorage::CHILD_TRANSFORM_DIRTY_BIT) != 0 || transform_dirty;
+		flags &= ~(TransformStorage::TRANSFORM_DIRTY_BIT | TransformStorage::CHILD_TRANSFORM_DIRTY_BIT);
+
+		if (transform_dirty)
+		{
+			auto &transform = storage.get_transform(entry.slot);
+			auto &world = transform_parent_space[i];
+			compute_model_transform(world, transform.scale, transform.rotation, transform.translation, *parent_transform);
 
-		// Apply the first transformation in the sequence, this is used for skinning.
-		node.cached_transform.world_transform = node.cached_transform.world_transform * node.initial_transform;
+			// Bones are applied with their inverse bind pose when the skin palettes are built.
+			if ((entry.flags & TRANSFORM_NODE_SKELETON_BIT) == 0)
+			{
+				auto &cached = storage.get_cached_transform(entry.slot);
+				cached.world_transform = world * storage.get_initial_transform(entry.slot);
+				compute_normal_transform(cached.normal_transform, cached.world_transform);
+			}
+
+			// Same as TransformStorage::mark_moved(), but the slot goes to a list owned by this task.
+			storage.get_timestamp(entry.slot)++;
+			if ((flags & TransformStorage::MOVED_BIT) == 0)
+			{
+				flags |= TransformStorage::MOVED_BIT;
+				moved.push_back(entry.slot);
+			}
+		}
 
-		compute_normal_transform(node.cached_transform.normal_transform, node.cached_transform.world_transform);
-		update_skinning(node);
-		node.update_timestamp();
+		transform_states[i] = uint8_t((transform_dirty ? TRANSFORM_STATE_DIRTY_BIT : 0) |
+		                              (visit_children ? TRANSFORM_STATE_VISIT_CHILDREN_BIT : 0));
 	}
 }
 
-void Scene::update_cached_transforms()
+void Scene::update_transform_hierarchy()
 {
-	if (root_node)
-		update_transform_tree(*root_node, mat4(1.0f), false);
+	if (transform_hierarchy_dirty || (root_node && root_node->get_and_clear_hierarchy_dirty()))
+		rebuild_transform_hierarchy();
 
-	for (auto &s : spatials)
+	// A level only depends on the one above it, so nodes within a level can be updated in any order.
+	size_t num_levels = transform_level_offsets.empty() ? 0 : transform_level_offsets.size() - 1;
+	for (size_t level = 0; level < num_levels; level++)
 	{
-		BoundedComponent *aabb;
-		CachedSpatialTransformComponent *cached_transform;
-		CachedSpatialTransformTimestampComponent *timestamp;
-		tie(aabb, cached_transform, timestamp) = s;
+		size_t begin = transform_level_offsets[level];
+		size_t end = transform_level_offsets[level + 1];
 
-		if (timestamp->last_timestamp != *timestamp->current_timestamp)
+		if (gather_group && end - begin >= 2 * gather_min_objects_per_task)
 		{
-			if (cached_transform->transform)
-			{
-				if (cached_transform->skin_transform)
-				{
-					// TODO: Isolate the AABB per bone.
-					cached_transform->world_aabb = AABB(vec3(FLT_MAX), vec3(-FLT_MAX));
-					for (auto &m : cached_transform->skin_transform->bone_world_transforms)
-						cached_transform->world_aabb.expand(aabb->aabb->transform(m));
-				}
-				else
-				{
-					cached_transform->world_aabb = aabb->aabb->transform(
-						cached_transform->transform->world_transform);
-				}
-			}
-			timestamp->last_timestamp = *timestamp->current_timestamp;
+			mutex lock;
+			gather_group->parallel_for(begin, end, gather_min_objects_per_task, [&](size_t first, size_t last) {
+				vector<uint32_t> moved;
+				update_transform_range(first, last, moved);
+				lock_guard<mutex> holder{lock};
+				auto &moved_slots = transform_storage->moved_slots;
+				moved_slots.insert(moved_slots.end(), moved.begin(), moved.end());
+			});
+		}
+		else
+			update_transform_range(begin, end, transform_storage->moved_slots);
+	}
+
+	// Bones live deeper in the hierarchy than the node they skin, so palettes are built once all levels are done.
+	// Bones only move along with their skinned node, so its state says whether the palette needs rebuilding.
+	transform_dirty_skins.clear();
+	size_t dirty_bones = 0;
+	for (size_t i = 0; i < transform_skins.size(); i++)
+	{
+		if (transform_states[transform_skins[i].index] & TRANSFORM_STATE_DIRTY_BIT)
+		{
+			transform_dirty_skins.push_back(uint32_t(i));
+			dirty_bones += transform_skins[i].num_bones;
 		}
 	}
 
+	if (gather_group && dirty_bones >= 2 * gather_min_objects_per_task)
+	{
+		// Split on bones rather than skins, so each task gets roughly gather_min_objects_per_task bones.
+		size_t skins_per_task = std::max<size_t>(1, gather_min_objects_per_task * transform_dirty_skins.size() / dirty_bones);
+		gather_group->parallel_for(0, transform_dirty_skins.size(), skins_per_task, [this](size_t first, size_t last) {
+			update_skin_range(first, last);
+		});
+	}
+	else
+		update_skin_range(0, transform_dirty_skins.size());
+}
+
+void Scene::update_skin_range(size_t begin, size_t end)
+{
+	for (size_t i = begin; i < end; i++)
+	{
+		auto &skin = transform_skins[transform_dirty_skins[i]];
+		auto &cached = skin.node->cached_skin_transform;
+		compute_skin_palette(cached.bone_world_transforms.data(), transform_parent_space.data(),
+		                     transform_skin_bones.data() + skin.first_bone,
+		                     transform_skin_inverse_bind.data() + skin.first_bone, skin.num_bones);
+		cached.invalidate_normal_transforms();
+	}
+}
+
+void Scene::update_cached_transforms()
+{
+	update_transform_hierarchy();
+
+	update_spatial_entries();
+
 	// Update camera transforms.
 	for (auto &c : cameras)
 	{
@@ -343,7 +1088,47 @@ void Scene::update_cached_transforms()
 
 Scene::NodeHandle Scene::create_node()
 {
-	return Util::make_handle<Node>();
+	return Util::make_handle<Node>(transform_storage, transform_storage->allocate_slot());
+}
+
+uint32_t Scene::TransformStorage::allocate_slot()
+{
+	if (vacants.empty())
+	{
+		chunks.emplace_back(new Chunk);
+
+		// Hand out slots in ascending order so nodes created in sequence are laid out in sequence.
+		uint32_t base = uint32_t(chunks.size() - 1) * ChunkSize;
+		for (uint32_t i = ChunkSize; i; i--)
+			vacants.push_back(base + i - 1);
+	}
+
+	uint32_t slot = vacants.back();
+	vacants.pop_back();
+
+	get_transform(slot) = {};
+	get_initial_transform(slot) = mat4(1.0f);
+	get_timestamp(slot) = 0;
+	get_flags(slot) = TRANSFORM_DIRTY_BIT | CHILD_TRANSFORM_DIRTY_BIT;
+	return slot;
+}
+
+void Scene::TransformStorage::free_slot(uint32_t slot)
+{
+	vacants.push_back(slot);
+}
+
+Scene::Node::Node(Util::IntrusivePtr<TransformStorage> storage_, uint32_t slot_)
+	: transform(storage_->get_transform(slot_)),
+	  cached_transform(storage_->get_cached_transform(slot_)),
+	  initial_transform(storage_->get_initial_transform(slot_)),
+	  storage(move(storage_)), slot(slot_)
+{
+}
+
+Scene::Node::~Node()
+{
+	storage->free_slot(slot);
 }
 
 static void add_bone(Scene::NodeHandle *bones, uint32_t parent, const SceneFormats::Skin::Bone &bone)
@@ -370,16 +1155,11 @@ Scene::NodeHandle Scene::create_skinned_node(const SceneFormats::Skin &skin)
 	}
 
 	node->cached_skin_transform.bone_world_transforms.resize(skin.joint_transforms.size());
-	node->cached_skin_transform.bone_normal_transforms.resize(skin.joint_transforms.size());
 
 	auto &node_skin = node->get_skin();
-	node_skin.cached_skin.reserve(skin.joint_transforms.size());
 	node_skin.skin.reserve(skin.joint_transforms.size());
 	for (size_t i = 0; i < skin.joint_transforms.size(); i++)
-	{
 		node_skin.skin.push_back(&bones[i]->transform);
-		node_skin.cached_skin.push_back(&bones[i]->cached_transform);
-	}
 
 	for (auto &skeleton : skin.skeletons)
 	{
@@ -397,9 +1177,10 @@ void Scene::Node::add_child(NodeHandle node)
 	assert(this != node.get());
 	assert(node->parent == nullptr);
 	node->parent = this;
+	invalidate_hierarchy();
 
 	// Force parents to be notified.
-	node->cached_transform_dirty = false;
+	node->get_and_clear_transform_dirty();
 	node->invalidate_cached_transform();
 	children.push_back(node);
 }
@@ -408,9 +1189,10 @@ void Scene::Node::remove_child(Node &node)
 {
 	assert(node.parent == this);
 	node.parent = nullptr;
+	invalidate_hierarchy();
 
 	// Force parents to be notified.
-	node.cached_transform_dirty = false;
+	node.get_and_clear_transform_dirty();
 	node.invalidate_cached_transform();
 
 	auto itr = remove_if(begin(children), end(children), [&](const NodeHandle &h) {
@@ -420,13 +1202,25 @@ void Scene::Node::remove_child(Node &node)
 	children.erase(itr, end(children));
 }
 
+void Scene::Node::invalidate_hierarchy()
+{
+	for (auto *p = this; p && !p->hierarchy_dirty; p = p->parent)
+		p->hierarchy_dirty = true;
+}
+
 void Scene::Node::invalidate_cached_transform()
 {
-	if (!cached_transform_dirty)
+	auto &flags = storage->get_flags(slot);
+	if ((flags & TransformStorage::TRANSFORM_DIRTY_BIT) == 0)
 	{
-		cached_transform_dirty = true;
-		for (auto *p = parent; p && !p->any_child_transform_dirty; p = p->parent)
-			p->any_child_transform_dirty = true;
+		flags |= TransformStorage::TRANSFORM_DIRTY_BIT;
+		for (auto *p = parent; p; p = p->parent)
+		{
+			auto &parent_flags = p->storage->get_flags(p->slot);
+			if (parent_flags & TransformStorage::CHILD_TRANSFORM_DIRTY_BIT)
+				break;
+			parent_flags |= TransformStorage::CHILD_TRANSFORM_DIRTY_BIT;
+		}
 	}
 }
 
@@ -499,56 +1293,63 @@ EntityHandle Scene::create_light(const SceneFormats::LightInfo &light, Node *nod
 
 EntityHandle Scene::create_renderable(AbstractRenderableHandle renderable, Node *node)
 {
-	EntityHandle entity = pool.create_entity();
-	nodes.push_back(entity);
+	// Renderables only come in a few shapes, so store each shape as an archetype.
+	// This keeps the components the gather functions iterate over packed together.
+	bool transparent = renderable->get_mesh_draw_pipeline() == DrawPipeline::AlphaBlend;
+	EntityHandle entity;
 
 	if (renderable->has_static_aabb())
 	{
-		auto *transform = entity->allocate_component<CachedSpatialTransformComponent>();
-		auto *timestamp = entity->allocate_component<CachedSpatialTransformTimestampComponent>();
+		if (transparent)
+		{
+			entity = pool.create_archetype_entity<CachedSpatialTransformComponent,
+			                                      CachedSpatialTransformTimestampComponent,
+			                                      BoundedComponent,
+			                                      RenderableComponent,
+			                                      TransparentComponent>();
+		}
+		else
+		{
+			// TODO: Find a way to make this smarter.
+			entity = pool.create_archetype_entity<CachedSpatialTransformComponent,
+			                                      CachedSpatialTransformTimestampComponent,
+			                                      BoundedComponent,
+			                                      RenderableComponent,
+			                                      OpaqueComponent,
+			                                      CastsStaticShadowComponent,
+			                                      CastsDynamicShadowComponent>();
+		}
+
+		auto *transform = entity->get_component<CachedSpatialTransformComponent>();
+		auto *timestamp = entity->get_component<CachedSpatialTransformTimestampComponent>();
 		if (node)
 		{
 			transform->transform = &node->cached_transform;
 			timestamp->current_timestamp = node->get_timestamp_pointer();
 
-			if (!node->get_skin().cached_skin.empty())
+			if (!node->get_skin().skin.empty())
 				transform->skin_transform = &node->cached_skin_transform;
 		}
-		auto *bounded = entity->allocate_component<BoundedComponent>();
-		bounded->aabb = renderable->get_static_aabb();
+		entity->get_component<BoundedComponent>()->aabb = renderable->get_static_aabb();
 	}
+	else if (transparent)
+		entity = pool.create_archetype_entity<UnboundedComponent, RenderableComponent, TransparentComponent>();
 	else
-		entity->allocate_component<UnboundedComponent>();
+		entity = pool.create_archetype_entity<UnboundedComponent, RenderableComponent, OpaqueComponent>();
 
-	auto *render = entity->allocate_component<RenderableComponent>();
-
-	switch (renderable->get_mesh_draw_pipeline())
-	{
-	case DrawPipeline::AlphaBlend:
-		entity->allocate_component<TransparentComponent>();
-		break;
-
-	default:
-		entity->allocate_component<OpaqueComponent>();
-		if (renderable->has_static_aabb())
-		{
-			// TODO: Find a way to make this smarter.
-			entity->allocate_component<CastsStaticShadowComponent>();
-			entity->allocate_component<CastsDynamicShadowComponent>();
-		}
-		break;
-	}
-
-	render->renderable = renderable;
+	nodes.push_back(entity);
+	entity->get_component<RenderableComponent>()->renderable = renderable;
 	return entity;
 }
 
 void Scene::remove_entities_with_component(uint32_t id)
 {
-	auto itr = remove_if(begin(nodes), end(nodes), [id](const EntityHandle &entity) {
-		return entity->has_component(id);
+	auto itr = stable_partition(begin(nodes), end(nodes), [id](const EntityHandle &entity) {
+		return !entity->has_component(id);
 	});
 
+	size_t keep = size_t(itr - begin(nodes));
+	pool.destroy_entities(nodes.data() + keep, nodes.size() - keep);
 	nodes.erase(itr, end(nodes));
 }
 
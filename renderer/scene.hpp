@@ -25,7 +25,9 @@
 #include "ecs.hpp"
 #include "render_components.hpp"
 #include "frustum.hpp"
+#include "bvh.hpp"
 #include <tuple>
+#include <unordered_map>
 #include "scene_formats.hpp"
 
 namespace Granite
@@ -38,6 +40,7 @@ struct RenderableInfo
 using VisibilityList = std::vector<RenderableInfo>;
 
 class RenderContext;
+class ThreadGroup;
 struct EnvironmentComponent;
 
 class Scene
@@ -57,6 +60,39 @@ public:
 	                                      unsigned max_point_lights = std::numeric_limits<unsigned>::max());
 	void gather_visible_render_pass_sinks(const vec3 &camera_pos, VisibilityList &list);
 	void gather_unbounded_renderables(VisibilityList &list);
+
+	enum SpatialQueryFlagBits
+	{
+		SPATIAL_QUERY_OPAQUE_BIT = 1 << 0,
+		SPATIAL_QUERY_TRANSPARENT_BIT = 1 << 1,
+		SPATIAL_QUERY_STATIC_SHADOW_BIT = 1 << 2,
+		SPATIAL_QUERY_DYNAMIC_SHADOW_BIT = 1 << 3,
+		SPATIAL_QUERY_POSITIONAL_LIGHT_BIT = 1 << 4
+	};
+	using SpatialQueryFlags = uint32_t;
+
+	// Appends every renderable in the selected groups whose world AABB intersects the volume, once each.
+	// Frustum queries accept the same objects as Frustum::intersects_fast(), but in no particular order.
+	// Objects without a transform are always appended, as the gather functions do.
+	// Objects only show up after the first update_cached_transforms() which sees them.
+	void query_spatials(const Frustum &frustum, SpatialQueryFlags flags, VisibilityList &list);
+	void query_spatials(const vec3 &center, float radius, SpatialQueryFlags flags, VisibilityList &list);
+	void query_spatials(const AABB &aabb, SpatialQueryFlags flags, VisibilityList &list);
+
+	// Moves every bounded object into a tree built top-down in one go, which is never refit.
+	// Objects which move afterwards drop out of it and go back to the dynamic tree on the next
+	// update_cached_transforms(), so calling this on a partially animated scene is fine.
+	// Call it once the scene is loaded and its transforms are updated.
+	void rebuild_static_spatial_tree();
+
+	// The gather functions cull through the bounding volume hierarchies by default.
+	// With the trees disabled, they scan the component groups instead, which set_parallel_gather() can split up.
+	void set_spatial_tree_culling(bool enable);
+
+	// Splits frustum culling of large component groups, and transform updates of wide levels of the node hierarchy,
+	// over the workers of group. Lists end up identical to, and in the same order as, the serial path.
+	// Anything with fewer than 2 * min_objects_per_task objects is still processed serially. Pass nullptr to disable.
+	void set_parallel_gather(ThreadGroup *group, size_t min_objects_per_task = 1024);
 	EnvironmentComponent *get_environment() const;
 	EntityPool &get_entity_pool();
 
@@ -65,11 +101,100 @@ public:
 	void set_render_pass_data(Renderer *forward_renderer, Renderer *deferred_renderer, Renderer *depth_renderer, const RenderContext *context);
 	void bind_render_graph_resources(RenderGraph &graph);
 
+	// Transforms and hierarchy update state of every node created by a scene, one array per member,
+	// allocated in chunks which never move. Nodes refer to their entries, so components and skins can keep
+	// pointing at them, while the hierarchy update reads and writes the arrays without going through Node.
+	class TransformStorage : public Util::IntrusivePtrEnabled<TransformStorage>
+	{
+	public:
+		enum FlagBits
+		{
+			TRANSFORM_DIRTY_BIT = 1 << 0,
+			CHILD_TRANSFORM_DIRTY_BIT = 1 << 1,
+			// Set while the slot is in moved_slots, so it is queued once per update however often it moves.
+			MOVED_BIT = 1 << 2
+		};
+
+		uint32_t allocate_slot();
+		void free_slot(uint32_t slot);
+
+		// Bumps the timestamp, and queues the slot for the next spatial refresh.
+		void mark_moved(uint32_t slot)
+		{
+			get_timestamp(slot)++;
+			auto &flags = get_flags(slot);
+			if ((flags & MOVED_BIT) == 0)
+			{
+				flags |= MOVED_BIT;
+				moved_slots.push_back(slot);
+			}
+		}
+
+		// Slots whose timestamp changed since the last update_cached_transforms().
+		std::vector<uint32_t> moved_slots;
+
+		Transform &get_transform(uint32_t slot)
+		{
+			return get_chunk(slot).transforms[slot % ChunkSize];
+		}
+
+		CachedTransform &get_cached_transform(uint32_t slot)
+		{
+			return get_chunk(slot).cached_transforms[slot % ChunkSize];
+		}
+
+		mat4 &get_initial_transform(uint32_t slot)
+		{
+			return get_chunk(slot).initial_transforms[slot % ChunkSize];
+		}
+
+		uint32_t &get_timestamp(uint32_t slot)
+		{
+			return get_chunk(slot).timestamps[slot % ChunkSize];
+		}
+
+		const uint32_t &get_timestamp(uint32_t slot) const
+		{
+			return get_chunk(slot).timestamps[slot % ChunkSize];
+		}
+
+		uint8_t &get_flags(uint32_t slot)
+		{
+			return get_chunk(slot).flags[slot % ChunkSize];
+		}
+
+	private:
+		enum { ChunkSize = 256 };
+
+		struct Chunk
+		{
+			Transform transforms[ChunkSize];
+			CachedTransform cached_transforms[ChunkSize];
+			mat4 initial_transforms[ChunkSize];
+			uint32_t timestamps[ChunkSize];
+			uint8_t flags[ChunkSize];
+		};
+
+		std::vector<std::unique_ptr<Chunk>> chunks;
+		std::vector<uint32_t> vacants;
+
+		Chunk &get_chunk(uint32_t slot) const
+		{
+			return *chunks[slot / ChunkSize];
+		}
+	};
+
 	class Node : public Util::IntrusivePtrEnabled<Node>
 	{
 	public:
-		Transform transform;
-		CachedTransform cached_transform;
+		// Nodes are created with Scene::create_node(), which hands out a slot in the scene's TransformStorage.
+		Node(Util::IntrusivePtr<TransformStorage> storage, uint32_t slot);
+		~Node();
+
+		// These refer into the scene's TransformStorage, and stay at the same address for the lifetime of the node.
+		Transform &transform;
+		CachedTransform &cached_transform;
+		mat4 &initial_transform;
 		CachedSkinTransform cached_skin_transform;
 
 		void invalidate_cached_transform();
@@ -101,10 +226,11 @@ public:
 			return parent;
 		}
 
+		// Bones only track their local transforms. Their world transforms end up in the
+		// cached_skin_transform palette of the skinned node, not in their own cached_transform.
 		struct Skinning
 		{
 			std::vector<Transform *> skin;
-			std::vector<CachedTransform *> cached_skin;
 			Util::Hash skin_compat = 0;
 		};
 
@@ -115,39 +241,63 @@ public:
 
 		inline bool get_and_clear_child_transform_dirty()
 		{
-			auto ret = any_child_transform_dirty;
-			any_child_transform_dirty = false;
-			return ret;
+			return get_and_clear_flag(TransformStorage::CHILD_TRANSFORM_DIRTY_BIT);
 		}
 
 		inline bool get_and_clear_transform_dirty()
 		{
-			auto ret = cached_transform_dirty;
-			cached_transform_dirty = false;
-			return ret;
+			return get_and_clear_flag(TransformStorage::TRANSFORM_DIRTY_BIT);
 		}
 
-		mat4 initial_transform = mat4(1.0f);
+		// Set on a node and all its ancestors when children are attached to or detached from it.
+		inline bool get_and_clear_hierarchy_dirty()
+		{
+			auto ret = hierarchy_dirty;
+			hierarchy_dirty = false;
+			return ret;
+		}
 
+		// Queues entities bound to this node for a bounds refresh in the next update_cached_transforms().
+		// Only needed when cached_transform is written directly, the hierarchy update calls it for moved nodes.
 		void update_timestamp()
 		{
-			timestamp++;
+			storage->mark_moved(slot);
 		}
 
 		const uint32_t *get_timestamp_pointer() const
 		{
-			return &timestamp;
+			return &storage->get_timestamp(slot);
+		}
+
+		const TransformStorage *get_transform_storage() const
+		{
+			return storage.get();
+		}
+
+		uint32_t get_transform_slot() const
+		{
+			return slot;
 		}
 
 	private:
+		Util::IntrusivePtr<TransformStorage> storage;
+		uint32_t slot;
+
 		std::vector<Util::IntrusivePtr<Node>> children;
 		std::vector<Util::IntrusivePtr<Node>> skeletons;
 		Skinning skinning;
 		Node *parent = nullptr;
+		bool hierarchy_dirty = true;
+
+		void invalidate_hierarchy();
 
-		bool any_child_transform_dirty = true;
-		bool cached_transform_dirty = true;
-		uint32_t timestamp = 0;
+		bool get_and_clear_flag(uint8_t flag)
+		{
+			auto &flags = storage->get_flags(slot);
+			bool ret = (flags & flag) != 0;
+			flags &= ~flag;
+			return ret;
+		}
 	};
 	using NodeHandle = Util::IntrusivePtr<Node>;
 	NodeHandle create_node();
@@ -156,6 +306,7 @@ public:
 	void set_root_node(NodeHandle node)
 	{
 		root_node = node;
+		transform_hierarchy_dirty = true;
 	}
 
 	NodeHandle get_root_node() const
@@ -178,7 +329,6 @@ public:
 private:
 	EntityPool pool;
 	NodeHandle root_node;
-	std::vector<std::tuple<BoundedComponent*, CachedSpatialTransformComponent*, CachedSpatialTransformTimestampComponent *>> &spatials;
 	std::vector<std::tuple<CachedSpatialTransformComponent*, RenderableComponent*, OpaqueComponent*>> &opaque;
 	std::vector<std::tuple<CachedSpatialTransformComponent*, RenderableComponent*, TransparentComponent*>> &transparent;
 	std::vector<std::tuple<CachedSpatialTransformComponent*, RenderableComponent*, PositionalLightComponent*>> &positional_lights;
@@ -195,8 +345,130 @@ private:
 	std::vector<std::tuple<RenderPassSinkComponent*, RenderableComponent*, CullPlaneComponent*>> &render_pass_sinks;
 	std::vector<std::tuple<RenderPassComponent*>> &render_pass_creators;
 	std::vector<EntityHandle> nodes;
-	void update_transform_tree(Node &node, const mat4 &transform, bool parent_is_dirty);
+	ThreadGroup *gather_group = nullptr;
+	size_t gather_min_objects_per_task = 1024;
+
+	// Set on spatial entries of entities which are in the bounded spatials group.
+	enum { SPATIAL_BOUNDED_BIT = 1u << 31 };
+
+	// One per CachedSpatialTransformComponent which is in any of the groups the trees serve.
+	// Entries are kept in sync by group listeners, and moved in and out of the trees by update_cached_transforms().
+	struct SpatialEntry
+	{
+		CachedSpatialTransformComponent *transform = nullptr;
+		CachedSpatialTransformTimestampComponent *timestamp = nullptr;
+		const BoundedComponent *bounded = nullptr;
+		RenderableComponent *renderable = nullptr;
+		uint32_t flags = 0;
+		uint32_t leaf = BVH::Invalid;
+		// Position in unindexed_spatials, if the entry is in there.
+		uint32_t unindexed_slot = ~0u;
+		// Entries sharing a node timestamp are chained from spatial_timestamp_heads.
+		const uint32_t *tracked_timestamp = nullptr;
+		uint32_t next_with_timestamp = ~0u;
+		bool is_static = false;
+		bool pending = false;
+	};
+
+	// What queries need of an entry in a tree, packed so visiting a leaf touches a single cache line.
+	// The renderable is captured when the entry is inserted, and the bounding sphere whenever it moves.
+	struct SpatialCullInfo
+	{
+		vec4 sphere;
+		AbstractRenderable *renderable;
+		CachedSpatialTransformComponent *transform;
+	};
+
+	class SpatialGroupListener : public EntityGroupListener
+	{
+	public:
+		void init(Scene *scene, uint32_t flag);
+		void on_entity_added(Entity &entity) override;
+		void on_entity_removed(Entity &entity) override;
+
+	private:
+		Scene *scene = nullptr;
+		uint32_t flag = 0;
+	};
+
+	SpatialGroupListener spatial_listeners[6];
+	std::vector<SpatialEntry> spatial_entries;
+	std::vector<SpatialCullInfo> spatial_cull_info;
+	std::vector<uint32_t> spatial_free_list;
+	std::unordered_map<const CachedSpatialTransformComponent *, uint32_t> spatial_lookup;
+	// Entries which are in no tree, because they have no transform or no usable bounds. Tested linearly.
+	std::vector<uint32_t> unindexed_spatials;
+	// Entries to look at in the next update_spatial_entries(), because they are new, changed or moved.
+	std::vector<uint32_t> pending_spatials;
+	std::unordered_map<const uint32_t *, uint32_t> spatial_timestamp_heads;
+	BVH dynamic_tree;
+	BVH static_tree;
+	bool spatial_tree_culling = true;
+
+	void add_spatial_flag(Entity &entity, uint32_t flag);
+	void remove_spatial_flag(Entity &entity, uint32_t flag);
+	void remove_spatial_leaf(SpatialEntry &entry);
+	void insert_spatial_leaf(uint32_t index, const AABB &bounds);
+	void queue_spatial(uint32_t index);
+	void track_spatial_timestamp(uint32_t index);
+	void untrack_spatial_timestamp(uint32_t index);
+	void set_spatial_unindexed(uint32_t index, bool unindexed);
+	void update_spatial_entry(uint32_t index);
+	void update_spatial_entries();
+
+	template <typename Query, typename Test>
+	void query_spatial_trees(const Query &query, const Test &test, SpatialQueryFlags flags, VisibilityList &list);
+
+	template <typename T>
+	void gather_visible_renderables(const Frustum &frustum, VisibilityList &list, const T &objects);
+
+	Util::IntrusivePtr<TransformStorage> transform_storage;
+
+	// The node hierarchy flattened into breadth-first levels, so each level can be updated in parallel.
+	// Rebuilt whenever nodes are attached or detached. Entries refer to nodes by their TransformStorage slot.
+	enum TransformNodeFlagBits
+	{
+		TRANSFORM_NODE_SKELETON_BIT = 1 << 0
+	};
+
+	enum TransformStateFlagBits
+	{
+		TRANSFORM_STATE_DIRTY_BIT = 1 << 0,
+		TRANSFORM_STATE_VISIT_CHILDREN_BIT = 1 << 1
+	};
+
+	struct TransformNode
+	{
+		uint32_t slot;
+		uint32_t parent;
+		uint32_t flags;
+	};
+	std::vector<TransformNode> transform_nodes;
+	std::vector<Node *> transform_rebuild_nodes;
+	// World transforms before Node::initial_transform is applied, which is what children are composed with.
+	// One extra identity entry at the end stands in for bones which are not part of the hierarchy.
+	std::vector<mat4> transform_parent_space;
+	std::vector<uint8_t> transform_states;
+	std::vector<uint32_t> transform_level_offsets;
+
+	// Bone indices into transform_nodes and inverse bind poses, packed per skin in joint order.
+	// The inverse bind poses are the bones' Node::initial_transform at the time the hierarchy was rebuilt.
+	struct TransformSkin
+	{
+		Node *node;
+		uint32_t index;
+		uint32_t first_bone;
+		uint32_t num_bones;
+	};
+	std::vector<TransformSkin> transform_skins;
+	std::vector<uint32_t> transform_skin_bones;
+	std::vector<mat4> transform_skin_inverse_bind;
+	std::vector<uint32_t> transform_dirty_skins;
+	bool transform_hierarchy_dirty = true;
 
-	void update_skinning(Node &node);
+	void rebuild_transform_hierarchy();
+	void update_transform_range(size_t begin, size_t end, std::vector<uint32_t> &moved);
+	void update_skin_range(size_t begin, size_t end);
+	void update_transform_hierarchy();
 };
 }
\ No newline at end of file
@@ -45,6 +45,21 @@ unique_ptr<AnimationSystem> SceneLoader::consume_animation_system()
 	return move(animation_system);
 }
 
+void SceneLoader::set_animation_compression(const SceneFormats::AnimationCompressionOptions *options)
+{
+	compress_animations = options != nullptr;
+	if (options)
+		animation_compression = *options;
+}
+
+void SceneLoader::register_animation(const std::string &name, const SceneFormats::Animation &animation)
+{
+	if (compress_animations)
+		animation_system->register_animation(name, SceneFormats::CompressedAnimation(animation, animation_compression));
+	else
+		animation_system->register_animation(name, animation);
+}
+
 void SceneLoader::load_scene(const std::string &path)
 {
 	animation_system.reset(new AnimationSystem);
@@ -87,7 +102,7 @@ Scene::NodeHandle SceneLoader::build_tree_for_subscene(const SubsceneData &subsc
 				{
 					if (animation.skin_compat == skin_compat)
 					{
-						animation_system->register_animation(animation.name, animation);
+						register_animation(animation.name, animation);
 						animation_system->start_animation(*nodeptr, animation.name, 0.0, true);
 					}
 				}
@@ -111,7 +126,7 @@ Scene::NodeHandle SceneLoader::build_tree_for_subscene(const SubsceneData &subsc
 	{
 		if (!animation.skinning)
 		{
-			animation_system->register_animation(animation.name, animation);
+			register_animation(animation.name, animation);
 			animation_system->start_animation(nodes.data(), animation.name, 0.0, true);
 		}
 	}
@@ -490,7 +505,7 @@ void SceneLoader::parse_scene_format(const std::string &path, const std::string
 			auto ident = to_string(index);
 
 			if (!track.channels.empty())
-				animation_system->register_animation(ident, track);
+				register_animation(ident, track);
 
 			bool per_instance = false;
 			if (animation.HasMember("perInstance"))
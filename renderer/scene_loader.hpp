@@ -43,6 +43,10 @@ public:
 
 	std::unique_ptr<AnimationSystem> consume_animation_system();
 
+	// Animations of scenes loaded afterwards are registered as CompressedAnimation with these options,
+	// and decoded a chunk at a time while they play. Pass nullptr to keep them uncompressed, which is the default.
+	void set_animation_compression(const SceneFormats::AnimationCompressionOptions *options);
+
 private:
 	struct SubsceneData
 	{
@@ -53,6 +57,10 @@ private:
 
 	std::unique_ptr<Scene> scene;
 	std::unique_ptr<AnimationSystem> animation_system;
+	SceneFormats::AnimationCompressionOptions animation_compression;
+	bool compress_animations = false;
+
+	void register_animation(const std::string &name, const SceneFormats::Animation &animation);
 	void parse_scene_format(const std::string &path, const std::string &json);
 	void parse_gltf(const std::string &path);
 
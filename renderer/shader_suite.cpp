@@ -33,7 +33,7 @@ void ShaderSuite::init_graphics(ShaderManager *manager, const std::string &verte
 {
 	this->manager = manager;
 	program = manager->register_graphics(vertex, fragment);
-	variants.get_hashmap().clear();
+	variants.clear();
 	base_defines.clear();
 }
 
@@ -41,7 +41,7 @@ void ShaderSuite::init_compute(Vulkan::ShaderManager *manager, const std::string
 {
 	this->manager = manager;
 	program = manager->register_compute(compute);
-	variants.get_hashmap().clear();
+	variants.clear();
 	base_defines.clear();
 }
 
@@ -0,0 +1,494 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "animation_compression.hpp"
+#include "hashmap.hpp"
+#include <cmath>
+#include <float.h>
+#include <string.h>
+
+using namespace Util;
+using namespace std;
+
+namespace Granite
+{
+namespace SceneFormats
+{
+// Longest run of keys tested for removal in one go, which bounds the cost on long, smoothly moving channels.
+static const size_t MaxReducedRun = 1024;
+
+template <typename Interpolate, typename Error>
+static vector<size_t> select_keys(const vector<float> &timestamps, float max_error,
+                                  const Interpolate &interpolate, const Error &error)
+{
+	vector<size_t> kept;
+	size_t count = timestamps.size();
+	if (count == 0)
+		return kept;
+
+	kept.push_back(0);
+	if (count == 1)
+		return kept;
+
+	// Extend the segment from the last kept key for as long as every key inside it can be interpolated.
+	size_t anchor = 0;
+	for (size_t candidate = 2; candidate < count; candidate++)
+	{
+		bool representable = candidate - anchor <= MaxReducedRun;
+		float span = timestamps[candidate] - timestamps[anchor];
+		for (size_t i = anchor + 1; representable && i < candidate; i++)
+		{
+			float phase = span > 0.0f ? (timestamps[i] - timestamps[anchor]) / span : 0.0f;
+			representable = error(interpolate(anchor, candidate, phase), i) <= max_error;
+		}
+
+		if (!representable)
+		{
+			anchor = candidate - 1;
+			kept.push_back(anchor);
+		}
+	}
+	kept.push_back(count - 1);
+
+	// A channel which never moves only needs a single key.
+	if (kept.size() == 2 && error(interpolate(0, 0, 0.0f), count - 1) <= max_error)
+	{
+		bool constant = true;
+		for (size_t i = 1; constant && i < count; i++)
+			constant = error(interpolate(0, 0, 0.0f), i) <= max_error;
+		if (constant)
+			kept.pop_back();
+	}
+
+	return kept;
+}
+
+template <typename T>
+static void keep_keys(vector<T> &values, const vector<size_t> &kept)
+{
+	for (size_t i = 0; i < kept.size(); i++)
+		values[i] = values[kept[i]];
+	values.resize(kept.size());
+}
+
+static float quat_angle(const quat &a, const quat &b)
+{
+	// slerp() falls back to an unnormalized lerp for close rotations, so only compare orientations.
+	// acos() of the dot product cannot resolve small angles in single precision, the chord length can.
+	vec4 x = normalize(a.as_vec4());
+	vec4 y = normalize(b.as_vec4());
+	if (dot(x, y) < 0.0f)
+		y = -y;
+	return 4.0f * std::asin(std::min(0.5f * length(x - y), 1.0f));
+}
+
+static float max_component_error(const vec3 &a, const vec3 &b)
+{
+	vec3 d = abs(a - b);
+	return std::max(std::max(d.x, d.y), d.z);
+}
+
+// Keys are interpolated from the values which end up stored, but measured against the source values,
+// so the error introduced by storing the kept keys is part of the budget.
+static vector<size_t> select_linear_keys(const vector<float> &timestamps, const vector<vec3> &source,
+                                         const vector<vec3> &stored, float max_error)
+{
+	return select_keys(timestamps, max_error,
+	                   [&](size_t a, size_t b, float phase) { return mix(stored[a], stored[b], phase); },
+	                   [&](const vec3 &v, size_t i) { return max_component_error(v, source[i]); });
+}
+
+static vector<size_t> select_rotation_keys(const vector<float> &timestamps, const vector<quat> &source,
+                                           const vector<quat> &stored, float max_error)
+{
+	return select_keys(timestamps, max_error,
+	                   [&](size_t a, size_t b, float phase) { return slerp(stored[a], stored[b], phase); },
+	                   [&](const quat &q, size_t i) { return quat_angle(q, source[i]); });
+}
+
+static float get_linear_error(AnimationChannel::Type type, const AnimationCompressionOptions &options)
+{
+	return type == AnimationChannel::Type::Translation ? options.translation_error : options.scale_error;
+}
+
+void reduce_animation_keys(Animation &animation, const AnimationCompressionOptions &options, bool snorm16_rotations)
+{
+	for (auto &channel : animation.channels)
+	{
+		vector<size_t> kept;
+		switch (channel.type)
+		{
+		case AnimationChannel::Type::Translation:
+		case AnimationChannel::Type::Scale:
+			kept = select_linear_keys(channel.timestamps, channel.linear.values, channel.linear.values,
+			                          get_linear_error(channel.type, options));
+			break;
+
+		case AnimationChannel::Type::Rotation:
+		{
+			auto &values = channel.spherical.values;
+			vector<quat> stored;
+			if (snorm16_rotations)
+			{
+				stored.resize(values.size());
+				for (size_t i = 0; i < values.size(); i++)
+				{
+					uint16_t encoded[4];
+					quantize_rotation(values[i], encoded);
+					stored[i] = dequantize_rotation(encoded);
+				}
+			}
+			kept = select_rotation_keys(channel.timestamps, values, snorm16_rotations ? stored : values,
+			                            options.rotation_error);
+			break;
+		}
+
+		default:
+			continue;
+		}
+
+		if (kept.size() == channel.timestamps.size())
+			continue;
+
+		keep_keys(channel.timestamps, kept);
+		if (channel.type == AnimationChannel::Type::Rotation)
+			keep_keys(channel.spherical.values, kept);
+		else
+			keep_keys(channel.linear.values, kept);
+	}
+}
+
+static uint16_t quantize_unorm16(float v, float base, float extent)
+{
+	if (extent <= 0.0f)
+		return 0;
+	float n = std::round((v - base) / extent * 65535.0f);
+	return uint16_t(std::min(std::max(n, 0.0f), 65535.0f));
+}
+
+static uint16_t quantize_snorm16(float v)
+{
+	float n = std::round(std::min(std::max(v, -1.0f), 1.0f) * 32767.0f);
+	return uint16_t(int16_t(n));
+}
+
+static float dequantize_snorm16(uint16_t v)
+{
+	return std::max(float(int16_t(v)) / 32767.0f, -1.0f);
+}
+
+// Shared between the encoder and decode_channel(), so keys are selected against exactly what is decoded.
+static vec3 dequantize_linear(const uint16_t *data, const vec3 &base, const vec3 &scale)
+{
+	return base + scale * vec3(float(data[0]), float(data[1]), float(data[2]));
+}
+
+quat dequantize_rotation(const uint16_t *data)
+{
+	vec4 q(dequantize_snorm16(data[0]), dequantize_snorm16(data[1]),
+	       dequantize_snorm16(data[2]), dequantize_snorm16(data[3]));
+	return quat(normalize(q));
+}
+
+void quantize_rotation(const quat &q, uint16_t *data)
+{
+	for (unsigned c = 0; c < 4; c++)
+		data[c] = quantize_snorm16(q.as_vec4()[c]);
+}
+
+CompressedAnimation::CompressedAnimation(const Animation &animation, const AnimationCompressionOptions &options)
+	: name(animation.name), length(animation.length), chunk_duration(options.chunk_duration),
+	  skin_compat(animation.skin_compat), skinning(animation.skinning)
+{
+	HashMap<uint32_t> timeline_hash;
+	channels.reserve(animation.channels.size());
+
+	vector<size_t> kept;
+	vector<uint16_t> encoded;
+	vector<vec3> linear_values;
+	vector<quat> spherical_values;
+	vector<float> timestamps;
+
+	for (auto &input : animation.channels)
+	{
+		Channel channel = {};
+		channel.node_index = input.node_index;
+		channel.joint_index = input.joint_index;
+		channel.joint = input.joint;
+		channel.type = input.type;
+
+		size_t count = input.timestamps.size();
+		kept.clear();
+		encoded.clear();
+
+		switch (input.type)
+		{
+		case AnimationChannel::Type::Translation:
+		case AnimationChannel::Type::Scale:
+		{
+			auto &values = input.linear.values;
+			float max_error = get_linear_error(input.type, options);
+
+			vec3 lo(FLT_MAX), hi(-FLT_MAX);
+			for (auto &v : values)
+			{
+				lo = min(lo, v);
+				hi = max(hi, v);
+			}
+
+			vec3 extent = hi - lo;
+			channel.range_base = lo;
+			channel.range_scale = extent / 65535.0f;
+
+			// Quantize every source key up front. If a step of the range is too coarse for the error limit,
+			// no choice of keys can help, and the channel is stored at full precision instead.
+			linear_values.resize(count);
+			for (size_t i = 0; i < count; i++)
+			{
+				for (unsigned c = 0; c < 3; c++)
+					encoded.push_back(quantize_unorm16(values[i][c], lo[c], extent[c]));
+				linear_values[i] = dequantize_linear(&encoded[3 * i], channel.range_base, channel.range_scale);
+				if (max_component_error(linear_values[i], values[i]) > max_error)
+					channel.full_precision = true;
+			}
+
+			kept = select_linear_keys(input.timestamps, values,
+			                          channel.full_precision ? values : linear_values, max_error);
+
+			if (channel.full_precision)
+			{
+				channel.offset = uint32_t(float_values.size());
+				for (auto i : kept)
+					float_values.insert(end(float_values), values[i].data, values[i].data + 3);
+			}
+			else
+			{
+				channel.offset = uint32_t(quantized.size());
+				for (auto i : kept)
+					quantized.insert(end(quantized), &encoded[3 * i], &encoded[3 * i] + 3);
+			}
+			break;
+		}
+
+		case AnimationChannel::Type::Rotation:
+		{
+			auto &values = input.spherical.values;
+			spherical_values.resize(count);
+			for (size_t i = 0; i < count; i++)
+			{
+				for (unsigned c = 0; c < 4; c++)
+					encoded.push_back(quantize_snorm16(values[i].as_vec4()[c]));
+				spherical_values[i] = dequantize_rotation(&encoded[4 * i]);
+				if (quat_angle(spherical_values[i], values[i]) > options.rotation_error)
+					channel.full_precision = true;
+			}
+
+			kept = select_rotation_keys(input.timestamps, values,
+			                            channel.full_precision ? values : spherical_values, options.rotation_error);
+
+			if (channel.full_precision)
+			{
+				channel.offset = uint32_t(float_values.size());
+				for (auto i : kept)
+				{
+					vec4 q = values[i].as_vec4();
+					float_values.insert(end(float_values), q.data, q.data + 4);
+				}
+			}
+			else
+			{
+				channel.offset = uint32_t(quantized.size());
+				for (auto i : kept)
+					quantized.insert(end(quantized), &encoded[4 * i], &encoded[4 * i] + 4);
+			}
+			break;
+		}
+
+		case AnimationChannel::Type::CubicTranslation:
+		case AnimationChannel::Type::CubicScale:
+			for (size_t i = 0; i < count; i++)
+				kept.push_back(i);
+			channel.full_precision = true;
+			channel.offset = uint32_t(float_values.size());
+			for (auto &v : input.cubic.values)
+				float_values.insert(end(float_values), v.data, v.data + 3);
+			break;
+		}
+
+		timestamps.clear();
+		for (auto i : kept)
+			timestamps.push_back(input.timestamps[i]);
+
+		// Channels sampled at the same times share their timestamps.
+		Hasher h;
+		h.u32(uint32_t(timestamps.size()));
+		h.data(reinterpret_cast<const uint8_t *>(timestamps.data()), timestamps.size() * sizeof(float));
+		auto itr = timeline_hash.find(h.get());
+		if (itr != end(timeline_hash) && timelines[itr->second] == timestamps)
+			channel.timeline = itr->second;
+		else
+		{
+			channel.timeline = uint32_t(timelines.size());
+			timelines.push_back(timestamps);
+			timeline_hash[h.get()] = channel.timeline;
+		}
+
+		channels.push_back(channel);
+	}
+}
+
+unsigned CompressedAnimation::get_chunk_count() const
+{
+	if (chunk_duration <= 0.0f || length <= chunk_duration)
+		return 1;
+	return unsigned(std::ceil(length / chunk_duration));
+}
+
+unsigned CompressedAnimation::get_chunk_index(float t) const
+{
+	unsigned count = get_chunk_count();
+	if (count == 1 || t <= 0.0f)
+		return 0;
+
+	// Agree with the windows computed in decode_chunk() when t / chunk_duration rounds across a boundary.
+	unsigned chunk = unsigned(t / chunk_duration);
+	if (chunk > 0 && t < float(chunk) * chunk_duration)
+		chunk--;
+	else if (t >= float(chunk + 1) * chunk_duration)
+		chunk++;
+	return std::min(chunk, count - 1);
+}
+
+void CompressedAnimation::decode_channel(const Channel &channel, size_t first, size_t last, AnimationChannel &output) const
+{
+	auto &timeline = timelines[channel.timeline];
+	output.node_index = channel.node_index;
+	output.joint_index = channel.joint_index;
+	output.joint = channel.joint;
+	output.type = channel.type;
+	output.timestamps.assign(begin(timeline) + first, begin(timeline) + last + 1);
+	output.linear.values.clear();
+	output.spherical.values.clear();
+	output.cubic.values.clear();
+
+	switch (channel.type)
+	{
+	case AnimationChannel::Type::Translation:
+	case AnimationChannel::Type::Scale:
+		if (channel.full_precision)
+		{
+			const float *data = float_values.data() + channel.offset;
+			for (size_t i = first; i <= last; i++)
+				output.linear.values.push_back(vec3(data[3 * i + 0], data[3 * i + 1], data[3 * i + 2]));
+		}
+		else
+		{
+			const uint16_t *data = quantized.data() + channel.offset;
+			for (size_t i = first; i <= last; i++)
+				output.linear.values.push_back(dequantize_linear(data + 3 * i, channel.range_base, channel.range_scale));
+		}
+		break;
+
+	case AnimationChannel::Type::Rotation:
+		if (channel.full_precision)
+		{
+			const float *data = float_values.data() + channel.offset;
+			for (size_t i = first; i <= last; i++)
+				output.spherical.values.push_back(quat(vec4(data[4 * i + 0], data[4 * i + 1], data[4 * i + 2], data[4 * i + 3])));
+		}
+		else
+		{
+			const uint16_t *data = quantized.data() + channel.offset;
+			for (size_t i = first; i <= last; i++)
+				output.spherical.values.push_back(dequantize_rotation(data + 4 * i));
+		}
+		break;
+
+	case AnimationChannel::Type::CubicTranslation:
+	case AnimationChannel::Type::CubicScale:
+	{
+		const float *data = float_values.data() + channel.offset;
+		for (size_t i = 3 * first; i < 3 * (last + 1); i++)
+			output.cubic.values.push_back(vec3(data[3 * i + 0], data[3 * i + 1], data[3 * i + 2]));
+		break;
+	}
+	}
+}
+
+void CompressedAnimation::decode_chunk(unsigned chunk, Animation &animation) const
+{
+	animation.name = name;
+	animation.length = length;
+	animation.skin_compat = skin_compat;
+	animation.skinning = skinning;
+	animation.channels.resize(channels.size());
+
+	bool whole_clip = get_chunk_count() == 1;
+	float window_begin = float(chunk) * chunk_duration;
+	float window_end = float(chunk + 1) * chunk_duration;
+
+	for (size_t i = 0; i < channels.size(); i++)
+	{
+		auto &timeline = timelines[channels[i].timeline];
+		size_t first = 0;
+		size_t last = timeline.size() - 1;
+
+		// Keep the last key before the window, and the first key at or after its end,
+		// so everything inside the window finds the same keys and phases as in the full clip.
+		if (!whole_clip)
+		{
+			auto lo = lower_bound(begin(timeline), end(timeline), window_begin);
+			if (lo != begin(timeline))
+				first = size_t(lo - begin(timeline)) - 1;
+			auto hi = lower_bound(begin(timeline), end(timeline), window_end);
+			last = std::min(size_t(hi - begin(timeline)), timeline.size() - 1);
+		}
+
+		decode_channel(channels[i], first, last, animation.channels[i]);
+	}
+}
+
+Animation CompressedAnimation::decode() const
+{
+	Animation animation;
+	animation.name = name;
+	animation.length = length;
+	animation.skin_compat = skin_compat;
+	animation.skinning = skinning;
+	animation.channels.resize(channels.size());
+	for (size_t i = 0; i < channels.size(); i++)
+		decode_channel(channels[i], 0, timelines[channels[i].timeline].size() - 1, animation.channels[i]);
+	return animation;
+}
+
+size_t CompressedAnimation::get_memory_usage() const
+{
+	size_t size = sizeof(*this) + name.size();
+	size += channels.size() * sizeof(Channel);
+	for (auto &timeline : timelines)
+		size += sizeof(timeline) + timeline.size() * sizeof(float);
+	size += quantized.size() * sizeof(uint16_t);
+	size += float_values.size() * sizeof(float);
+	return size;
+}
+}
+}
@@ -0,0 +1,114 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "scene_formats.hpp"
+#include <string>
+#include <vector>
+
+namespace Granite
+{
+namespace SceneFormats
+{
+struct AnimationCompressionOptions
+{
+	// Keys which can be interpolated from the keys kept around them within these errors are dropped.
+	// Translation and scale errors are per component, rotation errors are in radians.
+	float translation_error = 1e-4f;
+	float rotation_error = 1e-4f;
+	float scale_error = 1e-4f;
+
+	// Long clips are decoded in windows of this many seconds at a time.
+	float chunk_duration = 4.0f;
+};
+
+// Drops keys of linearly interpolated channels which can be reconstructed from their neighbours.
+// Cubic channels are left alone. With snorm16_rotations set, rotation keys are selected against what
+// quantize_rotation() and dequantize_rotation() give back, for callers which store the kept rotations that way.
+void reduce_animation_keys(Animation &animation, const AnimationCompressionOptions &options,
+                           bool snorm16_rotations = false);
+
+// Rotations as 4 x snorm16, in as_vec4() order. Decoding normalizes, like the glTF loader does.
+void quantize_rotation(const quat &q, uint16_t *data);
+quat dequantize_rotation(const uint16_t *data);
+
+// A clip with reduced keys, quantized values and timelines shared between channels.
+// Rotations are stored as 4 x snorm16, translations and scales as 3 x unorm16 within the range of each channel.
+// Keys are reduced against the quantized values, so the decoded clip stays within the error limits at every source key.
+// Cubic channels, and channels which 16 bits cannot represent within the error limits, keep their float values.
+class CompressedAnimation
+{
+public:
+	CompressedAnimation() = default;
+	CompressedAnimation(const Animation &animation, const AnimationCompressionOptions &options);
+
+	unsigned get_chunk_count() const;
+	unsigned get_chunk_index(float t) const;
+
+	// Decodes every key needed to sample the clip between chunk * duration and (chunk + 1) * duration.
+	// Channels end up in the same order as in the original clip, and existing storage in animation is reused.
+	void decode_chunk(unsigned chunk, Animation &animation) const;
+	Animation decode() const;
+
+	const std::string &get_name() const
+	{
+		return name;
+	}
+
+	float get_length() const
+	{
+		return length;
+	}
+
+	size_t get_memory_usage() const;
+
+private:
+	struct Channel
+	{
+		uint32_t node_index;
+		uint32_t joint_index;
+		bool joint;
+		AnimationChannel::Type type;
+		uint32_t timeline;
+		// Into float_values for cubic and full precision channels, into quantized otherwise.
+		uint32_t offset;
+		bool full_precision;
+		vec3 range_base;
+		vec3 range_scale;
+	};
+
+	std::vector<Channel> channels;
+	std::vector<std::vector<float>> timelines;
+	std::vector<uint16_t> quantized;
+	std::vector<float> float_values;
+
+	std::string name;
+	float length = 0.0f;
+	float chunk_duration = 0.0f;
+	Util::Hash skin_compat = 0;
+	bool skinning = false;
+
+	void decode_channel(const Channel &channel, size_t first, size_t last, AnimationChannel &output) const;
+};
+}
+}
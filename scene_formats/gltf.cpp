@@ -570,8 +570,11 @@ void Parser::extract_attribute(std::vector<vec3> &attributes, const Accessor &ac
 
 void Parser::extract_attribute(std::vector<quat> &attributes, const Accessor &accessor)
 {
-	if (accessor.type != ScalarType::Float32)
-		throw logic_error("Attribute is not Float32.");
+	// KHR_mesh_quantization allows normalized rotations as well.
+	if (accessor.type != ScalarType::Float32 &&
+	    accessor.type != ScalarType::Int16Snorm &&
+	    accessor.type != ScalarType::Int8Snorm)
+		throw logic_error("Attribute is not Float32, Int16Snorm or Int8Snorm.");
 	if (accessor.components != 4)
 		throw logic_error("Attribute is not single component.");
 
@@ -580,8 +583,25 @@ void Parser::extract_attribute(std::vector<quat> &attributes, const Accessor &ac
 	for (uint32_t i = 0; i < accessor.count; i++)
 	{
 		uint32_t offset = view.offset + accessor.offset + i * accessor.stride;
-		const auto *data = reinterpret_cast<const float *>(&buffer[offset]);
-		attributes.push_back(normalize(quat(data[3], data[0], data[1], data[2])));
+		vec4 q;
+		if (accessor.type == ScalarType::Int16Snorm)
+		{
+			const auto *data = reinterpret_cast<const int16_t *>(&buffer[offset]);
+			for (unsigned c = 0; c < 4; c++)
+				q[c] = std::max(float(data[c]) / 32767.0f, -1.0f);
+		}
+		else if (accessor.type == ScalarType::Int8Snorm)
+		{
+			const auto *data = reinterpret_cast<const int8_t *>(&buffer[offset]);
+			for (unsigned c = 0; c < 4; c++)
+				q[c] = std::max(float(data[c]) / 127.0f, -1.0f);
+		}
+		else
+		{
+			const auto *data = reinterpret_cast<const float *>(&buffer[offset]);
+			q = vec4(data[0], data[1], data[2], data[3]);
+		}
+		attributes.push_back(normalize(quat(q.w, q.x, q.y, q.z)));
 	}
 }
 
@@ -27,6 +27,7 @@
 #include "rapidjson_wrapper.hpp"
 #include "hashmap.hpp"
 #include "thread_group.hpp"
+#include "task_future.hpp"
 #include <unordered_set>
 #include "texture_utils.hpp"
 #include "texture_format.hpp"
@@ -1052,8 +1053,18 @@ unsigned RemapState::emit_meshes(ArrayView<const unsigned> meshes)
 
 void RemapState::emit_animations(ArrayView<const Animation> animations)
 {
-	for (auto &animation : animations)
+	for (auto &input_animation : animations)
 	{
+		const Animation *animation_ptr = &input_animation;
+		Animation reduced_animation;
+		if (options->compress_animations)
+		{
+			reduced_animation = input_animation;
+			reduce_animation_keys(reduced_animation, options->animation_compression, true);
+			animation_ptr = &reduced_animation;
+		}
+		auto &animation = *animation_ptr;
+
 		EmittedAnimation anim;
 		anim.name = animation.name;
 
@@ -1075,10 +1086,25 @@ void RemapState::emit_animations(ArrayView<const Animation> animations)
 			{
 			case AnimationChannel::Type::Rotation:
 				chan.path = "rotation";
-				data_view = emit_buffer({ reinterpret_cast<const uint8_t *>(channel.spherical.values.data()),
-				                          channel.spherical.values.size() * sizeof(quat) });
-				data_accessor = emit_accessor(data_view, VK_FORMAT_R32G32B32A32_SFLOAT, 0,
-				                              channel.spherical.values.size());
+				if (options->compress_animations)
+				{
+					// Normalized rotations are allowed by core glTF. Keys were selected against these values.
+					vector<uint16_t> quantized(channel.spherical.values.size() * 4);
+					for (size_t i = 0; i < channel.spherical.values.size(); i++)
+						quantize_rotation(channel.spherical.values[i], &quantized[4 * i]);
+
+					data_view = emit_buffer({ reinterpret_cast<const uint8_t *>(quantized.data()),
+					                          quantized.size() * sizeof(uint16_t) });
+					data_accessor = emit_accessor(data_view, VK_FORMAT_R16G16B16A16_SNORM, 0,
+					                              channel.spherical.values.size());
+				}
+				else
+				{
+					data_view = emit_buffer({ reinterpret_cast<const uint8_t *>(channel.spherical.values.data()),
+					                          channel.spherical.values.size() * sizeof(quat) });
+					data_accessor = emit_accessor(data_view, VK_FORMAT_R32G32B32A32_SFLOAT, 0,
+					                              channel.spherical.values.size());
+				}
 				break;
 			case AnimationChannel::Type::CubicTranslation:
 				chan.path = "translation";
@@ -1453,33 +1479,37 @@ void AnalysisResult::deduce_compression(TextureCompressionFamily family)
 	}
 }
 
-static shared_ptr<AnalysisResult> analyze_image(ThreadGroup &workers,
-                                                const string &src, const VkComponentMapping &swizzle,
-                                                Material::Textures type, TextureCompressionFamily family,
-                                                TextureMode mode,
-                                                TaskSignal *signal)
+static TaskFuture<shared_ptr<AnalysisResult>> analyze_image(ThreadGroup &workers,
+                                                            const string &src, const VkComponentMapping &swizzle,
+                                                            Material::Textures type, TextureCompressionFamily family,
+                                                            TextureMode mode)
 {
-	auto result = make_shared<AnalysisResult>();
-	result->mode = mode;
-	result->type = type;
+	return create_future(workers, [=]() {
+		auto result = make_shared<AnalysisResult>();
+		result->mode = mode;
+		result->type = type;
 
-	auto group = workers.create_task([=]() {
 		if (!result->load_image(src, swizzle))
 		{
 			LOGE("Failed to load image.\n");
-			return;
+			return result;
 		}
 
 		result->deduce_compression(family);
-	});
-	group->set_fence_counter_signal(signal);
-
-	return result;
+		return result;
+	}, TaskClass::Background, "image-analyze");
 }
 
 static void compress_image(ThreadGroup &workers, const string &target_path, shared_ptr<AnalysisResult> &result,
                            unsigned quality, TaskSignal *signal)
 {
+	if (result->image->get_layout().get_required_size() == 0)
+	{
+		if (signal)
+			signal->signal_increment();
+		return;
+	}
+
 	FileStat src_stat, dst_stat;
 	if (Filesystem::get().stat(result->src_path, src_stat) && Filesystem::get().stat(target_path, dst_stat))
 	{
@@ -1571,7 +1601,18 @@ bool export_scene_to_glb(const SceneInformation &scene, const string &path, cons
 	auto &allocator = doc.GetAllocator();
 
 	ThreadGroup workers;
-	workers.start(options.threads ? options.threads : std::thread::hardware_concurrency());
+	unsigned num_threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+	if (options.thread_pinning != ThreadPinning::None || !options.thread_topology.empty())
+	{
+		ThreadTopology topology;
+		if (options.thread_topology.empty() || !ThreadTopology::parse(options.thread_topology, topology))
+			topology = ThreadTopology::detect();
+
+		workers.set_topology(topology, options.thread_pinning);
+		if (!options.threads)
+			num_threads = topology.get_num_cpus();
+	}
+	workers.start(num_threads);
 
 	Value asset(kObjectType);
 	asset.AddMember("generator", "Granite glTF 2.0 exporter", allocator);
@@ -1806,26 +1847,39 @@ bool export_scene_to_glb(const SceneInformation &scene, const string &path, cons
 	{
 		Value images(kArrayType);
 
-		LOGI("Analyzing images ...\n");
-		// Load images, swizzle, and figure out which compression type is the most appropriate.
-		unsigned image_max_count = 0;
-		TaskSignal image_signal;
+		LOGI("Processing images ...\n");
+		// Load images, swizzle, and figure out which compression type is the most appropriate,
+		// then generate mipmaps, compress and write them out. Every image is its own chain of tasks,
+		// so loading one image overlaps with compressing the others.
+		// Only keep a certain number of images in flight at a time.
+		TaskSignal signal;
+		unsigned max_count = 0;
+		vector<TaskFuture<shared_ptr<AnalysisResult>>> analysis;
+		analysis.reserve(state.image_cache.size());
 		for (auto &image : state.image_cache)
 		{
-			if (image_max_count > 8)
-				image_signal.wait_until_at_least(image_max_count - 8);
-			image.loaded_image = analyze_image(workers,
-			                                   image.source_path, image.swizzle,
-			                                   image.type, image.compression, image.mode,
-			                                   &image_signal);
+			if (max_count > 3)
+				signal.wait_until_at_least(max_count - 3);
+
+			auto analyzed = analyze_image(workers,
+			                              image.source_path, image.swizzle,
+			                              image.type, image.compression, image.mode);
+
+			auto target_path = Path::relpath(path, image.target_relpath);
+			unsigned quality = image.compression_quality;
+			analyzed.then([&workers, &signal, target_path, quality](shared_ptr<AnalysisResult> &result) {
+				compress_image(workers, target_path, result, quality, &signal);
+			}, "image-compress-setup");
+
+			analysis.push_back(move(analyzed));
+			max_count++;
 		}
-		workers.wait_idle();
-		LOGI("Analyzed images ...\n");
 
-		TaskSignal signal;
-		unsigned max_count = 0;
-		for (auto &image : state.image_cache)
+		for (size_t index = 0; index < state.image_cache.size(); index++)
 		{
+			auto &image = state.image_cache[index];
+			image.loaded_image = analysis[index].get();
+
 			// Replace the swizzle with possibly something else.
 			auto swiz = image.loaded_image->swizzle;
 
@@ -1869,17 +1923,11 @@ bool export_scene_to_glb(const SceneInformation &scene, const string &path, cons
 			}
 
 			images.PushBack(i, allocator);
-
-			// Only keep a certain number of compression jobs alive at a time.
-			if (max_count > 3)
-				signal.wait_until_at_least(max_count - 3);
-
-			compress_image(workers, Path::relpath(path, image.target_relpath),
-			               image.loaded_image, image.compression_quality, &signal);
-
-			max_count++;
 		}
 		doc.AddMember("images", images, allocator);
+
+		// The compression tasks refer to signal.
+		workers.wait_idle();
 	}
 
 	// Sources
@@ -24,6 +24,7 @@
 
 #include "scene_formats.hpp"
 #include "texture_compression.hpp"
+#include "animation_compression.hpp"
 
 namespace Granite
 {
@@ -58,6 +59,9 @@ struct ExportOptions
 	TextureCompressionFamily compression = TextureCompressionFamily::Uncompressed;
 	unsigned texcomp_quality = 3;
 	unsigned threads = 0;
+	// Topology description as accepted by ThreadTopology::parse(), or empty to detect it.
+	std::string thread_topology;
+	ThreadPinning thread_pinning = ThreadPinning::None;
 
 	struct
 	{
@@ -76,6 +80,10 @@ struct ExportOptions
 	bool optimize_meshes = false;
 	bool stripify_meshes = false;
 	bool gltf = false;
+
+	// Drops redundant animation keys and stores rotations as normalized 16-bit values.
+	bool compress_animations = false;
+	AnimationCompressionOptions animation_compression;
 };
 
 bool export_scene_to_glb(const SceneInformation &scene, const std::string &path, const ExportOptions &options);
@@ -22,6 +22,7 @@
 
 #include "scene_formats.hpp"
 #include <string.h>
+#include <float.h>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -572,6 +573,45 @@ bool mesh_recompute_normals(Mesh &mesh)
 	return true;
 }
 
+vector<AABB> mesh_compute_bone_aabbs(const Mesh &mesh)
+{
+	auto &pos = mesh.attribute_layout[ecast(MeshAttribute::Position)];
+	auto &index = mesh.attribute_layout[ecast(MeshAttribute::BoneIndex)];
+	auto &weight = mesh.attribute_layout[ecast(MeshAttribute::BoneWeights)];
+
+	if (index.format != VK_FORMAT_R8G8B8A8_UINT)
+		return {};
+	if (pos.format != VK_FORMAT_R32G32B32_SFLOAT && pos.format != VK_FORMAT_R32G32B32A32_SFLOAT)
+		return {};
+	if (weight.format != VK_FORMAT_UNDEFINED && weight.format != VK_FORMAT_R16G16B16A16_UNORM)
+		return {};
+
+	vector<AABB> aabbs;
+	unsigned vertex_count = unsigned(mesh.positions.size() / mesh.position_stride);
+	for (unsigned i = 0; i < vertex_count; i++)
+	{
+		vec3 p;
+		uint8_t indices[4];
+		uint16_t weights[4] = { 1, 1, 1, 1 };
+		memcpy(&p, mesh.positions.data() + i * mesh.position_stride + pos.offset, sizeof(p));
+		memcpy(indices, mesh.attributes.data() + i * mesh.attribute_stride + index.offset, sizeof(indices));
+		if (weight.format != VK_FORMAT_UNDEFINED)
+			memcpy(weights, mesh.attributes.data() + i * mesh.attribute_stride + weight.offset, sizeof(weights));
+
+		for (unsigned j = 0; j < 4; j++)
+		{
+			if (!weights[j])
+				continue;
+
+			if (indices[j] >= aabbs.size())
+				aabbs.resize(indices[j] + 1, AABB(vec3(FLT_MAX), vec3(-FLT_MAX)));
+			aabbs[indices[j]].expand(AABB(p, p));
+		}
+	}
+
+	return aabbs;
+}
+
 static void touch_node_children(unordered_set<uint32_t> &touched, const vector<Node> &nodes, uint32_t index)
 {
 	touched.insert(index);
@@ -24,6 +24,7 @@
 
 #include <vector>
 #include <unordered_set>
+#include <algorithm>
 #include <stdint.h>
 #include "mesh.hpp"
 #include "enum_cast.hpp"
@@ -89,6 +90,42 @@ struct AnimationChannel
 			phase = (t - timestamps[index]) / (timestamps[end_target] - timestamps[index]);
 		}
 	}
+
+	// Same as above, but starts looking from the index found by the previous call,
+	// which makes sampling a clip front to back cheap. cursor is updated to the new index.
+	void get_index_phase(float t, unsigned &index, float &phase, unsigned &cursor) const
+	{
+		if (t <= timestamps.front() || timestamps.size() == 1)
+		{
+			index = 0;
+			phase = 0.0f;
+		}
+		else if (t >= timestamps.back())
+		{
+			index = timestamps.size() - 2;
+			phase = 1.0f;
+		}
+		else
+		{
+			// Find the first key at or after t, like the linear scan does.
+			auto first = timestamps.begin();
+			unsigned end_target = std::min<unsigned>(std::max(cursor, 1u), timestamps.size() - 1);
+			if (timestamps[end_target - 1] >= t)
+				end_target = unsigned(std::lower_bound(first, first + end_target, t) - first);
+			else
+			{
+				unsigned steps = 0;
+				while (timestamps[end_target] < t && steps++ < 4)
+					end_target++;
+				if (timestamps[end_target] < t)
+					end_target = unsigned(std::lower_bound(first + end_target, timestamps.end(), t) - first);
+			}
+
+			index = end_target - 1;
+			phase = (t - timestamps[index]) / (timestamps[end_target] - timestamps[index]);
+		}
+		cursor = index + 1;
+	}
 };
 
 struct Animation
@@ -273,6 +310,10 @@ bool mesh_renormalize_tangents(Mesh &mesh);
 bool mesh_flip_tangents_w(Mesh &mesh);
 
 void mesh_deduplicate_vertices(Mesh &mesh);
+
+// Bounds of the vertices influenced by each bone, indexed by bone. Bones without vertices get an empty (inverted) box.
+// Returns an empty vector if the mesh is not skinned or uses formats which are not understood.
+std::vector<AABB> mesh_compute_bone_aabbs(const Mesh &mesh);
 Mesh mesh_optimize_index_buffer(const Mesh &mesh, bool stripify);
 std::unordered_set<uint32_t> build_used_nodes_in_scene(const SceneNodes &scene, const std::vector<Node> &nodes);
 }
@@ -411,97 +411,97 @@ void CompressorState::enqueue_compression_block_rgtc(TaskGroup &group, const Com
 	int width = layout.get_width(level);
 	int height = layout.get_height(level);
 	int blocks_x = (width + block_size_x - 1) / block_size_x;
+	int blocks_y = (height + block_size_y - 1) / block_size_y;
 
-	for (int y = 0; y < height; y += block_size_y)
-	{
-		for (int x = 0; x < width; x += block_size_x)
+	group->enqueue_parallel_for(0, size_t(blocks_x * blocks_y), 64, [=, format = args.format](size_t begin, size_t end) {
+		for (size_t block = begin; block < end; block++)
 		{
-			group->enqueue_task([=, format = args.format]() {
-				uint8_t padded_red[4 * 4];
-				uint8_t padded_green[4 * 4];
-				auto *src = static_cast<const uint8_t *>(layout.data(layer, level));
-
-				const auto get_block_data = [&](int block_size) -> uint8_t * {
-					auto *dst = static_cast<uint8_t *>(output->get_layout().data(layer, level));
-					dst += (x / block_size_x) * block_size;
-					dst += (y / block_size_y) * blocks_x * block_size;
-					return dst;
-				};
-
-				const auto get_encode_data = [&](int block_size) -> uint8_t * {
-					return get_block_data(block_size);
-				};
-
-				const auto get_component = [&](int sx, int sy, int c) -> uint8_t {
-					sx = std::min(sx, width - 1);
-					sy = std::min(sy, height - 1);
-					return src[4 * (sy * width + sx) + c];
-				};
-
-				for (int sy = 0; sy < 4; sy++)
+			int x = int(block % blocks_x) * block_size_x;
+			int y = int(block / blocks_x) * block_size_y;
+			uint8_t padded_red[4 * 4];
+			uint8_t padded_green[4 * 4];
+			auto *src = static_cast<const uint8_t *>(layout.data(layer, level));
+
+			const auto get_block_data = [&](int block_size) -> uint8_t * {
+				auto *dst = static_cast<uint8_t *>(output->get_layout().data(layer, level));
+				dst += (x / block_size_x) * block_size;
+				dst += (y / block_size_y) * blocks_x * block_size;
+				return dst;
+			};
+
+			const auto get_encode_data = [&](int block_size) -> uint8_t * {
+				return get_block_data(block_size);
+			};
+
+			const auto get_component = [&](int sx, int sy, int c) -> uint8_t {
+				sx = std::min(sx, width - 1);
+				sy = std::min(sy, height - 1);
+				return src[4 * (sy * width + sx) + c];
+			};
+
+			for (int sy = 0; sy < 4; sy++)
+			{
+				for (int sx = 0; sx < 4; sx++)
 				{
-					for (int sx = 0; sx < 4; sx++)
-					{
-						padded_red[sy * 4 + sx] = get_component(x + sx, y + sy, 0);
-						padded_green[sy * 4 + sx] = get_component(x + sx, y + sy, 1);
-					}
+					padded_red[sy * 4 + sx] = get_component(x + sx, y + sy, 0);
+					padded_green[sy * 4 + sx] = get_component(x + sx, y + sy, 1);
 				}
+			}
 
-				switch (format)
-				{
-				case VK_FORMAT_BC4_UNORM_BLOCK:
-				{
-					compress_rgtc_red_block(get_encode_data(8), padded_red);
+			switch (format)
+			{
+			case VK_FORMAT_BC4_UNORM_BLOCK:
+			{
+				compress_rgtc_red_block(get_encode_data(8), padded_red);
 
 #ifdef RGTC_DEBUG
-					if (level == 0 && layer == 0)
-					{
-						uint8_t decoded_red[16];
-						decompress_rgtc_red_block(decoded_red, get_encode_data(8));
-						double error = 0.0;
-						for (int i = 0; i < 16; i++)
-							error += double((decoded_red[i] - padded_red[i]) * (decoded_red[i] - padded_red[i])) / (width * height);
-
-						lock_guard<mutex> l{lock};
-						total_error[0] += error;
-					}
-#endif
-					break;
+				if (level == 0 && layer == 0)
+				{
+					uint8_t decoded_red[16];
+					decompress_rgtc_red_block(decoded_red, get_encode_data(8));
+					double error = 0.0;
+					for (int i = 0; i < 16; i++)
+						error += double((decoded_red[i] - padded_red[i]) * (decoded_red[i] - padded_red[i])) / (width * height);
+
+					lock_guard<mutex> l{lock};
+					total_error[0] += error;
 				}
+#endif
+				break;
+			}
 
-				case VK_FORMAT_BC5_UNORM_BLOCK:
-				{
-					compress_rgtc_red_green_block(get_encode_data(16), padded_red, padded_green);
+			case VK_FORMAT_BC5_UNORM_BLOCK:
+			{
+				compress_rgtc_red_green_block(get_encode_data(16), padded_red, padded_green);
 
 #ifdef RGTC_DEBUG
-					if (level == 0 && layer == 0)
-					{
-						uint8_t decoded_red[16];
-						uint8_t decoded_green[16];
-						decompress_rgtc_red_block(decoded_red, get_encode_data(16));
-						decompress_rgtc_red_block(decoded_green, get_encode_data(16) + 8);
-
-						double error_red = 0.0;
-						double error_green = 0.0;
-						for (int i = 0; i < 16; i++)
-							error_red += double((decoded_red[i] - padded_red[i]) * (decoded_red[i] - padded_red[i])) / (width * height);
-						for (int i = 0; i < 16; i++)
-							error_green += double((decoded_green[i] - padded_green[i]) * (decoded_green[i] - padded_green[i])) / (width * height);
-
-						lock_guard<mutex> l{lock};
-						total_error[0] += error_red;
-						total_error[1] += error_green;
-					}
-#endif
-					break;
+				if (level == 0 && layer == 0)
+				{
+					uint8_t decoded_red[16];
+					uint8_t decoded_green[16];
+					decompress_rgtc_red_block(decoded_red, get_encode_data(16));
+					decompress_rgtc_red_block(decoded_green, get_encode_data(16) + 8);
+
+					double error_red = 0.0;
+					double error_green = 0.0;
+					for (int i = 0; i < 16; i++)
+						error_red += double((decoded_red[i] - padded_red[i]) * (decoded_red[i] - padded_red[i])) / (width * height);
+					for (int i = 0; i < 16; i++)
+						error_green += double((decoded_green[i] - padded_green[i]) * (decoded_green[i] - padded_green[i])) / (width * height);
+
+					lock_guard<mutex> l{lock};
+					total_error[0] += error_red;
+					total_error[1] += error_green;
 				}
+#endif
+				break;
+			}
 
-				default:
-					break;
-				}
-			});
+			default:
+				break;
+			}
 		}
-	}
+	});
 }
 
 #ifdef HAVE_ISPC
@@ -513,111 +513,112 @@ void CompressorState::enqueue_compression_block_ispc(TaskGroup &group, const Com
 	int height = layout.get_height(level);
 	int grid_stride_x = (32 / block_size_x) * block_size_x;
 	int grid_stride_y = (32 / block_size_y) * block_size_y;
+	int grids_x = (width + grid_stride_x - 1) / grid_stride_x;
+	int grids_y = (height + grid_stride_y - 1) / grid_stride_y;
 
-	for (int y = 0; y < height; y += grid_stride_y)
-	{
-		for (int x = 0; x < width; x += grid_stride_x)
+	group->enqueue_parallel_for(0, size_t(grids_x * grids_y), 1, [=, format = args.format](size_t begin, size_t end) {
+		for (size_t grid = begin; grid < end; grid++)
 		{
-			group->enqueue_task([=, format = args.format]() {
-				uint8_t padded_buffer[32 * 32 * 8];
-				uint8_t encode_buffer[16 * 8 * 8];
-				rgba_surface surface = {};
-				surface.ptr = const_cast<uint8_t *>(static_cast<const uint8_t *>(layout.data(layer, level)));
-				surface.width = std::min(width - x, grid_stride_x);
-				surface.height = std::min(height - y, grid_stride_y);
-				surface.stride = width * format_to_stride(format);
-				surface.ptr += y * surface.stride + x * format_to_stride(format);
-
-				rgba_surface padded_surface = {};
-
-				int num_blocks_x = (surface.width + block_size_x - 1) / block_size_x;
-				int num_blocks_y = (surface.height + block_size_y - 1) / block_size_y;
-				int blocks_x = (width + block_size_x - 1) / block_size_x;
-
-				const auto get_block_data = [&](int bx, int by, int block_size) -> uint8_t * {
-					auto *dst = static_cast<uint8_t *>(output->get_layout().data(layer, level));
-					dst += ((x / block_size_x) + bx) * block_size;
-					dst += ((y / block_size_y) + by) * blocks_x * block_size;
-					return dst;
-				};
-
-				const auto write_encode_data = [&](int block_size) {
-					for (int by = 0; by < num_blocks_y; by++)
+			int x = int(grid % grids_x) * grid_stride_x;
+			int y = int(grid / grids_x) * grid_stride_y;
+			uint8_t padded_buffer[32 * 32 * 8];
+			uint8_t encode_buffer[16 * 8 * 8];
+			rgba_surface surface = {};
+			surface.ptr = const_cast<uint8_t *>(static_cast<const uint8_t *>(layout.data(layer, level)));
+			surface.width = std::min(width - x, grid_stride_x);
+			surface.height = std::min(height - y, grid_stride_y);
+			surface.stride = width * format_to_stride(format);
+			surface.ptr += y * surface.stride + x * format_to_stride(format);
+
+			rgba_surface padded_surface = {};
+
+			int num_blocks_x = (surface.width + block_size_x - 1) / block_size_x;
+			int num_blocks_y = (surface.height + block_size_y - 1) / block_size_y;
+			int blocks_x = (width + block_size_x - 1) / block_size_x;
+
+			const auto get_block_data = [&](int bx, int by, int block_size) -> uint8_t * {
+				auto *dst = static_cast<uint8_t *>(output->get_layout().data(layer, level));
+				dst += ((x / block_size_x) + bx) * block_size;
+				dst += ((y / block_size_y) + by) * blocks_x * block_size;
+				return dst;
+			};
+
+			const auto write_encode_data = [&](int block_size) {
+				for (int by = 0; by < num_blocks_y; by++)
+				{
+					for (int bx = 0; bx < num_blocks_x; bx++)
 					{
-						for (int bx = 0; bx < num_blocks_x; bx++)
-						{
-							auto *dst = get_block_data(bx, by, block_size);
-							memcpy(dst, &encode_buffer[(by * num_blocks_x + bx) * block_size], block_size);
-						}
+						auto *dst = get_block_data(bx, by, block_size);
+						memcpy(dst, &encode_buffer[(by * num_blocks_x + bx) * block_size], block_size);
 					}
-				};
-
-				if ((surface.width % block_size_x) || (surface.height % block_size_y))
-				{
-					padded_surface.width = num_blocks_x * block_size_x;
-					padded_surface.height = num_blocks_y * block_size_y;
-					padded_surface.stride = padded_surface.width * format_to_stride(format);
-					padded_surface.ptr = padded_buffer;
-					ReplicateBorders(&padded_surface, &surface, 0, 0, format_to_stride(format) * 8);
 				}
-				else
-					padded_surface = surface;
+			};
 
-				switch (format)
-				{
-				case VK_FORMAT_BC6H_UFLOAT_BLOCK:
-				{
-					CompressBlocksBC6H(&padded_surface, encode_buffer, &bc6);
-					write_encode_data(16);
-					break;
-				}
+			if ((surface.width % block_size_x) || (surface.height % block_size_y))
+			{
+				padded_surface.width = num_blocks_x * block_size_x;
+				padded_surface.height = num_blocks_y * block_size_y;
+				padded_surface.stride = padded_surface.width * format_to_stride(format);
+				padded_surface.ptr = padded_buffer;
+				ReplicateBorders(&padded_surface, &surface, 0, 0, format_to_stride(format) * 8);
+			}
+			else
+				padded_surface = surface;
 
-				case VK_FORMAT_BC7_SRGB_BLOCK:
-				case VK_FORMAT_BC7_UNORM_BLOCK:
-				{
-					CompressBlocksBC7(&padded_surface, encode_buffer, &bc7);
-					write_encode_data(16);
-					break;
-				}
+			switch (format)
+			{
+			case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+			{
+				CompressBlocksBC6H(&padded_surface, encode_buffer, &bc6);
+				write_encode_data(16);
+				break;
+			}
 
-				case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
-				case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
-				case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
-				case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
-				{
-					CompressBlocksBC1(&padded_surface, encode_buffer);
-					write_encode_data(8);
-					break;
-				}
+			case VK_FORMAT_BC7_SRGB_BLOCK:
+			case VK_FORMAT_BC7_UNORM_BLOCK:
+			{
+				CompressBlocksBC7(&padded_surface, encode_buffer, &bc7);
+				write_encode_data(16);
+				break;
+			}
 
-				case VK_FORMAT_BC3_SRGB_BLOCK:
-				case VK_FORMAT_BC3_UNORM_BLOCK:
-				{
-					CompressBlocksBC3(&padded_surface, encode_buffer);
-					write_encode_data(16);
-					break;
-				}
+			case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+			case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+			case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+			case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+			{
+				CompressBlocksBC1(&padded_surface, encode_buffer);
+				write_encode_data(8);
+				break;
+			}
 
-				case VK_FORMAT_ASTC_4x4_SRGB_BLOCK:
-				case VK_FORMAT_ASTC_4x4_UNORM_BLOCK:
-				case VK_FORMAT_ASTC_5x5_SRGB_BLOCK:
-				case VK_FORMAT_ASTC_5x5_UNORM_BLOCK:
-				case VK_FORMAT_ASTC_6x6_SRGB_BLOCK:
-				case VK_FORMAT_ASTC_6x6_UNORM_BLOCK:
-				case VK_FORMAT_ASTC_8x8_SRGB_BLOCK:
-				case VK_FORMAT_ASTC_8x8_UNORM_BLOCK:
-				{
-					CompressBlocksASTC(&padded_surface, encode_buffer, &astc);
-					write_encode_data(16);
-					break;
-				}
+			case VK_FORMAT_BC3_SRGB_BLOCK:
+			case VK_FORMAT_BC3_UNORM_BLOCK:
+			{
+				CompressBlocksBC3(&padded_surface, encode_buffer);
+				write_encode_data(16);
+				break;
+			}
 
-				default:
-					break;
-				}
-			});
+			case VK_FORMAT_ASTC_4x4_SRGB_BLOCK:
+			case VK_FORMAT_ASTC_4x4_UNORM_BLOCK:
+			case VK_FORMAT_ASTC_5x5_SRGB_BLOCK:
+			case VK_FORMAT_ASTC_5x5_UNORM_BLOCK:
+			case VK_FORMAT_ASTC_6x6_SRGB_BLOCK:
+			case VK_FORMAT_ASTC_6x6_UNORM_BLOCK:
+			case VK_FORMAT_ASTC_8x8_SRGB_BLOCK:
+			case VK_FORMAT_ASTC_8x8_UNORM_BLOCK:
+			{
+				CompressBlocksASTC(&padded_surface, encode_buffer, &astc);
+				write_encode_data(16);
+				break;
+			}
+
+			default:
+				break;
+			}
 		}
-	}
+	});
 }
 #endif
 
@@ -775,33 +776,37 @@ void CompressorState::enqueue_compression_block_astc(TaskGroup &compression_task
 	state->layer = layer;
 	state->level = level;
 
-	for (int y = 0; y < state->blocks_y; y++)
-	{
-		for (int x = 0; x < state->blocks_x; x++)
+	size_t num_blocks = size_t(state->blocks_x * state->blocks_y);
+	compression_task->enqueue_parallel_for(0, num_blocks, 4, [=](size_t begin, size_t end) {
+		for (size_t block = begin; block < end; block++)
 		{
-			compression_task->enqueue_task([=]() {
-				symbolic_compressed_block scb;
-				physical_compressed_block pcb;
-				imageblock pb = {};
-				const swizzlepattern swizzle = { 0, 1, 2, 3 };
-
-				fetch_imageblock(&state->astc_image, &pb, block_size_x, block_size_y, 1, x * block_size_x,
-				                 y * block_size_y, 0, swizzle);
-				compress_symbolic_block(&state->astc_image, use_hdr ? DECODE_HDR : DECODE_LDR,
-				                        block_size_x, block_size_y, 1, &state->ewp, &pb, &scb);
-				pcb = symbolic_to_physical(block_size_x, block_size_y, 1, &scb);
-
-				auto *dst = static_cast<uint8_t *>(output->get_layout().data(state->layer, state->level));
-				memcpy(dst + 16 * (y * state->blocks_x + x), &pcb, sizeof(pcb));
-			});
+			int x = int(block % state->blocks_x);
+			int y = int(block / state->blocks_x);
+			symbolic_compressed_block scb;
+			physical_compressed_block pcb;
+			imageblock pb = {};
+			const swizzlepattern swizzle = { 0, 1, 2, 3 };
+
+			fetch_imageblock(&state->astc_image, &pb, block_size_x, block_size_y, 1, x * block_size_x,
+			                 y * block_size_y, 0, swizzle);
+			compress_symbolic_block(&state->astc_image, use_hdr ? DECODE_HDR : DECODE_LDR,
+			                        block_size_x, block_size_y, 1, &state->ewp, &pb, &scb);
+			pcb = symbolic_to_physical(block_size_x, block_size_y, 1, &scb);
+
+			auto *dst = static_cast<uint8_t *>(output->get_layout().data(state->layer, state->level));
+			memcpy(dst + 16 * (y * state->blocks_x + x), &pcb, sizeof(pcb));
 		}
-	}
+	});
 }
 #endif
 
 void CompressorState::enqueue_compression(ThreadGroup &group, const CompressorArguments &args)
 {
 	auto compression_task = group.create_task();
+	compression_task->set_task_class(TaskClass::Background);
+	compression_task->set_desc("texture-compress-blocks");
+	// The setup task just mapped input and output on this node, keep the block work there.
+	compression_task->set_numa_node(group.get_current_numa_node());
 
 	for (unsigned layer = 0; layer < input->get_layout().get_layers(); layer++)
 	{
@@ -867,6 +872,8 @@ void CompressorState::enqueue_compression(ThreadGroup &group, const CompressorAr
 		state->output.reset();
 		state->input.reset();
 	});
+	write_task->set_task_class(TaskClass::Background);
+	write_task->set_desc("texture-compress-finish");
 	group.add_dependency(write_task, compression_task);
 	write_task->set_fence_counter_signal(signal);
 }
@@ -914,6 +921,8 @@ void compress_texture(ThreadGroup &group, const CompressorArguments &args, const
 
 		output->enqueue_compression(group, args);
 	});
+	setup_task->set_task_class(TaskClass::Background);
+	setup_task->set_desc("texture-compress-setup");
 	group.add_dependency(setup_task, dep);
 }
 }
@@ -0,0 +1,298 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "animation_system.hpp"
+#include "util.hpp"
+#include <cmath>
+#include <stdexcept>
+#include <stdlib.h>
+
+using namespace Granite;
+using namespace Granite::SceneFormats;
+
+static const unsigned NumNodes = 3;
+
+static quat rotation_from_axis(float angle, const vec3 &axis)
+{
+	vec3 n = normalize(axis);
+	return quat(std::cos(0.5f * angle), std::sin(0.5f * angle) * n);
+}
+
+// Two keys per channel for every node, with values derived from seed.
+static Animation make_animation(float seed, bool additive)
+{
+	Animation animation;
+	for (unsigned node = 0; node < NumNodes; node++)
+	{
+		float s = seed + float(node);
+
+		AnimationChannel translation;
+		translation.node_index = node;
+		translation.type = AnimationChannel::Type::Translation;
+		translation.timestamps = { 0.0f, 1.0f };
+		translation.linear.values = { vec3(s, 2.0f * s, -s), vec3(-s, 0.5f, 3.0f * s) };
+
+		AnimationChannel rotation;
+		rotation.node_index = node;
+		rotation.type = AnimationChannel::Type::Rotation;
+		rotation.timestamps = { 0.0f, 1.0f };
+		if (additive)
+		{
+			rotation.spherical.values = { rotation_from_axis(0.1f * s, vec3(0.0f, 1.0f, 0.0f)),
+			                              rotation_from_axis(0.3f * s, vec3(1.0f, 1.0f, 0.0f)) };
+		}
+		else
+		{
+			rotation.spherical.values = { rotation_from_axis(0.4f * s, vec3(1.0f, 0.2f, 0.0f)),
+			                              rotation_from_axis(0.9f * s, vec3(0.0f, 0.3f, 1.0f)) };
+		}
+
+		AnimationChannel scale;
+		scale.node_index = node;
+		scale.type = AnimationChannel::Type::Scale;
+		scale.timestamps = { 0.0f, 1.0f };
+		scale.linear.values = { vec3(1.0f + 0.1f * s), vec3(1.0f, 1.0f + 0.2f * s, 0.5f) };
+
+		animation.channels.push_back(std::move(translation));
+		animation.channels.push_back(std::move(rotation));
+		animation.channels.push_back(std::move(scale));
+	}
+	animation.update_length();
+	return animation;
+}
+
+static Transform sample_animation(const Animation &animation, unsigned node, float t)
+{
+	Transform transform;
+	for (auto &channel : animation.channels)
+	{
+		if (channel.node_index != node)
+			continue;
+
+		unsigned index;
+		float phase;
+		channel.get_index_phase(t, index, phase);
+		if (channel.type == AnimationChannel::Type::Translation)
+			transform.translation = channel.linear.sample(index, phase);
+		else if (channel.type == AnimationChannel::Type::Scale)
+			transform.scale = channel.linear.sample(index, phase);
+		else if (channel.type == AnimationChannel::Type::Rotation)
+			transform.rotation = channel.spherical.sample(index, phase);
+	}
+	return transform;
+}
+
+static float max_difference(const Transform &a, const Transform &b)
+{
+	vec4 qa = normalize(a.rotation.as_vec4());
+	vec4 qb = normalize(b.rotation.as_vec4());
+	if (dot(qa, qb) < 0.0f)
+		qb = -qb;
+
+	vec3 t = abs(a.translation - b.translation);
+	vec3 s = abs(a.scale - b.scale);
+	vec4 r = abs(qa - qb);
+	float d = std::max(std::max(t.x, t.y), t.z);
+	d = std::max(d, std::max(std::max(s.x, s.y), s.z));
+	d = std::max(d, std::max(std::max(r.x, r.y), std::max(r.z, r.w)));
+	return d;
+}
+
+struct BlendTest
+{
+	BlendTest()
+	{
+		system.register_animation("a", make_animation(0.5f, false));
+		system.register_animation("b", make_animation(1.5f, false));
+		system.register_animation("add", make_animation(0.25f, true));
+
+		for (unsigned i = 0; i < NumNodes; i++)
+		{
+			nodes[i] = scene.create_node();
+			nodes[i]->transform.translation = vec3(10.0f + float(i), -3.0f, 7.0f);
+			// The same orientation in the opposite hemisphere on odd nodes.
+			quat rotation = rotation_from_axis(0.7f + float(i), vec3(1.0f, 0.0f, 1.0f));
+			nodes[i]->transform.rotation = i & 1 ? quat(-rotation.as_vec4()) : rotation;
+			nodes[i]->transform.scale = vec3(2.0f, 3.0f, 4.0f + float(i));
+			rest[i] = nodes[i]->transform;
+		}
+	}
+
+	Scene scene;
+	AnimationSystem system;
+	Scene::NodeHandle nodes[NumNodes];
+	Transform rest[NumNodes];
+};
+
+static bool check(const char *test, const Transform &result, const Transform &reference, float tolerance)
+{
+	float d = max_difference(result, reference);
+	if (d > tolerance)
+	{
+		LOGE("%s: transform differs from the reference by %g.\n", test, d);
+		return false;
+	}
+	return true;
+}
+
+static const float SampleTimes[] = { 0.0f, 0.125f, 0.5f, 0.8f, 1.25f };
+
+// A single layer at weight 1 must give what playing the clip directly gives.
+static bool test_single_layer()
+{
+	BlendTest blended;
+	BlendTest plain;
+
+	unsigned blend = blended.system.create_blend(blended.nodes, NumNodes);
+	blended.system.add_blend_layer(blend, "a", 0.0, true);
+	plain.system.start_animation(plain.nodes, "a", 0.0, true);
+
+	for (float t : SampleTimes)
+	{
+		blended.system.animate(t);
+		plain.system.animate(t);
+		for (unsigned i = 0; i < NumNodes; i++)
+			if (!check("Single layer", blended.nodes[i]->transform, plain.nodes[i]->transform, 1e-6f))
+				return false;
+	}
+	return true;
+}
+
+// Two weighted layers and an additive layer, against the blend computed by hand from the sampled clips.
+// If the weighted layers add up to less than 1, the rest pose makes up for the difference.
+static bool test_weighted_and_additive(float wa, float wb, float wadd)
+{
+	BlendTest test;
+	auto a = make_animation(0.5f, false);
+	auto b = make_animation(1.5f, false);
+	auto add = make_animation(0.25f, true);
+
+	unsigned blend = test.system.create_blend(test.nodes, NumNodes);
+	test.system.add_blend_layer(blend, "a", 0.0, true, wa);
+	test.system.add_blend_layer(blend, "add", 0.0, true, wadd, AnimationSystem::BlendMode::Additive);
+	test.system.add_blend_layer(blend, "b", 0.0, true, wb);
+
+	float total = wa + wb;
+	float wrest = std::max(1.0f - total, 0.0f);
+	float normalize_weight = std::max(total, 1.0f);
+
+	for (float t : SampleTimes)
+	{
+		test.system.animate(t);
+		float wrapped = std::fmod(t, a.length);
+		for (unsigned i = 0; i < NumNodes; i++)
+		{
+			Transform ta = sample_animation(a, i, wrapped);
+			Transform tb = sample_animation(b, i, wrapped);
+			Transform tadd = sample_animation(add, i, wrapped);
+
+			vec4 qa = ta.rotation.as_vec4();
+			vec4 qb = tb.rotation.as_vec4();
+			if (dot(qa, qb) < 0.0f)
+				qb = -qb;
+			vec4 q = wa * qa + wb * qb;
+			vec4 qrest = test.rest[i].rotation.as_vec4();
+			if (dot(q, qrest) < 0.0f)
+				qrest = -qrest;
+			q += wrest * qrest;
+
+			vec4 qadd = tadd.rotation.as_vec4();
+			if (qadd.w < 0.0f)
+				qadd = -qadd;
+			quat additive_rotation(normalize(mix(vec4(0.0f, 0.0f, 0.0f, 1.0f), qadd, wadd)));
+
+			Transform reference;
+			reference.translation = (wa * ta.translation + wb * tb.translation + wrest * test.rest[i].translation) /
+			                        normalize_weight + wadd * tadd.translation;
+			reference.rotation = additive_rotation * quat(normalize(q));
+			reference.scale = (wa * ta.scale + wb * tb.scale + wrest * test.rest[i].scale) /
+			                  normalize_weight * mix(vec3(1.0f), tadd.scale, wadd);
+
+			if (!check("Weighted and additive", test.nodes[i]->transform, reference, 1e-5f))
+				return false;
+		}
+	}
+	return true;
+}
+
+// With every layer at weight 0, targets stay at the rest pose.
+static bool test_zero_weight()
+{
+	BlendTest test;
+	unsigned blend = test.system.create_blend(test.nodes, NumNodes);
+	unsigned layer_a = test.system.add_blend_layer(blend, "a", 0.0, true);
+	unsigned layer_add = test.system.add_blend_layer(blend, "add", 0.0, true, 1.0f, AnimationSystem::BlendMode::Additive);
+
+	test.system.animate(0.5);
+	test.system.set_blend_layer_weight(blend, layer_a, 0.0f);
+	test.system.set_blend_layer_weight(blend, layer_add, 0.0f);
+
+	for (float t : SampleTimes)
+	{
+		test.system.animate(t);
+		for (unsigned i = 0; i < NumNodes; i++)
+			if (!check("Zero weight", test.nodes[i]->transform, test.rest[i], 1e-6f))
+				return false;
+	}
+	return true;
+}
+
+// Blends are evaluated in parallel, so two of them must not write the same transform.
+static bool test_overlapping_targets()
+{
+	BlendTest test;
+	test.system.create_blend(test.nodes, 2);
+
+	bool rejected = false;
+	try
+	{
+		test.system.create_blend(test.nodes + 1, 2);
+	}
+	catch (const std::logic_error &)
+	{
+		rejected = true;
+	}
+
+	if (!rejected)
+	{
+		LOGE("Overlapping blends were not rejected.\n");
+		return false;
+	}
+
+	// The rejected blend must not have claimed the node it did not overlap on.
+	test.system.create_blend(test.nodes + 2, 1);
+	return true;
+}
+
+int main()
+{
+	if (!test_single_layer() ||
+	    !test_weighted_and_additive(0.25f, 0.75f, 0.5f) ||
+	    !test_weighted_and_additive(0.2f, 0.4f, 1.0f) ||
+	    !test_weighted_and_additive(1.5f, 0.5f, 0.3f) ||
+	    !test_zero_weight() ||
+	    !test_overlapping_targets())
+		return EXIT_FAILURE;
+
+	LOGI("Animation blend test passed.\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,339 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "animation_compression.hpp"
+#include "util.hpp"
+#include <random>
+#include <cmath>
+#include <float.h>
+#include <string.h>
+#include <stdlib.h>
+
+using namespace Granite;
+using namespace Granite::SceneFormats;
+
+static void sample_channel(const AnimationChannel &channel, float t, vec3 &v, quat &q)
+{
+	unsigned index;
+	float phase;
+	channel.get_index_phase(t, index, phase);
+
+	switch (channel.type)
+	{
+	case AnimationChannel::Type::Translation:
+	case AnimationChannel::Type::Scale:
+		v = channel.linear.sample(index, phase);
+		break;
+
+	case AnimationChannel::Type::Rotation:
+		q = channel.spherical.sample(index, phase);
+		break;
+
+	case AnimationChannel::Type::CubicTranslation:
+	case AnimationChannel::Type::CubicScale:
+	{
+		float dt = channel.timestamps.size() > 1 ? channel.timestamps[index + 1] - channel.timestamps[index] : 0.0f;
+		v = channel.cubic.sample(index, phase, dt);
+		break;
+	}
+	}
+}
+
+static float rotation_error(const quat &a, const quat &b)
+{
+	vec4 x = normalize(a.as_vec4());
+	vec4 y = normalize(b.as_vec4());
+	if (dot(x, y) < 0.0f)
+		y = -y;
+	return 4.0f * std::asin(std::min(0.5f * length(x - y), 1.0f));
+}
+
+static AnimationChannel make_channel(unsigned node, AnimationChannel::Type type)
+{
+	AnimationChannel channel;
+	channel.node_index = node;
+	channel.type = type;
+	return channel;
+}
+
+static Animation make_animation()
+{
+	std::mt19937 rnd(11);
+	std::uniform_real_distribution<float> freq(0.5f, 4.0f);
+	std::uniform_real_distribution<float> jitter(0.0f, 0.02f);
+
+	Animation animation;
+	animation.name = "test";
+
+	for (unsigned node = 0; node < 8; node++)
+	{
+		auto translation = make_channel(node, AnimationChannel::Type::Translation);
+		auto rotation = make_channel(node, AnimationChannel::Type::Rotation);
+		auto scale = make_channel(node, node & 1 ? AnimationChannel::Type::CubicScale : AnimationChannel::Type::Scale);
+		float f[4] = { freq(rnd), freq(rnd), freq(rnd), freq(rnd) };
+
+		// Irregular key times on odd nodes, so not every channel shares a timeline.
+		for (unsigned i = 0; i <= 400; i++)
+		{
+			float t = i / 30.0f + ((node & 1) && i != 0 ? jitter(rnd) : 0.0f);
+
+			vec3 v;
+			if (node == 0)
+				v = vec3(1.0f, 2.0f, 3.0f);
+			else if (node == 1)
+				v = vec3(400.0f * std::sin(f[0] * t), 300.0f * t, -50.0f); // Too large for 16 bits within the error.
+			else
+				v = vec3(std::sin(f[0] * t), 0.25f * t, std::cos(f[1] * t));
+
+			translation.timestamps.push_back(t);
+			translation.linear.values.push_back(v);
+
+			vec4 q = normalize(vec4(std::sin(f[2] * t), 0.3f, std::cos(f[3] * t), 1.0f));
+			rotation.timestamps.push_back(t);
+			rotation.spherical.values.push_back(quat(q));
+
+			scale.timestamps.push_back(t);
+			if (scale.type == AnimationChannel::Type::CubicScale)
+			{
+				for (unsigned k = 0; k < 3; k++)
+					scale.cubic.values.push_back(vec3(1.0f + 0.1f * std::sin(f[0] * t + float(k))));
+			}
+			else
+				scale.linear.values.push_back(vec3(1.0f + (i > 200 ? 0.2f : 0.0f) * float(i & 1)));
+		}
+
+		animation.channels.push_back(std::move(translation));
+		animation.channels.push_back(std::move(rotation));
+		animation.channels.push_back(std::move(scale));
+	}
+
+	animation.update_length();
+	return animation;
+}
+
+// Decoded values may differ from the source by the error limits of the options,
+// plus the rounding of interpolating between keys at the magnitude of the values.
+static bool check_error(const Animation &source, const CompressedAnimation &compressed,
+                        const AnimationCompressionOptions &options)
+{
+	auto decoded = compressed.decode();
+	if (decoded.channels.size() != source.channels.size())
+	{
+		LOGE("Expected %u channels, got %u.\n", unsigned(source.channels.size()), unsigned(decoded.channels.size()));
+		return false;
+	}
+
+	size_t source_keys = 0;
+	size_t decoded_keys = 0;
+	float max_linear_error = 0.0f;
+	float max_rotation_error = 0.0f;
+
+	for (size_t c = 0; c < source.channels.size(); c++)
+	{
+		auto &src = source.channels[c];
+		auto &dst = decoded.channels[c];
+		source_keys += src.timestamps.size();
+		decoded_keys += dst.timestamps.size();
+
+		float max_error = 0.0f;
+		if (src.type == AnimationChannel::Type::Translation)
+			max_error = options.translation_error;
+		else if (src.type == AnimationChannel::Type::Scale)
+			max_error = options.scale_error;
+		else if (src.type == AnimationChannel::Type::Rotation)
+			max_error = options.rotation_error;
+
+		for (size_t i = 0; i < src.timestamps.size(); i++)
+		{
+			float t = src.timestamps[i];
+			vec3 a(0.0f), b(0.0f);
+			quat qa(1.0f, 0.0f, 0.0f, 0.0f), qb(1.0f, 0.0f, 0.0f, 0.0f);
+			sample_channel(src, t, a, qa);
+			sample_channel(dst, t, b, qb);
+
+			float error;
+			float tolerance;
+			if (src.type == AnimationChannel::Type::Rotation)
+			{
+				error = rotation_error(qa, qb);
+				tolerance = max_error + 1e-6f;
+				max_rotation_error = std::max(max_rotation_error, error);
+			}
+			else
+			{
+				vec3 d = abs(a - b);
+				vec3 m = abs(a);
+				error = std::max(std::max(d.x, d.y), d.z);
+				tolerance = max_error + 4.0f * FLT_EPSILON * std::max(1.0f, std::max(std::max(m.x, m.y), m.z));
+				max_linear_error = std::max(max_linear_error, error);
+			}
+
+			if (error > tolerance)
+			{
+				LOGE("Channel %u at t = %f: error %g exceeds %g.\n", unsigned(c), t, error, tolerance);
+				return false;
+			}
+		}
+	}
+
+	LOGI("Keys %u -> %u, %u bytes, max error: linear %g, rotation %g.\n",
+	     unsigned(source_keys), unsigned(decoded_keys), unsigned(compressed.get_memory_usage()),
+	     max_linear_error, max_rotation_error);
+	return true;
+}
+
+// Sampling a decoded chunk anywhere in its window, boundaries included, must match sampling the full clip exactly.
+static bool check_chunks(const CompressedAnimation &compressed, const AnimationCompressionOptions &options)
+{
+	auto decoded = compressed.decode();
+	Animation chunk;
+	unsigned count = compressed.get_chunk_count();
+	if (count < 2)
+	{
+		LOGE("Expected more than one chunk.\n");
+		return false;
+	}
+
+	for (unsigned c = 0; c < count; c++)
+	{
+		compressed.decode_chunk(c, chunk);
+		float window_begin = float(c) * options.chunk_duration;
+		float window_end = std::min(float(c + 1) * options.chunk_duration, compressed.get_length());
+
+		for (unsigned s = 0; s <= 256; s++)
+		{
+			float t = window_begin + (window_end - window_begin) * (float(s) / 256.0f);
+			if (s == 0)
+				t = window_begin;
+			else if (s == 256)
+				t = window_end;
+
+			if (compressed.get_chunk_index(t) != c && s != 0 && s != 256)
+			{
+				LOGE("t = %f is inside chunk %u, but get_chunk_index() returned %u.\n", t, c, compressed.get_chunk_index(t));
+				return false;
+			}
+
+			for (size_t i = 0; i < decoded.channels.size(); i++)
+			{
+				vec3 a(0.0f), b(0.0f);
+				quat qa(1.0f, 0.0f, 0.0f, 0.0f), qb(1.0f, 0.0f, 0.0f, 0.0f);
+				sample_channel(decoded.channels[i], t, a, qa);
+				sample_channel(chunk.channels[i], t, b, qb);
+				if (memcmp(&a, &b, sizeof(a)) != 0 || memcmp(&qa, &qb, sizeof(qa)) != 0)
+				{
+					LOGE("Chunk %u, channel %u differs from the full clip at t = %f.\n", c, unsigned(i), t);
+					return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+// What the glTF exporter does: reduce keys on their own, then store rotations as snorm16.
+// The kept rotations, as loaded back, must still be within the error limit at every source key.
+static bool check_snorm16_reduction(const Animation &source, const AnimationCompressionOptions &options)
+{
+	Animation reduced = source;
+	reduce_animation_keys(reduced, options, true);
+
+	float max_error = 0.0f;
+	for (size_t c = 0; c < source.channels.size(); c++)
+	{
+		auto &src = source.channels[c];
+		auto &dst = reduced.channels[c];
+		if (src.type != AnimationChannel::Type::Rotation)
+			continue;
+
+		for (auto &q : dst.spherical.values)
+		{
+			uint16_t encoded[4];
+			quantize_rotation(q, encoded);
+			q = dequantize_rotation(encoded);
+		}
+
+		for (float t : src.timestamps)
+		{
+			vec3 v;
+			quat qa(1.0f, 0.0f, 0.0f, 0.0f), qb(1.0f, 0.0f, 0.0f, 0.0f);
+			sample_channel(src, t, v, qa);
+			sample_channel(dst, t, v, qb);
+
+			float error = rotation_error(qa, qb);
+			max_error = std::max(max_error, error);
+			if (error > options.rotation_error + 1e-6f)
+			{
+				LOGE("snorm16 rotation channel %u at t = %f: error %g exceeds %g.\n",
+				     unsigned(c), t, error, options.rotation_error);
+				return false;
+			}
+		}
+	}
+
+	LOGI("Reduced snorm16 rotations, max error %g.\n", max_error);
+	return true;
+}
+
+int main()
+{
+	auto animation = make_animation();
+
+	AnimationCompressionOptions options;
+	options.chunk_duration = 3.0f;
+
+	// Tighter limits than snorm16 can meet push rotations to full precision too.
+	AnimationCompressionOptions tight = options;
+	tight.translation_error = 1e-5f;
+	tight.rotation_error = 1e-5f;
+	tight.scale_error = 1e-5f;
+
+	// Loose limits drop most keys, so interpolation spans long runs of quantized values.
+	AnimationCompressionOptions loose = options;
+	loose.translation_error = 1e-2f;
+	loose.rotation_error = 1e-2f;
+	loose.scale_error = 1e-2f;
+	loose.chunk_duration = 1.0f;
+
+	for (auto *opts : { &options, &tight, &loose })
+	{
+		CompressedAnimation compressed(animation, *opts);
+		if (!check_error(animation, compressed, *opts))
+			return EXIT_FAILURE;
+		if (!check_chunks(compressed, *opts))
+			return EXIT_FAILURE;
+	}
+
+	// Limits below what snorm16 can represent are left out, the exporter has no full precision fallback.
+	// Selecting keys against the source rotations exceeds some of these limits.
+	for (float rotation_error : { 1e-4f, 3e-4f, 5e-4f, 3e-3f, 1e-2f })
+	{
+		AnimationCompressionOptions snorm16 = options;
+		snorm16.rotation_error = rotation_error;
+		if (!check_snorm16_reduction(animation, snorm16))
+			return EXIT_FAILURE;
+	}
+
+	LOGI("Animation compression test passed.\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,278 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "scene_formats.hpp"
+#include "transforms.hpp"
+#include "util.hpp"
+#include <random>
+#include <cmath>
+#include <stdlib.h>
+
+using namespace Granite;
+using namespace Granite::SceneFormats;
+
+// Not a multiple of 4, so the padding lanes get exercised as well.
+static const size_t num_channels = 37;
+static const size_t stride = (num_channels + 3) & ~size_t(3);
+
+static bool close(float a, float b)
+{
+	return std::abs(a - b) <= 1e-5f * std::max(1.0f, std::abs(b));
+}
+
+// Every phase of interest for each channel: no change, both ends, and in between.
+static std::vector<float> make_phases(std::mt19937 &rnd)
+{
+	std::uniform_real_distribution<float> phase(0.0f, 1.0f);
+	std::vector<float> phases(stride);
+	for (size_t i = 0; i < stride; i++)
+	{
+		switch (i % 5)
+		{
+		case 0:
+			phases[i] = 0.0f;
+			break;
+		case 1:
+			phases[i] = 1.0f;
+			break;
+		default:
+			phases[i] = phase(rnd);
+			break;
+		}
+	}
+	return phases;
+}
+
+static bool test_linear(std::mt19937 &rnd)
+{
+	std::uniform_real_distribution<float> value(-100.0f, 100.0f);
+	std::vector<float> a(3 * stride), b(3 * stride), out(3 * stride);
+
+	for (unsigned iteration = 0; iteration < 16; iteration++)
+	{
+		auto phases = make_phases(rnd);
+		LinearSampler sampler;
+		for (size_t i = 0; i < stride; i++)
+		{
+			vec3 va(value(rnd), value(rnd), value(rnd));
+			vec3 vb(value(rnd), value(rnd), value(rnd));
+			for (unsigned c = 0; c < 3; c++)
+			{
+				a[c * stride + i] = va[c];
+				b[c * stride + i] = vb[c];
+			}
+			sampler.values.push_back(va);
+			sampler.values.push_back(vb);
+		}
+
+		sample_linear_soa(out.data(), a.data(), b.data(), phases.data(), stride);
+
+		for (size_t i = 0; i < num_channels; i++)
+		{
+			vec3 ref = sampler.sample(unsigned(2 * i), phases[i]);
+			for (unsigned c = 0; c < 3; c++)
+			{
+				if (!close(out[c * stride + i], ref[c]))
+				{
+					LOGE("Linear channel %u, phase %f: %f != %f.\n", unsigned(i), phases[i], out[c * stride + i], ref[c]);
+					return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+static quat random_rotation(std::mt19937 &rnd)
+{
+	std::uniform_real_distribution<float> angle(-3.1f, 3.1f);
+	std::uniform_real_distribution<float> axis(-1.0f, 1.0f);
+	vec3 v(axis(rnd), axis(rnd), axis(rnd) + 2.0f);
+	return angleAxis(angle(rnd), v);
+}
+
+static bool test_slerp(std::mt19937 &rnd)
+{
+	std::uniform_real_distribution<float> small_angle(0.0f, 0.02f);
+	std::vector<float> a(4 * stride), b(4 * stride), out(4 * stride);
+
+	for (unsigned iteration = 0; iteration < 16; iteration++)
+	{
+		auto phases = make_phases(rnd);
+		SlerpSampler sampler;
+		for (size_t i = 0; i < stride; i++)
+		{
+			quat qa = random_rotation(rnd);
+			quat qb;
+
+			// Equal and nearly equal rotations take the lerp path, and every other channel is in the opposite hemisphere.
+			if (i & 2)
+				qb = qa * angleAxis(i & 4 ? 0.0f : small_angle(rnd), vec3(0.0f, 1.0f, 0.0f));
+			else
+				qb = random_rotation(rnd);
+			if (i & 1)
+				qb = quat(-qb.as_vec4());
+
+			for (unsigned c = 0; c < 4; c++)
+			{
+				a[c * stride + i] = qa.as_vec4()[c];
+				b[c * stride + i] = qb.as_vec4()[c];
+			}
+			sampler.values.push_back(qa);
+			sampler.values.push_back(qb);
+		}
+
+		sample_slerp_soa(out.data(), a.data(), b.data(), phases.data(), stride);
+
+		for (size_t i = 0; i < num_channels; i++)
+		{
+			vec4 ref = sampler.sample(unsigned(2 * i), phases[i]).as_vec4();
+			for (unsigned c = 0; c < 4; c++)
+			{
+				if (!close(out[c * stride + i], ref[c]))
+				{
+					LOGE("Slerp channel %u, phase %f: %f != %f.\n", unsigned(i), phases[i], out[c * stride + i], ref[c]);
+					return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+static bool test_cubic(std::mt19937 &rnd)
+{
+	std::uniform_real_distribution<float> value(-10.0f, 10.0f);
+	std::uniform_real_distribution<float> duration(0.01f, 2.0f);
+	std::vector<float> p0(3 * stride), m0(3 * stride), m1(3 * stride), p1(3 * stride), out(3 * stride);
+	std::vector<float> dt(stride);
+
+	for (unsigned iteration = 0; iteration < 16; iteration++)
+	{
+		auto phases = make_phases(rnd);
+		std::vector<CubicSampler> samplers(stride);
+		for (size_t i = 0; i < stride; i++)
+		{
+			// In-tangent, value and out-tangent of two keys.
+			auto &values = samplers[i].values;
+			for (unsigned k = 0; k < 6; k++)
+				values.push_back(vec3(value(rnd), value(rnd), value(rnd)));
+
+			for (unsigned c = 0; c < 3; c++)
+			{
+				p0[c * stride + i] = values[1][c];
+				m0[c * stride + i] = values[2][c];
+				m1[c * stride + i] = values[3][c];
+				p1[c * stride + i] = values[4][c];
+			}
+			dt[i] = duration(rnd);
+		}
+
+		sample_cubic_soa(out.data(), p0.data(), m0.data(), m1.data(), p1.data(), phases.data(), dt.data(), stride);
+
+		for (size_t i = 0; i < num_channels; i++)
+		{
+			vec3 ref = samplers[i].sample(0, phases[i], dt[i]);
+			for (unsigned c = 0; c < 3; c++)
+			{
+				// The terms are summed in a different order, so allow for the magnitude of the inputs.
+				if (std::abs(out[c * stride + i] - ref[c]) > 1e-4f)
+				{
+					LOGE("Cubic channel %u, phase %f: %f != %f.\n", unsigned(i), phases[i], out[c * stride + i], ref[c]);
+					return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+static bool check_cursor(const AnimationChannel &channel, float t, unsigned &cursor)
+{
+	unsigned index, ref_index;
+	float phase, ref_phase;
+	channel.get_index_phase(t, ref_index, ref_phase);
+	channel.get_index_phase(t, index, phase, cursor);
+	if (index != ref_index || phase != ref_phase)
+	{
+		LOGE("t = %f: cursor gives key %u, phase %f, the scan key %u, phase %f.\n", t, index, phase, ref_index, ref_phase);
+		return false;
+	}
+	return true;
+}
+
+static bool test_cursor(std::mt19937 &rnd)
+{
+	std::uniform_real_distribution<float> spacing(0.01f, 0.1f);
+	AnimationChannel channel;
+	channel.type = AnimationChannel::Type::Translation;
+	float t = 0.25f;
+	for (unsigned i = 0; i < 200; i++)
+	{
+		channel.timestamps.push_back(t);
+		t += spacing(rnd);
+	}
+
+	float length = channel.get_length();
+	std::uniform_real_distribution<float> seek(-0.5f, length + 0.5f);
+	unsigned cursor = 0;
+
+	// Forward play, at steps shorter than a key and steps skipping many keys, wrapping around at the end.
+	for (float step : { 0.004f, 0.05f, 0.3f, 2.0f })
+	{
+		for (float time = 0.0f; time < 3.0f * length; time += step)
+			if (!check_cursor(channel, std::fmod(time, length), cursor))
+				return false;
+	}
+
+	// Exactly on every key, forward and backward.
+	for (float key : channel.timestamps)
+		if (!check_cursor(channel, key, cursor))
+			return false;
+	for (auto itr = channel.timestamps.rbegin(); itr != channel.timestamps.rend(); ++itr)
+		if (!check_cursor(channel, *itr, cursor))
+			return false;
+
+	// Random seeks, including before the first key and after the last.
+	for (unsigned i = 0; i < 10000; i++)
+		if (!check_cursor(channel, seek(rnd), cursor))
+			return false;
+
+	// A cursor left over from a longer channel.
+	cursor = 1000;
+	if (!check_cursor(channel, 0.5f * length, cursor))
+		return false;
+
+	return true;
+}
+
+int main()
+{
+	std::mt19937 rnd(7);
+	if (!test_linear(rnd) || !test_slerp(rnd) || !test_cubic(rnd) || !test_cursor(rnd))
+		return EXIT_FAILURE;
+
+	LOGI("Batched samplers and key cursors match the scalar paths.\n");
+}
@@ -0,0 +1,256 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ecs.hpp"
+#include "timer.hpp"
+#include "util.hpp"
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+
+using namespace Granite;
+
+struct PositionComponent : ComponentBase
+{
+	float x = 0.0f, y = 0.0f, z = 0.0f;
+};
+
+struct VelocityComponent : ComponentBase
+{
+	float x = 1.0f, y = 2.0f, z = 3.0f;
+};
+
+// Stand-in for everything else living in a scene which shares PositionComponent with the movers.
+struct PayloadComponent : ComponentBase
+{
+	float data[16] = {};
+};
+
+struct Result
+{
+	double create_nsecs;
+	double iterate_nsecs;
+	double iterate_chunks_nsecs;
+	double destroy_nsecs;
+	float checksum;
+};
+
+using MoverGroup = std::vector<std::tuple<PositionComponent *, VelocityComponent *>>;
+using MoverChunks = std::vector<EntityGroup<PositionComponent, VelocityComponent>::Chunk>;
+
+static double iterate_group(MoverGroup &group)
+{
+	const unsigned iterations = 20;
+	auto start = Util::get_current_time_nsecs();
+	for (unsigned iter = 0; iter < iterations; iter++)
+	{
+		for (auto &e : group)
+		{
+			auto *pos = std::get<0>(e);
+			auto *vel = std::get<1>(e);
+			pos->x += vel->x * 0.01f;
+			pos->y += vel->y * 0.01f;
+			pos->z += vel->z * 0.01f;
+		}
+	}
+	return double(Util::get_current_time_nsecs() - start) / double(iterations * group.size());
+}
+
+static double iterate_chunks(const MoverChunks &chunks, size_t count)
+{
+	const unsigned iterations = 20;
+	auto start = Util::get_current_time_nsecs();
+	for (unsigned iter = 0; iter < iterations; iter++)
+	{
+		for (auto &chunk : chunks)
+		{
+			auto *pos = std::get<0>(chunk.components);
+			auto *vel = std::get<1>(chunk.components);
+			for (size_t i = 0; i < chunk.count; i++)
+			{
+				pos[i].x += vel[i].x * 0.01f;
+				pos[i].y += vel[i].y * 0.01f;
+				pos[i].z += vel[i].z * 0.01f;
+			}
+		}
+	}
+	return double(Util::get_current_time_nsecs() - start) / double(iterations * count);
+}
+
+// Both views of a group must visit exactly the same components, each of them once.
+static bool check_chunks(const MoverGroup &group, const MoverChunks &chunks)
+{
+	std::vector<std::pair<PositionComponent *, VelocityComponent *>> from_group;
+	std::vector<std::pair<PositionComponent *, VelocityComponent *>> from_chunks;
+	from_group.reserve(group.size());
+	from_chunks.reserve(group.size());
+
+	for (auto &e : group)
+		from_group.emplace_back(std::get<0>(e), std::get<1>(e));
+	for (auto &chunk : chunks)
+		for (size_t i = 0; i < chunk.count; i++)
+			from_chunks.emplace_back(std::get<0>(chunk.components) + i, std::get<1>(chunk.components) + i);
+
+	std::sort(std::begin(from_group), std::end(from_group));
+	std::sort(std::begin(from_chunks), std::end(from_chunks));
+	if (from_group != from_chunks)
+	{
+		LOGE("Chunks visit %u components, group has %u, or they differ.\n",
+		     unsigned(from_chunks.size()), unsigned(from_group.size()));
+		return false;
+	}
+	return true;
+}
+
+template <typename Create>
+static bool run(const char *tag, size_t count, Create &&create, Result &result)
+{
+	EntityPool pool;
+	auto &group = pool.get_component_group<PositionComponent, VelocityComponent>();
+
+	std::vector<EntityHandle> handles;
+	handles.reserve(2 * count);
+
+	auto start = Util::get_current_time_nsecs();
+	for (size_t i = 0; i < count; i++)
+		create(pool, handles);
+	result.create_nsecs = double(Util::get_current_time_nsecs() - start) / double(2 * count);
+
+	auto &chunks = pool.get_component_chunks<PositionComponent, VelocityComponent>();
+	if (!check_chunks(group, chunks))
+		return false;
+
+	result.iterate_nsecs = iterate_group(group);
+	result.iterate_chunks_nsecs = iterate_chunks(chunks, group.size());
+
+	result.checksum = 0.0f;
+	for (auto &e : group)
+		result.checksum += std::get<0>(e)->y;
+	unsigned group_size = unsigned(group.size());
+
+	start = Util::get_current_time_nsecs();
+	handles.clear();
+	result.destroy_nsecs = double(Util::get_current_time_nsecs() - start) / double(2 * count);
+
+	LOGI("%-10s: create %6.1f ns/entity, iterate %5.2f ns/entity, iterate chunks %5.2f ns/entity (%u chunks), "
+	     "destroy %6.1f ns/entity (%u entities in group).\n",
+	     tag, result.create_nsecs, result.iterate_nsecs, result.iterate_chunks_nsecs, unsigned(chunks.size()),
+	     result.destroy_nsecs, group_size);
+	return true;
+}
+
+// Streams out every other mover, either one handle at a time or in one batch.
+// Returns the cost per destroyed entity, or a negative value if the group ended up wrong.
+static double run_removal(size_t count, bool bulk)
+{
+	EntityPool pool;
+	auto &group = pool.get_component_group<PositionComponent, VelocityComponent>();
+
+	std::vector<EntityHandle> handles;
+	handles.reserve(count);
+	for (size_t i = 0; i < count; i++)
+		handles.push_back(pool.create_archetype_entity<PositionComponent, VelocityComponent>());
+
+	std::vector<EntityHandle> removed;
+	std::vector<EntityHandle> kept;
+	for (size_t i = 0; i < count; i++)
+		(i & 1 ? removed : kept).push_back(std::move(handles[i]));
+	handles.clear();
+
+	auto start = Util::get_current_time_nsecs();
+	if (bulk)
+		pool.destroy_entities(removed.data(), removed.size());
+	else
+		for (auto &handle : removed)
+			handle.reset();
+	double destroy_nsecs = double(Util::get_current_time_nsecs() - start) / double(removed.size());
+
+	if (group.size() != kept.size())
+	{
+		LOGE("Expected %u entities in group, got %u.\n", unsigned(kept.size()), unsigned(group.size()));
+		return -1.0;
+	}
+
+	// Every other slot is now a hole, so each chunk is a single entity.
+	auto &chunks = pool.get_component_chunks<PositionComponent, VelocityComponent>();
+	if (!check_chunks(group, chunks))
+		return -1.0;
+
+	LOGI("%-10s: destroy %6.1f ns/entity, iterate remaining %5.2f ns/entity.\n",
+	     bulk ? "bulk" : "one-by-one", destroy_nsecs, iterate_group(group));
+	return destroy_nsecs;
+}
+
+int main()
+{
+	// Movers and static objects are created interleaved, as when loading a scene.
+	const size_t count = 1000000;
+
+	Result per_component, archetype;
+	bool success = run("component", count, [](EntityPool &pool, std::vector<EntityHandle> &handles) {
+		auto mover = pool.create_entity();
+		mover->allocate_component<PositionComponent>();
+		mover->allocate_component<VelocityComponent>();
+		handles.push_back(mover);
+
+		auto other = pool.create_entity();
+		other->allocate_component<PositionComponent>();
+		other->allocate_component<PayloadComponent>();
+		handles.push_back(other);
+	}, per_component);
+
+	success = success && run("archetype", count, [](EntityPool &pool, std::vector<EntityHandle> &handles) {
+		handles.push_back(pool.create_archetype_entity<PositionComponent, VelocityComponent>());
+		handles.push_back(pool.create_archetype_entity<PositionComponent, PayloadComponent>());
+	}, archetype);
+
+	if (!success)
+		return EXIT_FAILURE;
+
+	if (per_component.checksum != archetype.checksum)
+	{
+		LOGE("Checksum mismatch, %f != %f.\n", per_component.checksum, archetype.checksum);
+		return EXIT_FAILURE;
+	}
+
+	LOGI("Archetype chunk iteration speedup: %.2fx over per-component tuples, %.2fx over archetype tuples.\n",
+	     per_component.iterate_nsecs / archetype.iterate_chunks_nsecs,
+	     archetype.iterate_nsecs / archetype.iterate_chunks_nsecs);
+
+	// Take the best of a few runs, so a single hiccup does not skew the comparison.
+	double one_by_one_nsecs = 0.0;
+	double bulk_nsecs = 0.0;
+	for (unsigned iter = 0; iter < 3; iter++)
+	{
+		double one_by_one = run_removal(count, false);
+		double bulk = run_removal(count, true);
+		if (one_by_one < 0.0 || bulk < 0.0)
+			return EXIT_FAILURE;
+		one_by_one_nsecs = iter ? std::min(one_by_one_nsecs, one_by_one) : one_by_one;
+		bulk_nsecs = iter ? std::min(bulk_nsecs, bulk) : bulk;
+	}
+
+	// Timing depends on the machine and its load, so this is only reported.
+	LOGI("Bulk destroy: %.1f ns/entity, one-by-one: %.1f ns/entity (%.2fx).\n",
+	     bulk_nsecs, one_by_one_nsecs, one_by_one_nsecs / bulk_nsecs);
+	return EXIT_SUCCESS;
+}
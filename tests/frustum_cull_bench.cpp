@@ -0,0 +1,114 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "frustum.hpp"
+#include "transforms.hpp"
+#include "muglm/matrix_helper.hpp"
+#include "timer.hpp"
+#include "util.hpp"
+#include <random>
+#include <vector>
+#include <stdlib.h>
+
+using namespace Granite;
+
+static Frustum build_frustum(const vec3 &eye, const vec3 &direction)
+{
+	mat4 view = mat4_cast(look_at(direction, vec3(0.0f, 1.0f, 0.0f))) * translate(-eye);
+	mat4 proj = projection(0.5f * pi<float>(), 16.0f / 9.0f, 0.1f, 500.0f);
+
+	Frustum frustum;
+	frustum.build_planes(inverse(proj * view));
+	return frustum;
+}
+
+int main()
+{
+	const size_t count = 1 << 20;
+	std::mt19937 rnd(1337);
+	std::uniform_real_distribution<float> position(-500.0f, 500.0f);
+	std::uniform_real_distribution<float> extent(0.01f, 10.0f);
+
+	std::vector<AABB> boxes;
+	boxes.reserve(count);
+	AABBSoA bounds;
+	bounds.resize(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		vec3 center(position(rnd), position(rnd), position(rnd));
+		vec3 half(extent(rnd), extent(rnd), extent(rnd));
+		boxes.emplace_back(center - half, center + half);
+		bounds.set(i, boxes.back());
+	}
+
+	auto frustum = build_frustum(vec3(10.0f, 20.0f, 30.0f), normalize(vec3(0.3f, -0.1f, -1.0f)));
+
+	std::vector<uint32_t> reference((count + 31) / 32);
+	std::vector<uint32_t> scalar_mask((count + 31) / 32);
+	std::vector<uint32_t> simd_mask((count + 31) / 32);
+
+	const unsigned iterations = 20;
+	auto start = Util::get_current_time_nsecs();
+	for (unsigned iter = 0; iter < iterations; iter++)
+	{
+		std::fill(reference.begin(), reference.end(), 0u);
+		for (size_t i = 0; i < count; i++)
+			if (frustum.intersects_fast(boxes[i]))
+				reference[i >> 5] |= 1u << (i & 31);
+	}
+	auto per_box_nsecs = Util::get_current_time_nsecs() - start;
+
+	start = Util::get_current_time_nsecs();
+	for (unsigned iter = 0; iter < iterations; iter++)
+		frustum.intersects_fast_scalar(bounds, 0, count, scalar_mask.data());
+	auto scalar_nsecs = Util::get_current_time_nsecs() - start;
+
+	start = Util::get_current_time_nsecs();
+	for (unsigned iter = 0; iter < iterations; iter++)
+		frustum.intersects_fast(bounds, 0, count, simd_mask.data());
+	auto simd_nsecs = Util::get_current_time_nsecs() - start;
+
+	double boxes_total = double(count) * iterations;
+	LOGI("Per-box AABB test:  %.3f boxes/ns\n", boxes_total / double(per_box_nsecs));
+	LOGI("Batched scalar:     %.3f boxes/ns\n", boxes_total / double(scalar_nsecs));
+	LOGI("Batched SIMD:       %.3f boxes/ns\n", boxes_total / double(simd_nsecs));
+
+	if (reference != scalar_mask || reference != simd_mask)
+	{
+		LOGE("Batched culling results differ from Frustum::intersects_fast().\n");
+		return EXIT_FAILURE;
+	}
+
+	// Ranges which do not end on a mask word boundary must leave the padding bits cleared.
+	frustum.intersects_fast(bounds, 64, 64 + 45, simd_mask.data());
+	if (simd_mask[2] != reference[2] || simd_mask[3] != (reference[3] & ((1u << 13) - 1u)))
+	{
+		LOGE("Partial range produced wrong results.\n");
+		return EXIT_FAILURE;
+	}
+
+	unsigned visible = 0;
+	for (auto word : reference)
+		for (; word; word &= word - 1)
+			visible++;
+	LOGI("%u of %u boxes visible, all kernels agree.\n", visible, unsigned(count));
+}
@@ -0,0 +1,256 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "hashmap.hpp"
+#include "timer.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using namespace Util;
+
+// What Hasher::data() did before bulk hashing, one element per multiply.
+template <typename T>
+static Hash hash_elements(const T *data, size_t size)
+{
+	Hash h = 0xcbf29ce484222325ull;
+	size /= sizeof(*data);
+	for (size_t i = 0; i < size; i++)
+		h = (h * 0x100000001b3ull) ^ data[i];
+	return h;
+}
+
+template <typename T>
+static Hash hash_hasher(const T *data, size_t size)
+{
+	Hasher h;
+	h.data(data, size);
+	return h.get();
+}
+
+template <typename T, typename Func>
+static double bench_throughput(const std::vector<uint8_t> &buffer, size_t size, const Func &func)
+{
+	size_t iterations = std::max<size_t>(1, (256u << 20) / size);
+	size_t offset_mask = buffer.size() / size > 1 ? 4095 : 0;
+	Hash sink = 0;
+
+	auto start = get_current_time_nsecs();
+	for (size_t i = 0; i < iterations; i++)
+	{
+		size_t offset = (i * 64) & offset_mask;
+		sink ^= func(reinterpret_cast<const T *>(buffer.data() + offset), size);
+	}
+	auto end = get_current_time_nsecs();
+
+	if (sink == 1)
+		LOGI("Unlikely.\n");
+	return double(iterations) * size / double(end - start);
+}
+
+static size_t count_collisions(std::vector<Hash> &hashes, Hash mask)
+{
+	for (auto &hash : hashes)
+		hash &= mask;
+	std::sort(hashes.begin(), hashes.end());
+	size_t collisions = 0;
+	for (size_t i = 1; i < hashes.size(); i++)
+		if (hashes[i] == hashes[i - 1])
+			collisions++;
+	return collisions;
+}
+
+// Structured keys like pipeline state: mostly constant blobs where only a few words or bits change.
+template <typename Func>
+static void report_collisions(const char *tag, size_t blob_size, const Func &func)
+{
+	const size_t count = 1u << 22;
+	std::vector<uint32_t> blob(blob_size / sizeof(uint32_t));
+	std::vector<Hash> hashes(count);
+	std::mt19937 rnd(7);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		std::fill(blob.begin(), blob.end(), 0u);
+		// Two small counters in different words make every key unique. On top of that,
+		// one bit is flipped in one of the other words.
+		size_t counter0 = 1;
+		size_t counter1 = blob.size() - 2;
+		blob[counter0] = uint32_t(i & 1023);
+		blob[counter1] = uint32_t(i >> 10);
+		size_t word;
+		do
+		{
+			word = rnd() % blob.size();
+		} while (word == counter0 || word == counter1);
+		blob[word] ^= 1u << (rnd() & 31);
+		hashes[i] = func(blob.data(), blob_size);
+	}
+
+	auto low = hashes;
+	size_t full = count_collisions(hashes, ~Hash(0));
+	size_t low32 = count_collisions(low, 0xffffffffull);
+	LOGI("  %-8s %4zu byte keys: %zu 64-bit collisions, %zu 32-bit collisions (random would give ~%.0f)\n",
+	     tag, blob_size, full, low32, double(count) * double(count) / double(1ull << 33));
+}
+
+// Flips every input bit of random keys and tracks how often each output bit follows.
+// A good hash flips every output bit half the time, the worst input/output pair shows how far off it gets.
+template <typename Func>
+static void report_avalanche(const char *tag, size_t key_size, const Func &func)
+{
+	const unsigned samples = 200;
+	const size_t input_bits = key_size * 8;
+	std::vector<unsigned> flips(input_bits * 64);
+	std::vector<uint32_t> key(key_size / sizeof(uint32_t));
+	std::mt19937 rnd(11);
+
+	for (unsigned sample = 0; sample < samples; sample++)
+	{
+		for (auto &word : key)
+			word = rnd();
+		Hash base = func(key.data(), key_size);
+
+		for (size_t bit = 0; bit < input_bits; bit++)
+		{
+			key[bit / 32] ^= 1u << (bit & 31);
+			Hash diff = base ^ func(key.data(), key_size);
+			key[bit / 32] ^= 1u << (bit & 31);
+
+			for (unsigned out = 0; out < 64; out++)
+				flips[bit * 64 + out] += unsigned(diff >> out) & 1u;
+		}
+	}
+
+	double worst = 0.0;
+	double total = 0.0;
+	for (auto count : flips)
+	{
+		double p = double(count) / samples;
+		worst = std::max(worst, std::abs(p - 0.5));
+		total += p;
+	}
+	LOGI("  %-8s %4zu byte keys: %.1f of 64 output bits flip on average, worst bias %.3f\n",
+	     tag, key_size, 64.0 * total / double(flips.size()), worst);
+}
+
+// What Hasher::u64() did for a while, one multiply-xor round for all 64 bits.
+static Hash hash_u64_single(uint64_t value)
+{
+	return (0xcbf29ce484222325ull * 0x100000001b3ull) ^ value;
+}
+
+static Hash hash_u64(uint64_t value)
+{
+	Hasher h;
+	h.u64(value);
+	return h.get();
+}
+
+// Keys like pointers and hashes, where only the upper or only the lower half changes between keys.
+// Returns the collisions in the low 32 bits, which is what hash maps index with, for keys which differ in the upper half.
+template <typename Func>
+static size_t report_u64_collisions(const char *tag, const Func &func)
+{
+	const size_t count = 1u << 20;
+	std::vector<Hash> upper(count), lower(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		upper[i] = func((uint64_t(i) << 32) | 0x1000u);
+		lower[i] = func(0x7f0000000000ull | (uint64_t(i) << 4));
+	}
+
+	size_t upper_low32 = count_collisions(upper, 0xffffffffull);
+	size_t lower_low32 = count_collisions(lower, 0xffffffffull);
+	LOGI("  %-8s 32-bit collisions over %zu keys: %zu varying the upper half, %zu varying the lower half\n",
+	     tag, count, upper_low32, lower_low32);
+	return upper_low32;
+}
+
+int main()
+{
+	std::vector<uint8_t> buffer((1u << 20) + 8192);
+	std::mt19937 rnd(1);
+	for (auto &b : buffer)
+		b = uint8_t(rnd());
+
+	// Long arrays hash the same bytes the same way whatever the element type, and seeds change the result.
+	{
+		Hasher a, b, c(1);
+		a.data(buffer.data(), 1000);
+		b.data(reinterpret_cast<const uint32_t *>(buffer.data()), 1000);
+		c.data(buffer.data(), 1000);
+		if (a.get() != b.get() || a.get() == c.get())
+		{
+			LOGE("Bulk hashing is inconsistent.\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	LOGI("Throughput in GB/s, elementwise vs Hasher::data:\n");
+	for (size_t size : { 16, 32, 64, 128, 256, 1024, 4096, 65536, 1 << 20 })
+	{
+		double old8 = bench_throughput<uint8_t>(buffer, size, hash_elements<uint8_t>);
+		double new8 = bench_throughput<uint8_t>(buffer, size, hash_hasher<uint8_t>);
+		double old32 = bench_throughput<uint32_t>(buffer, size, hash_elements<uint32_t>);
+		double new32 = bench_throughput<uint32_t>(buffer, size, hash_hasher<uint32_t>);
+		LOGI("  %7zu bytes: uint8_t %6.2f -> %6.2f, uint32_t %6.2f -> %6.2f\n", size, old8, new8, old32, new32);
+	}
+
+	// Key sizes start at BulkMinElements words, so the Hasher rows measure hash_bulk() rather than the short loop.
+	LOGI("Collisions over %u keys:\n", 1u << 22);
+	for (size_t size : { 128, 256, 1024 })
+	{
+		report_collisions("elements", size, [](const uint32_t *data, size_t size) {
+			return hash_elements(data, size);
+		});
+		report_collisions("Hasher", size, [](const uint32_t *data, size_t size) {
+			return hash_hasher(data, size);
+		});
+	}
+
+	LOGI("u64 keys:\n");
+	report_u64_collisions("single", hash_u64_single);
+	if (report_u64_collisions("Hasher", hash_u64) != 0)
+	{
+		LOGE("The upper half of u64 keys does not reach the low bits of the hash.\n");
+		return EXIT_FAILURE;
+	}
+
+	LOGI("Avalanche:\n");
+	report_avalanche("elements", 256, [](const uint32_t *data, size_t size) {
+		return hash_elements(data, size);
+	});
+	report_avalanche("Hasher", 256, [](const uint32_t *data, size_t size) {
+		return hash_hasher(data, size);
+	});
+	report_avalanche("single", 8, [](const uint32_t *data, size_t) {
+		return hash_u64_single(data[0] | (uint64_t(data[1]) << 32));
+	});
+	report_avalanche("Hasher", 8, [](const uint32_t *data, size_t) {
+		return hash_u64(data[0] | (uint64_t(data[1]) << 32));
+	});
+}
@@ -0,0 +1,250 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "hashmap.hpp"
+#include "timer.hpp"
+#include "util.hpp"
+#include <random>
+#include <stdlib.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace Util;
+
+template <typename T>
+using StdHashMap = std::unordered_map<Hash, T, UnityHasher>;
+
+static std::vector<Hash> make_keys(size_t count, unsigned seed)
+{
+	std::mt19937_64 rnd(seed);
+	std::vector<Hash> keys(count);
+	for (auto &key : keys)
+	{
+		Hasher h;
+		h.u64(rnd());
+		key = h.get();
+	}
+	return keys;
+}
+
+// Random inserts, erases and lookups against std::unordered_map.
+// A small key range keeps the table crowded so erase has long runs to shift back.
+static bool validate(unsigned seed, Hash key_range, Hash key_stride)
+{
+	std::mt19937 rnd(seed);
+	HashMap<uint32_t> map;
+	StdHashMap<uint32_t> reference;
+
+	for (unsigned i = 0; i < 1000000; i++)
+	{
+		Hash key = (rnd() % key_range) * key_stride;
+		unsigned op = rnd() % 8;
+
+		if (op < 3)
+		{
+			uint32_t value = rnd();
+			bool inserted = map.emplace(key, value).second;
+			if (inserted != reference.emplace(key, value).second)
+				return false;
+		}
+		else if (op < 5)
+		{
+			if (map.erase(key) != reference.erase(key))
+				return false;
+		}
+		else if (op == 5)
+		{
+			uint32_t value = rnd();
+			map[key] = value;
+			reference[key] = value;
+		}
+		else
+		{
+			auto itr = map.find(key);
+			auto ref = reference.find(key);
+			if ((itr == map.end()) != (ref == reference.end()))
+				return false;
+			if (itr != map.end() && itr->second != ref->second)
+				return false;
+		}
+
+		if (i % 100000 == 0)
+			map.clear(), reference.clear();
+	}
+
+	if (map.size() != reference.size())
+		return false;
+
+	size_t visited = 0;
+	for (auto &value : map)
+	{
+		auto itr = reference.find(value.first);
+		if (itr == reference.end() || itr->second != value.second)
+			return false;
+		visited++;
+	}
+
+	HashMap<uint32_t> copy(map);
+	HashMap<uint32_t> moved(std::move(copy));
+	for (auto &value : reference)
+		if (moved.count(value.first) != 1)
+			return false;
+
+	return visited == reference.size();
+}
+
+// RenderQueue::render_infos: cleared every frame, mostly hits once the first draws of a kind are in.
+template <typename Map>
+static double bench_render_infos(const std::vector<Hash> &keys, unsigned frames)
+{
+	Map map;
+	std::mt19937 rnd(1);
+	std::vector<Hash> draws(20000);
+	for (auto &draw : draws)
+		draw = keys[rnd() % 4096];
+
+	uintptr_t sink = 0;
+	auto start = get_current_time_nsecs();
+	for (unsigned frame = 0; frame < frames; frame++)
+	{
+		map.clear();
+		for (auto &draw : draws)
+		{
+			auto itr = map.find(draw);
+			if (itr != map.end())
+				sink += uintptr_t(itr->second);
+			else
+				map[draw] = reinterpret_cast<void *>(uintptr_t(draw));
+		}
+	}
+	auto end = get_current_time_nsecs();
+	if (sink == 1)
+		LOGI("Unlikely.\n");
+	return double(end - start) / (double(frames) * draws.size());
+}
+
+// TemporaryHashmap: a ring of live entries where the oldest frame is erased and a new one is inserted.
+template <typename Map>
+static double bench_temporary(const std::vector<Hash> &keys, unsigned frames)
+{
+	const size_t per_frame = 256;
+	const size_t ring = 4;
+	Map map;
+	size_t next = 0;
+	uint64_t sink = 0;
+
+	auto start = get_current_time_nsecs();
+	for (unsigned frame = 0; frame < frames; frame++)
+	{
+		if (frame >= ring)
+		{
+			size_t first = (next - ring * per_frame) % keys.size();
+			for (size_t i = 0; i < per_frame; i++)
+				map.erase(keys[(first + i) % keys.size()]);
+		}
+
+		for (size_t i = 0; i < per_frame; i++)
+		{
+			map[keys[next % keys.size()]] = unsigned(next);
+			next++;
+		}
+
+		for (size_t i = 0; i < per_frame * ring; i++)
+		{
+			auto itr = map.find(keys[(next - 1 - i) % keys.size()]);
+			if (itr != map.end())
+				sink += itr->second;
+		}
+	}
+	auto end = get_current_time_nsecs();
+	if (sink == 1)
+		LOGI("Unlikely.\n");
+	return double(end - start) / (double(frames) * per_frame * (ring + 2));
+}
+
+// Cache / VulkanCache and pipeline lookup: a table built once and read from many times, with some misses.
+template <typename Map>
+static double bench_lookup(const std::vector<Hash> &keys, size_t entries, unsigned lookups)
+{
+	Map map;
+	for (size_t i = 0; i < entries; i++)
+		map[keys[i]] = unsigned(i);
+
+	std::mt19937 rnd(2);
+	std::vector<Hash> queries(4096);
+	for (auto &query : queries)
+		query = keys[rnd() % (entries + entries / 8)];
+
+	uint64_t sink = 0;
+	auto start = get_current_time_nsecs();
+	for (unsigned i = 0; i < lookups; i++)
+	{
+		auto itr = map.find(queries[i & 4095]);
+		if (itr != map.end())
+			sink += itr->second;
+	}
+	auto end = get_current_time_nsecs();
+	if (sink == 1)
+		LOGI("Unlikely.\n");
+	return double(end - start) / lookups;
+}
+
+// Filling a table from empty, like baking descriptor set layouts or loading a scene.
+template <typename Map>
+static double bench_insert(const std::vector<Hash> &keys, unsigned iterations)
+{
+	double total = 0.0;
+	for (unsigned i = 0; i < iterations; i++)
+	{
+		auto start = get_current_time_nsecs();
+		{
+			Map map;
+			for (auto &key : keys)
+				map[key] = unsigned(key);
+		}
+		total += double(get_current_time_nsecs() - start);
+	}
+	return total / (double(iterations) * keys.size());
+}
+
+int main()
+{
+	if (!validate(1, 64, 1) || !validate(2, 5000, 1) || !validate(3, 5000, 64) || !validate(4, 1u << 20, 0x10001))
+	{
+		LOGE("HashMap does not match std::unordered_map.\n");
+		return EXIT_FAILURE;
+	}
+
+	auto keys = make_keys(1 << 20, 1337);
+	std::vector<Hash> insert_keys(keys.begin(), keys.begin() + 100000);
+
+	LOGI("render infos:     HashMap %.2f ns/op, unordered_map %.2f ns/op\n",
+	     bench_render_infos<HashMap<void *>>(keys, 200), bench_render_infos<StdHashMap<void *>>(keys, 200));
+	LOGI("temporary:        HashMap %.2f ns/op, unordered_map %.2f ns/op\n",
+	     bench_temporary<HashMap<unsigned>>(keys, 20000), bench_temporary<StdHashMap<unsigned>>(keys, 20000));
+	LOGI("pipeline lookup:  HashMap %.2f ns/op, unordered_map %.2f ns/op\n",
+	     bench_lookup<HashMap<unsigned>>(keys, 64, 10000000), bench_lookup<StdHashMap<unsigned>>(keys, 64, 10000000));
+	LOGI("cache lookup:     HashMap %.2f ns/op, unordered_map %.2f ns/op\n",
+	     bench_lookup<HashMap<unsigned>>(keys, 200000, 10000000), bench_lookup<StdHashMap<unsigned>>(keys, 200000, 10000000));
+	LOGI("insert:           HashMap %.2f ns/op, unordered_map %.2f ns/op\n",
+	     bench_insert<HashMap<unsigned>>(insert_keys, 20), bench_insert<StdHashMap<unsigned>>(insert_keys, 20));
+}
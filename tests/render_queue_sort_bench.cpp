@@ -0,0 +1,337 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "render_queue.hpp"
+#include "thread_group.hpp"
+#include "timer.hpp"
+#include "util.hpp"
+#include <algorithm>
+#include <random>
+#include <memory>
+#include <unordered_map>
+#include <stdlib.h>
+
+using namespace Granite;
+
+struct DummyInfo
+{
+	Util::Hash instance_key;
+};
+
+static void render_dummy(Vulkan::CommandBuffer &, const RenderQueueData *, unsigned)
+{
+}
+
+struct Draw
+{
+	Util::Hash instance_key;
+	uint64_t sort_key;
+	Queue queue_type;
+};
+
+// Roughly what a scene pushes: a handful of pipelines, many draws, and opaque and transparent depths.
+static std::vector<Draw> generate_draws(unsigned count)
+{
+	std::mt19937 rnd(1337);
+	std::uniform_real_distribution<float> depth(0.0f, 500.0f);
+	std::vector<Draw> draws;
+	draws.reserve(count);
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		Util::Hash pipeline_hash = 0x9e3779b97f4a7c15ull * (1 + rnd() % 64);
+		Util::Hash draw_hash = rnd() % 4096;
+		Queue queue_type = i % 8 == 0 ? Queue::Transparent : Queue::Opaque;
+		// Repeated depths give plenty of equal keys to check stability with.
+		float z = float(int(depth(rnd)));
+
+		uint64_t sort_key = RenderInfo::get_sprite_sort_key(queue_type, pipeline_hash, draw_hash, z);
+		draws.push_back({ draw_hash + 1, sort_key, queue_type });
+	}
+
+	return draws;
+}
+
+// Draw i is pushed with instance data i + 1, so draws can be told apart after sorting.
+static void push_draws(RenderQueue &queue, const std::vector<Draw> &draws, size_t begin, size_t end)
+{
+	for (size_t i = begin; i < end; i++)
+	{
+		auto &draw = draws[i];
+		auto *info = queue.push<DummyInfo>(draw.queue_type, draw.instance_key, draw.sort_key, render_dummy,
+		                                   reinterpret_cast<void *>(uintptr_t(i + 1)));
+		if (info)
+			info->instance_key = draw.instance_key;
+	}
+}
+
+static void fill_queue(RenderQueue &queue, const std::vector<Draw> &draws)
+{
+	queue.reset();
+	push_draws(queue, draws, 0, draws.size());
+}
+
+static double bench_stable_sort(RenderQueue &queue, const std::vector<Draw> &draws, unsigned iterations,
+                                std::vector<RenderQueueData> *reference)
+{
+	double total = 0.0;
+	for (unsigned i = 0; i < iterations; i++)
+	{
+		fill_queue(queue, draws);
+		for (auto type : { Queue::Opaque, Queue::Transparent })
+		{
+			auto data = queue.get_queue_data(type);
+			auto start = Util::get_current_time_nsecs();
+			std::stable_sort(begin(data), end(data), [](const RenderQueueData &a, const RenderQueueData &b) {
+				return a.sorting_key < b.sorting_key;
+			});
+			total += double(Util::get_current_time_nsecs() - start);
+
+			if (reference && i == 0)
+				reference[Util::ecast(type)] = std::move(data);
+		}
+	}
+
+	return 1e-6 * total / iterations;
+}
+
+static double bench_sort(RenderQueue &queue, const std::vector<Draw> &draws, unsigned iterations)
+{
+	double total = 0.0;
+	for (unsigned i = 0; i < iterations; i++)
+	{
+		fill_queue(queue, draws);
+		auto start = Util::get_current_time_nsecs();
+		queue.sort();
+		total += double(Util::get_current_time_nsecs() - start);
+	}
+
+	return 1e-6 * total / iterations;
+}
+
+static bool check_sorted(const char *tag, unsigned count, const RenderQueue &queue,
+                         const std::vector<RenderQueueData> *reference)
+{
+	for (auto type : { Queue::Opaque, Queue::Transparent })
+	{
+		auto &data = queue.get_queue_data(type);
+		auto &ref = reference[Util::ecast(type)];
+		if (data.size() != ref.size())
+		{
+			LOGE("%7u draws, %s lost draws.\n", count, tag);
+			return false;
+		}
+
+		for (size_t i = 0; i < data.size(); i++)
+		{
+			if (data[i].sorting_key != ref[i].sorting_key || data[i].instance_data != ref[i].instance_data)
+			{
+				LOGE("%7u draws, %s differs from stable_sort at draw %u.\n", count, tag, unsigned(i));
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Pushes the draws into num_queues queues, the first slice into the merging queue itself and the rest into the others,
+// then merges them. The result must match pushing every draw into one queue, and sorting it if sort is set.
+// Draws of an instance key must end up on the render info of the first queue which pushed that key.
+static bool check_merge(const std::vector<Draw> &draws, unsigned num_queues, bool sort, ThreadGroup *group)
+{
+	RenderQueue reference;
+	fill_queue(reference, draws);
+	if (sort)
+		reference.sort();
+
+	RenderQueue merged;
+	merged.set_parallel_sort(group, 1024);
+	std::vector<std::unique_ptr<RenderQueue>> others;
+	std::vector<RenderQueue *> other_pointers;
+
+	size_t slice = (draws.size() + num_queues - 1) / num_queues;
+	for (unsigned i = 0; i < num_queues; i++)
+	{
+		RenderQueue *queue = &merged;
+		if (i != 0)
+		{
+			others.emplace_back(new RenderQueue);
+			queue = others.back().get();
+			other_pointers.push_back(queue);
+		}
+		push_draws(*queue, draws, std::min(draws.size(), i * slice), std::min(draws.size(), (i + 1) * slice));
+	}
+
+	std::unordered_map<Util::Hash, const void *> first_render_info;
+	for (unsigned i = 0; i < num_queues; i++)
+	{
+		auto &queue = i ? *other_pointers[i - 1] : merged;
+		for (auto type : { Queue::Opaque, Queue::Transparent })
+			for (auto &data : queue.get_queue_data(type))
+				first_render_info.emplace(static_cast<const DummyInfo *>(data.render_info)->instance_key, data.render_info);
+	}
+
+	merged.merge(other_pointers.data(), other_pointers.size(), sort);
+
+	for (auto type : { Queue::Opaque, Queue::Transparent })
+	{
+		auto &data = merged.get_queue_data(type);
+		auto &ref = reference.get_queue_data(type);
+		if (data.size() != ref.size())
+		{
+			LOGE("%7u draws, merging %u queues lost draws.\n", unsigned(draws.size()), num_queues);
+			return false;
+		}
+
+		for (size_t i = 0; i < data.size(); i++)
+		{
+			auto instance_key = static_cast<const DummyInfo *>(ref[i].render_info)->instance_key;
+			if (data[i].sorting_key != ref[i].sorting_key || data[i].instance_data != ref[i].instance_data ||
+			    data[i].render != ref[i].render || data[i].render_info != first_render_info[instance_key])
+			{
+				LOGE("%7u draws, merging %u queues (%s) differs from a single queue at draw %u.\n",
+				     unsigned(draws.size()), num_queues, sort ? "sorted" : "unsorted", unsigned(i));
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Like Renderer with parallel pushes: every other slice goes straight into the merging queue,
+// and whatever it holds is moved into a run of its own before the next worker slice and before merging.
+static bool check_direct_pushes(const std::vector<Draw> &draws, unsigned num_slices, bool sort)
+{
+	RenderQueue reference;
+	fill_queue(reference, draws);
+	if (sort)
+		reference.sort();
+
+	RenderQueue merged;
+	std::vector<std::unique_ptr<RenderQueue>> runs;
+	std::vector<RenderQueue *> run_pointers;
+	const auto add_run = [&]() -> RenderQueue & {
+		runs.emplace_back(new RenderQueue);
+		run_pointers.push_back(runs.back().get());
+		return *runs.back();
+	};
+
+	size_t slice = (draws.size() + num_slices - 1) / num_slices;
+	for (unsigned i = 0; i < num_slices; i++)
+	{
+		size_t begin = std::min(draws.size(), i * slice);
+		size_t end = std::min(draws.size(), (i + 1) * slice);
+		if (i & 1)
+		{
+			merged.move_queue_data(add_run());
+			push_draws(add_run(), draws, begin, end);
+		}
+		else
+			push_draws(merged, draws, begin, end);
+	}
+	merged.move_queue_data(add_run());
+	merged.merge(run_pointers.data(), run_pointers.size(), sort);
+
+	std::unordered_map<Util::Hash, const void *> render_info;
+	for (auto type : { Queue::Opaque, Queue::Transparent })
+	{
+		auto &data = merged.get_queue_data(type);
+		auto &ref = reference.get_queue_data(type);
+		if (data.size() != ref.size())
+		{
+			LOGE("%7u draws, direct pushes in between %u slices lost draws.\n", unsigned(draws.size()), num_slices);
+			return false;
+		}
+
+		for (size_t i = 0; i < data.size(); i++)
+		{
+			auto instance_key = static_cast<const DummyInfo *>(ref[i].render_info)->instance_key;
+			auto *info = render_info.emplace(instance_key, data[i].render_info).first->second;
+			if (data[i].sorting_key != ref[i].sorting_key || data[i].instance_data != ref[i].instance_data ||
+			    data[i].render != ref[i].render || data[i].render_info != info)
+			{
+				LOGE("%7u draws, direct pushes in between %u slices (%s) differ from a single queue at draw %u.\n",
+				     unsigned(draws.size()), num_slices, sort ? "sorted" : "unsorted", unsigned(i));
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned max_threads = argc > 1 ? unsigned(strtoul(argv[1], nullptr, 0)) : std::thread::hardware_concurrency();
+
+	for (unsigned count : { 1000u, 4000u, 10000u, 100000u, 500000u })
+	{
+		RenderQueue queue;
+		unsigned iterations = std::max(2000000u / count, 4u);
+		auto draws = generate_draws(count);
+
+		std::vector<RenderQueueData> reference[Util::ecast(Queue::Count)];
+		double stable_ms = bench_stable_sort(queue, draws, iterations, reference);
+		LOGI("%7u draws, stable_sort: %8.3f ms.\n", count, stable_ms);
+
+		double radix_ms = bench_sort(queue, draws, iterations);
+		LOGI("%7u draws, radix sort:  %8.3f ms (%.2fx).\n", count, radix_ms, stable_ms / radix_ms);
+		if (!check_sorted("radix sort", count, queue, reference))
+			return EXIT_FAILURE;
+
+		for (unsigned threads = 2; threads <= max_threads; threads *= 2)
+		{
+			ThreadGroup group;
+			group.start(threads);
+			queue.set_parallel_sort(&group);
+
+			double parallel_ms = bench_sort(queue, draws, iterations);
+			LOGI("%7u draws, %2u threads:  %8.3f ms (%.2fx).\n", count, threads, parallel_ms, stable_ms / parallel_ms);
+			if (!check_sorted("parallel radix sort", count, queue, reference))
+				return EXIT_FAILURE;
+
+			queue.set_parallel_sort(nullptr);
+		}
+
+		ThreadGroup merge_group;
+		merge_group.start(std::max(max_threads, 2u));
+		for (unsigned num_queues : { 1u, 3u, 8u })
+		{
+			for (bool sort : { false, true })
+			{
+				if (!check_merge(draws, num_queues, sort, nullptr) ||
+				    !check_merge(draws, num_queues, sort, &merge_group))
+				{
+					return EXIT_FAILURE;
+				}
+			}
+		}
+
+		for (unsigned num_slices : { 2u, 5u, 8u })
+			for (bool sort : { false, true })
+				if (!check_direct_pushes(draws, num_slices, sort))
+					return EXIT_FAILURE;
+		LOGI("%7u draws, merging queues matches a single queue.\n", count);
+	}
+}
@@ -0,0 +1,213 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "scene.hpp"
+#include "camera.hpp"
+#include "muglm/matrix_helper.hpp"
+#include "thread_group.hpp"
+#include "timer.hpp"
+#include "util.hpp"
+#include <random>
+#include <stdlib.h>
+
+using namespace Granite;
+
+// Culling only looks at the world space AABB, so the renderables never have to draw anything.
+struct BoxRenderable : AbstractRenderable
+{
+	void get_render_info(const RenderContext &, const CachedSpatialTransformComponent *, RenderQueue &) const override
+	{
+	}
+
+	bool has_static_aabb() const override
+	{
+		return true;
+	}
+
+	const AABB *get_static_aabb() const override
+	{
+		return &aabb;
+	}
+
+	AABB aabb = AABB(vec3(-0.5f), vec3(0.5f));
+};
+
+static void build_scene(Scene &scene, unsigned count)
+{
+	auto root = scene.create_node();
+	AbstractRenderableHandle renderable(new BoxRenderable);
+
+	std::mt19937 rnd(1337);
+	std::uniform_real_distribution<float> dist(-500.0f, 500.0f);
+	for (unsigned i = 0; i < count; i++)
+	{
+		auto node = scene.create_node();
+		node->transform.translation = vec3(dist(rnd), 0.1f * dist(rnd), dist(rnd));
+		root->add_child(node);
+		scene.create_renderable(renderable, node.get());
+	}
+
+	scene.set_root_node(root);
+	scene.update_cached_transforms();
+}
+
+static Frustum build_frustum(float fovy, const vec3 &eye, const vec3 &target)
+{
+	Camera camera;
+	camera.set_depth_range(0.1f, 1000.0f);
+	camera.set_fovy(fovy);
+	camera.set_aspect(16.0f / 9.0f);
+	camera.look_at(eye, target);
+
+	Frustum frustum;
+	frustum.build_planes(inverse(camera.get_projection() * camera.get_view()));
+	return frustum;
+}
+
+static double bench_gather(Scene &scene, const Frustum *frustums, unsigned num_frustums, unsigned iterations,
+                           size_t &visible_count)
+{
+	VisibilityList list;
+	visible_count = 0;
+
+	auto start = Util::get_current_time_nsecs();
+	for (unsigned i = 0; i < iterations; i++)
+	{
+		for (unsigned f = 0; f < num_frustums; f++)
+		{
+			list.clear();
+			scene.gather_visible_opaque_renderables(frustums[f], list);
+			visible_count += list.size();
+		}
+	}
+	auto end = Util::get_current_time_nsecs();
+
+	return 1e-6 * double(end - start) / iterations;
+}
+
+static bool check_visible(const char *tag, unsigned count, size_t visible, size_t reference)
+{
+	if (visible != reference)
+	{
+		LOGE("%6u objects, %s found %u objects, serial scan found %u.\n",
+		     count, tag, unsigned(visible), unsigned(reference));
+		return false;
+	}
+	return true;
+}
+
+static void move_nodes(Scene &scene, unsigned stride)
+{
+	// Moves every stride-th object far enough to leave its place in the dynamic tree.
+	auto &children = scene.get_root_node()->get_children();
+	for (size_t i = 0; i < children.size(); i += stride)
+	{
+		children[i]->transform.translation.x += 20.0f;
+		children[i]->invalidate_cached_transform();
+	}
+	scene.update_cached_transforms();
+}
+
+int main(int argc, char **argv)
+{
+	unsigned max_threads = argc > 1 ? unsigned(strtoul(argv[1], nullptr, 0)) : std::thread::hardware_concurrency();
+
+	// A main view plus three shadow cascade like views, which all cull the same groups.
+	const Frustum frustums[] = {
+		build_frustum(0.5f * pi<float>(), vec3(0.0f, 10.0f, 0.0f), vec3(0.0f, 0.0f, -100.0f)),
+		build_frustum(0.1f * pi<float>(), vec3(0.0f, 400.0f, 0.0f), vec3(10.0f, 0.0f, 0.0f)),
+		build_frustum(0.2f * pi<float>(), vec3(0.0f, 400.0f, 0.0f), vec3(10.0f, 0.0f, 0.0f)),
+		build_frustum(0.4f * pi<float>(), vec3(0.0f, 400.0f, 0.0f), vec3(10.0f, 0.0f, 0.0f)),
+	};
+	const unsigned num_frustums = sizeof(frustums) / sizeof(frustums[0]);
+
+	for (unsigned count : { 10000u, 50000u, 200000u })
+	{
+		Scene scene;
+		build_scene(scene, count);
+		scene.set_spatial_tree_culling(false);
+
+		size_t serial_visible;
+		double serial_ms = bench_gather(scene, frustums, num_frustums, 20, serial_visible);
+		LOGI("%6u objects, serial:     %8.3f ms per frame (%u visible).\n",
+		     count, serial_ms, unsigned(serial_visible / 20));
+
+		for (unsigned threads = 2; threads <= max_threads; threads *= 2)
+		{
+			ThreadGroup group;
+			group.start(threads);
+			scene.set_parallel_gather(&group);
+
+			size_t parallel_visible;
+			double parallel_ms = bench_gather(scene, frustums, num_frustums, 20, parallel_visible);
+			LOGI("%6u objects, %2u threads: %8.3f ms per frame (%.2fx).\n",
+			     count, threads, parallel_ms, serial_ms / parallel_ms);
+
+			if (!check_visible("parallel gather", count, parallel_visible, serial_visible))
+				return EXIT_FAILURE;
+
+			scene.set_parallel_gather(nullptr);
+		}
+
+		scene.set_spatial_tree_culling(true);
+		size_t tree_visible;
+		double tree_ms = bench_gather(scene, frustums, num_frustums, 20, tree_visible);
+		LOGI("%6u objects, dynamic BVH: %7.3f ms per frame (%.2fx).\n", count, tree_ms, serial_ms / tree_ms);
+		if (!check_visible("dynamic BVH", count, tree_visible, serial_visible))
+			return EXIT_FAILURE;
+
+		scene.rebuild_static_spatial_tree();
+		tree_ms = bench_gather(scene, frustums, num_frustums, 20, tree_visible);
+		LOGI("%6u objects, static BVH:  %7.3f ms per frame (%.2fx).\n", count, tree_ms, serial_ms / tree_ms);
+		if (!check_visible("static BVH", count, tree_visible, serial_visible))
+			return EXIT_FAILURE;
+
+		// Refreshing bounds should scale with the number of moved objects, not the scene size.
+		{
+			const unsigned frames = 20;
+			auto start = Util::get_current_time_nsecs();
+			for (unsigned i = 0; i < frames; i++)
+				move_nodes(scene, 1000);
+			auto end = Util::get_current_time_nsecs();
+			LOGI("%6u objects, 1/1000 moved: update %.3f ms per frame.\n",
+			     count, 1e-6 * double(end - start) / frames);
+		}
+
+		// Objects which move leave the static tree, and have to be found in the dynamic one.
+		for (unsigned stride : { 7u, 3u })
+		{
+			auto start = Util::get_current_time_nsecs();
+			move_nodes(scene, stride);
+			auto end = Util::get_current_time_nsecs();
+
+			tree_ms = bench_gather(scene, frustums, num_frustums, 20, tree_visible);
+			scene.set_spatial_tree_culling(false);
+			bench_gather(scene, frustums, num_frustums, 1, serial_visible);
+			scene.set_spatial_tree_culling(true);
+
+			LOGI("%6u objects, 1/%u moved:   %7.3f ms per frame, update %.3f ms.\n",
+			     count, stride, tree_ms, 1e-6 * double(end - start));
+			if (!check_visible("BVH after moving objects", count, tree_visible / 20, serial_visible))
+				return EXIT_FAILURE;
+		}
+	}
+}
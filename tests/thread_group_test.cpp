@@ -21,11 +21,43 @@
  */
 
 #include "thread_group.hpp"
+#include "task_future.hpp"
+#include "timer.hpp"
 #include "util.hpp"
+#include <atomic>
+#include <algorithm>
+#include <stdlib.h>
+#include <new>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <string>
 
 using namespace Granite;
 
-int main()
+// Count heap allocations so we can verify that task submission does not allocate after warm-up.
+static std::atomic_size_t allocation_count;
+
+void *operator new(size_t size)
+{
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	void *ptr = malloc(size);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+static void test_dependencies()
 {
 	ThreadGroup group;
 	group.start(4);
@@ -53,4 +85,517 @@ int main()
 	group.submit(task3);
 
 	group.wait_idle();
-}
\ No newline at end of file
+}
+
+static void test_parallel_for()
+{
+	ThreadGroup group;
+	group.start(4);
+
+	const size_t count = 100003;
+	std::vector<std::atomic_uint> hits(count);
+	for (auto &hit : hits)
+		hit.store(0, std::memory_order_relaxed);
+
+	group.parallel_for(0, count, 0, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			hits[i].fetch_add(1, std::memory_order_relaxed);
+	});
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (hits[i].load() != 1)
+		{
+			LOGE("Index %u was visited %u times.\n", unsigned(i), hits[i].load());
+			exit(1);
+		}
+	}
+
+	uint64_t sum = group.parallel_reduce(0, count, 64, uint64_t(0), [](size_t begin, size_t end) {
+		uint64_t partial = 0;
+		for (size_t i = begin; i < end; i++)
+			partial += i;
+		return partial;
+	}, [](uint64_t a, uint64_t b) {
+		return a + b;
+	});
+
+	uint64_t expected = uint64_t(count) * (count - 1) / 2;
+	if (sum != expected)
+	{
+		LOGE("parallel_reduce: expected %llu, got %llu.\n",
+		     static_cast<unsigned long long>(expected), static_cast<unsigned long long>(sum));
+		exit(1);
+	}
+}
+
+// Every worker blocks in a nested wait, which only completes if waiting threads help out.
+static void test_nested_wait()
+{
+	ThreadGroup group;
+	group.start(2);
+
+	std::atomic_uint counter;
+	counter.store(0);
+
+	auto roots = group.create_task();
+	for (unsigned i = 0; i < 8; i++)
+	{
+		roots->enqueue_task([&group, &counter]() {
+			group.parallel_for(0, 1000, 10, [&counter](size_t begin, size_t end) {
+				counter.fetch_add(unsigned(end - begin), std::memory_order_relaxed);
+			});
+		});
+	}
+	roots->wait();
+
+	if (counter.load() != 8 * 1000)
+	{
+		LOGE("Nested wait: expected %u iterations, got %u.\n", 8 * 1000, counter.load());
+		exit(1);
+	}
+}
+
+static void test_topology()
+{
+	ThreadTopology topology;
+	if (!ThreadTopology::parse("0-3,8;4-7", topology) || topology.nodes.size() != 2 ||
+	    topology.nodes[0].size() != 5 || topology.nodes[1].size() != 4 || topology.get_num_cpus() != 9)
+	{
+		LOGE("Failed to parse thread topology.\n");
+		exit(1);
+	}
+
+	if (ThreadTopology::parse("0-", topology) || ThreadTopology::parse("0;;1", topology))
+	{
+		LOGE("Parsed invalid thread topology.\n");
+		exit(1);
+	}
+
+	// Fake a two node machine, without pinning, so it works anywhere.
+	ThreadGroup group;
+	ThreadTopology::parse("0-1;2-3", topology);
+	group.set_topology(topology, ThreadPinning::None);
+	group.start(4);
+
+	// Pinned tasks must only ever run on workers of their node, never on other workers,
+	// and never on this thread while it waits for them.
+	auto main_thread = std::this_thread::get_id();
+	for (unsigned node = 0; node < 2; node++)
+	{
+		std::atomic_uint counter;
+		std::atomic_uint wrong_thread;
+		counter.store(0);
+		wrong_thread.store(0);
+
+		auto task = group.create_task();
+		task->set_numa_node(node);
+		for (unsigned i = 0; i < 1000; i++)
+		{
+			task->enqueue_task([&, node]() {
+				if (std::this_thread::get_id() == main_thread || group.get_current_numa_node() != node)
+					wrong_thread.fetch_add(1, std::memory_order_relaxed);
+				counter.fetch_add(1, std::memory_order_relaxed);
+			});
+		}
+		task->wait();
+
+		if (counter.load() != 1000)
+		{
+			LOGE("NUMA tasks: expected %u tasks, got %u.\n", 1000, counter.load());
+			exit(1);
+		}
+
+		if (wrong_thread.load() != 0)
+		{
+			LOGE("NUMA tasks: %u of 1000 tasks pinned to node %u ran elsewhere.\n", wrong_thread.load(), node);
+			exit(1);
+		}
+	}
+
+	// Pinned tasks spawned from a worker of the other node must be handed over as well.
+	{
+		std::atomic_uint counter;
+		std::atomic_uint wrong_thread;
+		counter.store(0);
+		wrong_thread.store(0);
+
+		auto outer = group.create_task();
+		outer->set_numa_node(0);
+		for (unsigned i = 0; i < 16; i++)
+		{
+			outer->enqueue_task([&]() {
+				auto inner = group.create_task();
+				inner->set_numa_node(1);
+				for (unsigned j = 0; j < 64; j++)
+				{
+					inner->enqueue_task([&]() {
+						if (group.get_current_numa_node() != 1 || std::this_thread::get_id() == main_thread)
+							wrong_thread.fetch_add(1, std::memory_order_relaxed);
+						counter.fetch_add(1, std::memory_order_relaxed);
+					});
+				}
+				inner->wait();
+			});
+		}
+		outer->wait();
+
+		if (counter.load() != 16 * 64 || wrong_thread.load() != 0)
+		{
+			LOGE("NUMA tasks: nested pinned tasks ran %u times, %u on the wrong node.\n",
+			     counter.load(), wrong_thread.load());
+			exit(1);
+		}
+	}
+}
+
+static void test_task_signal()
+{
+	ThreadGroup group;
+	group.start(4);
+
+	// The signal goes away as soon as the waiter sees the final count, while the last signaling task may still be running.
+	for (unsigned iter = 0; iter < 1000; iter++)
+	{
+		TaskSignal signal;
+		for (unsigned i = 0; i < 4; i++)
+		{
+			auto task = group.create_task([]() {});
+			task->set_fence_counter_signal(&signal);
+			group.submit(task);
+		}
+		signal.wait_until_at_least(4);
+	}
+
+	TaskSignal signal;
+	std::vector<std::thread> waiters;
+	for (unsigned i = 0; i < 4; i++)
+		waiters.emplace_back([&signal, i]() { signal.wait_until_at_least(100 * (i + 1)); });
+
+	for (unsigned i = 0; i < 400; i++)
+	{
+		auto task = group.create_task([]() {});
+		task->set_fence_counter_signal(&signal);
+		group.submit(task);
+	}
+
+	for (auto &waiter : waiters)
+		waiter.join();
+
+	if (signal.get_count() != 400)
+	{
+		LOGE("Task signal: expected count %u, got %u.\n", 400, unsigned(signal.get_count()));
+		exit(1);
+	}
+}
+
+static void test_futures()
+{
+	ThreadGroup group;
+	group.start(4);
+
+	auto value = create_future(group, []() { return 20; })
+		.then([](int &v) { return v + 1; })
+		.then([](int &v) { return std::to_string(2 * v); });
+
+	std::vector<TaskFuture<unsigned>> parts;
+	for (unsigned i = 0; i < 64; i++)
+		parts.push_back(create_future(group, [i]() { return i; }, TaskClass::Background));
+
+	std::atomic_uint sum;
+	sum.store(0);
+	auto all = when_all(group, parts).then([&]() {
+		for (auto &part : parts)
+			sum.fetch_add(part.get(), std::memory_order_relaxed);
+	});
+
+	// Continuing a future which has already completed schedules the continuation right away.
+	parts[0].wait();
+	auto late = parts[0].then([](unsigned &v) { return v + 1; });
+
+	// Plain task groups can be held back by a future as well.
+	std::atomic_bool ordered;
+	ordered.store(false);
+	auto gate = create_future(group, []() { std::this_thread::sleep_for(std::chrono::milliseconds(10)); });
+	auto task = group.create_task([&]() { ordered.store(gate.is_ready()); });
+	gate.add_dependee(task);
+	task->wait();
+
+	all.wait();
+	if (value.get() != "42" || sum.load() != 64 * 63 / 2 || late.get() != 1 || !ordered.load())
+	{
+		LOGE("Futures: unexpected results.\n");
+		exit(1);
+	}
+}
+
+static void spin_work(std::atomic_uint &counter)
+{
+	counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+// All tasks are submitted from the main thread, so they go through the injection queue.
+static double bench_flat(unsigned num_threads, unsigned num_tasks)
+{
+	ThreadGroup group;
+	group.start(num_threads);
+	std::atomic_uint counter;
+	counter.store(0);
+
+	auto start = Util::get_current_time_nsecs();
+	auto task = group.create_task();
+	for (unsigned i = 0; i < num_tasks; i++)
+		task->enqueue_task([&counter]() { spin_work(counter); });
+	task->wait();
+	auto end = Util::get_current_time_nsecs();
+
+	if (counter.load() != num_tasks)
+	{
+		LOGE("Expected %u tasks to complete, got %u.\n", num_tasks, counter.load());
+		exit(1);
+	}
+
+	return double(num_tasks) / (1e-9 * double(end - start));
+}
+
+// Each root task fans out more tasks from within a worker, which exercises the per-worker deques and stealing.
+static double bench_nested(unsigned num_threads, unsigned num_roots, unsigned num_children)
+{
+	ThreadGroup group;
+	group.start(num_threads);
+	std::atomic_uint counter;
+	counter.store(0);
+
+	auto start = Util::get_current_time_nsecs();
+	auto roots = group.create_task();
+	for (unsigned i = 0; i < num_roots; i++)
+	{
+		roots->enqueue_task([&group, &counter, num_children]() {
+			auto children = group.create_task();
+			for (unsigned j = 0; j < num_children; j++)
+				children->enqueue_task([&counter]() { spin_work(counter); });
+			group.submit(children);
+		});
+	}
+	group.submit(roots);
+	group.wait_idle();
+	auto end = Util::get_current_time_nsecs();
+
+	unsigned expected = num_roots * num_children;
+	if (counter.load() != expected)
+	{
+		LOGE("Expected %u tasks to complete, got %u.\n", expected, counter.load());
+		exit(1);
+	}
+
+	return double(num_roots * (num_children + 1)) / (1e-9 * double(end - start));
+}
+
+// Submits tasks with captures which are too large for std::function's small buffer.
+static void run_allocation_round(ThreadGroup &group, unsigned num_tasks, std::atomic_uint &counter)
+{
+	uint64_t a = 1, b = 2, c = 3, d = 4;
+	auto task = group.create_task();
+	for (unsigned i = 0; i < num_tasks; i++)
+	{
+		task->enqueue_task([&counter, a, b, c, d]() {
+			counter.fetch_add(unsigned(a + b + c + d) & 1, std::memory_order_relaxed);
+		});
+	}
+	task->wait();
+
+	// Small groups, so creating and freeing TaskGroup and TaskDeps is covered as well.
+	TaskSignal signal;
+	for (unsigned i = 0; i < num_tasks / 16; i++)
+	{
+		auto small = group.create_task([&counter]() {
+			counter.fetch_add(1, std::memory_order_relaxed);
+		});
+		small->set_fence_counter_signal(&signal);
+		group.submit(small);
+	}
+	signal.wait_until_at_least(num_tasks / 16);
+}
+
+static void test_allocations()
+{
+	ThreadGroup group;
+	group.start(4);
+	std::atomic_uint counter;
+	counter.store(0);
+
+	const unsigned num_tasks = 100000;
+	for (unsigned i = 0; i < 4; i++)
+		run_allocation_round(group, num_tasks, counter);
+
+	size_t before = allocation_count.load();
+	run_allocation_round(group, num_tasks, counter);
+	size_t after = allocation_count.load();
+
+	LOGI("Allocations per task after warm-up: %.4f\n", double(after - before) / num_tasks);
+	if (after != before)
+	{
+		LOGE("Task submission allocated %zu times after warm-up.\n", after - before);
+		exit(1);
+	}
+}
+
+// Threads which are not workers get their own pool caches. Several of them create tasks on two groups at once,
+// and then exit, so their caches are taken over by the next batch of threads.
+static void test_external_threads()
+{
+	ThreadGroup groups[2];
+	groups[0].start(2);
+	groups[1].start(2);
+	std::atomic_uint counter;
+	counter.store(0);
+
+	const unsigned num_threads = 4;
+	const unsigned num_rounds = 200;
+	for (unsigned wave = 0; wave < 3; wave++)
+	{
+		std::vector<std::thread> threads;
+		for (unsigned i = 0; i < num_threads; i++)
+		{
+			threads.emplace_back([&groups, &counter]() {
+				for (unsigned round = 0; round < num_rounds; round++)
+				{
+					auto &group = groups[round & 1];
+					auto task = group.create_task();
+					for (unsigned j = 0; j < 100; j++)
+						task->enqueue_task([&counter]() { counter.fetch_add(1, std::memory_order_relaxed); });
+
+					// Free some tasks on this thread too, by running them while waiting.
+					task->wait();
+				}
+			});
+		}
+
+		for (auto &thread : threads)
+			thread.join();
+	}
+
+	unsigned expected = 3 * num_threads * num_rounds * 100;
+	if (counter.load() != expected)
+	{
+		LOGE("External threads: expected %u tasks to run, got %u.\n", expected, counter.load());
+		exit(1);
+	}
+}
+
+static void spin_for_nsecs(int64_t nsecs)
+{
+	auto start = Util::get_current_time_nsecs();
+	while (Util::get_current_time_nsecs() - start < nsecs)
+		std::this_thread::yield();
+}
+
+// Saturates the workers with background work, and measures the time it takes
+// for a stream of small probe tasks to start executing.
+static void bench_priority_latency(TaskClass probe_class, unsigned num_foreground_threads)
+{
+	ThreadGroup group;
+	group.start(4, num_foreground_threads);
+
+	auto background = group.create_task();
+	background->set_task_class(TaskClass::Background);
+	for (unsigned i = 0; i < 1000; i++)
+		background->enqueue_task([]() { spin_for_nsecs(500 * 1000); });
+	group.submit(background);
+
+	const unsigned num_probes = 100;
+	std::vector<int64_t> latencies(num_probes);
+	for (unsigned i = 0; i < num_probes; i++)
+	{
+		auto submit_time = Util::get_current_time_nsecs();
+		auto probe = group.create_task([&latencies, i, submit_time]() {
+			latencies[i] = Util::get_current_time_nsecs() - submit_time;
+		});
+		probe->set_task_class(probe_class);
+		group.submit(probe);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	group.wait_idle();
+
+	std::sort(latencies.begin(), latencies.end());
+	LOGI("%s probes, %u reserved threads: p50 %8.3f ms, p99 %8.3f ms\n",
+	     probe_class == TaskClass::Foreground ? "Foreground" : "Background", num_foreground_threads,
+	     1e-6 * double(latencies[num_probes / 2]), 1e-6 * double(latencies[(num_probes * 99) / 100]));
+}
+
+static void bench_priorities()
+{
+	bench_priority_latency(TaskClass::Background, 0);
+	bench_priority_latency(TaskClass::Foreground, 0);
+	bench_priority_latency(TaskClass::Foreground, 1);
+}
+
+static void capture_timeline(const char *path)
+{
+	ThreadGroup group;
+	group.set_timeline_enabled(true);
+	group.start(4);
+
+	std::atomic_uint counter;
+	counter.store(0);
+
+	auto roots = group.create_task();
+	roots->set_desc("root");
+	for (unsigned i = 0; i < 16; i++)
+	{
+		roots->enqueue_task([&group, &counter]() {
+			auto children = group.create_task();
+			children->set_desc("children");
+			children->enqueue_parallel_for(0, 100000, 0, [&counter](size_t begin, size_t end) {
+				for (size_t j = begin; j < end; j++)
+					spin_work(counter);
+			});
+			children->wait();
+		});
+	}
+	roots->wait();
+
+	group.wait_idle();
+	if (!group.dump_timeline(path))
+		exit(1);
+	LOGI("Wrote timeline to %s.\n", path);
+}
+
+static void bench_contention()
+{
+	unsigned max_threads = std::thread::hardware_concurrency();
+	if (max_threads == 0)
+		max_threads = 1;
+
+	for (unsigned num_threads = 1; num_threads <= max_threads; )
+	{
+		double flat = bench_flat(num_threads, 200000);
+		double nested = bench_nested(num_threads, 1000, 200);
+		LOGI("%3u threads: flat %10.0f tasks/s, nested %10.0f tasks/s\n", num_threads, flat, nested);
+
+		if (num_threads == max_threads)
+			break;
+		num_threads = std::min(num_threads * 2, max_threads);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+	{
+		capture_timeline(argv[1]);
+		return 0;
+	}
+
+	test_dependencies();
+	test_parallel_for();
+	test_nested_wait();
+	test_topology();
+	test_task_signal();
+	test_futures();
+	test_allocations();
+	test_external_threads();
+	bench_priorities();
+	bench_contention();
+}
@@ -0,0 +1,189 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "thread_safe_cache.hpp"
+#include "timer.hpp"
+#include "util.hpp"
+#include <atomic>
+#include <memory>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+using namespace Util;
+
+struct Entry
+{
+	explicit Entry(Hash hash)
+		: hash(hash)
+	{
+	}
+	Hash hash;
+};
+
+// What ThreadSafeCache used to do: every lookup takes the read side of a RWSpinLock.
+class LockedCache
+{
+public:
+	Entry *find(Hash hash) const
+	{
+		lock.lock_read();
+		auto *ret = cache.find(hash);
+		lock.unlock_read();
+		return ret;
+	}
+
+	Entry *insert(Hash hash, std::unique_ptr<Entry> value)
+	{
+		lock.lock_write();
+		auto *ret = cache.insert(hash, std::move(value));
+		lock.unlock_write();
+		return ret;
+	}
+
+private:
+	Cache<Entry> cache;
+	mutable RWSpinLock lock;
+};
+
+static Hash get_key(unsigned index)
+{
+	Hasher h;
+	h.u32(index);
+	return h.get();
+}
+
+// Every thread looks up a mix of pipeline-like keys, all of which are present.
+template <typename CacheType>
+static double bench_lookups(CacheType &cache, unsigned num_threads, unsigned num_entries, unsigned lookups_per_thread)
+{
+	std::atomic_uint ready(0);
+	std::atomic_bool go(false);
+	std::atomic_uint failures(0);
+	std::vector<std::thread> threads;
+
+	for (unsigned t = 0; t < num_threads; t++)
+	{
+		threads.emplace_back([&, t]() {
+			unsigned index = t * 7919;
+			unsigned misses = 0;
+			ready.fetch_add(1, std::memory_order_relaxed);
+			while (!go.load(std::memory_order_acquire))
+				std::this_thread::yield();
+
+			for (unsigned i = 0; i < lookups_per_thread; i++)
+			{
+				index = (index + 40503u) % num_entries;
+				Hash key = get_key(index);
+				auto *entry = cache.find(key);
+				if (!entry || entry->hash != key)
+					misses++;
+			}
+			failures.fetch_add(misses, std::memory_order_relaxed);
+		});
+	}
+
+	while (ready.load(std::memory_order_relaxed) != num_threads)
+		std::this_thread::yield();
+
+	auto start = get_current_time_nsecs();
+	go.store(true, std::memory_order_release);
+	for (auto &thread : threads)
+		thread.join();
+	auto end = get_current_time_nsecs();
+
+	if (failures.load())
+	{
+		LOGE("%u lookups failed.\n", failures.load());
+		exit(EXIT_FAILURE);
+	}
+
+	return double(num_threads) * lookups_per_thread / (1e-9 * double(end - start)) * 1e-6;
+}
+
+// Readers race against a writer which fills the cache. Anything a reader finds must be complete.
+static bool test_concurrent_inserts(unsigned num_threads)
+{
+	const unsigned num_entries = 100000;
+	ThreadSafeCache<Entry> cache;
+	std::atomic_bool done(false);
+	std::atomic_uint failures(0);
+	std::vector<std::thread> threads;
+
+	for (unsigned t = 0; t < num_threads; t++)
+	{
+		threads.emplace_back([&, t]() {
+			unsigned index = t;
+			while (!done.load(std::memory_order_acquire))
+			{
+				index = (index + 7u) % num_entries;
+				Hash key = get_key(index);
+				auto *entry = cache.find(key);
+				if (entry && entry->hash != key)
+					failures.fetch_add(1, std::memory_order_relaxed);
+			}
+		});
+	}
+
+	for (unsigned i = 0; i < num_entries; i++)
+	{
+		Hash key = get_key(i);
+		auto *entry = cache.insert(key, std::unique_ptr<Entry>(new Entry(key)));
+		if (cache.insert(key, std::unique_ptr<Entry>(new Entry(key))) != entry || cache.find(key) != entry)
+			failures.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	done.store(true, std::memory_order_release);
+	for (auto &thread : threads)
+		thread.join();
+
+	return failures.load() == 0 && cache.get_hashmap().size() == num_entries;
+}
+
+int main()
+{
+	if (!test_concurrent_inserts(4))
+	{
+		LOGE("Concurrent inserts failed.\n");
+		return EXIT_FAILURE;
+	}
+
+	const unsigned num_entries = 2048;
+	const unsigned lookups_per_thread = 1000000;
+	ThreadSafeCache<Entry> lock_free;
+	LockedCache locked;
+	for (unsigned i = 0; i < num_entries; i++)
+	{
+		Hash key = get_key(i);
+		lock_free.insert(key, std::unique_ptr<Entry>(new Entry(key)));
+		locked.insert(key, std::unique_ptr<Entry>(new Entry(key)));
+	}
+
+	LOGI("Hardware threads: %u\n", std::thread::hardware_concurrency());
+	for (unsigned num_threads = 1; num_threads <= 32; num_threads *= 2)
+	{
+		double lock_free_rate = bench_lookups(lock_free, num_threads, num_entries, lookups_per_thread);
+		double locked_rate = bench_lookups(locked, num_threads, num_entries, lookups_per_thread);
+		LOGI("%2u threads: lock-free %8.1f M lookups/s, RWSpinLock %8.1f M lookups/s\n",
+		     num_threads, lock_free_rate, locked_rate);
+	}
+}
@@ -0,0 +1,348 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "scene.hpp"
+#include "transforms.hpp"
+#include "muglm/matrix_helper.hpp"
+#include "thread_group.hpp"
+#include "util.hpp"
+#include <random>
+#include <unordered_map>
+#include <cmath>
+#include <stdlib.h>
+
+using namespace Granite;
+
+static bool matrices_equal(const mat4 &a, const mat4 &b)
+{
+	for (unsigned c = 0; c < 4; c++)
+		for (unsigned r = 0; r < 4; r++)
+			if (a[c][r] != b[c][r])
+				return false;
+	return true;
+}
+
+static float max_relative_error(const mat4 &a, const mat4 &reference)
+{
+	float error = 0.0f;
+	for (unsigned c = 0; c < 4; c++)
+		for (unsigned r = 0; r < 4; r++)
+			error = std::max(error, std::abs(a[c][r] - reference[c][r]) / std::max(1.0f, std::abs(reference[c][r])));
+	return error;
+}
+
+static quat random_rotation(std::mt19937 &rnd)
+{
+	std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+	vec4 q = normalize(vec4(dist(rnd), dist(rnd), dist(rnd), dist(rnd)));
+	return quat(q.w, q.x, q.y, q.z);
+}
+
+static bool test_model_transform()
+{
+	std::mt19937 rnd(42);
+	std::uniform_real_distribution<float> dist(-10.0f, 10.0f);
+	std::uniform_real_distribution<float> scale_dist(0.1f, 4.0f);
+
+	float max_error = 0.0f;
+	for (unsigned i = 0; i < 100000; i++)
+	{
+		vec3 s(scale_dist(rnd), scale_dist(rnd), scale_dist(rnd));
+		vec3 t(dist(rnd), dist(rnd), dist(rnd));
+		quat r = random_rotation(rnd);
+
+		mat4 parent;
+		for (unsigned c = 0; c < 4; c++)
+			parent[c] = vec4(dist(rnd), dist(rnd), dist(rnd), dist(rnd));
+
+		mat4 world;
+		compute_model_transform(world, s, r, t, parent);
+		mat4 reference = parent * translate(t) * (mat4_cast(r) * scale(s));
+		max_error = std::max(max_error, max_relative_error(world, reference));
+	}
+
+	LOGI("compute_model_transform: max relative error %g.\n", max_error);
+	if (max_error > 1e-5f)
+	{
+		LOGE("compute_model_transform does not match parent * translate * mat4_cast * scale.\n");
+		return false;
+	}
+	return true;
+}
+
+// The recursive update the level by level update replaced, driven through the public Node interface.
+static void collect_bones(Scene::Node &node, std::unordered_map<const Transform *, Scene::Node *> &bones)
+{
+	for (auto &bone : node.get_skeletons())
+	{
+		bones[&bone->transform] = bone.get();
+		collect_bones(*bone, bones);
+	}
+}
+
+static void update_reference(Scene::Node &node, const mat4 &parent, bool parent_dirty)
+{
+	bool transform_dirty = node.get_and_clear_transform_dirty() || parent_dirty;
+	if (transform_dirty)
+	{
+		compute_model_transform(node.cached_transform.world_transform,
+		                        node.transform.scale, node.transform.rotation, node.transform.translation, parent);
+	}
+
+	if (node.get_and_clear_child_transform_dirty() || transform_dirty)
+		for (auto &child : node.get_children())
+			update_reference(*child, node.cached_transform.world_transform, transform_dirty);
+
+	if (transform_dirty)
+	{
+		for (auto &child : node.get_skeletons())
+			update_reference(*child, node.cached_transform.world_transform, true);
+
+		node.cached_transform.world_transform = node.cached_transform.world_transform * node.initial_transform;
+		compute_normal_transform(node.cached_transform.normal_transform, node.cached_transform.world_transform);
+
+		if (!node.get_skin().skin.empty())
+		{
+			std::unordered_map<const Transform *, Scene::Node *> bones;
+			collect_bones(node, bones);
+			auto &palette = node.cached_skin_transform.bone_world_transforms;
+			for (size_t i = 0; i < palette.size(); i++)
+				palette[i] = bones[node.get_skin().skin[i]]->cached_transform.world_transform;
+		}
+
+		node.update_timestamp();
+	}
+}
+
+struct Hierarchy
+{
+	Scene scene;
+	std::vector<Scene::NodeHandle> nodes;
+};
+
+static void build_hierarchy(Hierarchy &hierarchy, unsigned count)
+{
+	std::mt19937 rnd(1337);
+	std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+	SceneFormats::Skin skin;
+	for (unsigned i = 0; i < 6; i++)
+	{
+		SceneFormats::NodeTransform joint;
+		joint.translation = vec3(dist(rnd), dist(rnd), dist(rnd));
+		joint.scale = vec3(1.0f);
+		joint.rotation = random_rotation(rnd);
+		skin.joint_transforms.push_back(joint);
+
+		mat4 inverse_bind(1.0f);
+		inverse_bind[3] = vec4(dist(rnd), dist(rnd), dist(rnd), 1.0f);
+		skin.inverse_bind_pose.push_back(inverse_bind);
+	}
+
+	SceneFormats::Skin::Bone bones[6];
+	for (unsigned i = 0; i < 6; i++)
+		bones[i].index = i;
+	bones[1].children.push_back(bones[2]);
+	bones[1].children.push_back(bones[3]);
+	bones[0].children.push_back(bones[1]);
+	bones[4].children.push_back(bones[5]);
+	skin.skeletons.push_back(bones[0]);
+	skin.skeletons.push_back(bones[4]);
+
+	auto root = hierarchy.scene.create_node();
+	hierarchy.nodes.push_back(root);
+	for (unsigned i = 0; i < count; i++)
+	{
+		auto node = i % 50 == 7 ? hierarchy.scene.create_skinned_node(skin) : hierarchy.scene.create_node();
+		node->transform.translation = vec3(dist(rnd), dist(rnd), dist(rnd));
+		node->transform.scale = vec3(1.0f + 0.1f * dist(rnd));
+		node->transform.rotation = random_rotation(rnd);
+		if (i % 10 == 3)
+			node->initial_transform = translate(vec3(dist(rnd), dist(rnd), dist(rnd)));
+		hierarchy.nodes[rnd() % hierarchy.nodes.size()]->add_child(node);
+		hierarchy.nodes.push_back(node);
+	}
+	hierarchy.scene.set_root_node(root);
+}
+
+static bool compare_hierarchies(const Hierarchy &a, const Hierarchy &b, unsigned frame)
+{
+	for (size_t i = 0; i < a.nodes.size(); i++)
+	{
+		auto &node = *a.nodes[i];
+		auto &reference = *b.nodes[i];
+		bool equal = matrices_equal(node.cached_transform.world_transform, reference.cached_transform.world_transform) &&
+		             matrices_equal(node.cached_transform.normal_transform, reference.cached_transform.normal_transform) &&
+		             *node.get_timestamp_pointer() == *reference.get_timestamp_pointer();
+
+		auto &palette = node.cached_skin_transform.bone_world_transforms;
+		auto &reference_palette = reference.cached_skin_transform.bone_world_transforms;
+		for (size_t j = 0; j < palette.size(); j++)
+			if (!matrices_equal(palette[j], reference_palette[j]))
+				equal = false;
+
+		if (!equal)
+		{
+			LOGE("Frame %u: node %u differs from the recursive update.\n", frame, unsigned(i));
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool test_hierarchy(ThreadGroup *group)
+{
+	Hierarchy levels, reference;
+	build_hierarchy(levels, 3000);
+	build_hierarchy(reference, 3000);
+	if (group)
+		levels.scene.set_parallel_gather(group, 16);
+
+	std::mt19937 rnd(9);
+	for (unsigned frame = 0; frame < 40; frame++)
+	{
+		levels.scene.update_cached_transforms();
+		update_reference(*reference.nodes.front(), mat4(1.0f), false);
+		if (!compare_hierarchies(levels, reference, frame))
+			return false;
+
+		for (unsigned i = 0; i < 100; i++)
+		{
+			size_t index = rnd() % levels.nodes.size();
+			float offset = float(rnd() % 100) * 0.01f;
+			levels.nodes[index]->transform.translation.y += offset;
+			levels.nodes[index]->invalidate_cached_transform();
+			reference.nodes[index]->transform.translation.y += offset;
+			reference.nodes[index]->invalidate_cached_transform();
+		}
+
+		// Move some subtrees around, so the levels have to be rebuilt.
+		if (frame % 5 == 3)
+		{
+			for (unsigned i = 0; i < 10; i++)
+			{
+				size_t child = 1 + rnd() % (levels.nodes.size() - 1);
+				size_t parent = rnd() % levels.nodes.size();
+
+				bool cycle = false;
+				for (auto *p = levels.nodes[parent].get(); p; p = p->get_parent())
+					if (p == levels.nodes[child].get())
+						cycle = true;
+				if (cycle)
+					continue;
+
+				for (auto *hierarchy : { &levels, &reference })
+				{
+					auto node = hierarchy->nodes[child];
+					node->get_parent()->remove_child(*node);
+					hierarchy->nodes[parent]->add_child(node);
+				}
+			}
+		}
+	}
+	return true;
+}
+
+// Culling only looks at the world space AABB, so the renderable never has to draw anything.
+struct BoxRenderable : AbstractRenderable
+{
+	void get_render_info(const RenderContext &, const CachedSpatialTransformComponent *, RenderQueue &) const override
+	{
+	}
+
+	bool has_static_aabb() const override
+	{
+		return true;
+	}
+
+	const AABB *get_static_aabb() const override
+	{
+		return &aabb;
+	}
+
+	AABB aabb = AABB(vec3(-0.5f), vec3(0.5f));
+};
+
+// Writing cached_transform directly and calling Node::update_timestamp() must refresh the bounds
+// of entities on that node, even though the hierarchy update never sees the node as dirty.
+static bool test_manual_timestamp()
+{
+	Scene scene;
+	auto root = scene.create_node();
+	auto node = scene.create_node();
+	root->add_child(node);
+	scene.set_root_node(root);
+	auto entity = scene.create_renderable(AbstractRenderableHandle(new BoxRenderable), node.get());
+	scene.update_cached_transforms();
+
+	auto query = [&](const vec3 &center) {
+		VisibilityList list;
+		scene.query_spatials(AABB(center - vec3(1.0f), center + vec3(1.0f)), Scene::SPATIAL_QUERY_OPAQUE_BIT, list);
+		return list.size();
+	};
+
+	if (query(vec3(0.0f)) != 1 || query(vec3(100.0f, 0.0f, 0.0f)) != 0)
+	{
+		LOGE("Renderable is not at the origin after the first update.\n");
+		return false;
+	}
+
+	node->cached_transform.world_transform = translate(vec3(100.0f, 0.0f, 0.0f));
+	node->update_timestamp();
+	node->update_timestamp();
+	scene.update_cached_transforms();
+
+	if (query(vec3(0.0f)) != 0 || query(vec3(100.0f, 0.0f, 0.0f)) != 1)
+	{
+		LOGE("Node::update_timestamp() did not refresh the bounds of the renderable.\n");
+		return false;
+	}
+
+	// Nothing moved since, so the next update must not undo it.
+	scene.update_cached_transforms();
+	if (query(vec3(100.0f, 0.0f, 0.0f)) != 1)
+	{
+		LOGE("Renderable moved without its node changing.\n");
+		return false;
+	}
+	return true;
+}
+
+int main()
+{
+	if (!test_model_transform())
+		return EXIT_FAILURE;
+
+	if (!test_manual_timestamp())
+		return EXIT_FAILURE;
+
+	if (!test_hierarchy(nullptr))
+		return EXIT_FAILURE;
+
+	ThreadGroup group;
+	group.start(4);
+	if (!test_hierarchy(&group))
+		return EXIT_FAILURE;
+
+	LOGI("Level by level transform update matches the recursive update.\n");
+	return EXIT_SUCCESS;
+}
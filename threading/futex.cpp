@@ -0,0 +1,84 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "futex.hpp"
+#include <limits.h>
+#include <atomic>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+
+namespace Granite
+{
+#if defined(__linux__)
+void futex_wait(const void *word, uint32_t expected)
+{
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+void futex_wake_all(const void *word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+#else
+namespace
+{
+struct WaitBucket
+{
+	std::mutex lock;
+	std::condition_variable cond;
+};
+}
+
+static WaitBucket &get_wait_bucket(const void *addr)
+{
+	static WaitBucket buckets[64];
+	auto hash = reinterpret_cast<uintptr_t>(addr);
+	hash ^= hash >> 6;
+	hash ^= hash >> 12;
+	return buckets[hash & 63];
+}
+
+void futex_wait(const void *word, uint32_t expected)
+{
+	// The value is checked under the bucket lock, which futex_wake_all() takes after modifying the word,
+	// so a wake-up cannot get lost between the check and going to sleep.
+	auto &bucket = get_wait_bucket(word);
+	std::unique_lock<std::mutex> holder{bucket.lock};
+	if (static_cast<const std::atomic<uint32_t> *>(word)->load() == expected)
+		bucket.cond.wait(holder);
+}
+
+void futex_wake_all(const void *word)
+{
+	auto &bucket = get_wait_bucket(word);
+	std::lock_guard<std::mutex> holder{bucket.lock};
+	bucket.cond.notify_all();
+}
+#endif
+}
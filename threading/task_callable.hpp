@@ -0,0 +1,144 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Granite
+{
+namespace Internal
+{
+// Type-erased void() callable for tasks. Unlike std::function, captures up to InlineSize bytes
+// are stored inline, so enqueueing typical task lambdas does not allocate.
+// Larger captures fall back to the heap. The callable is never copied or moved once assigned.
+class TaskCallable
+{
+public:
+	enum { InlineSize = 48 };
+
+	TaskCallable() = default;
+
+	~TaskCallable()
+	{
+		reset();
+	}
+
+	TaskCallable(const TaskCallable &) = delete;
+	void operator=(const TaskCallable &) = delete;
+
+	template <typename Func>
+	void assign(Func &&func)
+	{
+		using F = typename std::decay<Func>::type;
+		reset();
+		assign_impl<F>(std::forward<Func>(func),
+		               std::integral_constant<bool, sizeof(F) <= InlineSize &&
+		                                            alignof(F) <= alignof(max_align_t)>());
+	}
+
+	void operator()()
+	{
+		ops->invoke(storage);
+	}
+
+	explicit operator bool() const
+	{
+		return ops != nullptr;
+	}
+
+	void reset()
+	{
+		if (ops)
+		{
+			ops->destroy(storage);
+			ops = nullptr;
+		}
+	}
+
+private:
+	struct Ops
+	{
+		void (*invoke)(void *);
+		void (*destroy)(void *);
+	};
+
+	template <typename F>
+	struct InlineOps
+	{
+		static void invoke(void *storage)
+		{
+			(*static_cast<F *>(storage))();
+		}
+
+		static void destroy(void *storage)
+		{
+			static_cast<F *>(storage)->~F();
+		}
+
+		static const Ops ops;
+	};
+
+	template <typename F>
+	struct HeapOps
+	{
+		static void invoke(void *storage)
+		{
+			(**static_cast<F **>(storage))();
+		}
+
+		static void destroy(void *storage)
+		{
+			delete *static_cast<F **>(storage);
+		}
+
+		static const Ops ops;
+	};
+
+	template <typename F, typename Func>
+	void assign_impl(Func &&func, std::true_type)
+	{
+		new (storage) F(std::forward<Func>(func));
+		ops = &InlineOps<F>::ops;
+	}
+
+	template <typename F, typename Func>
+	void assign_impl(Func &&func, std::false_type)
+	{
+		*reinterpret_cast<F **>(storage) = new F(std::forward<Func>(func));
+		ops = &HeapOps<F>::ops;
+	}
+
+	alignas(max_align_t) unsigned char storage[InlineSize];
+	const Ops *ops = nullptr;
+};
+
+template <typename F>
+const TaskCallable::Ops TaskCallable::InlineOps<F>::ops = { &InlineOps<F>::invoke, &InlineOps<F>::destroy };
+
+template <typename F>
+const TaskCallable::Ops TaskCallable::HeapOps<F>::ops = { &HeapOps<F>::invoke, &HeapOps<F>::destroy };
+}
+}
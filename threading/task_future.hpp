@@ -0,0 +1,296 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "thread_group.hpp"
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Granite
+{
+template <typename T>
+class TaskFuture;
+
+namespace Internal
+{
+// Shared between a future, the task producing its value and everything waiting for it.
+struct FutureStateBase
+{
+	FutureStateBase(TaskDepsHandle deps, TaskClass task_class, const char *desc)
+		: deps(std::move(deps)), task_class(task_class), desc(desc)
+	{
+		completed.store(false, std::memory_order_relaxed);
+	}
+
+	// The group of the producing task. Waiting on it helps out with other work in the meantime.
+	TaskDepsHandle deps;
+	TaskClass task_class;
+	const char *desc;
+
+	// Holds back dependee until the value has been produced. dependee must not have been flushed yet.
+	void add_dependee(TaskDepsHandle dependee)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		if (completed.load(std::memory_order_relaxed))
+			return;
+		dependee->dependency_count.fetch_add(1, std::memory_order_relaxed);
+		dependees.push_back(std::move(dependee));
+	}
+
+	// Called by the producing task once the value is in place.
+	void complete()
+	{
+		std::vector<TaskDepsHandle> ready;
+		{
+			std::lock_guard<std::mutex> holder{lock};
+			completed.store(true, std::memory_order_release);
+			std::swap(ready, dependees);
+		}
+
+		for (auto &dep : ready)
+			dep->dependency_satisfied();
+	}
+
+	bool is_completed() const
+	{
+		return completed.load(std::memory_order_acquire);
+	}
+
+private:
+	std::mutex lock;
+	std::vector<TaskDepsHandle> dependees;
+	std::atomic_bool completed;
+};
+
+template <typename T>
+struct FutureState : FutureStateBase
+{
+	using FutureStateBase::FutureStateBase;
+
+	~FutureState()
+	{
+		if (has_value)
+			get_value().~T();
+	}
+
+	template <typename Func, typename... Args>
+	void produce(Func &func, Args &&... args)
+	{
+		new (&storage) T(func(std::forward<Args>(args)...));
+		has_value = true;
+	}
+
+	T &get_value()
+	{
+		return *reinterpret_cast<T *>(&storage);
+	}
+
+	typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+	bool has_value = false;
+};
+
+template <>
+struct FutureState<void> : FutureStateBase
+{
+	using FutureStateBase::FutureStateBase;
+
+	template <typename Func, typename... Args>
+	void produce(Func &func, Args &&... args)
+	{
+		func(std::forward<Args>(args)...);
+	}
+
+	void get_value()
+	{
+	}
+};
+
+// Continuations receive the value of the future they continue by reference, or nothing for futures of void.
+template <typename T, typename Func>
+struct ContinuationResult
+{
+	using type = typename std::result_of<Func &(T &)>::type;
+};
+
+template <typename Func>
+struct ContinuationResult<void, Func>
+{
+	using type = typename std::result_of<Func &()>::type;
+};
+
+template <typename T>
+struct ContinuationInvoker
+{
+	template <typename R, typename Func>
+	static void run(FutureState<R> &dst, FutureState<T> &src, Func &func)
+	{
+		dst.produce(func, src.get_value());
+	}
+};
+
+template <>
+struct ContinuationInvoker<void>
+{
+	template <typename R, typename Func>
+	static void run(FutureState<R> &dst, FutureState<void> &, Func &func)
+	{
+		dst.produce(func);
+	}
+};
+
+// Creates a group with a single task which runs body(state) once all antecedents have completed.
+template <typename R, typename Body>
+std::shared_ptr<FutureState<R>> spawn_future(ThreadGroup &workers, TaskClass task_class, const char *desc,
+                                             FutureStateBase * const *antecedents, size_t num_antecedents,
+                                             Body body)
+{
+	auto group = workers.create_task();
+	group->set_task_class(task_class);
+	group->set_desc(desc);
+
+	auto state = std::make_shared<FutureState<R>>(group->deps, task_class, desc);
+	group->enqueue_task([state, body = std::move(body)]() mutable {
+		body(*state);
+		state->complete();
+	});
+
+	for (size_t i = 0; i < num_antecedents; i++)
+		antecedents[i]->add_dependee(group->deps);
+
+	// Nothing blocks on the antecedents. The task becomes ready when the last one completes.
+	group->flush();
+	return state;
+}
+}
+
+// A value which is produced by a task in a ThreadGroup.
+// Continuations attached with then() are scheduled when the value is available, without blocking any thread,
+// so chains of I/O and CPU work overlap naturally.
+template <typename T>
+class TaskFuture
+{
+public:
+	TaskFuture() = default;
+	explicit TaskFuture(std::shared_ptr<Internal::FutureState<T>> state)
+		: state(std::move(state))
+	{
+	}
+
+	explicit operator bool() const
+	{
+		return bool(state);
+	}
+
+	bool is_ready() const
+	{
+		return state->is_completed();
+	}
+
+	// Runs other ready tasks on the calling thread until the value is available, so it is safe to call from a task.
+	void wait() const
+	{
+		state->deps->group->wait_for_task_deps(*state->deps);
+	}
+
+	typename std::add_lvalue_reference<T>::type get() const
+	{
+		wait();
+		return state->get_value();
+	}
+
+	// Runs func(value) as a new task once the value is available, and returns a future for its result.
+	// The continuation has the same task class as this future, and its description unless one is given.
+	template <typename Func>
+	TaskFuture<typename Internal::ContinuationResult<T, Func>::type> then(Func func, const char *desc = nullptr) const
+	{
+		using R = typename Internal::ContinuationResult<T, Func>::type;
+		auto src = state;
+		auto body = [src, func](Internal::FutureState<R> &dst) mutable {
+			Internal::ContinuationInvoker<T>::run(dst, *src, func);
+		};
+
+		Internal::FutureStateBase *antecedent = state.get();
+		return TaskFuture<R>(Internal::spawn_future<R>(*state->deps->group, state->task_class,
+		                                               desc ? desc : state->desc, &antecedent, 1,
+		                                               std::move(body)));
+	}
+
+	// Holds back a regular task group until the value is available. Must be called before group is flushed.
+	void add_dependee(TaskGroup &group) const
+	{
+		if (group->flushed)
+			throw std::logic_error("Cannot add dependency to task group which has been flushed.");
+		state->add_dependee(group->deps);
+	}
+
+	Internal::FutureStateBase *get_state() const
+	{
+		return state.get();
+	}
+
+private:
+	std::shared_ptr<Internal::FutureState<T>> state;
+};
+
+// Runs func() as a task, and returns a future for its result.
+template <typename Func>
+TaskFuture<typename std::result_of<Func &()>::type>
+create_future(ThreadGroup &workers, Func func, TaskClass task_class = TaskClass::Foreground, const char *desc = nullptr)
+{
+	using R = typename std::result_of<Func &()>::type;
+	auto body = [func](Internal::FutureState<R> &dst) mutable {
+		dst.produce(func);
+	};
+	return TaskFuture<R>(Internal::spawn_future<R>(workers, task_class, desc, nullptr, 0, std::move(body)));
+}
+
+// Completes once all futures have completed.
+template <typename T>
+TaskFuture<void> when_all(ThreadGroup &workers, const std::vector<TaskFuture<T>> &futures,
+                          TaskClass task_class = TaskClass::Foreground, const char *desc = nullptr)
+{
+	std::vector<Internal::FutureStateBase *> antecedents;
+	antecedents.reserve(futures.size());
+	for (auto &future : futures)
+		antecedents.push_back(future.get_state());
+
+	return TaskFuture<void>(Internal::spawn_future<void>(workers, task_class, desc,
+	                                                     antecedents.data(), antecedents.size(),
+	                                                     [](Internal::FutureState<void> &) {}));
+}
+
+// Completes once all futures have completed. Has the same task class as the first future.
+template <typename T, typename... Ts>
+TaskFuture<void> when_all(const TaskFuture<T> &first, const TaskFuture<Ts> &... rest)
+{
+	Internal::FutureStateBase *antecedents[] = { first.get_state(), rest.get_state()... };
+	auto *state = antecedents[0];
+	return TaskFuture<void>(Internal::spawn_future<void>(*state->deps->group, state->task_class, nullptr,
+	                                                     antecedents, sizeof...(Ts) + 1,
+	                                                     [](Internal::FutureState<void> &) {}));
+}
+}
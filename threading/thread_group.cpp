@@ -23,7 +23,12 @@
 #include "thread_group.hpp"
 #include <assert.h>
 #include <stdexcept>
+#include <algorithm>
 #include "util.hpp"
+#include "timer.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 using namespace std;
 
@@ -46,11 +51,10 @@ void TaskDeps::notify_dependees()
 		dep->dependency_satisfied();
 	pending.clear();
 
-	{
-		lock_guard<mutex> holder{cond_lock};
-		done = true;
-		cond.notify_one();
-	}
+	// Pairs with the increment of waiters in ThreadGroup::wait_for_task_deps().
+	done.store(true);
+	if (waiters.load() != 0)
+		group->wake_task_deps_waiters();
 }
 
 void TaskDeps::task_completed()
@@ -68,32 +72,37 @@ void TaskDeps::dependency_satisfied()
 	assert(old_deps > 0);
 	if (old_deps == 1)
 	{
-		if (pending_tasks.empty())
+		if (!pending_tasks)
 			notify_dependees();
 		else
-		{
-			group->move_to_ready_tasks(pending_tasks);
-			pending_tasks.clear();
-		}
+			move_pending_tasks_to_ready();
 	}
 }
 
+void TaskDeps::add_pending_task(Task *task)
+{
+	if (pending_tasks_tail)
+		pending_tasks_tail->next = task;
+	else
+		pending_tasks = task;
+	pending_tasks_tail = task;
+}
+
+void TaskDeps::move_pending_tasks_to_ready()
+{
+	// Detach the list first. Once the tasks are visible to workers, this object might complete and go away.
+	auto *list = pending_tasks;
+	pending_tasks = nullptr;
+	pending_tasks_tail = nullptr;
+	group->move_to_ready_tasks(list);
+}
+
 void TaskGroup::flush()
 {
 	if (flushed)
 		throw logic_error("Cannot flush more than once.");
 	flushed = true;
-
-	if (deps->dependency_count == 0)
-	{
-		if (deps->pending_tasks.empty())
-			deps->notify_dependees();
-		else
-		{
-			group->move_to_ready_tasks(deps->pending_tasks);
-			deps->pending_tasks.clear();
-		}
-	}
+	deps->dependency_satisfied();
 }
 
 void TaskGroup::wait()
@@ -101,10 +110,7 @@ void TaskGroup::wait()
 	if (!flushed)
 		flush();
 
-	unique_lock<mutex> holder{deps->cond_lock};
-	deps->cond.wait(holder, [this]() {
-		return deps->done;
-	});
+	group->wait_for_task_deps(*deps);
 }
 
 TaskGroup::~TaskGroup()
@@ -117,9 +123,51 @@ TaskGroup::~TaskGroup()
 struct ThreadGroupHolder
 {
 	ThreadGroup group;
+	string timeline_path;
+
 	ThreadGroupHolder()
 	{
-		group.start(thread::hardware_concurrency());
+		const char *path = getenv("GRANITE_TIMELINE");
+		if (path && *path)
+		{
+			timeline_path = path;
+			group.set_timeline_enabled(true);
+		}
+
+		// Keep one worker free for frame-critical work when there are enough cores to go around.
+		unsigned num_threads = thread::hardware_concurrency();
+
+		// GRANITE_THREAD_TOPOLOGY is either "auto" or a list of nodes, see ThreadTopology::parse().
+		// GRANITE_THREAD_PINNING is one of none, node or cpu.
+		const char *topology_desc = getenv("GRANITE_THREAD_TOPOLOGY");
+		const char *pinning_desc = getenv("GRANITE_THREAD_PINNING");
+		if ((topology_desc && *topology_desc) || (pinning_desc && *pinning_desc))
+		{
+			ThreadTopology topology;
+			if (!topology_desc || !*topology_desc || strcmp(topology_desc, "auto") == 0 ||
+			    !ThreadTopology::parse(topology_desc, topology))
+			{
+				topology = ThreadTopology::detect();
+			}
+
+			ThreadPinning pinning = ThreadPinning::Node;
+			if (pinning_desc && *pinning_desc && !parse_thread_pinning(pinning_desc, pinning))
+				pinning = ThreadPinning::None;
+
+			group.set_topology(topology, pinning);
+			num_threads = topology.get_num_cpus();
+		}
+
+		group.start(num_threads, num_threads >= 4 ? 1 : 0);
+	}
+
+	~ThreadGroupHolder()
+	{
+		if (!timeline_path.empty())
+		{
+			group.wait_idle();
+			group.dump_timeline(timeline_path);
+		}
 	}
 };
 
@@ -130,6 +178,7 @@ ThreadGroup &ThreadGroup::get_global()
 }
 
 static thread_local unsigned thread_id_to_index = ~0u;
+static thread_local ThreadGroup *thread_id_to_group = nullptr;
 
 unsigned ThreadGroup::get_current_thread_index()
 {
@@ -144,15 +193,26 @@ void ThreadGroup::register_main_thread()
 	thread_id_to_index = 0;
 }
 
-void ThreadGroup::start(unsigned num_threads)
+void ThreadGroup::start(unsigned num_threads, unsigned num_foreground_threads)
 {
 	if (active)
 		throw logic_error("Cannot start a thread group which has already started.");
+	if (num_foreground_threads >= num_threads && num_threads != 0)
+		throw invalid_argument("Need at least one thread which can execute background tasks.");
 
 	dead = false;
 	active = true;
+	this->num_foreground_threads = num_foreground_threads;
 
 	thread_group.resize(num_threads);
+	worker_queues.clear();
+	for (unsigned i = 0; i < num_threads; i++)
+	{
+		worker_queues.emplace_back(new WorkerQueue);
+		worker_queues.back()->rng_state = 0x9e3779b9u * (i + 1);
+		reserve_pool_cache(worker_queues.back()->cache);
+	}
+	assign_workers_to_nodes();
 
 	unsigned self_index = 1;
 	for (auto &t : thread_group)
@@ -164,6 +224,101 @@ void ThreadGroup::start(unsigned num_threads)
 	}
 }
 
+void ThreadGroup::set_topology(const ThreadTopology &topology, ThreadPinning pinning)
+{
+	if (active)
+		throw logic_error("Cannot change topology of a thread group which has already started.");
+	if (topology.nodes.empty())
+		throw invalid_argument("Topology must have at least one node.");
+	for (auto &node : topology.nodes)
+		if (node.empty())
+			throw invalid_argument("Topology nodes must have at least one CPU.");
+
+	this->topology = topology;
+	this->pinning = pinning;
+
+	lock_guard<mutex> holder{cond_lock};
+	if (injection_queues.size() < topology.nodes.size())
+		injection_queues.resize(topology.nodes.size());
+}
+
+void ThreadGroup::assign_workers_to_nodes()
+{
+	node_workers.clear();
+	node_workers.resize(max<size_t>(topology.nodes.size(), 1));
+
+	// Walk the CPUs in node order with a stride, so a partially populated machine
+	// still gets workers on every node, in proportion to the node sizes.
+	unsigned num_cpus = topology.get_num_cpus();
+	auto num_workers = unsigned(worker_queues.size());
+	for (unsigned i = 0; i < num_workers; i++)
+	{
+		auto &worker = *worker_queues[i];
+		worker.numa_node = 0;
+		worker.affinity.clear();
+
+		if (num_cpus)
+		{
+			auto cpu = unsigned((uint64_t(i) * num_cpus) / num_workers);
+			unsigned node = 0;
+			while (cpu >= topology.nodes[node].size())
+				cpu -= unsigned(topology.nodes[node++].size());
+
+			worker.numa_node = node;
+			if (pinning == ThreadPinning::CPU)
+				worker.affinity.push_back(topology.nodes[node][cpu]);
+			else if (pinning == ThreadPinning::Node)
+				worker.affinity = topology.nodes[node];
+		}
+
+		node_workers[worker.numa_node].push_back(i);
+	}
+
+	pinned_queues.clear();
+	for (size_t i = 0; i < node_workers.size(); i++)
+	{
+		pinned_queues.emplace_back(new PinnedQueue);
+		for (auto &c : pinned_queues.back()->ready_count)
+			c.store(0, memory_order_relaxed);
+	}
+}
+
+unsigned ThreadGroup::get_current_numa_node() const
+{
+	unsigned slot = get_current_worker_slot();
+	return slot ? worker_queues[slot - 1]->numa_node : 0;
+}
+
+unsigned ThreadGroup::get_injection_node() const
+{
+	auto num_nodes = unsigned(node_workers.size());
+	unsigned slot = get_current_worker_slot();
+	if (slot)
+		return worker_queues[slot - 1]->numa_node;
+	return injection_rr % num_nodes;
+}
+
+unsigned ThreadGroup::get_pinned_node(const Internal::TaskDeps &deps) const
+{
+	if (deps.numa_node == ~0u || pinned_queues.empty())
+		return ~0u;
+	unsigned node = deps.numa_node % unsigned(node_workers.size());
+	return node_workers[node].empty() ? ~0u : node;
+}
+
+// The number of ready tasks the thread in the given slot is allowed to run.
+// The counters are read in the reverse order of how tasks are taken, so while a task is taken
+// the result can only be too high, which at worst wakes a thread for nothing.
+unsigned ThreadGroup::get_available_count(unsigned index, unsigned c) const
+{
+	unsigned ready = ready_count[c].load();
+	unsigned pinned = pinned_ready_count[c].load();
+	unsigned own = 0;
+	if (index)
+		own = pinned_queues[worker_queues[index - 1]->numa_node]->ready_count[c].load();
+	return ready - pinned + own;
+}
+
 void ThreadGroup::submit(TaskGroup &group)
 {
 	group->flush();
@@ -181,18 +336,272 @@ void ThreadGroup::add_dependency(TaskGroup &dependee, TaskGroup &dependency)
 	dependee->deps->dependency_count.fetch_add(1, memory_order_relaxed);
 }
 
-void ThreadGroup::move_to_ready_tasks(const std::vector<Internal::Task *> &list)
+void ThreadGroup::move_to_ready_tasks(Internal::Task *list)
 {
-	lock_guard<mutex> holder{cond_lock};
-	total_tasks.fetch_add(list.size(), memory_order_relaxed);
+	size_t count = 0;
+	Internal::Task *tail = nullptr;
+	for (auto *task = list; task; task = task->next)
+	{
+		tail = task;
+		count++;
+	}
 
-	for (auto &t : list)
-		ready_tasks.push(t);
+	if (!count)
+		return;
 
-	if (list.size() > 1)
-		cond.notify_all();
+	total_tasks.fetch_add(count, memory_order_relaxed);
+
+	// All tasks in a list belong to the same group.
+	auto task_class = list->deps->task_class;
+	unsigned c = Util::ecast(task_class);
+
+	// Pinned tasks can only go to a deque of a worker on their node, everything else to any worker's deque.
+	unsigned pinned_node = get_pinned_node(*list->deps);
+	unsigned slot = get_current_worker_slot();
+	WorkStealingDeque<Internal::Task *> *deque = nullptr;
+	if (slot != 0)
+	{
+		auto &worker = *worker_queues[slot - 1];
+		if (pinned_node == ~0u)
+			deque = &worker.deques[c];
+		else if (pinned_node == worker.numa_node)
+			deque = &worker.pinned_deques[c];
+	}
+
+	// Count the tasks before they can be taken, the counters are decremented in the reverse order.
+	ready_count[c].fetch_add(count);
+	if (pinned_node != ~0u)
+	{
+		pinned_ready_count[c].fetch_add(count);
+		pinned_queues[pinned_node]->ready_count[c].fetch_add(count);
+	}
+
+	if (deque)
+	{
+		while (list)
+		{
+			// Read next before pushing, the task might be stolen and executed right away.
+			auto *next = list->next;
+			list->next = nullptr;
+			deque->push(list);
+			list = next;
+		}
+	}
 	else
-		cond.notify_one();
+	{
+		lock_guard<mutex> holder{cond_lock};
+		InjectionQueue *queue;
+		if (pinned_node != ~0u)
+			queue = &pinned_queues[pinned_node]->queue;
+		else
+		{
+			queue = &injection_queues[get_injection_node()];
+			if (slot == 0)
+				injection_rr++;
+			injected_count[c].fetch_add(count, memory_order_relaxed);
+		}
+
+		if (queue->tail[c])
+			queue->tail[c]->next = list;
+		else
+			queue->head[c] = list;
+		queue->tail[c] = tail;
+		queue->count[c] += unsigned(count);
+	}
+
+	wake_workers(task_class, count, pinned_node != ~0u);
+}
+
+namespace
+{
+// Pool caches of a thread which is not a worker, one per thread group it has created or freed tasks on.
+// Group ids are never reused, so an entry of a destroyed group cannot be mistaken for one of a live group.
+struct ExternalPoolCaches
+{
+	struct Entry
+	{
+		uint64_t instance_id;
+		Internal::PoolCache *cache;
+		weak_ptr<Internal::PoolCache> owner;
+	};
+	vector<Entry> entries;
+
+	~ExternalPoolCaches();
+};
+}
+
+static atomic<uint64_t> next_instance_id;
+static thread_local ExternalPoolCaches external_pool_caches;
+
+// Tasks can still be freed after the thread_local above is gone, e.g. while static objects are destroyed.
+// Such threads go straight to the pools.
+static thread_local bool external_pool_caches_destroyed = false;
+
+ExternalPoolCaches::~ExternalPoolCaches()
+{
+	for (auto &entry : entries)
+		if (auto cache = entry.owner.lock())
+			cache->orphaned.store(true, memory_order_release);
+	external_pool_caches_destroyed = true;
+}
+
+template <typename T>
+static T *acquire_cached(Util::ThreadSafeObjectPool<T> &pool, vector<T *> *cache, size_t batch)
+{
+	T *object = nullptr;
+	if (!cache)
+	{
+		if (!pool.acquire_vacants(&object, 1))
+			throw bad_alloc();
+		return object;
+	}
+
+	if (cache->empty())
+	{
+		cache->resize(batch);
+		cache->resize(pool.acquire_vacants(cache->data(), batch));
+		if (cache->empty())
+			throw bad_alloc();
+	}
+
+	object = cache->back();
+	cache->pop_back();
+	return object;
+}
+
+template <typename T>
+static void release_cached(Util::ThreadSafeObjectPool<T> &pool, vector<T *> *cache, T *object, size_t batch)
+{
+	object->~T();
+	if (!cache)
+	{
+		pool.release_vacants(&object, 1);
+		return;
+	}
+
+	cache->push_back(object);
+
+	// Objects are typically allocated on one thread and freed on the workers, so give memory back eventually.
+	if (cache->size() >= 2 * batch)
+	{
+		pool.release_vacants(cache->data() + batch, cache->size() - batch);
+		cache->resize(batch);
+	}
+}
+
+void ThreadGroup::reserve_pool_cache(Internal::PoolCache &cache)
+{
+	cache.tasks.reserve(2 * TaskCacheBatch);
+	cache.groups.reserve(2 * TaskCacheBatch);
+	cache.deps.reserve(2 * TaskCacheBatch);
+}
+
+Internal::PoolCache *ThreadGroup::get_pool_cache()
+{
+	unsigned slot = get_current_worker_slot();
+	if (slot != 0)
+		return &worker_queues[slot - 1]->cache;
+
+	if (external_pool_caches_destroyed)
+		return nullptr;
+
+	auto &entries = external_pool_caches.entries;
+	for (auto &entry : entries)
+		if (entry.instance_id == instance_id)
+			return entry.cache;
+
+	// First use of this group on this thread. Forget about groups which have been destroyed since the last one.
+	entries.erase(remove_if(begin(entries), end(entries), [](const ExternalPoolCaches::Entry &entry) {
+		return entry.owner.expired();
+	}), end(entries));
+
+	shared_ptr<Internal::PoolCache> cache;
+	{
+		lock_guard<mutex> holder{external_cache_lock};
+		for (auto &candidate : external_caches)
+		{
+			bool orphaned = true;
+			if (candidate->orphaned.compare_exchange_strong(orphaned, false, memory_order_acquire))
+			{
+				cache = candidate;
+				break;
+			}
+		}
+
+		if (!cache)
+		{
+			cache = make_shared<Internal::PoolCache>();
+			reserve_pool_cache(*cache);
+			external_caches.push_back(cache);
+		}
+	}
+
+	entries.push_back({ instance_id, cache.get(), cache });
+	return cache.get();
+}
+
+Internal::Task *ThreadGroup::allocate_task(Internal::TaskDepsHandle deps)
+{
+	auto *cache = get_pool_cache();
+	auto *task = acquire_cached(task_pool, cache ? &cache->tasks : nullptr, TaskCacheBatch);
+	return new (task) Internal::Task(move(deps));
+}
+
+void ThreadGroup::free_task(Internal::Task *task)
+{
+	auto *cache = get_pool_cache();
+	release_cached(task_pool, cache ? &cache->tasks : nullptr, task, TaskCacheBatch);
+}
+
+bool ThreadGroup::should_split_range() const
+{
+	// If there are fewer ready tasks than workers, someone is about to go looking for work.
+	unsigned ready = 0;
+	for (auto &c : ready_count)
+		ready += c.load(memory_order_relaxed);
+	return ready < get_num_threads();
+}
+
+size_t ThreadGroup::get_default_grain(size_t count) const
+{
+	size_t num_ranges = 8 * max<size_t>(get_num_threads(), 1);
+	return max<size_t>(count / num_ranges, 1);
+}
+
+unsigned ThreadGroup::get_current_worker_slot() const
+{
+	return thread_id_to_group == this ? thread_id_to_index : 0;
+}
+
+void ThreadGroup::wake_workers(TaskClass task_class, size_t count, bool pinned)
+{
+	// Only some sleepers can run pinned tasks, and we don't know which, so wake everyone up for those.
+	if (pinned)
+		count = ~size_t(0);
+
+	// Pairs with the increment of the sleeping counts in thread_looper().
+	// Either we observe a sleeping worker here, or the worker observes our ready_count increment.
+	bool wake_any = sleeping_count.load() != 0;
+	bool wake_foreground = task_class == TaskClass::Foreground && sleeping_foreground_count.load() != 0;
+	if (!wake_any && !wake_foreground)
+		return;
+
+	lock_guard<mutex> holder{cond_lock};
+	if (wake_any)
+	{
+		if (count > 1)
+			cond.notify_all();
+		else
+			cond.notify_one();
+	}
+
+	if (wake_foreground)
+	{
+		if (count > 1)
+			foreground_cond.notify_all();
+		else
+			foreground_cond.notify_one();
+	}
 }
 
 void Internal::TaskGroupDeleter::operator()(Internal::TaskGroup *group)
@@ -207,44 +616,66 @@ void Internal::TaskDepsDeleter::operator()(Internal::TaskDeps *deps)
 
 void ThreadGroup::free_task_group(Internal::TaskGroup *group)
 {
-	task_group_pool.free(group);
+	auto *cache = get_pool_cache();
+	release_cached(task_group_pool, cache ? &cache->groups : nullptr, group, TaskCacheBatch);
 }
 
 void ThreadGroup::free_task_deps(Internal::TaskDeps *deps)
 {
-	task_deps_pool.free(deps);
+	auto *cache = get_pool_cache();
+	release_cached(task_deps_pool, cache ? &cache->deps : nullptr, deps, TaskCacheBatch);
 }
 
-void TaskSignal::signal_increment()
+TaskSignal::TaskSignal()
 {
-	lock_guard<mutex> holder{lock};
-	counter++;
-	cond.notify_all();
+	state.store(0, memory_order_relaxed);
 }
 
-void TaskSignal::wait_until_at_least(uint64_t count)
+// Futexes are 32-bit, so waiters sleep on the half of state which holds the waiter count
+// and the low bits of the counter. It changes on every increment.
+static const void *get_futex_word(const atomic<uint64_t> &state)
 {
-	unique_lock<mutex> holder{lock};
-	cond.wait(holder, [&]() -> bool {
-		return counter >= count;
-	});
+	static_assert(sizeof(state) == sizeof(uint64_t), "64-bit atomics must be plain words.");
+	const uint16_t probe = 1;
+	bool little_endian = *reinterpret_cast<const uint8_t *>(&probe) == 1;
+	return reinterpret_cast<const uint32_t *>(&state) + (little_endian ? 0 : 1);
 }
 
-TaskGroup ThreadGroup::create_task(std::function<void()> func)
+uint64_t TaskSignal::get_count() const
 {
-	TaskGroup group(task_group_pool.allocate(this));
+	return state.load(memory_order_acquire) >> WaiterBits;
+}
 
-	group->deps = Internal::TaskDepsHandle(task_deps_pool.allocate(this));
+void TaskSignal::signal_increment()
+{
+	auto word = get_futex_word(state);
+	auto old_state = state.fetch_add(uint64_t(1) << WaiterBits, memory_order_acq_rel);
+	if (old_state & ((1u << WaiterBits) - 1u))
+		futex_wake_all(word);
+}
 
-	group->deps->pending_tasks.push_back(task_pool.allocate(group->deps, move(func)));
-	group->deps->count.store(1, memory_order_relaxed);
-	return group;
+void TaskSignal::wait_until_at_least(uint64_t count)
+{
+	if (get_count() >= count)
+		return;
+
+	auto word = get_futex_word(state);
+	auto current = state.fetch_add(1, memory_order_acq_rel) + 1;
+	while ((current >> WaiterBits) < count)
+	{
+		futex_wait(word, uint32_t(current));
+		current = state.load(memory_order_acquire);
+	}
+	state.fetch_sub(1, memory_order_relaxed);
 }
 
 TaskGroup ThreadGroup::create_task()
 {
-	TaskGroup group(task_group_pool.allocate(this));
-	group->deps = Internal::TaskDepsHandle(task_deps_pool.allocate(this));
+	auto *cache = get_pool_cache();
+	auto *group_memory = acquire_cached(task_group_pool, cache ? &cache->groups : nullptr, TaskCacheBatch);
+	TaskGroup group(new (group_memory) Internal::TaskGroup(this));
+	auto *deps_memory = acquire_cached(task_deps_pool, cache ? &cache->deps : nullptr, TaskCacheBatch);
+	group->deps = Internal::TaskDepsHandle(new (deps_memory) Internal::TaskDeps(this));
 	group->deps->count.store(0, memory_order_relaxed);
 	return group;
 }
@@ -254,18 +685,34 @@ void Internal::TaskGroup::set_fence_counter_signal(TaskSignal *signal)
 	deps->signal = signal;
 }
 
-void Internal::TaskGroup::enqueue_task(std::function<void()> func)
+void Internal::TaskGroup::set_desc(const char *desc)
 {
-	auto ref = reference_from_this();
-	group->enqueue_task(ref, move(func));
+	deps->desc = desc;
 }
 
-void ThreadGroup::enqueue_task(TaskGroup &group, std::function<void()> func)
+void Internal::TaskGroup::set_numa_node(unsigned node)
+{
+	if (flushed)
+		throw logic_error("Cannot change NUMA node of a flushed task group.");
+	deps->numa_node = node;
+}
+
+void Internal::TaskGroup::set_task_class(TaskClass task_class)
+{
+	if (flushed)
+		throw logic_error("Cannot change task class of a flushed task group.");
+	deps->task_class = task_class;
+}
+
+void ThreadGroup::enqueue_task(TaskGroup &group, Internal::Task *task)
 {
 	if (group->flushed)
+	{
+		free_task(task);
 		throw logic_error("Cannot enqueue work to a flushed task group.");
+	}
 
-	group->deps->pending_tasks.push_back(task_pool.allocate(group->deps, move(func)));
+	group->deps->add_pending_task(task);
 	group->deps->count.fetch_add(1, memory_order_relaxed);
 }
 
@@ -277,50 +724,430 @@ void ThreadGroup::wait_idle()
 	});
 }
 
+Internal::Task *ThreadGroup::pull_injected_tasks(WorkerQueue *worker, unsigned c)
+{
+	lock_guard<mutex> holder{cond_lock};
+
+	// Work pinned to our node can only be run by us and our neighbours, so it comes first.
+	if (worker)
+	{
+		auto &pinned = pinned_queues[worker->numa_node]->queue;
+		if (pinned.head[c])
+		{
+			return take_injected_tasks(pinned, &worker->pinned_deques[c],
+			                           unsigned(node_workers[worker->numa_node].size()), c, false);
+		}
+	}
+
+	// Drain our own node's queue first, and only then help out the other nodes.
+	auto num_nodes = unsigned(injection_queues.size());
+	unsigned home = worker ? worker->numa_node : 0;
+	unsigned node = home;
+	while (!injection_queues[node].head[c])
+	{
+		node = (node + 1) % num_nodes;
+		if (node == home)
+			return nullptr;
+	}
+
+	return take_injected_tasks(injection_queues[node], worker ? &worker->deques[c] : nullptr,
+	                           unsigned(node_workers[node].size()), c, true);
+}
+
+Internal::Task *ThreadGroup::take_injected_tasks(InjectionQueue &queue, WorkStealingDeque<Internal::Task *> *deque,
+                                                 unsigned num_takers, unsigned c, bool shared)
+{
+	// Grab a fair share of the injected work at once so we don't hit the lock for every task.
+	// Whatever we do not execute ourselves can be stolen by the other workers.
+	// Threads which are not workers have no deque to hold on to the rest, so they only take one.
+	unsigned available = queue.count[c];
+	unsigned count = 1;
+	if (deque)
+	{
+		count = available / max(num_takers, 1u) + 1;
+		count = min(count, min(available, 64u));
+	}
+	queue.count[c] -= count;
+	if (shared)
+		injected_count[c].fetch_sub(count, memory_order_relaxed);
+
+	auto *task = queue.head[c];
+	queue.head[c] = task->next;
+	task->next = nullptr;
+	for (unsigned i = 1; i < count; i++)
+	{
+		auto *t = queue.head[c];
+		queue.head[c] = t->next;
+		t->next = nullptr;
+		deque->push(t);
+	}
+
+	if (!queue.head[c])
+		queue.tail[c] = nullptr;
+
+	return task;
+}
+
+Internal::Task *ThreadGroup::steal_task(unsigned index, unsigned c)
+{
+	auto num_workers = unsigned(worker_queues.size());
+	if (num_workers < (index ? 2u : 1u))
+		return nullptr;
+
+	static thread_local uint32_t external_rng_state = 0x9e3779b9u;
+	auto &state = index ? worker_queues[index - 1]->rng_state : external_rng_state;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+
+	Internal::Task *task = nullptr;
+	// Pinned tasks can only be stolen by workers of the same node.
+	const auto try_steal = [&](unsigned victim) -> bool {
+		if (index && victim == index - 1)
+			return false;
+		auto &queue = *worker_queues[victim];
+		bool same_node = index && queue.numa_node == worker_queues[index - 1]->numa_node;
+		if (!queue.deques[c].steal(task) && !(same_node && queue.pinned_deques[c].steal(task)))
+			return false;
+
+		if (timeline_enabled.load(memory_order_relaxed))
+		{
+			auto &timeline = get_timeline(index);
+			lock_guard<mutex> holder{timeline.lock};
+			timeline.steals++;
+		}
+		return true;
+	};
+
+	// Workers look for victims on their own node first, where the data the tasks work on is likely to live.
+	bool numa = index != 0 && node_workers.size() > 1;
+	unsigned node = index ? worker_queues[index - 1]->numa_node : 0;
+	if (numa)
+	{
+		auto &local = node_workers[node];
+		auto num_local = unsigned(local.size());
+		unsigned offset = state % num_local;
+		for (unsigned i = 0; i < num_local; i++)
+			if (try_steal(local[(offset + i) % num_local]))
+				return task;
+	}
+
+	unsigned victim = state % num_workers;
+	for (unsigned i = 0; i < num_workers; i++, victim = (victim + 1) % num_workers)
+	{
+		if (numa && worker_queues[victim]->numa_node == node)
+			continue;
+		if (try_steal(victim))
+			return task;
+	}
+
+	return nullptr;
+}
+
+Internal::Task *ThreadGroup::find_task(unsigned index, TaskClass task_class)
+{
+	auto *worker = index ? worker_queues[index - 1].get() : nullptr;
+	unsigned c = Util::ecast(task_class);
+
+	Internal::Task *task = nullptr;
+	if (!worker || (!worker->deques[c].pop(task) && !worker->pinned_deques[c].pop(task)))
+	{
+		task = nullptr;
+		bool pinned_work = worker && pinned_queues[worker->numa_node]->ready_count[c].load(memory_order_relaxed) != 0;
+		if (pinned_work || injected_count[c].load(memory_order_relaxed) != 0)
+			task = pull_injected_tasks(worker, c);
+		if (!task)
+			task = steal_task(index, c);
+	}
+
+	if (task)
+	{
+		unsigned pinned_node = get_pinned_node(*task->deps);
+		if (pinned_node != ~0u)
+		{
+			pinned_queues[pinned_node]->ready_count[c].fetch_sub(1);
+			pinned_ready_count[c].fetch_sub(1);
+		}
+		ready_count[c].fetch_sub(1);
+	}
+	return task;
+}
+
+bool ThreadGroup::is_foreground_only_worker(unsigned index) const
+{
+	return index != 0 && index > get_num_threads() - num_foreground_threads;
+}
+
+void ThreadGroup::run_task(Internal::Task *task)
+{
+	bool record = timeline_enabled.load(memory_order_relaxed);
+	TimelineEvent event = {};
+	if (record)
+	{
+		event.desc = task->deps->desc;
+		event.ready_tasks = 0;
+		for (auto &c : ready_count)
+			event.ready_tasks += c.load(memory_order_relaxed);
+		event.start_nsecs = Util::get_current_time_nsecs();
+	}
+
+	if (task->func)
+		task->func();
+
+	task->deps->task_completed();
+	free_task(task);
+
+	if (record)
+	{
+		event.end_nsecs = Util::get_current_time_nsecs();
+		auto &timeline = get_timeline(get_current_worker_slot());
+		lock_guard<mutex> holder{timeline.lock};
+		timeline.events.push_back(event);
+	}
+
+	{
+		auto completed = completed_tasks.fetch_add(1, memory_order_relaxed) + 1;
+		//LOGI("Task completed (%u / %u)!\n", completed, total_tasks.load(memory_order_relaxed));
+
+		if (completed == total_tasks.load(memory_order_relaxed))
+		{
+			lock_guard<mutex> holder{wait_cond_lock};
+			wait_cond.notify_one();
+		}
+	}
+}
+
+void ThreadGroup::wait_for_task_deps(Internal::TaskDeps &deps)
+{
+	unsigned index = get_current_worker_slot();
+	bool foreground_only = is_foreground_only_worker(index);
+	const auto foreground_ready = [&]() {
+		return get_available_count(index, Util::ecast(TaskClass::Foreground));
+	};
+	const auto background_ready = [&]() {
+		return get_available_count(index, Util::ecast(TaskClass::Background));
+	};
+
+	while (!deps.done.load(memory_order_acquire))
+	{
+		// Our own deque is checked first, and it is LIFO, so we tend to pick up tasks
+		// spawned by the task we are waiting from before anything else.
+		Internal::Task *task = find_task(index, TaskClass::Foreground);
+		if (!task && !foreground_only)
+			task = find_task(index, TaskClass::Background);
+
+		if (task)
+		{
+			run_task(task);
+			continue;
+		}
+
+		// Nothing to help with right now, sleep like an idle worker would,
+		// but also wake up when the group completes.
+		unique_lock<mutex> holder{cond_lock};
+		deps.waiters.fetch_add(1);
+		if (foreground_only)
+		{
+			sleeping_foreground_count.fetch_add(1);
+			foreground_cond.wait(holder, [&]() {
+				return deps.done.load() || foreground_ready() != 0;
+			});
+			sleeping_foreground_count.fetch_sub(1, memory_order_relaxed);
+		}
+		else
+		{
+			sleeping_count.fetch_add(1);
+			cond.wait(holder, [&]() {
+				return deps.done.load() || foreground_ready() != 0 || background_ready() != 0;
+			});
+			sleeping_count.fetch_sub(1, memory_order_relaxed);
+		}
+		deps.waiters.fetch_sub(1, memory_order_relaxed);
+	}
+}
+
+void ThreadGroup::wake_task_deps_waiters()
+{
+	// We don't know which threads wait for which group, so wake everyone up and let them sort it out.
+	// This only happens for groups which someone is blocking on.
+	lock_guard<mutex> holder{cond_lock};
+	cond.notify_all();
+	foreground_cond.notify_all();
+}
+
 void ThreadGroup::thread_looper(unsigned index)
 {
 	thread_id_to_index = index;
+	thread_id_to_group = this;
+
+	auto &affinity = worker_queues[index - 1]->affinity;
+	if (!affinity.empty() && !set_current_thread_affinity(affinity.data(), affinity.size()))
+		LOGE("Failed to set affinity for worker %u.\n", index);
+
+	bool foreground_only = is_foreground_only_worker(index);
+	const auto foreground_ready = [&]() {
+		return get_available_count(index, Util::ecast(TaskClass::Foreground));
+	};
+	const auto background_ready = [&]() {
+		return get_available_count(index, Util::ecast(TaskClass::Background));
+	};
 
 	for (;;)
 	{
-		Internal::Task *task = nullptr;
+		Internal::Task *task = find_task(index, TaskClass::Foreground);
+		if (!task && !foreground_only)
+			task = find_task(index, TaskClass::Background);
 
+		if (!task)
 		{
+			bool record = timeline_enabled.load(memory_order_relaxed);
+			int64_t idle_start = record ? Util::get_current_time_nsecs() : 0;
+
 			unique_lock<mutex> holder{cond_lock};
-			cond.wait(holder, [&]() {
-				return dead || !ready_tasks.empty();
-			});
+			if (foreground_only)
+			{
+				sleeping_foreground_count.fetch_add(1);
+				foreground_cond.wait(holder, [&]() {
+					return dead || foreground_ready() != 0;
+				});
+				sleeping_foreground_count.fetch_sub(1, memory_order_relaxed);
 
-			if (dead && ready_tasks.empty())
-				break;
+				if (dead && foreground_ready() == 0)
+					break;
+			}
+			else
+			{
+				sleeping_count.fetch_add(1);
+				cond.wait(holder, [&]() {
+					return dead || foreground_ready() != 0 || background_ready() != 0;
+				});
+				sleeping_count.fetch_sub(1, memory_order_relaxed);
 
-			task = ready_tasks.front();
-			ready_tasks.pop();
+				if (dead && foreground_ready() == 0 && background_ready() == 0)
+					break;
+			}
+
+			if (record)
+			{
+				holder.unlock();
+				auto &timeline = get_timeline(index);
+				lock_guard<mutex> timeline_holder{timeline.lock};
+				timeline.idle_nsecs += Util::get_current_time_nsecs() - idle_start;
+			}
+			continue;
 		}
 
-		if (task->func)
-			task->func();
+		run_task(task);
+	}
+
+	thread_id_to_group = nullptr;
+}
+
+ThreadGroup::Timeline &ThreadGroup::get_timeline(unsigned slot)
+{
+	return slot ? worker_queues[slot - 1]->timeline : external_timeline;
+}
+
+void ThreadGroup::set_timeline_enabled(bool enable)
+{
+	if (enable && !timeline_enabled.load(memory_order_relaxed))
+		timeline_base_nsecs = Util::get_current_time_nsecs();
+	timeline_enabled.store(enable, memory_order_relaxed);
+}
+
+static void write_json_string(FILE *file, const char *str)
+{
+	fputc('"', file);
+	for (; *str; str++)
+	{
+		if (*str == '"' || *str == '\\')
+			fputc('\\', file);
+		if (uint8_t(*str) >= 0x20)
+			fputc(*str, file);
+	}
+	fputc('"', file);
+}
+
+bool ThreadGroup::dump_timeline(const std::string &path)
+{
+	FILE *file = fopen(path.c_str(), "w");
+	if (!file)
+	{
+		LOGE("Failed to open %s for writing timeline.\n", path.c_str());
+		return false;
+	}
+
+	fprintf(file, "{\"traceEvents\":[\n");
+	bool first = true;
 
-		task->deps->task_completed();
-		task_pool.free(task);
+	const auto separate = [&]() {
+		if (!first)
+			fprintf(file, ",\n");
+		first = false;
+	};
 
+	for (unsigned slot = 0; slot <= worker_queues.size(); slot++)
+	{
+		auto &timeline = get_timeline(slot);
+		lock_guard<mutex> holder{timeline.lock};
+
+		separate();
+		fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", slot);
+		if (slot)
+			fprintf(file, "\"Worker %u\"}}", slot);
+		else
+			fprintf(file, "\"External\"}}");
+
+		int64_t busy_nsecs = 0;
+		for (auto &event : timeline.events)
 		{
-			auto completed = completed_tasks.fetch_add(1, memory_order_relaxed) + 1;
-			//LOGI("Task completed (%u / %u)!\n", completed, total_tasks.load(memory_order_relaxed));
+			busy_nsecs += event.end_nsecs - event.start_nsecs;
 
-			if (completed == total_tasks.load(memory_order_relaxed))
-			{
-				lock_guard<mutex> holder{wait_cond_lock};
-				wait_cond.notify_one();
-			}
+			separate();
+			fprintf(file, "{\"name\":");
+			write_json_string(file, event.desc ? event.desc : "task");
+			fprintf(file, ",\"cat\":\"task\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+			        slot, 1e-3 * double(event.start_nsecs - timeline_base_nsecs),
+			        1e-3 * double(event.end_nsecs - event.start_nsecs));
+
+			separate();
+			fprintf(file, "{\"name\":\"Ready tasks\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"ready\":%u}}",
+			        1e-3 * double(event.start_nsecs - timeline_base_nsecs), event.ready_tasks);
 		}
+
+		if (!timeline.events.empty() || timeline.idle_nsecs)
+		{
+			LOGI("ThreadGroup %s %u: %u tasks, busy %.3f ms, idle %.3f ms, %u steals.\n",
+			     slot ? "worker" : "external", slot, unsigned(timeline.events.size()),
+			     1e-6 * double(busy_nsecs), 1e-6 * double(timeline.idle_nsecs), unsigned(timeline.steals));
+		}
+
+		timeline.events.clear();
+		timeline.steals = 0;
+		timeline.idle_nsecs = 0;
 	}
+
+	fprintf(file, "\n]}\n");
+	fclose(file);
+	return true;
 }
 
 ThreadGroup::ThreadGroup()
+	: instance_id(next_instance_id.fetch_add(1, memory_order_relaxed))
 {
 	total_tasks.store(0);
 	completed_tasks.store(0);
+	for (auto &c : injected_count)
+		c.store(0);
+	for (auto &c : ready_count)
+		c.store(0);
+	for (auto &c : pinned_ready_count)
+		c.store(0);
+	sleeping_count.store(0);
+	sleeping_foreground_count.store(0);
+	timeline_enabled.store(false);
+	injection_queues.resize(1);
+	node_workers.resize(1);
 }
 
 ThreadGroup::~ThreadGroup()
@@ -339,6 +1166,7 @@ void ThreadGroup::stop()
 		lock_guard<mutex> holder{cond_lock};
 		dead = true;
 		cond.notify_all();
+		foreground_cond.notify_all();
 	}
 
 	for (auto &t : thread_group)
@@ -350,6 +1178,21 @@ void ThreadGroup::stop()
 		}
 	}
 
+	for (auto &worker : worker_queues)
+	{
+		auto &cache = worker->cache;
+		task_pool.release_vacants(cache.tasks.data(), cache.tasks.size());
+		task_group_pool.release_vacants(cache.groups.data(), cache.groups.size());
+		task_deps_pool.release_vacants(cache.deps.data(), cache.deps.size());
+		cache.tasks.clear();
+		cache.groups.clear();
+		cache.deps.clear();
+	}
+
+	// Without workers, nothing could run pinned tasks, so they are treated like any other task until restarted.
+	for (auto &node : node_workers)
+		node.clear();
+
 	active = false;
 	dead = false;
 }
@@ -26,26 +26,47 @@
 #include <mutex>
 #include <thread>
 #include <vector>
-#include <queue>
 #include <future>
 #include <memory>
 #include <object_pool.hpp>
 #include "variant.hpp"
 #include "intrusive.hpp"
+#include "work_stealing_deque.hpp"
+#include "task_callable.hpp"
+#include "thread_topology.hpp"
+#include "futex.hpp"
+#include "enum_cast.hpp"
 #include <unordered_map>
+#include <algorithm>
+#include <string>
 
 namespace Granite
 {
 class ThreadGroup;
 
-struct TaskSignal
+// Foreground tasks are frame-critical, and workers always drain them before any background task.
+// Background tasks are for long-running work such as texture compression and asset loading.
+enum class TaskClass : unsigned
 {
-	std::condition_variable cond;
-	std::mutex lock;
-	uint64_t counter = 0;
+	Foreground,
+	Background,
+	Count
+};
 
+// Counts completed task groups. Incrementing is a single atomic operation,
+// and only goes to the kernel to wake threads up when someone is actually waiting.
+struct TaskSignal
+{
+	TaskSignal();
 	void signal_increment();
 	void wait_until_at_least(uint64_t count);
+	uint64_t get_count() const;
+
+	// The counter lives in the upper bits, the number of sleeping waiters in the lower bits.
+	// Keeping both in one word means signal_increment() does not touch the object after the increment,
+	// so a waiter is free to destroy it as soon as it observes the count it waits for.
+	enum { WaiterBits = 16 };
+	std::atomic<uint64_t> state;
 };
 
 namespace Internal
@@ -70,24 +91,35 @@ struct TaskDeps : Util::IntrusivePtrEnabled<TaskDeps, TaskDepsDeleter, Util::Mul
 	    : group(group)
 	{
 		count.store(0, std::memory_order_relaxed);
-		dependency_count.store(0, std::memory_order_relaxed);
+		// Flushing the group counts as a dependency, so the group cannot be released before it is flushed.
+		dependency_count.store(1, std::memory_order_relaxed);
+		done.store(false, std::memory_order_relaxed);
+		waiters.store(0, std::memory_order_relaxed);
 	}
 
 	ThreadGroup *group;
 	std::vector<Util::IntrusivePtr<TaskDeps>> pending;
 	std::atomic_uint count;
 
-	std::vector<Task *> pending_tasks;
+	// Intrusive list of tasks which are held back until the group is flushed and its dependencies are satisfied.
+	Task *pending_tasks = nullptr;
+	Task *pending_tasks_tail = nullptr;
 	TaskSignal *signal = nullptr;
+	TaskClass task_class = TaskClass::Foreground;
+	const char *desc = nullptr;
+	unsigned numa_node = ~0u;
 	std::atomic_uint dependency_count;
 
 	void task_completed();
 	void dependency_satisfied();
 	void notify_dependees();
+	void add_pending_task(Task *task);
+	void move_pending_tasks_to_ready();
 
-	std::condition_variable cond;
-	std::mutex cond_lock;
-	bool done = false;
+	// Threads blocked in TaskGroup::wait() sleep on the ThreadGroup's condition variables,
+	// so they can be woken up both when this group completes and when new work becomes ready.
+	std::atomic_bool done;
+	std::atomic_uint waiters;
 };
 using TaskDepsHandle = Util::IntrusivePtr<TaskDeps>;
 
@@ -96,28 +128,56 @@ struct TaskGroup : Util::IntrusivePtrEnabled<TaskGroup, TaskGroupDeleter, Util::
 	explicit TaskGroup(ThreadGroup *group);
 	~TaskGroup();
 	void flush();
+
+	// Executes other ready tasks while waiting, so it is safe to call from within a task.
 	void wait();
 
 	ThreadGroup *group;
 	TaskDepsHandle deps;
-	void enqueue_task(std::function<void ()> func);
+	template <typename Func>
+	void enqueue_task(Func &&func);
 	void set_fence_counter_signal(TaskSignal *signal);
 
+	// Must be set before the group is flushed. It does not propagate through dependencies.
+	void set_task_class(TaskClass task_class);
+
+	// Name used for this group's tasks in timeline captures. Must point to a string which outlives the capture.
+	void set_desc(const char *desc);
+
+	// Run this group's tasks only on workers of the given NUMA node, e.g. the node which touched its input.
+	// Workers on other nodes and threads which are not workers never pick them up, not even while waiting.
+	// If the node has no workers, the setting is ignored. Must be set before the group is flushed.
+	void set_numa_node(unsigned node);
+
+	template <typename Func>
+	void enqueue_parallel_for(size_t begin, size_t end, size_t grain, Func func);
+
 	unsigned id = 0;
 	bool flushed = false;
 };
 
 struct Task
 {
-	Task(TaskDepsHandle deps, std::function<void ()> func)
-		: deps(std::move(deps)), func(std::move(func))
+	explicit Task(TaskDepsHandle deps)
+		: deps(std::move(deps))
 	{
 	}
 
-	Task() = default;
-
 	TaskDepsHandle deps;
-	std::function<void ()> func;
+	Task *next = nullptr;
+	TaskCallable func;
+};
+
+// Free object memory held by one thread, so creating and freeing tasks only takes the pool locks once per batch.
+// Workers own one each, other threads are handed one per thread group on first use.
+struct PoolCache
+{
+	std::vector<Task *> tasks;
+	std::vector<TaskGroup *> groups;
+	std::vector<TaskDeps *> deps;
+
+	// Set when the thread owning an external cache exits, so the next new thread can take it over.
+	std::atomic_bool orphaned{false};
 };
 }
 
@@ -131,7 +191,20 @@ public:
 	ThreadGroup(ThreadGroup &&) = delete;
 	void operator=(ThreadGroup &&) = delete;
 
-	void start(unsigned num_threads);
+	// The last num_foreground_threads workers only ever execute foreground tasks,
+	// so frame-critical work does not have to wait for long background tasks to complete.
+	void start(unsigned num_threads, unsigned num_foreground_threads = 0);
+
+	// Must be called before start(). Workers are spread over the nodes in proportion to their number of CPUs,
+	// and prefer work which was queued on, or can be stolen from, their own node.
+	void set_topology(const ThreadTopology &topology, ThreadPinning pinning);
+	unsigned get_num_numa_nodes() const
+	{
+		return unsigned(node_workers.size());
+	}
+
+	// The NUMA node of the calling worker, or 0 if the calling thread is not a worker of this group.
+	unsigned get_current_numa_node() const;
 	unsigned get_num_threads() const
 	{
 		return thread_group.size();
@@ -140,11 +213,29 @@ public:
 
 	static unsigned get_current_thread_index();
 
-	void enqueue_task(TaskGroup &group, std::function<void ()> func);
-	TaskGroup create_task(std::function<void ()> func);
+	template <typename Func>
+	void enqueue_task(TaskGroup &group, Func &&func);
+	template <typename Func>
+	TaskGroup create_task(Func &&func);
 	TaskGroup create_task();
 
-	void move_to_ready_tasks(const std::vector<Internal::Task *> &list);
+	// Calls func(begin, end) for disjoint sub-ranges which together cover [begin, end), as part of group.
+	// Ranges are split in halves while other workers are running out of work, but never below grain.
+	// If grain is 0, a grain is derived from the number of worker threads.
+	template <typename Func>
+	void enqueue_parallel_for(TaskGroup &group, size_t begin, size_t end, size_t grain, Func func);
+
+	// Blocking variants. The calling thread helps out with the work while waiting.
+	template <typename Func>
+	void parallel_for(size_t begin, size_t end, size_t grain, Func func);
+
+	// map(begin, end) returns a T for a sub-range. reduce(T, T) must be associative and commutative,
+	// since sub-ranges are combined in no particular order.
+	template <typename T, typename Map, typename Reduce>
+	T parallel_reduce(size_t begin, size_t end, size_t grain, T identity, Map map, Reduce reduce);
+
+	// Takes a list of tasks linked through Task::next.
+	void move_to_ready_tasks(Internal::Task *list);
 
 	void add_dependency(TaskGroup &dependee, TaskGroup &dependency);
 
@@ -154,21 +245,146 @@ public:
 	void submit(TaskGroup &group);
 	void wait_idle();
 
+	// Runs ready tasks on the calling thread until deps has completed.
+	void wait_for_task_deps(Internal::TaskDeps &deps);
+	void wake_task_deps_waiters();
+
 	static ThreadGroup &get_global();
 	static void register_main_thread();
 
+	// Records begin and end of every task along with the group's description, and per-worker statistics.
+	// When disabled, the only cost is a branch per executed task.
+	// For the global group, set GRANITE_TIMELINE=<path> to capture a timeline of the whole run.
+	void set_timeline_enabled(bool enable);
+
+	// Writes the captured timeline as Chrome trace event JSON (chrome://tracing, Perfetto),
+	// logs per-worker statistics and clears the capture. Must be called while the group is idle.
+	bool dump_timeline(const std::string &path);
+
 private:
 	Util::ThreadSafeObjectPool<Internal::Task> task_pool;
 	Util::ThreadSafeObjectPool<Internal::TaskGroup> task_group_pool;
 	Util::ThreadSafeObjectPool<Internal::TaskDeps> task_deps_pool;
 
-	std::queue<Internal::Task *> ready_tasks;
+	// Tasks which become ready on a worker thread are pushed to that worker's deque.
+	// Tasks which become ready anywhere else go through an injection queue, an intrusive list protected by cond_lock.
+	// Tasks pinned to a NUMA node use that node's pinned injection queue and the pinned deques of its workers,
+	// which only the node's own workers take from.
+	enum { NumTaskClasses = Util::ecast(TaskClass::Count) };
+	struct InjectionQueue
+	{
+		Internal::Task *head[NumTaskClasses] = {};
+		Internal::Task *tail[NumTaskClasses] = {};
+		unsigned count[NumTaskClasses] = {};
+	};
+	std::vector<InjectionQueue> injection_queues;
+	std::atomic_uint injected_count[NumTaskClasses];
+	unsigned injection_rr = 0;
+
+	// ready_count includes pinned tasks. Threads subtract the pinned tasks they are not allowed to run
+	// to decide whether there is anything for them to do.
+	struct PinnedQueue
+	{
+		InjectionQueue queue;
+		std::atomic_uint ready_count[NumTaskClasses];
+	};
+	std::vector<std::unique_ptr<PinnedQueue>> pinned_queues;
+	std::atomic_uint pinned_ready_count[NumTaskClasses];
+
+	// Objects move between a pool and a thread's PoolCache this many at a time.
+	enum { TaskCacheBatch = 64 };
+
+	// Caches of threads which are not workers of this group. Threads find theirs through a thread_local list,
+	// which only holds weak references, so this group can go away before the threads do.
+	std::vector<std::shared_ptr<Internal::PoolCache>> external_caches;
+	std::mutex external_cache_lock;
+	uint64_t instance_id;
+
+	struct TimelineEvent
+	{
+		const char *desc;
+		int64_t start_nsecs;
+		int64_t end_nsecs;
+		unsigned ready_tasks;
+	};
+
+	struct Timeline
+	{
+		std::mutex lock;
+		std::vector<TimelineEvent> events;
+		uint64_t steals = 0;
+		int64_t idle_nsecs = 0;
+	};
+
+	struct WorkerQueue
+	{
+		WorkStealingDeque<Internal::Task *> deques[NumTaskClasses];
+		WorkStealingDeque<Internal::Task *> pinned_deques[NumTaskClasses];
+		Internal::PoolCache cache;
+		uint32_t rng_state = 0;
+		unsigned numa_node = 0;
+		std::vector<unsigned> affinity;
+		Timeline timeline;
+	};
+	std::vector<std::unique_ptr<WorkerQueue>> worker_queues;
+
+	// Worker indices belonging to each NUMA node.
+	std::vector<std::vector<unsigned>> node_workers;
+	ThreadTopology topology;
+	ThreadPinning pinning = ThreadPinning::None;
+	void assign_workers_to_nodes();
+	unsigned get_injection_node() const;
+	unsigned get_pinned_node(const Internal::TaskDeps &deps) const;
+	unsigned get_available_count(unsigned index, unsigned task_class) const;
+	std::atomic_uint ready_count[NumTaskClasses];
+	std::atomic_uint sleeping_count;
+	std::atomic_uint sleeping_foreground_count;
+	unsigned num_foreground_threads = 0;
+
+	std::atomic_bool timeline_enabled;
+	int64_t timeline_base_nsecs = 0;
+	Timeline external_timeline;
+	Timeline &get_timeline(unsigned slot);
 
 	std::vector<std::unique_ptr<std::thread>> thread_group;
 	std::mutex cond_lock;
 	std::condition_variable cond;
+	std::condition_variable foreground_cond;
+
+	template <typename Func>
+	struct ParallelForState
+	{
+		ParallelForState(Func func, size_t grain)
+			: func(std::move(func)), grain(grain)
+		{
+		}
+		Func func;
+		size_t grain;
+	};
+
+	template <typename Func>
+	void run_parallel_range(const std::shared_ptr<ParallelForState<Func>> &state,
+	                        const Internal::TaskDepsHandle &deps, size_t begin, size_t end);
+	template <typename Func>
+	void spawn_task(Internal::TaskDepsHandle deps, Func &&func);
+	Internal::Task *allocate_task(Internal::TaskDepsHandle deps);
+	void free_task(Internal::Task *task);
+	Internal::PoolCache *get_pool_cache();
+	void reserve_pool_cache(Internal::PoolCache &cache);
+	void enqueue_task(TaskGroup &group, Internal::Task *task);
+	bool should_split_range() const;
+	size_t get_default_grain(size_t count) const;
+	unsigned get_current_worker_slot() const;
 
 	void thread_looper(unsigned self_index);
+	Internal::Task *find_task(unsigned self_index, TaskClass task_class);
+	Internal::Task *pull_injected_tasks(WorkerQueue *worker, unsigned task_class);
+	Internal::Task *take_injected_tasks(InjectionQueue &queue, WorkStealingDeque<Internal::Task *> *deque,
+	                                    unsigned num_takers, unsigned task_class, bool shared);
+	Internal::Task *steal_task(unsigned self_index, unsigned task_class);
+	void run_task(Internal::Task *task);
+	bool is_foreground_only_worker(unsigned index) const;
+	void wake_workers(TaskClass task_class, size_t count, bool pinned);
 
 	bool active = false;
 	bool dead = false;
@@ -178,4 +394,135 @@ private:
 	std::atomic_uint total_tasks;
 	std::atomic_uint completed_tasks;
 };
+
+template <typename Func>
+void ThreadGroup::enqueue_task(TaskGroup &group, Func &&func)
+{
+	auto *task = allocate_task(group->deps);
+	task->func.assign(std::forward<Func>(func));
+	enqueue_task(group, task);
+}
+
+template <typename Func>
+TaskGroup ThreadGroup::create_task(Func &&func)
+{
+	auto group = create_task();
+	enqueue_task(group, std::forward<Func>(func));
+	return group;
+}
+
+template <typename Func>
+void ThreadGroup::spawn_task(Internal::TaskDepsHandle deps, Func &&func)
+{
+	// Only called from a task which belongs to deps, so the group cannot complete before we add to its count.
+	deps->count.fetch_add(1, std::memory_order_relaxed);
+	auto *task = allocate_task(std::move(deps));
+	task->func.assign(std::forward<Func>(func));
+	move_to_ready_tasks(task);
+}
+
+template <typename Func>
+void ThreadGroup::run_parallel_range(const std::shared_ptr<ParallelForState<Func>> &state,
+                                     const Internal::TaskDepsHandle &deps, size_t begin, size_t end)
+{
+	while (end - begin > state->grain)
+	{
+		if (should_split_range())
+		{
+			// Hand off the upper half so idle workers can steal it, keep going with the lower half.
+			size_t mid = begin + (end - begin) / 2;
+			spawn_task(deps, [this, state, deps, mid, end]() {
+				run_parallel_range(state, deps, mid, end);
+			});
+			end = mid;
+		}
+		else
+		{
+			state->func(begin, begin + state->grain);
+			begin += state->grain;
+		}
+	}
+
+	state->func(begin, end);
+}
+
+template <typename Func>
+void ThreadGroup::enqueue_parallel_for(TaskGroup &group, size_t begin, size_t end, size_t grain, Func func)
+{
+	if (begin >= end)
+		return;
+
+	size_t count = end - begin;
+	if (grain == 0)
+		grain = get_default_grain(count);
+
+	auto state = std::make_shared<ParallelForState<Func>>(std::move(func), grain);
+	Internal::TaskDepsHandle deps = group->deps;
+
+	// Start out with one range per worker so the initial fan-out does not have to go through splitting.
+	size_t num_ranges = (count + grain - 1) / grain;
+	num_ranges = std::min<size_t>(num_ranges, std::max(get_num_threads(), 1u));
+
+	for (size_t i = 0; i < num_ranges; i++)
+	{
+		size_t range_begin = begin + (count * i) / num_ranges;
+		size_t range_end = begin + (count * (i + 1)) / num_ranges;
+		enqueue_task(group, [this, state, deps, range_begin, range_end]() {
+			run_parallel_range(state, deps, range_begin, range_end);
+		});
+	}
+}
+
+template <typename Func>
+void ThreadGroup::parallel_for(size_t begin, size_t end, size_t grain, Func func)
+{
+	auto group = create_task();
+	enqueue_parallel_for(group, begin, end, grain, std::move(func));
+	group->wait();
+}
+
+template <typename T, typename Map, typename Reduce>
+T ThreadGroup::parallel_reduce(size_t begin, size_t end, size_t grain, T identity, Map map, Reduce reduce)
+{
+	// One accumulator per worker, padded to avoid false sharing.
+	// Slot 0 is shared by any non-worker thread which might end up running tasks, so it is locked.
+	struct Slot
+	{
+		T value;
+		char padding[64];
+	};
+	std::vector<Slot> slots(get_num_threads() + 1, Slot{identity, {}});
+	std::mutex external_lock;
+
+	parallel_for(begin, end, grain, [&](size_t range_begin, size_t range_end) {
+		T value = map(range_begin, range_end);
+		unsigned slot = get_current_worker_slot();
+		if (slot == 0)
+		{
+			std::lock_guard<std::mutex> holder{external_lock};
+			slots[0].value = reduce(slots[0].value, value);
+		}
+		else
+			slots[slot].value = reduce(slots[slot].value, value);
+	});
+
+	T result = identity;
+	for (auto &slot : slots)
+		result = reduce(result, slot.value);
+	return result;
+}
+
+template <typename Func>
+void Internal::TaskGroup::enqueue_task(Func &&func)
+{
+	auto ref = reference_from_this();
+	group->enqueue_task(ref, std::forward<Func>(func));
+}
+
+template <typename Func>
+void Internal::TaskGroup::enqueue_parallel_for(size_t begin, size_t end, size_t grain, Func func)
+{
+	auto ref = reference_from_this();
+	group->enqueue_parallel_for(ref, begin, end, grain, std::move(func));
+}
 }
\ No newline at end of file
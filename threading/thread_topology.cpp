@@ -0,0 +1,236 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "thread_topology.hpp"
+#include "util.hpp"
+#include <thread>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__linux__)
+#include <sched.h>
+#elif defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+using namespace std;
+
+namespace Granite
+{
+static bool parse_cpu_list(const char *str, const char *end, vector<unsigned> &cpus)
+{
+	while (str < end)
+	{
+		char *next;
+		unsigned long first = strtoul(str, &next, 10);
+		if (next == str)
+			return false;
+
+		unsigned long last = first;
+		str = next;
+		if (str < end && *str == '-')
+		{
+			str++;
+			last = strtoul(str, &next, 10);
+			if (next == str || last < first)
+				return false;
+			str = next;
+		}
+
+		for (unsigned long cpu = first; cpu <= last; cpu++)
+			cpus.push_back(unsigned(cpu));
+
+		if (str < end)
+		{
+			if (*str != ',')
+				return false;
+			str++;
+		}
+	}
+
+	return true;
+}
+
+static void trim_trailing_whitespace(string &str)
+{
+	while (!str.empty() && (str.back() == '\n' || str.back() == ' ' || str.back() == '\r'))
+		str.pop_back();
+}
+
+#if defined(__linux__)
+static bool read_sysfs_line(const char *path, string &line)
+{
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return false;
+
+	char buffer[4096];
+	bool ret = fgets(buffer, sizeof(buffer), file) != nullptr;
+	fclose(file);
+
+	if (ret)
+	{
+		line = buffer;
+		trim_trailing_whitespace(line);
+	}
+	return ret;
+}
+
+static bool detect_linux(ThreadTopology &topology)
+{
+	string line;
+	if (!read_sysfs_line("/sys/devices/system/node/online", line))
+		return false;
+
+	vector<unsigned> node_ids;
+	if (!parse_cpu_list(line.data(), line.data() + line.size(), node_ids))
+		return false;
+
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	bool has_allowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+	for (auto id : node_ids)
+	{
+		char path[128];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", id);
+
+		// Memory-only nodes have an empty CPU list.
+		vector<unsigned> cpus;
+		if (!read_sysfs_line(path, line) || !parse_cpu_list(line.data(), line.data() + line.size(), cpus))
+			continue;
+
+		if (has_allowed)
+		{
+			auto itr = remove_if(begin(cpus), end(cpus), [&](unsigned cpu) {
+				return cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed);
+			});
+			cpus.erase(itr, end(cpus));
+		}
+
+		if (!cpus.empty())
+			topology.nodes.push_back(move(cpus));
+	}
+
+	return !topology.nodes.empty();
+}
+#endif
+
+ThreadTopology ThreadTopology::detect()
+{
+	ThreadTopology topology;
+#if defined(__linux__)
+	if (detect_linux(topology))
+		return topology;
+	topology.nodes.clear();
+#endif
+
+	unsigned num_cpus = max(thread::hardware_concurrency(), 1u);
+	topology.nodes.emplace_back();
+	for (unsigned i = 0; i < num_cpus; i++)
+		topology.nodes.back().push_back(i);
+	return topology;
+}
+
+bool ThreadTopology::parse(const string &desc, ThreadTopology &topology)
+{
+	topology.nodes.clear();
+
+	size_t offset = 0;
+	while (offset <= desc.size())
+	{
+		size_t end = desc.find(';', offset);
+		if (end == string::npos)
+			end = desc.size();
+
+		vector<unsigned> cpus;
+		if (!parse_cpu_list(desc.data() + offset, desc.data() + end, cpus) || cpus.empty())
+		{
+			LOGE("Invalid thread topology \"%s\".\n", desc.c_str());
+			topology.nodes.clear();
+			return false;
+		}
+
+		topology.nodes.push_back(move(cpus));
+		offset = end + 1;
+	}
+
+	return true;
+}
+
+unsigned ThreadTopology::get_num_cpus() const
+{
+	unsigned count = 0;
+	for (auto &node : nodes)
+		count += unsigned(node.size());
+	return count;
+}
+
+bool parse_thread_pinning(const string &str, ThreadPinning &pinning)
+{
+	if (str == "none")
+		pinning = ThreadPinning::None;
+	else if (str == "node")
+		pinning = ThreadPinning::Node;
+	else if (str == "cpu")
+		pinning = ThreadPinning::CPU;
+	else
+	{
+		LOGE("Invalid thread pinning \"%s\", expected none, node or cpu.\n", str.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool set_current_thread_affinity(const unsigned *cpus, size_t count)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	bool any = false;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (cpus[i] < CPU_SETSIZE)
+		{
+			CPU_SET(cpus[i], &set);
+			any = true;
+		}
+	}
+
+	return any && sched_setaffinity(0, sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+	DWORD_PTR mask = 0;
+	for (size_t i = 0; i < count; i++)
+		if (cpus[i] < 8 * sizeof(DWORD_PTR))
+			mask |= DWORD_PTR(1) << cpus[i];
+
+	return mask && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+	(void)cpus;
+	(void)count;
+	return false;
+#endif
+}
+}
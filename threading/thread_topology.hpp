@@ -0,0 +1,62 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stddef.h>
+
+namespace Granite
+{
+enum class ThreadPinning
+{
+	// Workers float freely, the OS scheduler decides where they run.
+	None,
+	// Workers are restricted to the CPUs of the NUMA node they are assigned to.
+	Node,
+	// Every worker is restricted to a single CPU.
+	CPU
+};
+
+struct ThreadTopology
+{
+	// Logical CPU indices belonging to each NUMA node.
+	std::vector<std::vector<unsigned>> nodes;
+
+	// On Linux, reads the NUMA layout from sysfs, restricted to the CPUs this process may run on.
+	// Elsewhere, or if that fails, all CPUs are assumed to belong to a single node.
+	static ThreadTopology detect();
+
+	// Nodes are separated by ';', and each node is a CPU list such as "0-7,16-23".
+	// E.g. "0-7,16-23;8-15,24-31" describes two nodes with 16 CPUs each.
+	static bool parse(const std::string &desc, ThreadTopology &topology);
+
+	unsigned get_num_cpus() const;
+};
+
+// Accepts "none", "node" and "cpu".
+bool parse_thread_pinning(const std::string &str, ThreadPinning &pinning);
+
+// Restricts the calling thread to the given CPUs. Returns false if unsupported on this platform or if it failed.
+bool set_current_thread_affinity(const unsigned *cpus, size_t count);
+}
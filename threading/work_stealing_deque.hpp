@@ -0,0 +1,163 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+namespace Granite
+{
+// Chase-Lev work-stealing deque, following "Correct and Efficient Work-Stealing for Weak Memory Models"
+// (Le, Pop, Cohen, Zappa Nardelli, 2013).
+// Only the owning thread may call push() and pop(). Any thread may call steal().
+template <typename T>
+class WorkStealingDeque
+{
+public:
+	explicit WorkStealingDeque(unsigned log2_capacity = 8)
+	{
+		top.store(0, std::memory_order_relaxed);
+		bottom.store(0, std::memory_order_relaxed);
+		arrays.emplace_back(new Array(log2_capacity));
+		array.store(arrays.back().get(), std::memory_order_relaxed);
+	}
+
+	WorkStealingDeque(const WorkStealingDeque &) = delete;
+	void operator=(const WorkStealingDeque &) = delete;
+
+	void push(T value)
+	{
+		int64_t b = bottom.load(std::memory_order_relaxed);
+		int64_t t = top.load(std::memory_order_acquire);
+		Array *a = array.load(std::memory_order_relaxed);
+
+		if (b - t > int64_t(a->mask))
+			a = grow(a, t, b);
+
+		a->put(b, value);
+		// A release store rather than fence + relaxed store as in the paper.
+		// Equivalent in cost, and visible to race detectors which do not model fences.
+		bottom.store(b + 1, std::memory_order_release);
+	}
+
+	bool pop(T &value)
+	{
+		int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		Array *a = array.load(std::memory_order_relaxed);
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = top.load(std::memory_order_relaxed);
+
+		if (t > b)
+		{
+			// Empty.
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return false;
+		}
+
+		value = a->get(b);
+		if (t == b)
+		{
+			// Last element, race against thieves.
+			bool won = top.compare_exchange_strong(t, t + 1,
+			                                       std::memory_order_seq_cst,
+			                                       std::memory_order_relaxed);
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return won;
+		}
+
+		return true;
+	}
+
+	bool steal(T &value)
+	{
+		int64_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t b = bottom.load(std::memory_order_acquire);
+
+		if (t >= b)
+			return false;
+
+		Array *a = array.load(std::memory_order_acquire);
+		value = a->get(t);
+		return top.compare_exchange_strong(t, t + 1,
+		                                   std::memory_order_seq_cst,
+		                                   std::memory_order_relaxed);
+	}
+
+	// Only a hint when called from threads other than the owner.
+	bool empty() const
+	{
+		int64_t b = bottom.load(std::memory_order_relaxed);
+		int64_t t = top.load(std::memory_order_relaxed);
+		return t >= b;
+	}
+
+private:
+	struct Array
+	{
+		explicit Array(unsigned log2_size)
+			: mask((size_t(1) << log2_size) - 1), log2_size(log2_size),
+			  data(new std::atomic<T>[size_t(1) << log2_size])
+		{
+		}
+
+		T get(int64_t index) const
+		{
+			return data[size_t(index) & mask].load(std::memory_order_relaxed);
+		}
+
+		void put(int64_t index, T value)
+		{
+			data[size_t(index) & mask].store(value, std::memory_order_relaxed);
+		}
+
+		size_t mask;
+		unsigned log2_size;
+		std::unique_ptr<std::atomic<T>[]> data;
+	};
+
+	Array *grow(Array *a, int64_t t, int64_t b)
+	{
+		// Thieves might still be reading from the old array, so keep it alive until the deque dies.
+		// Growth is exponential, so this wastes at most as much memory as the live array.
+		auto *new_array = new Array(a->log2_size + 1);
+		for (int64_t i = t; i < b; i++)
+			new_array->put(i, a->get(i));
+		arrays.emplace_back(new_array);
+		array.store(new_array, std::memory_order_release);
+		return new_array;
+	}
+
+	// Keep the thief and owner ends on separate cache lines.
+	// Plain padding rather than alignas, since C++14 operator new does not honor extended alignment.
+	std::atomic<int64_t> top;
+	char top_padding[64 - sizeof(std::atomic<int64_t>)];
+	std::atomic<int64_t> bottom;
+	char bottom_padding[64 - sizeof(std::atomic<int64_t>)];
+	std::atomic<Array *> array;
+	std::vector<std::unique_ptr<Array>> arrays;
+};
+}
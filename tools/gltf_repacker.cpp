@@ -25,6 +25,7 @@
 #include "util.hpp"
 #include "cli_parser.hpp"
 #include "rapidjson_wrapper.hpp"
+#include <stdexcept>
 
 using namespace Granite;
 using namespace Util;
@@ -53,6 +54,7 @@ static void print_help()
 	LOGI("[--environment-texcomp-quality <1 (fast) - 5 (slow)>]\n");
 	LOGI("[--environment-intensity <intensity>]\n");
 	LOGI("[--threads <num threads>]\n");
+	LOGI("[--thread-pinning <none/node/cpu>] [--thread-topology <cpus node 0;cpus node 1;...>]\n");
 	LOGI("[--fog-color R G B] [--fog-falloff falloff]\n");
 	LOGI("[--extra-lights lights.json]\n");
 	LOGI("[--texcomp-quality <1 (fast) - 5 (slow)>] input.gltf\n");
@@ -60,6 +62,7 @@ static void print_help()
 	LOGI("[--optimize-meshes]\n");
 	LOGI("[--stripify-meshes]\n");
 	LOGI("[--quantize-attributes]\n");
+	LOGI("[--compress-animations] [--animation-error <max error>]\n");
 	LOGI("[--flip-tangent-w]\n");
 	LOGI("[--renormalize-normals]\n");
 	LOGI("[--gltf]\n");
@@ -112,6 +115,17 @@ int main(int argc, char *argv[])
 		options.quantize_attributes = true;
 	});
 
+	cbs.add("--compress-animations", [&](CLIParser &) {
+		options.compress_animations = true;
+	});
+
+	cbs.add("--animation-error", [&](CLIParser &parser) {
+		float error = float(parser.next_double());
+		options.animation_compression.translation_error = error;
+		options.animation_compression.rotation_error = error;
+		options.animation_compression.scale_error = error;
+	});
+
 	cbs.add("--optimize-meshes", [&](CLIParser &) {
 		options.optimize_meshes = true;
 	});
@@ -122,6 +136,11 @@ int main(int argc, char *argv[])
 	});
 
 	cbs.add("--threads", [&](CLIParser &parser) { options.threads = parser.next_uint(); });
+	cbs.add("--thread-topology", [&](CLIParser &parser) { options.thread_topology = parser.next_string(); });
+	cbs.add("--thread-pinning", [&](CLIParser &parser) {
+		if (!parse_thread_pinning(parser.next_string(), options.thread_pinning))
+			throw invalid_argument("Invalid thread pinning");
+	});
 	cbs.add("--help", [](CLIParser &parser) { print_help(); parser.end(); });
 	cbs.default_handler = [&](const char *arg) { args.input = arg; };
 	CLIParser cli_parser(move(cbs), argc - 1, argv + 1);
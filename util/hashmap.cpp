@@ -0,0 +1,196 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "hashmap.hpp"
+#include <string.h>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+namespace Util
+{
+// Bulk hashing follows the structure of XXH3: eight 64-bit lanes take one 64-byte stripe at a time,
+// each lane multiplying the two 32-bit halves of its input xored with a key. The multiplies are independent,
+// so they pipeline well and map directly onto SSE2's 32x32 -> 64 multiply.
+// After every block of stripes the lanes are scrambled so that long inputs cannot cancel out.
+enum
+{
+	StripeSize = 64,
+	StripesPerBlock = 16,
+	BlockSize = StripeSize * StripesPerBlock,
+	LastStripeKey = 17,
+	MergeKey = 16,
+	ScrambleKey = 24
+};
+
+static const uint64_t prime32_1 = 0x9e3779b1u;
+
+// Random key material. Stripe n uses words n to n + 7.
+static const uint64_t secret[32] = {
+	0xa1efb4d6c54961faull, 0xb822bb847edd21a3ull, 0xd63774cc58175393ull, 0x2c6c4ff863b0df10ull,
+	0xc1a4a4bcf12f7a3full, 0x26612e96eb6a8240ull, 0x36ae077245920f97ull, 0xee03a5919f8a5486ull,
+	0x313955f4b89f82fbull, 0xeac0c3d0089cab66ull, 0x106aea73f99aa903ull, 0xba4579b286fad979ull,
+	0x23dbe040b7f9dc16ull, 0x44e3f71c96a99dd9ull, 0x5f1fff8e710a5703ull, 0xc559436dcf765920ull,
+	0x9143aefe5f4179ffull, 0x85433187752c47f4ull, 0xc92e8c3be1923707ull, 0x623dfd84dcc05d2cull,
+	0x7d971e65650bb518ull, 0x4b4d7a19ac4ec0b3ull, 0x810b442061e18c37ull, 0xb14f3a3b086c0f5cull,
+	0xcd2e16cf17a00049ull, 0xed90b96e5010d9c6ull, 0xd19782d400148a60ull, 0x4b4a5757daa77ed0ull,
+	0x28ecc1a01d1d8da4ull, 0xe39b29bfdfc94d96ull, 0xb2ea63eb93deb8afull, 0x2d465cb16c7f5a91ull,
+};
+
+static inline uint64_t read_u64(const uint8_t *data)
+{
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static inline uint64_t mul128_fold64(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+	unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+	return uint64_t(product) ^ uint64_t(product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	uint64_t hi;
+	uint64_t lo = _umul128(a, b, &hi);
+	return lo ^ hi;
+#else
+	uint64_t lo_lo = (a & 0xffffffffu) * (b & 0xffffffffu);
+	uint64_t hi_lo = (a >> 32) * (b & 0xffffffffu);
+	uint64_t lo_hi = (a & 0xffffffffu) * (b >> 32);
+	uint64_t hi_hi = (a >> 32) * (b >> 32);
+	uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffffu) + lo_hi;
+	uint64_t hi = hi_hi + (hi_lo >> 32) + (cross >> 32);
+	uint64_t lo = (cross << 32) | (lo_lo & 0xffffffffu);
+	return lo ^ hi;
+#endif
+}
+
+#ifdef UTIL_HASHMAP_SSE2
+static inline void accumulate_stripe(__m128i *acc, const uint8_t *data, const uint64_t *key)
+{
+	for (unsigned i = 0; i < 4; i++)
+	{
+		__m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data) + i);
+		__m128i keyed = _mm_xor_si128(value, _mm_loadu_si128(reinterpret_cast<const __m128i *>(key) + i));
+		__m128i product = _mm_mul_epu32(keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+		__m128i swapped = _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+		acc[i] = _mm_add_epi64(acc[i], _mm_add_epi64(product, swapped));
+	}
+}
+
+static inline void scramble(__m128i *acc)
+{
+	const __m128i prime = _mm_set1_epi32(int(prime32_1));
+	for (unsigned i = 0; i < 4; i++)
+	{
+		__m128i value = _mm_xor_si128(acc[i], _mm_srli_epi64(acc[i], 47));
+		value = _mm_xor_si128(value, _mm_loadu_si128(reinterpret_cast<const __m128i *>(secret + ScrambleKey) + i));
+		__m128i lo = _mm_mul_epu32(value, prime);
+		__m128i hi = _mm_mul_epu32(_mm_srli_epi64(value, 32), prime);
+		acc[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+	}
+}
+#else
+static inline void accumulate_stripe(uint64_t *acc, const uint8_t *data, const uint64_t *key)
+{
+	for (unsigned i = 0; i < 8; i++)
+	{
+		uint64_t value = read_u64(data + 8 * i);
+		uint64_t keyed = value ^ key[i];
+		acc[i ^ 1] += value;
+		acc[i] += (keyed & 0xffffffffu) * (keyed >> 32);
+	}
+}
+
+static inline void scramble(uint64_t *acc)
+{
+	for (unsigned i = 0; i < 8; i++)
+	{
+		uint64_t value = acc[i] ^ (acc[i] >> 47);
+		value ^= secret[ScrambleKey + i];
+		acc[i] = value * prime32_1;
+	}
+}
+#endif
+
+Hash hash_bulk(const void *data_, size_t size, Hash seed)
+{
+	auto *data = static_cast<const uint8_t *>(data_);
+
+	alignas(16) uint64_t lanes[8] = {
+		0xc2b2ae3du, 0x9e3779b185ebca87ull, 0xc2b2ae3d27d4eb4full, 0x165667b19e3779f9ull,
+		0x85ebca77c2b2ae63ull, 0x85ebca77u, 0x27d4eb2f165667c5ull, 0x9e3779b1u,
+	};
+
+#ifdef UTIL_HASHMAP_SSE2
+	__m128i acc[4];
+	for (unsigned i = 0; i < 4; i++)
+		acc[i] = _mm_load_si128(reinterpret_cast<const __m128i *>(lanes) + i);
+#else
+	uint64_t *acc = lanes;
+#endif
+
+	// The last stripe is always handled separately, so it never takes part in a scramble.
+	size_t full_stripes = size ? (size - 1) / StripeSize : 0;
+	size_t num_blocks = full_stripes / StripesPerBlock;
+
+	for (size_t block = 0; block < num_blocks; block++)
+	{
+		for (unsigned stripe = 0; stripe < StripesPerBlock; stripe++)
+			accumulate_stripe(acc, data + stripe * StripeSize, secret + stripe);
+		scramble(acc);
+		data += BlockSize;
+	}
+
+	size_t remaining_stripes = full_stripes - num_blocks * StripesPerBlock;
+	for (size_t stripe = 0; stripe < remaining_stripes; stripe++)
+		accumulate_stripe(acc, data + stripe * StripeSize, secret + stripe);
+
+	// Inputs of a stripe or more end on the last full 64 bytes, overlapping what came before.
+	// Shorter inputs are zero padded, the length mixed in below tells them apart.
+	if (size >= StripeSize)
+		accumulate_stripe(acc, static_cast<const uint8_t *>(data_) + size - StripeSize, secret + LastStripeKey);
+	else
+	{
+		alignas(16) uint8_t padded[StripeSize] = {};
+		memcpy(padded, data, size);
+		accumulate_stripe(acc, padded, secret + LastStripeKey);
+	}
+
+#ifdef UTIL_HASHMAP_SSE2
+	for (unsigned i = 0; i < 4; i++)
+		_mm_store_si128(reinterpret_cast<__m128i *>(lanes) + i, acc[i]);
+#endif
+
+	uint64_t result = uint64_t(size) * 0x9e3779b185ebca87ull;
+	for (unsigned i = 0; i < 8; i += 2)
+		result += mul128_fold64(lanes[i] ^ secret[MergeKey + i], lanes[i + 1] ^ secret[MergeKey + i + 1]);
+
+	result ^= result >> 37;
+	result *= 0x165667919e3779f9ull;
+	result ^= result >> 32;
+
+	// Chain onto whatever the hasher has seen so far.
+	return mul128_fold64(seed ^ secret[0], result ^ secret[1]);
+}
+}
@@ -23,8 +23,26 @@
 #pragma once
 #include <memory>
 #include <stdint.h>
-#include <unordered_map>
+#include <string.h>
+#include <iterator>
+#include <new>
 #include <string>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include "util.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define UTIL_HASHMAP_SSE2
+#endif
+
+#if defined(__GNUC__)
+#define UTIL_HASHMAP_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define UTIL_HASHMAP_UNLIKELY(x) (x)
+#endif
 
 namespace Util
 {
@@ -38,8 +56,489 @@ struct UnityHasher
 	}
 };
 
+// Open addressing hash map keyed by Hash, with the same interface subset as the std::unordered_map it replaces.
+// Slots are probed linearly, 16 control bytes at a time. A control byte is either Empty or 7 bits of the hash,
+// so most mismatches are rejected without touching the slot. Erase shifts later entries back instead of
+// leaving tombstones, so lookups never have to skip over deleted slots.
+// Unlike std::unordered_map, inserting may move existing values and invalidates iterators and references.
 template <typename T>
-using HashMap = std::unordered_map<Hash, T, UnityHasher>;
+class HashMap
+{
+public:
+	using key_type = Hash;
+	using mapped_type = T;
+	using value_type = std::pair<const Hash, T>;
+	using size_type = size_t;
+
+	template <typename V, typename C>
+	class IteratorBase
+	{
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = typename std::remove_const<V>::type;
+		using difference_type = std::ptrdiff_t;
+		using pointer = V *;
+		using reference = V &;
+
+		IteratorBase() = default;
+
+		template <typename U, typename D>
+		IteratorBase(const IteratorBase<U, D> &other)
+			: map(other.map), index(other.index)
+		{
+		}
+
+		V &operator*() const
+		{
+			return map->slot(index);
+		}
+
+		V *operator->() const
+		{
+			return &map->slot(index);
+		}
+
+		IteratorBase &operator++()
+		{
+			index = map->next_occupied(index + 1);
+			return *this;
+		}
+
+		IteratorBase operator++(int)
+		{
+			auto ret = *this;
+			++*this;
+			return ret;
+		}
+
+		bool operator==(const IteratorBase &other) const
+		{
+			return index == other.index;
+		}
+
+		bool operator!=(const IteratorBase &other) const
+		{
+			return index != other.index;
+		}
+
+	private:
+		friend class HashMap;
+		template <typename U, typename D>
+		friend class IteratorBase;
+
+		IteratorBase(C *map, size_t index)
+			: map(map), index(index)
+		{
+		}
+
+		C *map = nullptr;
+		size_t index = 0;
+	};
+
+	using iterator = IteratorBase<value_type, HashMap>;
+	using const_iterator = IteratorBase<const value_type, const HashMap>;
+
+	HashMap() = default;
+
+	HashMap(const HashMap &other)
+	{
+		*this = other;
+	}
+
+	HashMap(HashMap &&other) noexcept
+	{
+		swap(other);
+	}
+
+	HashMap &operator=(const HashMap &other)
+	{
+		if (this != &other)
+		{
+			clear();
+			reserve(other.element_count);
+			for (auto &value : other)
+				emplace(value.first, value.second);
+		}
+		return *this;
+	}
+
+	HashMap &operator=(HashMap &&other) noexcept
+	{
+		if (this != &other)
+		{
+			HashMap tmp(std::move(other));
+			swap(tmp);
+		}
+		return *this;
+	}
+
+	~HashMap()
+	{
+		destroy_all();
+	}
+
+	void swap(HashMap &other) noexcept
+	{
+		std::swap(control, other.control);
+		std::swap(slots, other.slots);
+		std::swap(capacity, other.capacity);
+		std::swap(element_count, other.element_count);
+		std::swap(shift, other.shift);
+	}
+
+	iterator begin()
+	{
+		return { this, next_occupied(0) };
+	}
+
+	iterator end()
+	{
+		return { this, capacity };
+	}
+
+	const_iterator begin() const
+	{
+		return { this, next_occupied(0) };
+	}
+
+	const_iterator end() const
+	{
+		return { this, capacity };
+	}
+
+	const_iterator cbegin() const
+	{
+		return begin();
+	}
+
+	const_iterator cend() const
+	{
+		return end();
+	}
+
+	size_t size() const
+	{
+		return element_count;
+	}
+
+	bool empty() const
+	{
+		return element_count == 0;
+	}
+
+	iterator find(Hash key)
+	{
+		size_t insert_index;
+		size_t index = probe(key, insert_index);
+		return { this, index != NotFound ? index : capacity };
+	}
+
+	const_iterator find(Hash key) const
+	{
+		size_t insert_index;
+		size_t index = probe(key, insert_index);
+		return { this, index != NotFound ? index : capacity };
+	}
+
+	size_t count(Hash key) const
+	{
+		size_t insert_index;
+		return probe(key, insert_index) != NotFound ? 1 : 0;
+	}
+
+	template <typename... P>
+	std::pair<iterator, bool> emplace(Hash key, P &&... p)
+	{
+		size_t insert_index;
+		size_t index = probe(key, insert_index);
+		if (index != NotFound)
+			return { { this, index }, false };
+
+		if (element_count + 1 > max_load())
+		{
+			grow(element_count + 1);
+			insert_index = find_empty(key);
+		}
+
+		new (&slot(insert_index)) value_type(std::piecewise_construct,
+		                                     std::forward_as_tuple(key),
+		                                     std::forward_as_tuple(std::forward<P>(p)...));
+		set_control(insert_index, get_tag(key));
+		element_count++;
+		return { { this, insert_index }, true };
+	}
+
+	std::pair<iterator, bool> insert(const value_type &value)
+	{
+		return emplace(value.first, value.second);
+	}
+
+	std::pair<iterator, bool> insert(value_type &&value)
+	{
+		return emplace(value.first, std::move(value.second));
+	}
+
+	T &operator[](Hash key)
+	{
+		return emplace(key).first->second;
+	}
+
+	size_t erase(Hash key)
+	{
+		size_t insert_index;
+		size_t index = probe(key, insert_index);
+		if (index == NotFound)
+			return 0;
+
+		slot(index).~value_type();
+		element_count--;
+
+		// Pull back every later entry in the run which is allowed to live in the hole,
+		// so that a probe never meets an empty slot before reaching its key.
+		size_t mask = capacity - 1;
+		size_t hole = index;
+		for (size_t next = (hole + 1) & mask; control[next] != Empty; next = (next + 1) & mask)
+		{
+			size_t home = get_home(slot(next).first);
+			if (((next - hole) & mask) <= ((next - home) & mask))
+			{
+				new (&slot(hole)) value_type(std::move(slot(next)));
+				slot(next).~value_type();
+				set_control(hole, control[next]);
+				hole = next;
+			}
+		}
+
+		set_control(hole, Empty);
+		return 1;
+	}
+
+	void clear()
+	{
+		if (element_count)
+		{
+			for (size_t i = 0; i < capacity; i++)
+				if (control[i] != Empty)
+					slot(i).~value_type();
+			memset(control.get(), Empty, capacity + GroupWidth - 1);
+			element_count = 0;
+		}
+	}
+
+	void reserve(size_t size)
+	{
+		if (size > max_load())
+			grow(size);
+	}
+
+private:
+	using Slot = typename std::aligned_storage<sizeof(value_type), alignof(value_type)>::type;
+
+	enum : size_t
+	{
+		GroupWidth = 16,
+		MinCapacity = 16,
+		NotFound = ~size_t(0)
+	};
+
+	enum : uint8_t
+	{
+		Empty = 0x80
+	};
+
+	std::unique_ptr<uint8_t[]> control;
+	std::unique_ptr<Slot[]> slots;
+	size_t capacity = 0;
+	size_t element_count = 0;
+	unsigned shift = 64;
+
+	value_type &slot(size_t index)
+	{
+		return *reinterpret_cast<value_type *>(&slots[index]);
+	}
+
+	const value_type &slot(size_t index) const
+	{
+		return *reinterpret_cast<const value_type *>(&slots[index]);
+	}
+
+	size_t max_load() const
+	{
+		return capacity - capacity / 8;
+	}
+
+	// Keys tend to be well mixed already, but pointers and small integers are not.
+	// Fibonacci hashing spreads them, the high bits pick the home slot and the bits below pick the tag.
+	uint64_t mix(Hash key) const
+	{
+		return key * 0x9e3779b97f4a7c15ull;
+	}
+
+	size_t get_home(Hash key) const
+	{
+		return size_t(mix(key) >> shift);
+	}
+
+	uint8_t get_tag(Hash key) const
+	{
+		return uint8_t((mix(key) >> (shift - 7)) & 0x7f);
+	}
+
+	// The first GroupWidth - 1 control bytes are mirrored after the end, so a group can be loaded from any slot.
+	void set_control(size_t index, uint8_t value)
+	{
+		control[index] = value;
+		if (index < GroupWidth - 1)
+			control[capacity + index] = value;
+	}
+
+	struct GroupMask
+	{
+		uint32_t match;
+		uint32_t empty;
+	};
+
+	GroupMask load_group(size_t index, uint8_t tag) const
+	{
+		const uint8_t *group = control.get() + index;
+#ifdef UTIL_HASHMAP_SSE2
+		__m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+		__m128i match = _mm_cmpeq_epi8(ctrl, _mm_set1_epi8(char(tag)));
+		return { uint32_t(_mm_movemask_epi8(match)), uint32_t(_mm_movemask_epi8(ctrl)) };
+#else
+		// Eight control bytes at a time. The zero byte test can flag a byte right after a real match,
+		// which is harmless since every candidate is compared against the key anyway.
+		GroupMask mask = { 0, 0 };
+		for (unsigned i = 0; i < GroupWidth; i += 8)
+		{
+			uint64_t word;
+			memcpy(&word, group + i, sizeof(word));
+			uint64_t x = word ^ (0x0101010101010101ull * tag);
+			uint64_t match = (x - 0x0101010101010101ull) & ~x & 0x8080808080808080ull;
+			uint64_t empty = word & 0x8080808080808080ull;
+			mask.match |= gather_high_bits(match) << i;
+			mask.empty |= gather_high_bits(empty) << i;
+		}
+		return mask;
+#endif
+	}
+
+#ifndef UTIL_HASHMAP_SSE2
+	// Packs the top bit of each byte into the low eight bits.
+	static uint32_t gather_high_bits(uint64_t value)
+	{
+		return uint32_t(((value >> 7) * 0x0102040810204080ull) >> 56);
+	}
+#endif
+
+	// Returns the slot holding key, or NotFound along with the first empty slot it can be inserted in.
+	size_t probe(Hash key, size_t &insert_index) const
+	{
+		insert_index = NotFound;
+		if (!capacity)
+			return NotFound;
+
+		size_t mask = capacity - 1;
+		size_t index = get_home(key);
+		uint8_t tag = get_tag(key);
+
+		for (;;)
+		{
+			auto group = load_group(index, tag);
+
+			// Nothing past the first empty slot can belong to this key.
+			if (group.empty)
+				group.match &= (group.empty & (0u - group.empty)) - 1u;
+
+			while (group.match)
+			{
+				size_t candidate = (index + trailing_zeroes(group.match)) & mask;
+				if (slot(candidate).first == key)
+					return candidate;
+				group.match &= group.match - 1;
+			}
+
+			if (group.empty)
+			{
+				insert_index = (index + trailing_zeroes(group.empty)) & mask;
+				return NotFound;
+			}
+
+			index = (index + GroupWidth) & mask;
+		}
+	}
+
+	size_t find_empty(Hash key) const
+	{
+		size_t mask = capacity - 1;
+		size_t index = get_home(key);
+		for (;;)
+		{
+			auto group = load_group(index, Empty);
+			if (group.empty)
+				return (index + trailing_zeroes(group.empty)) & mask;
+			index = (index + GroupWidth) & mask;
+		}
+	}
+
+	size_t next_occupied(size_t index) const
+	{
+		while (index < capacity && control[index] == Empty)
+			index++;
+		return index;
+	}
+
+	void grow(size_t size)
+	{
+		size_t new_capacity = capacity ? capacity : size_t(MinCapacity);
+		while (size > new_capacity - new_capacity / 8)
+			new_capacity *= 2;
+
+		HashMap old;
+		swap(old);
+
+		control.reset(new uint8_t[new_capacity + GroupWidth - 1]);
+		slots.reset(new Slot[new_capacity]);
+		memset(control.get(), Empty, new_capacity + GroupWidth - 1);
+		capacity = new_capacity;
+		shift = 64 - trailing_zeroes64(new_capacity);
+
+		for (size_t i = 0; i < old.capacity; i++)
+		{
+			if (old.control[i] == Empty)
+				continue;
+
+			auto &value = old.slot(i);
+			size_t index = find_empty(value.first);
+			new (&slot(index)) value_type(std::move(value));
+			set_control(index, get_tag(value.first));
+			element_count++;
+		}
+	}
+
+	static unsigned trailing_zeroes64(size_t value)
+	{
+		unsigned bits = 0;
+		while (!(value & 1))
+		{
+			value >>= 1;
+			bits++;
+		}
+		return bits;
+	}
+
+	void destroy_all()
+	{
+		if (!std::is_trivially_destructible<value_type>::value)
+			for (size_t i = 0; i < capacity; i++)
+				if (control[i] != Empty)
+					slot(i).~value_type();
+	}
+};
+
+// Hashes size bytes in one go. Much faster than feeding the bytes one by one for anything but small inputs,
+// and every input bit affects every output bit. Different seeds give unrelated hashes.
+Hash hash_bulk(const void *data, size_t size, Hash seed);
 
 class Hasher
 {
@@ -51,12 +550,23 @@ public:
 
 	Hasher() = default;
 
+	// A few elements are cheapest to fold in one at a time, longer arrays go through hash_bulk().
+	// The loop runs on a local copy of the state, as byte arrays could otherwise alias it and force
+	// a store and reload per element.
 	template <typename T>
 	inline void data(const T *data, size_t size)
 	{
 		size /= sizeof(*data);
+		if (UTIL_HASHMAP_UNLIKELY(size >= BulkMinElements))
+		{
+			h = hash_bulk(data, size * sizeof(*data), h);
+			return;
+		}
+
+		Hash hash = h;
 		for (size_t i = 0; i < size; i++)
-			h = (h * 0x100000001b3ull) ^ data[i];
+			hash = (hash * 0x100000001b3ull) ^ data[i];
+		h = hash;
 	}
 
 	inline void u32(uint32_t value)
@@ -94,17 +604,14 @@ public:
 
 	inline void string(const char *str)
 	{
-		char c;
 		u32(0xff);
-		while ((c = *str++) != '\0')
-			u32(uint8_t(c));
+		data(reinterpret_cast<const uint8_t *>(str), strlen(str));
 	}
 
 	inline void string(const std::string &str)
 	{
 		u32(0xff);
-		for (auto &c : str)
-			u32(uint8_t(c));
+		data(reinterpret_cast<const uint8_t *>(str.data()), str.size());
 	}
 
 	inline Hash get() const
@@ -113,6 +620,7 @@ public:
 	}
 
 private:
+	enum { BulkMinElements = 32 };
 	Hash h = 0xcbf29ce484222325ull;
 };
 }
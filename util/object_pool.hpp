@@ -25,6 +25,7 @@
 #include <memory>
 #include <mutex>
 #include <vector>
+#include <algorithm>
 #include <stdlib.h>
 
 namespace Util
@@ -36,18 +37,8 @@ public:
 	template<typename... P>
 	T *allocate(P &&... p)
 	{
-		if (vacants.empty())
-		{
-			unsigned num_objects = 64u << memory.size();
-			T *ptr = static_cast<T *>(malloc(num_objects * sizeof(T)));
-			if (!ptr)
-				return nullptr;
-
-			for (unsigned i = 0; i < num_objects; i++)
-				vacants.push_back(&ptr[i]);
-
-			memory.emplace_back(ptr);
-		}
+		if (vacants.empty() && !grow())
+			return nullptr;
 
 		T *ptr = vacants.back();
 		vacants.pop_back();
@@ -70,6 +61,20 @@ public:
 protected:
 	std::vector<T *> vacants;
 
+	bool grow()
+	{
+		unsigned num_objects = 64u << memory.size();
+		T *ptr = static_cast<T *>(malloc(num_objects * sizeof(T)));
+		if (!ptr)
+			return false;
+
+		for (unsigned i = 0; i < num_objects; i++)
+			vacants.push_back(&ptr[i]);
+
+		memory.emplace_back(ptr);
+		return true;
+	}
+
 	struct MallocDeleter
 	{
 		void operator()(T *ptr)
@@ -105,6 +110,28 @@ public:
 		ObjectPool<T>::clear();
 	}
 
+	// Hands out up to count unconstructed objects, so callers can keep a per-thread cache
+	// and only hit the lock once per batch. Objects are constructed and destroyed by the caller.
+	size_t acquire_vacants(T **objects, size_t count)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		if (this->vacants.empty() && !this->grow())
+			return 0;
+
+		count = std::min(count, this->vacants.size());
+		auto itr = this->vacants.end() - count;
+		std::copy(itr, this->vacants.end(), objects);
+		this->vacants.erase(itr, this->vacants.end());
+		return count;
+	}
+
+	// Returns destroyed objects obtained with allocate() or acquire_vacants().
+	void release_vacants(T * const *objects, size_t count)
+	{
+		std::lock_guard<std::mutex> holder{lock};
+		this->vacants.insert(this->vacants.end(), objects, objects + count);
+	}
+
 private:
 	std::mutex lock;
 };
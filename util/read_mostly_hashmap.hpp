@@ -0,0 +1,188 @@
+/* Copyright (c) 2017-2018 Hans-Kristian Arntzen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "hashmap.hpp"
+#include <assert.h>
+#include <atomic>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace Util
+{
+// Hash table for caches which are filled once and then looked up from many threads.
+// find() takes no locks and never writes shared memory, so concurrent lookups do not contend on a cache line.
+// Entries can only be added. Calls to insert() must be serialized by the caller, but may run concurrently with find().
+// A default constructed T marks an empty slot, so it is also what find() returns for a missing key and cannot be inserted.
+template <typename T>
+class ReadMostlyHashMap
+{
+public:
+	static_assert(std::is_trivially_copyable<T>::value, "ReadMostlyHashMap values must be trivially copyable.");
+
+	ReadMostlyHashMap() = default;
+	ReadMostlyHashMap(const ReadMostlyHashMap &) = delete;
+	void operator=(const ReadMostlyHashMap &) = delete;
+
+	T find(Hash hash) const
+	{
+		auto *table = current.load(std::memory_order_acquire);
+		if (!table)
+			return T();
+
+		// The value is published after the key, so a reader which sees the value also sees the right key.
+		size_t mask = table->capacity - 1;
+		for (size_t index = get_home(hash, table->shift);; index = (index + 1) & mask)
+		{
+			auto &slot = table->slots[index];
+			T value = slot.value.load(std::memory_order_acquire);
+			if (value == T())
+				return T();
+			if (slot.key.load(std::memory_order_relaxed) == hash)
+				return value;
+		}
+	}
+
+	// Returns the value already stored for hash if there is one, otherwise inserts value and returns it.
+	T insert(Hash hash, T value)
+	{
+		assert(value != T());
+		auto *table = current.load(std::memory_order_relaxed);
+		if (table)
+		{
+			size_t index = probe(*table, hash);
+			T existing = table->slots[index].value.load(std::memory_order_relaxed);
+			if (existing != T())
+				return existing;
+		}
+
+		if (!table || 2 * (count + 1) > table->capacity)
+			table = grow();
+
+		place(*table, hash, value);
+		count++;
+		return value;
+	}
+
+	template <typename Func>
+	void for_each(const Func &func) const
+	{
+		auto *table = current.load(std::memory_order_acquire);
+		if (!table)
+			return;
+
+		for (size_t i = 0; i < table->capacity; i++)
+		{
+			T value = table->slots[i].value.load(std::memory_order_relaxed);
+			if (value != T())
+				func(table->slots[i].key.load(std::memory_order_relaxed), value);
+		}
+	}
+
+	size_t size() const
+	{
+		return count;
+	}
+
+	// Not safe to call while other threads are looking up entries.
+	void clear()
+	{
+		current.store(nullptr, std::memory_order_relaxed);
+		tables.clear();
+		count = 0;
+	}
+
+private:
+	struct Slot
+	{
+		std::atomic<Hash> key;
+		std::atomic<T> value;
+
+		Slot()
+			: key(0), value(T())
+		{
+		}
+	};
+
+	struct Table
+	{
+		std::unique_ptr<Slot[]> slots;
+		size_t capacity;
+		unsigned shift;
+	};
+
+	std::atomic<Table *> current = { nullptr };
+	// Readers can still be probing a table after it has been replaced, so every table is kept until clear().
+	// Capacity doubles each time, so the old tables together are smaller than the current one.
+	std::vector<std::unique_ptr<Table>> tables;
+	size_t count = 0;
+
+	static size_t get_home(Hash hash, unsigned shift)
+	{
+		return size_t((hash * 0x9e3779b97f4a7c15ull) >> shift);
+	}
+
+	static size_t probe(const Table &table, Hash hash)
+	{
+		size_t mask = table.capacity - 1;
+		for (size_t index = get_home(hash, table.shift);; index = (index + 1) & mask)
+		{
+			auto &slot = table.slots[index];
+			if (slot.value.load(std::memory_order_relaxed) == T() || slot.key.load(std::memory_order_relaxed) == hash)
+				return index;
+		}
+	}
+
+	static void place(Table &table, Hash hash, T value)
+	{
+		auto &slot = table.slots[probe(table, hash)];
+		slot.key.store(hash, std::memory_order_relaxed);
+		slot.value.store(value, std::memory_order_release);
+	}
+
+	Table *grow()
+	{
+		auto *old = current.load(std::memory_order_relaxed);
+		std::unique_ptr<Table> table(new Table);
+		table->capacity = old ? old->capacity * 2 : 16;
+		table->shift = 64 - trailing_zeroes(uint32_t(table->capacity));
+		table->slots.reset(new Slot[table->capacity]);
+
+		if (old)
+		{
+			for (size_t i = 0; i < old->capacity; i++)
+			{
+				T value = old->slots[i].value.load(std::memory_order_relaxed);
+				if (value != T())
+					place(*table, old->slots[i].key.load(std::memory_order_relaxed), value);
+			}
+		}
+
+		auto *ret = table.get();
+		tables.push_back(std::move(table));
+		current.store(ret, std::memory_order_release);
+		return ret;
+	}
+};
+}
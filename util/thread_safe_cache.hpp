@@ -24,6 +24,7 @@
 
 #include "hashmap.hpp"
 #include "read_write_lock.hpp"
+#include "read_mostly_hashmap.hpp"
 #include <memory>
 #include <utility>
 
@@ -36,7 +37,7 @@ public:
 	T *find(Hash hash) const
 	{
 		auto itr = hashmap.find(hash);
-		auto *ret = itr != end(hashmap) ? itr->second.get() : nullptr;
+		auto *ret = itr != hashmap.end() ? itr->second.get() : nullptr;
 		return ret;
 	}
 
@@ -50,6 +51,11 @@ public:
 		return ret;
 	}
 
+	void clear()
+	{
+		hashmap.clear();
+	}
+
 	HashMap<std::unique_ptr<T>> &get_hashmap()
 	{
 		return hashmap;
@@ -64,29 +70,31 @@ private:
 	HashMap<std::unique_ptr<T>> hashmap;
 };
 
+// Lookups go through a ReadMostlyHashMap and take no lock, only inserts are serialized.
 template <typename T>
 class ThreadSafeCache
 {
 public:
 	T *find(Hash hash) const
 	{
-		lock.lock_read();
-		auto *ret = cache.find(hash);
-		lock.unlock_read();
-		return ret;
+		return index.find(hash);
 	}
 
 	T *insert(Hash hash, std::unique_ptr<T> value)
 	{
 		lock.lock_write();
 		auto *ret = cache.insert(hash, std::move(value));
+		if (ret)
+			index.insert(hash, ret);
 		lock.unlock_write();
 		return ret;
 	}
 
-	HashMap<std::unique_ptr<T>> &get_hashmap()
+	// Not safe to call while other threads are using the cache.
+	void clear()
 	{
-		return cache.get_hashmap();
+		index.clear();
+		cache.clear();
 	}
 
 	const HashMap<std::unique_ptr<T>> &get_hashmap() const
@@ -96,6 +104,7 @@ public:
 
 private:
 	Cache<T> cache;
-	mutable RWSpinLock lock;
+	ReadMostlyHashMap<T *> index;
+	RWSpinLock lock;
 };
 }
\ No newline at end of file
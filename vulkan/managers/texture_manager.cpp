@@ -79,8 +79,10 @@ void Texture::update(std::unique_ptr<Granite::File> file)
 
 #ifdef GRANITE_VULKAN_MT
 	auto &workers = Granite::ThreadGroup::get_global();
-	// Workaround, cannot copy the lambda because of owning a unique_ptr.
-	auto task = workers.create_task(move(work));
+	auto task = workers.create_task();
+	task->set_task_class(Granite::TaskClass::Background);
+	task->set_desc("texture-load");
+	task->enqueue_task(move(work));
 	task->flush();
 #else
 	work();
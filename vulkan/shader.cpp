@@ -339,42 +339,30 @@ Program::Program(Hash hash, Device *device, Shader *compute)
 
 VkPipeline Program::get_pipeline(Hash hash) const
 {
-	lock.lock_read();
-	auto itr = pipelines.find(hash);
-	if (itr != end(pipelines))
-	{
-		auto ret = itr->second;
-		lock.unlock_read();
-		return ret;
-	}
-	else
-	{
-		lock.unlock_read();
-		return VK_NULL_HANDLE;
-	}
+	return pipelines.find(hash);
 }
 
 VkPipeline Program::add_pipeline(Hash hash, VkPipeline pipeline)
 {
+	// Failed pipeline creation is not cached, the next draw just tries again.
+	if (pipeline == VK_NULL_HANDLE)
+		return VK_NULL_HANDLE;
+
 	lock.lock_write();
-	auto &cache = pipelines[hash];
-	if (cache == VK_NULL_HANDLE)
-		cache = pipeline;
-	else
+	auto ret = pipelines.insert(hash, pipeline);
+	if (ret != pipeline)
 		vkDestroyPipeline(device->get_device(), pipeline, nullptr);
-	auto ret = cache;
 	lock.unlock_write();
 	return ret;
 }
 
 Program::~Program()
 {
-	for (auto &pipe : pipelines)
-	{
+	pipelines.for_each([this](Hash, VkPipeline pipe) {
 		if (internal_sync)
-			device->destroy_pipeline_nolock(pipe.second);
+			device->destroy_pipeline_nolock(pipe);
 		else
-			device->destroy_pipeline(pipe.second);
-	}
+			device->destroy_pipeline(pipe);
+	});
 }
 }
@@ -29,6 +29,7 @@
 #include "limits.hpp"
 #include "vulkan.hpp"
 #include "read_write_lock.hpp"
+#include "read_mostly_hashmap.hpp"
 #include "enum_cast.hpp"
 
 namespace Vulkan
@@ -153,7 +154,7 @@ private:
 	Device *device;
 	Shader *shaders[Util::ecast(ShaderStage::Count)] = {};
 	PipelineLayout *layout = nullptr;
-	Util::HashMap<VkPipeline> pipelines;
-	mutable Util::RWSpinLock lock;
+	Util::ReadMostlyHashMap<VkPipeline> pipelines;
+	Util::RWSpinLock lock;
 };
 }